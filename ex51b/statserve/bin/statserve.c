@@ -1,18 +1,119 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <lcthw/dbg.h>
+#include <lcthw/bstrlib.h>
 #include "statserve.h"
 #include "net.h"
+#include "workers.h"
+#include "wal.h"
+#include "iopool.h"
+#include "replica.h"
+#include "metrics.h"
 
 
 int main(int argc, char *argv[])
 {
-    check(argc == 4, "USAGE: statserve host port store_path");
+    check(argc >= 4,
+            "USAGE: statserve host port store_path [fork|event|workers N] "
+            "[fsync MS] [checkpoint MB] [io THREADS] [window SECONDS] [rollup eager|lazy] "
+            "[limit RATE BURST] [source RATE BURST CONNECTIONS] [lf] [nosketch] "
+            "[unix PATH] [replicate] [backlog MB] [replica HOST PORT|replica PATH] [metrics EVERY]");
 
     const char *host = argv[1];
     const char *port = argv[2];
     const char *store_path = argv[3];
+    struct tagbstring mode = bsStatic("fork");
+    struct tagbstring option;
+    int workers = 1;
+    int i = 0;
 
-    check(run_server(host, port, store_path), "Failed to run the echo server.");
+    for(i = 4; i < argc; i++) {
+        btfromcstr(option, argv[i]);
+
+        if(biseqcstr(&option, "fsync") && i + 1 < argc) {
+            // 0 syncs every batch, -1 leaves it to the OS
+            WAL_FSYNC_MS = atoi(argv[++i]);
+        } else if(biseqcstr(&option, "checkpoint") && i + 1 < argc) {
+            WAL_CHECKPOINT_BYTES = atol(argv[++i]) * 1024 * 1024;
+            check(WAL_CHECKPOINT_BYTES > 0, "Invalid checkpoint size: %s", argv[i]);
+        } else if(biseqcstr(&option, "io") && i + 1 < argc) {
+            // 0 does store and load on the network threads
+            IO_THREADS = atoi(argv[++i]);
+            check(IO_THREADS >= 0, "Invalid I/O thread count: %s", argv[i]);
+        } else if(biseqcstr(&option, "window") && i + 1 < argc) {
+            // 0 keeps no windows, each second is a Stats on every record
+            WINDOW_SECONDS = atoi(argv[++i]);
+            check(WINDOW_SECONDS >= 0, "Invalid window: %s", argv[i]);
+        } else if(biseqcstr(&option, "rollup") && i + 1 < argc) {
+            // lazy parents add up every sample below them when read,
+            // and sample only replies for the name it was given
+            ROLLUP_LAZY = strcmp(argv[++i], "lazy") == 0;
+            check(ROLLUP_LAZY || strcmp(argv[i], "eager") == 0,
+                    "Invalid rollup: %s", argv[i]);
+        } else if(biseqcstr(&option, "limit") && i + 2 < argc) {
+            // requests a second for each connection, a RATE of 0 is no limit
+            CLIENT_RATE = atof(argv[++i]);
+            CLIENT_BURST = atof(argv[++i]);
+            check(CLIENT_RATE >= 0 && CLIENT_BURST >= 1, "Invalid limit: %s %s",
+                    argv[i - 1], argv[i]);
+        } else if(biseqcstr(&option, "source") && i + 2 < argc) {
+            // the same shared by an address, and how many it can have open
+            SOURCE_RATE = atof(argv[++i]);
+            SOURCE_BURST = atof(argv[++i]);
+            check(SOURCE_RATE >= 0 && SOURCE_BURST >= 1, "Invalid source limit: %s %s",
+                    argv[i - 1], argv[i]);
+            if(i + 1 < argc && atoi(argv[i + 1]) > 0) SOURCE_CONNECTIONS = atoi(argv[++i]);
+        } else if(biseqcstr(&option, "lf")) {
+            // for clients that split replies on \n and don't want the \r
+            REPLY_CRLF = 0;
+        } else if(biseqcstr(&option, "nosketch")) {
+            // saves about 2k a record, percentile replies ERR
+            SKETCHES = 0;
+        } else if(biseqcstr(&option, "unix") && i + 1 < argc) {
+            // listen on a unix socket as well, for clients and replicas on this box
+            UNIX_PATH = argv[++i];
+        } else if(biseqcstr(&option, "replicate")) {
+            // replicas can connect to the port too, not just the unix socket
+            REPLICATE_TCP = 1;
+        } else if(biseqcstr(&option, "backlog") && i + 1 < argc) {
+            // how far the replicas together can fall behind before one starts over
+            REPLICA_BACKLOG = atol(argv[++i]) * 1024 * 1024;
+            check(REPLICA_BACKLOG > 0, "Invalid backlog: %s", argv[i]);
+        } else if(biseqcstr(&option, "replica") && i + 1 < argc) {
+            // a read-only copy of the primary at HOST PORT, or at a unix socket
+            REPLICA_HOST = argv[++i];
+            if(REPLICA_HOST[0] != '/') {
+                check(i + 1 < argc, "A replica needs the primary's host and port.");
+                REPLICA_PORT = argv[++i];
+            }
+        } else if(biseqcstr(&option, "metrics") && i + 1 < argc) {
+            // info times one request in EVERY, 0 just counts them
+            METRICS_EVERY = atoi(argv[++i]);
+            check(METRICS_EVERY >= 0 && (METRICS_EVERY & (METRICS_EVERY - 1)) == 0,
+                    "Invalid metrics, it's a power of 2 or 0: %s", argv[i]);
+        } else if(biseqcstr(&option, "workers")) {
+            mode = option;
+            if(i + 1 < argc && atoi(argv[i + 1]) > 0) workers = atoi(argv[++i]);
+        } else {
+            mode = option;
+        }
+    }
+
+    // it applies the primary's entries on the one thread that has DATA
+    check(REPLICA_HOST == NULL || biseqcstr(&mode, "event"),
+            "A replica has to run in event mode.");
+
+    if(biseqcstr(&mode, "workers")) {
+        check(run_worker_server(host, port, store_path, workers),
+                "Failed to run the worker server.");
+    } else if(biseqcstr(&mode, "event")) {
+        check(run_event_server(host, port, store_path), "Failed to run the event server.");
+    } else {
+        // every client is its own process, so there's nothing to log
+        check(biseqcstr(&mode, "fork"), "Unknown server mode: %s", bdata(&mode));
+        check(run_server(host, port, store_path), "Failed to run the echo server.");
+    }
 
     return 0;
 
@@ -0,0 +1,112 @@
+#include <stdlib.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <lcthw/dbg.h>
+#include <lcthw/hashmap.h>
+#include "admit.h"
+
+double CLIENT_RATE = 0;
+double CLIENT_BURST = 100;
+double SOURCE_RATE = 0;
+double SOURCE_BURST = 1000;
+int SOURCE_CONNECTIONS = 0;
+
+// address text to Source, only this thread's connections are in it
+static __thread Hashmap *SOURCES = NULL;
+
+double admit_now()
+{
+    struct timespec now;
+
+    // checked on every request, the coarse clock is plenty
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void TokenBucket_init(TokenBucket *bucket, double burst, double now)
+{
+    // a new client gets its whole burst
+    bucket->tokens = burst;
+    bucket->stamp = now;
+}
+
+int TokenBucket_take(TokenBucket *bucket, double rate, double burst, double now)
+{
+    if(rate <= 0) return 1;
+
+    // top up for the time since the last take, never past burst
+    bucket->tokens += (now - bucket->stamp) * rate;
+    if(bucket->tokens > burst) bucket->tokens = burst;
+    bucket->stamp = now;
+
+    if(bucket->tokens < 1.0) return 0;
+
+    bucket->tokens -= 1.0;
+    return 1;
+}
+
+Source *Source_acquire(struct sockaddr *addr, double now)
+{
+    char text[INET6_ADDRSTRLEN];
+    const void *ip = NULL;
+    struct tagbstring key;
+    Source *source = NULL;
+
+    if(addr->sa_family == AF_INET) {
+        ip = &((struct sockaddr_in *)addr)->sin_addr;
+    } else if(addr->sa_family == AF_INET6) {
+        ip = &((struct sockaddr_in6 *)addr)->sin6_addr;
+    } else {
+        // a unix socket has no address to share a bucket with
+        return NULL;
+    }
+
+    check(inet_ntop(addr->sa_family, ip, text, sizeof(text)) != NULL,
+            "Failed to format a client address.");
+
+    if(SOURCES == NULL) {
+        SOURCES = Hashmap_create(NULL, NULL);
+        check_mem(SOURCES);
+    }
+
+    btfromcstr(key, text);
+    source = Hashmap_get(SOURCES, &key);
+
+    if(source == NULL) {
+        source = calloc(1, sizeof(Source));
+        check_mem(source);
+
+        source->address = bstrcpy(&key);
+        check_mem(source->address);
+        TokenBucket_init(&source->bucket, SOURCE_BURST, now);
+
+        int rc = Hashmap_set(SOURCES, source->address, source);
+        check(rc == 0, "Failed to add source %s.", text);
+    }
+
+    source->connections++;
+    return source;
+error:
+    if(source && Hashmap_get(SOURCES, &key) != source) {
+        bdestroy(source->address);
+        free(source);
+    }
+    return NULL;
+}
+
+void Source_release(Source *source, double now)
+{
+    double refilled = source->bucket.tokens
+        + (now - source->bucket.stamp) * SOURCE_RATE;
+
+    source->connections--;
+
+    // idle with a full bucket is no different from never seen, but an
+    // address can't reconnect its way out of an empty one
+    if(source->connections == 0 && (SOURCE_RATE <= 0 || refilled >= SOURCE_BURST)) {
+        Hashmap_delete(SOURCES, source->address);
+        bdestroy(source->address);
+        free(source);
+    }
+}
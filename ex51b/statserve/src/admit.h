@@ -0,0 +1,49 @@
+#ifndef _admit_h
+#define _admit_h
+
+#include <sys/socket.h>
+#include <lcthw/bstrlib.h>
+
+/*
+ * Admission control. Every connection has a TokenBucket, and so does
+ * every source address its connections share. A request takes a token
+ * from both before it's even parsed; one that can't gets BUSY back and
+ * is dropped, so a client looping on create or store only burns its
+ * own budget. Buckets refill at RATE tokens a second up to BURST, and
+ * a RATE of 0 leaves that bucket unlimited.
+ *
+ * Sources also cap how many connections an address holds at once, and
+ * with them the bytes it can have sitting in our buffers. They're kept
+ * per thread like DATA, so in worker mode each worker gives an address
+ * its own share.
+ */
+typedef struct TokenBucket {
+    double tokens;
+    // when tokens was last topped up
+    double stamp;
+} TokenBucket;
+
+typedef struct Source {
+    bstring address;
+    TokenBucket bucket;
+    int connections;
+} Source;
+
+extern double CLIENT_RATE;
+extern double CLIENT_BURST;
+extern double SOURCE_RATE;
+extern double SOURCE_BURST;
+// 0 for no limit
+extern int SOURCE_CONNECTIONS;
+
+double admit_now();
+
+void TokenBucket_init(TokenBucket *bucket, double burst, double now);
+
+int TokenBucket_take(TokenBucket *bucket, double rate, double burst, double now);
+
+Source *Source_acquire(struct sockaddr *addr, double now);
+
+void Source_release(Source *source, double now);
+
+#endif
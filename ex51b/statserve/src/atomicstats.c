@@ -0,0 +1,171 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <lcthw/dbg.h>
+#include "atomicstats.h"
+
+int STATS_STRIPES = 1;
+
+// every thread gets the next stripe the first time it samples
+static atomic_int NEXT_STRIPE = 0;
+static __thread int STRIPE = -1;
+
+static inline AtomicStripe *my_stripe(AtomicStats *st)
+{
+    if(STRIPE < 0) {
+        STRIPE = atomic_fetch_add_explicit(&NEXT_STRIPE, 1, memory_order_relaxed);
+    }
+
+    return &st->stripe[STRIPE % st->stripes];
+}
+
+static inline void atomic_add(_Atomic double *to, double value)
+{
+    double old = atomic_load_explicit(to, memory_order_relaxed);
+
+    while(!atomic_compare_exchange_weak_explicit(to, &old, old + value,
+                memory_order_relaxed, memory_order_relaxed));
+}
+
+static inline void atomic_min(_Atomic double *to, double value)
+{
+    double old = atomic_load_explicit(to, memory_order_relaxed);
+
+    // a failed exchange reloads old, so this stops once we're not lower
+    while(value < old && !atomic_compare_exchange_weak_explicit(to, &old, value,
+                memory_order_relaxed, memory_order_relaxed));
+}
+
+static inline void atomic_max(_Atomic double *to, double value)
+{
+    double old = atomic_load_explicit(to, memory_order_relaxed);
+
+    while(value > old && !atomic_compare_exchange_weak_explicit(to, &old, value,
+                memory_order_relaxed, memory_order_relaxed));
+}
+
+static void stripe_reset(AtomicStripe *stripe)
+{
+    atomic_init(&stripe->sum, 0.0);
+    atomic_init(&stripe->sumsq, 0.0);
+    atomic_init(&stripe->min, INFINITY);
+    atomic_init(&stripe->max, -INFINITY);
+    atomic_init(&stripe->n, 0);
+}
+
+AtomicStats *AtomicStats_create(int stripes)
+{
+    AtomicStats *st = NULL;
+
+    check(stripes > 0 && stripes <= STATS_STRIPES_MAX, "Bad stripe count: %d", stripes);
+
+    // stripes sit on their own cache lines so writers don't share one
+    int rc = posix_memalign((void **)&st, sizeof(AtomicStripe), AtomicStats_size(stripes));
+    check(rc == 0, "Failed to allocate %d stripes.", stripes);
+
+    AtomicStats_init(st, stripes);
+
+    return st;
+error:
+    return NULL;
+}
+
+size_t AtomicStats_size(int stripes)
+{
+    return sizeof(AtomicStats) + stripes * sizeof(AtomicStripe);
+}
+
+void AtomicStats_init(AtomicStats *st, int stripes)
+{
+    int i = 0;
+
+    st->stripes = stripes;
+    for(i = 0; i < stripes; i++) {
+        stripe_reset(&st->stripe[i]);
+    }
+}
+
+void AtomicStats_destroy(AtomicStats *st)
+{
+    if(st) free(st);
+}
+
+void AtomicStats_sample(AtomicStats *st, double s)
+{
+    AtomicStripe *stripe = my_stripe(st);
+
+    atomic_add(&stripe->sum, s);
+    atomic_add(&stripe->sumsq, s * s);
+    atomic_min(&stripe->min, s);
+    atomic_max(&stripe->max, s);
+    // n goes last so a reader that sees it also sees the sums
+    atomic_fetch_add_explicit(&stripe->n, 1, memory_order_release);
+}
+
+void AtomicStats_merge(AtomicStats *st, Stats *from)
+{
+    AtomicStripe *stripe = my_stripe(st);
+
+    if(from->n == 0) return;
+
+    atomic_add(&stripe->sum, from->sum);
+    atomic_add(&stripe->sumsq, from->sumsq);
+    atomic_min(&stripe->min, from->min);
+    atomic_max(&stripe->max, from->max);
+    atomic_fetch_add_explicit(&stripe->n, from->n, memory_order_release);
+}
+
+void AtomicStats_set(AtomicStats *st, Stats *from)
+{
+    int i = 0;
+
+    // only for records nobody else can see yet, like one being loaded
+    for(i = 0; i < st->stripes; i++) {
+        stripe_reset(&st->stripe[i]);
+    }
+
+    AtomicStats_merge(st, from);
+}
+
+void AtomicStats_fold(AtomicStats *st, Stats *out)
+{
+    int i = 0;
+
+    memset(out, 0, sizeof(Stats));
+
+    for(i = 0; i < st->stripes; i++) {
+        AtomicStripe *stripe = &st->stripe[i];
+        unsigned long n = atomic_load_explicit(&stripe->n, memory_order_acquire);
+        if(n == 0) continue;
+
+        double min = atomic_load_explicit(&stripe->min, memory_order_relaxed);
+        double max = atomic_load_explicit(&stripe->max, memory_order_relaxed);
+
+        if(out->n == 0 || min < out->min) out->min = min;
+        if(out->n == 0 || max > out->max) out->max = max;
+
+        out->sum += atomic_load_explicit(&stripe->sum, memory_order_relaxed);
+        out->sumsq += atomic_load_explicit(&stripe->sumsq, memory_order_relaxed);
+        out->n += n;
+    }
+}
+
+void stats_merge(Stats *to, Stats *from)
+{
+    if(from->n == 0) return;
+
+    if(to->n == 0 || from->min < to->min) to->min = from->min;
+    if(to->n == 0 || from->max > to->max) to->max = from->max;
+
+    to->sum += from->sum;
+    to->sumsq += from->sumsq;
+    to->n += from->n;
+}
+
+double AtomicStats_mean(AtomicStats *st)
+{
+    Stats folded;
+
+    AtomicStats_fold(st, &folded);
+    return Stats_mean(&folded);
+}
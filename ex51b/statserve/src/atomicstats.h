@@ -0,0 +1,57 @@
+#ifndef _atomicstats_h
+#define _atomicstats_h
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <lcthw/stats.h>
+
+#define STATS_STRIPES_MAX 64
+
+/*
+ * A Stats that many threads can sample at once without a lock. Each
+ * writer adds into its own stripe (picked once per thread) with atomic
+ * ops, and readers fold every stripe into a plain Stats on demand.
+ * A fold taken while writers are running can see half of a sample
+ * (the sum but not yet the n), which is fine for mean/stddev.
+ */
+typedef struct AtomicStripe {
+    _Atomic double sum;
+    _Atomic double sumsq;
+    _Atomic double min;
+    _Atomic double max;
+    _Atomic unsigned long n;
+} __attribute__((aligned(64))) AtomicStripe;
+
+typedef struct AtomicStats {
+    int stripes;
+    AtomicStripe stripe[];
+} AtomicStats;
+
+// how many stripes Record_create gives new records, 1 is plenty
+// when every record has a single writer
+extern int STATS_STRIPES;
+
+AtomicStats *AtomicStats_create(int stripes);
+
+// bytes for one with this many stripes, for putting it inside something else
+size_t AtomicStats_size(int stripes);
+
+// memory from AtomicStats_size, aligned to a stripe
+void AtomicStats_init(AtomicStats *st, int stripes);
+
+void AtomicStats_destroy(AtomicStats *st);
+
+void AtomicStats_sample(AtomicStats *st, double s);
+
+void AtomicStats_merge(AtomicStats *st, Stats *from);
+
+void AtomicStats_set(AtomicStats *st, Stats *from);
+
+void AtomicStats_fold(AtomicStats *st, Stats *out);
+
+double AtomicStats_mean(AtomicStats *st);
+
+// adds a plain Stats into another, the way fold adds up stripes
+void stats_merge(Stats *to, Stats *from);
+
+#endif
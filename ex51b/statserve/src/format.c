@@ -0,0 +1,317 @@
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "format.h"
+
+// a 64 bit significand and binary exponent, value is f * 2^e
+typedef struct DiyFp {
+    uint64_t f;
+    int e;
+} DiyFp;
+
+#define HIDDEN_BIT 0x0010000000000000ULL
+#define SIGNIFICAND_MASK 0x000FFFFFFFFFFFFFULL
+
+// 10^k normalized, for k = -348, -340, ..., 340
+static const uint64_t CACHED_F[] = {
+    0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+    0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+    0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+    0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+    0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+    0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+    0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+    0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+    0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+    0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+    0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+    0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+    0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+    0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+    0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+    0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+    0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+    0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+    0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+    0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+    0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+    0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+    0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+    0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+    0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+    0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+    0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+    0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+    0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL,};
+
+static const int16_t CACHED_E[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954, -927,
+    -901, -874, -847, -821, -794, -768, -741, -715, -688, -661, -635, -608,
+    -582, -555, -529, -502, -475, -449, -422, -396, -369, -343, -316, -289,
+    -263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30,
+    56, 83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614, 641, 667,
+    694, 720, 747, 774, 800, 827, 853, 880, 907, 933, 960, 986,
+    1013, 1039, 1066,
+};
+
+static const uint64_t POW10[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+};
+
+static inline DiyFp diy_from_double(double value)
+{
+    uint64_t bits = 0;
+    memcpy(&bits, &value, sizeof(bits));
+
+    int biased = (int)((bits >> 52) & 0x7FF);
+    uint64_t significand = bits & SIGNIFICAND_MASK;
+
+    // subnormals have no hidden bit and the smallest exponent
+    if(biased != 0) {
+        return (DiyFp){significand + HIDDEN_BIT, biased - 1075};
+    } else {
+        return (DiyFp){significand, -1074};
+    }
+}
+
+static inline DiyFp diy_mul(DiyFp a, DiyFp b)
+{
+    unsigned __int128 p = (unsigned __int128)a.f * b.f;
+    uint64_t high = (uint64_t)(p >> 64);
+    uint64_t low = (uint64_t)p;
+
+    // round the dropped half
+    if(low & (1ULL << 63)) high++;
+
+    return (DiyFp){high, a.e + b.e + 64};
+}
+
+static inline DiyFp diy_normalize(DiyFp a)
+{
+    int shift = __builtin_clzll(a.f);
+    return (DiyFp){a.f << shift, a.e - shift};
+}
+
+static inline void diy_boundaries(DiyFp v, DiyFp *minus, DiyFp *plus)
+{
+    // halfway to the next double up, normalized
+    DiyFp high = {(v.f << 1) + 1, v.e - 1};
+    while(!(high.f & (HIDDEN_BIT << 1))) {
+        high.f <<= 1;
+        high.e--;
+    }
+    high.f <<= 10;
+    high.e -= 10;
+
+    // the gap below a power of two is half the size
+    DiyFp low = v.f == HIDDEN_BIT ? (DiyFp){(v.f << 2) - 1, v.e - 2}
+        : (DiyFp){(v.f << 1) - 1, v.e - 1};
+    low.f <<= low.e - high.e;
+    low.e = high.e;
+
+    *minus = low;
+    *plus = high;
+}
+
+static inline DiyFp cached_power(int e, int *k)
+{
+    // the power of ten that brings e into [-60, -32]
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int ceiling = (int)dk;
+    if(dk - ceiling > 0.0) ceiling++;
+
+    unsigned index = (unsigned)((ceiling >> 3) + 1);
+    *k = -(-348 + (int)(index << 3));
+
+    return (DiyFp){CACHED_F[index], CACHED_E[index]};
+}
+
+static inline int count_digits(uint32_t n)
+{
+    int count = 1;
+    while(n >= 10 && count < 10) {
+        n /= 10;
+        count++;
+    }
+    return count;
+}
+
+static inline void grisu_round(char *digits, int len, uint64_t delta,
+        uint64_t rest, uint64_t ten_kappa, uint64_t wp_w)
+{
+    // step the last digit down while that gets closer to the real value
+    while(rest < wp_w && delta - rest >= ten_kappa
+            && (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+        digits[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+static int digit_gen(DiyFp w, DiyFp mp, uint64_t delta, char *digits, int *k)
+{
+    DiyFp one = {1ULL << -mp.e, mp.e};
+    uint64_t wp_w = mp.f - w.f;
+    uint32_t p1 = (uint32_t)(mp.f >> -one.e);
+    uint64_t p2 = mp.f & (one.f - 1);
+    int kappa = count_digits(p1);
+    int len = 0;
+
+    // the integer part, stopping as soon as the rest is inside delta
+    while(kappa > 0) {
+        uint32_t d = p1 / (uint32_t)POW10[kappa - 1];
+        p1 %= (uint32_t)POW10[kappa - 1];
+
+        if(d || len) digits[len++] = '0' + d;
+        kappa--;
+
+        uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+        if(rest <= delta) {
+            *k += kappa;
+            grisu_round(digits, len, delta, rest, POW10[kappa] << -one.e, wp_w);
+            return len;
+        }
+    }
+
+    // then the fraction
+    while(1) {
+        p2 *= 10;
+        delta *= 10;
+
+        char d = (char)(p2 >> -one.e);
+        if(d || len) digits[len++] = '0' + d;
+        p2 &= one.f - 1;
+        kappa--;
+
+        if(p2 < delta) {
+            *k += kappa;
+            int index = -kappa;
+            grisu_round(digits, len, delta, p2, one.f, wp_w * (index < 20 ? POW10[index] : 0));
+            return len;
+        }
+    }
+}
+
+static int grisu2(double value, char *digits, int *k)
+{
+    DiyFp v = diy_from_double(value);
+    DiyFp minus;
+    DiyFp plus;
+
+    diy_boundaries(v, &minus, &plus);
+
+    DiyFp c_mk = cached_power(plus.e, k);
+    DiyFp w = diy_mul(diy_normalize(v), c_mk);
+    DiyFp wp = diy_mul(plus, c_mk);
+    DiyFp wm = diy_mul(minus, c_mk);
+
+    // stay strictly inside the boundaries, the products are off by one
+    wm.f++;
+    wp.f--;
+
+    return digit_gen(w, wp, wp.f - wm.f, digits, k);
+}
+
+static int write_exponent(char *out, int exponent)
+{
+    char *at = out;
+
+    *at++ = 'e';
+    *at++ = exponent < 0 ? '-' : '+';
+    if(exponent < 0) exponent = -exponent;
+
+    if(exponent >= 100) *at++ = '0' + exponent / 100;
+    if(exponent >= 10) *at++ = '0' + exponent / 10 % 10;
+    *at++ = '0' + exponent % 10;
+
+    return at - out;
+}
+
+int format_double(char *out, double value)
+{
+    char digits[24];
+    char *at = out;
+    int k = 0;
+    int len = 0;
+    int point = 0;
+
+    if(isnan(value)) {
+        memcpy(out, "nan", 3);
+        return 3;
+    }
+
+    if(value == 0.0) {
+        // -0 too, like JavaScript
+        *at++ = '0';
+        return at - out;
+    }
+
+    if(value < 0) {
+        *at++ = '-';
+        value = -value;
+    }
+
+    if(isinf(value)) {
+        memcpy(at, "inf", 3);
+        return at + 3 - out;
+    }
+
+    len = grisu2(value, digits, &k);
+    // the value is 0.DIGITS * 10^point
+    point = len + k;
+
+    if(len <= point && point <= 21) {
+        // a whole number, 1500
+        memcpy(at, digits, len);
+        memset(at + len, '0', point - len);
+        at += point;
+    } else if(0 < point && point <= 21) {
+        // 12.5
+        memcpy(at, digits, point);
+        at[point] = '.';
+        memcpy(at + point + 1, digits + point, len - point);
+        at += len + 1;
+    } else if(-6 < point && point <= 0) {
+        // 0.00125
+        *at++ = '0';
+        *at++ = '.';
+        memset(at, '0', -point);
+        at += -point;
+        memcpy(at, digits, len);
+        at += len;
+    } else {
+        // 1.25e-7 or 1e+21
+        *at++ = digits[0];
+        if(len > 1) {
+            *at++ = '.';
+            memcpy(at, digits + 1, len - 1);
+            at += len - 1;
+        }
+        at += write_exponent(at, point - 1);
+    }
+
+    return at - out;
+}
+
+int format_long(char *out, long value)
+{
+    char digits[24];
+    int len = 0;
+    int i = 0;
+    // work in unsigned so LONG_MIN negates
+    unsigned long left = value < 0 ? -(unsigned long)value : (unsigned long)value;
+
+    do {
+        digits[len++] = '0' + left % 10;
+        left /= 10;
+    } while(left > 0);
+
+    if(value < 0) out[i++] = '-';
+    while(len > 0) out[i++] = digits[--len];
+
+    return i;
+}
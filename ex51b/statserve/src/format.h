@@ -0,0 +1,18 @@
+#ifndef _format_h
+#define _format_h
+
+// room for any double or long that format_double/format_long write
+#define FORMAT_MAX 32
+
+/*
+ * format_double writes the shortest digits that strtod reads back as
+ * exactly the same double, using Grisu2 (Loitsch, "Printing
+ * Floating-Point Numbers Quickly and Accurately"). It lays them out
+ * like JavaScript numbers: 15, 12.5, 0.001, 1e+21, 1.5e-7. Neither
+ * function adds a NUL, both return the length.
+ */
+int format_double(char *out, double value);
+
+int format_long(char *out, long value);
+
+#endif
@@ -0,0 +1,301 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/random.h>
+#include <lcthw/dbg.h>
+#include "intern.h"
+#include "siphash.h"
+
+#define ARENA_ROOM (INTERN_ARENA_SIZE - sizeof(InternArena))
+
+static InternStripe STRIPES[INTERN_STRIPES];
+static pthread_once_t INTERN_ONCE = PTHREAD_ONCE_INIT;
+// made fresh by every process, the hashes are never written anywhere
+static uint8_t HASH_KEY[SIPHASH_KEY_LEN];
+
+static void intern_init()
+{
+    ssize_t rc = getrandom(HASH_KEY, sizeof(HASH_KEY), 0);
+    int i = 0;
+
+    // no key is still a working hash, just one names can be picked against
+    if(rc != sizeof(HASH_KEY)) log_err("Failed to make the name hash key.");
+
+    for(i = 0; i < INTERN_STRIPES; i++) {
+        pthread_mutex_init(&STRIPES[i].lock, NULL);
+    }
+}
+
+uint64_t Intern_hash(bstring name)
+{
+    // every way in hashes first, so this sets up the stripes as well
+    pthread_once(&INTERN_ONCE, intern_init);
+    return siphash64(name->data, name->slen, HASH_KEY);
+}
+
+static inline InternStripe *stripe_for(uint64_t hash)
+{
+    // the low bits pick the bucket, so the stripe comes from the top
+    return &STRIPES[hash >> (64 - INTERN_STRIPE_BITS)];
+}
+
+static inline size_t slot_size(int len)
+{
+    // keep every header aligned
+    return (sizeof(Interned) + len + 1 + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+}
+
+static inline int size_class(size_t size)
+{
+    return size / 8 < INTERN_CLASSES - 1 ? size / 8 : INTERN_CLASSES - 1;
+}
+
+static void free_unlink(InternStripe *stripe, InternFree *slot)
+{
+    if(slot->prev) {
+        slot->prev->next = slot->next;
+    } else {
+        stripe->free[size_class(slot->size)] = slot->next;
+    }
+    if(slot->next) slot->next->prev = slot->prev;
+}
+
+static Interned *slot_alloc(InternStripe *stripe, size_t size)
+{
+    int class = size_class(size);
+    InternArena *arena = stripe->arena;
+    InternFree *slot = stripe->free[class];
+    Interned *at = NULL;
+
+    check(size <= ARENA_ROOM, "Name too long to intern: %zu", size);
+
+    if(class < INTERN_CLASSES - 1 && slot != NULL) {
+        // the same size a dead name left, anywhere
+        free_unlink(stripe, slot);
+        arena = slot->arena;
+        at = (Interned *)slot;
+    } else {
+        if(arena == NULL || arena->used + size > ARENA_ROOM) {
+            // the rest of a full arena is wasted, it's at most one name,
+            // and the arena itself goes once its last name does
+            arena = malloc(INTERN_ARENA_SIZE);
+            check_mem(arena);
+            arena->live = 0;
+            arena->used = 0;
+            stripe->arena = arena;
+            stripe->arenas++;
+        }
+
+        at = (Interned *)(arena->data + arena->used);
+        arena->used += size;
+    }
+
+    // so a release can find the arena again
+    at->at = (char *)at - arena->data;
+    arena->live++;
+    return at;
+error:
+    return NULL;
+}
+
+static void slot_free(InternStripe *stripe, Interned *name)
+{
+    InternArena *arena = (InternArena *)((char *)name - name->at - sizeof(InternArena));
+    size_t size = slot_size(name->str.slen);
+    InternFree *slot = (InternFree *)name;
+    int class = size_class(size);
+    size_t at = 0;
+
+    slot->size = size;
+    slot->arena = arena;
+    slot->prev = NULL;
+    slot->next = stripe->free[class];
+    if(slot->next) slot->next->prev = slot;
+    stripe->free[class] = slot;
+
+    if(--arena->live > 0) return;
+
+    // every slot in it is dead and on a free list, take them all off
+    for(at = 0; at < arena->used; at += slot->size) {
+        slot = (InternFree *)(arena->data + at);
+        free_unlink(stripe, slot);
+    }
+
+    if(arena == stripe->arena) {
+        arena->used = 0;
+    } else {
+        free(arena);
+        stripe->arenas--;
+    }
+}
+
+static int grow(InternStripe *stripe)
+{
+    uint64_t size = stripe->bucket ? (stripe->mask + 1) * 2 : INTERN_BUCKETS_MIN;
+    Interned **bucket = calloc(size, sizeof(Interned *));
+    uint64_t i = 0;
+    check_mem(bucket);
+
+    for(i = 0; stripe->bucket && i <= stripe->mask; i++) {
+        Interned *at = stripe->bucket[i];
+
+        while(at != NULL) {
+            Interned *next = at->next;
+            Interned **head = &bucket[at->hash & (size - 1)];
+
+            at->next = *head;
+            *head = at;
+            at = next;
+        }
+    }
+
+    free(stripe->bucket);
+    stripe->bucket = bucket;
+    stripe->mask = size - 1;
+
+    return 0;
+error:
+    return -1;
+}
+
+static Interned **probe(InternStripe *stripe, bstring name, uint64_t hash)
+{
+    Interned **at = NULL;
+    int len = blength(name);
+
+    if(stripe->bucket == NULL) return NULL;
+
+    // where it's linked from, so a release can unlink it
+    for(at = &stripe->bucket[hash & stripe->mask]; *at != NULL; at = &(*at)->next) {
+        if((*at)->hash == hash && (*at)->str.slen == len
+                && memcmp((*at)->data, name->data, len) == 0) {
+            return at;
+        }
+    }
+
+    return NULL;
+}
+
+bstring Intern_add(bstring name)
+{
+    uint64_t hash = Intern_hash(name);
+    InternStripe *stripe = stripe_for(hash);
+    Interned **link = NULL;
+    Interned *found = NULL;
+    int len = blength(name);
+
+    pthread_mutex_lock(&stripe->lock);
+
+    link = probe(stripe, name, hash);
+
+    if(link != NULL) {
+        found = *link;
+    } else {
+        if(stripe->bucket == NULL || stripe->count > stripe->mask) {
+            check(grow(stripe) == 0, "Failed to grow the intern table.");
+        }
+
+        found = slot_alloc(stripe, slot_size(len));
+        check_mem(found);
+
+        memcpy(found->data, name->data, len);
+        found->data[len] = '\0';
+        // a negative mlen makes bstrlib refuse to change it
+        found->str.mlen = -1;
+        found->str.slen = len;
+        found->str.data = (unsigned char *)found->data;
+        found->hash = hash;
+        found->refs = 0;
+
+        found->next = stripe->bucket[hash & stripe->mask];
+        stripe->bucket[hash & stripe->mask] = found;
+        stripe->count++;
+    }
+
+    found->refs++;
+
+    pthread_mutex_unlock(&stripe->lock);
+    return &found->str;
+error:
+    pthread_mutex_unlock(&stripe->lock);
+    return NULL;
+}
+
+bstring Intern_retain(bstring name)
+{
+    Interned *in = (Interned *)name;
+    InternStripe *stripe = stripe_for(in->hash);
+
+    pthread_mutex_lock(&stripe->lock);
+    in->refs++;
+    pthread_mutex_unlock(&stripe->lock);
+
+    return name;
+}
+
+void Intern_release(bstring name)
+{
+    Interned *in = (Interned *)name;
+    InternStripe *stripe = NULL;
+    Interned **link = NULL;
+
+    if(name == NULL) return;
+
+    stripe = stripe_for(in->hash);
+    pthread_mutex_lock(&stripe->lock);
+
+    if(--in->refs == 0) {
+        link = probe(stripe, name, in->hash);
+        *link = in->next;
+        stripe->count--;
+        slot_free(stripe, in);
+    }
+
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+bstring Intern_find(bstring name)
+{
+    uint64_t hash = Intern_hash(name);
+    InternStripe *stripe = stripe_for(hash);
+    Interned **link = NULL;
+
+    pthread_mutex_lock(&stripe->lock);
+    link = probe(stripe, name, hash);
+    pthread_mutex_unlock(&stripe->lock);
+
+    return link ? &(*link)->str : NULL;
+}
+
+size_t Intern_count()
+{
+    size_t count = 0;
+    int i = 0;
+
+    pthread_once(&INTERN_ONCE, intern_init);
+
+    for(i = 0; i < INTERN_STRIPES; i++) {
+        pthread_mutex_lock(&STRIPES[i].lock);
+        count += STRIPES[i].count;
+        pthread_mutex_unlock(&STRIPES[i].lock);
+    }
+
+    return count;
+}
+
+size_t Intern_bytes()
+{
+    size_t bytes = 0;
+    int i = 0;
+
+    pthread_once(&INTERN_ONCE, intern_init);
+
+    for(i = 0; i < INTERN_STRIPES; i++) {
+        pthread_mutex_lock(&STRIPES[i].lock);
+        bytes += STRIPES[i].arenas * INTERN_ARENA_SIZE;
+        if(STRIPES[i].bucket) bytes += (STRIPES[i].mask + 1) * sizeof(Interned *);
+        pthread_mutex_unlock(&STRIPES[i].lock);
+    }
+
+    return bytes;
+}
@@ -0,0 +1,102 @@
+#ifndef _intern_h
+#define _intern_h
+
+#include <stdint.h>
+#include <pthread.h>
+#include <lcthw/bstrlib.h>
+
+#define INTERN_ARENA_SIZE (64 * 1024)
+#define INTERN_BUCKETS_MIN 64
+#define INTERN_STRIPE_BITS 4
+#define INTERN_STRIPES (1 << INTERN_STRIPE_BITS)
+// free lists for slots up to 8 * (INTERN_CLASSES - 1) bytes, the last
+// one is every bigger slot and is never handed out again
+#define INTERN_CLASSES 64
+
+/*
+ * One copy of every record name, shared by all the threads. A name is
+ * interned once when its record is made, and from then on that bstring
+ * is the record's name, its key in DATA and its entry in the dirty
+ * list, and its hash is kept next to it so adding it to DATA hashes
+ * nothing. Only lookups coming off the wire hash the bytes. The hash
+ * is SipHash under a key each process makes when it starts, so nobody
+ * sending names can pick a pile of them that all land in one slot.
+ *
+ * Names live in arenas behind a small header instead of two mallocs
+ * apiece. Every holder takes a reference, the record, a dirty list, a
+ * list or snapshot that stopped after it, and the last one to let go
+ * frees it: its slot goes on a free list for its size, and an arena
+ * whose names are all gone is freed whole. So a name that's deleted
+ * costs nothing after, however many different ones come and go.
+ *
+ * The names are split over INTERN_STRIPES stripes by the top bits of
+ * their hash, each a chained table with its own lock and arenas, so
+ * threads making records mostly don't meet.
+ *
+ * Every prefix of a name is the name of a parent record, so those
+ * are all in here once already.
+ */
+typedef struct Interned {
+    // first, so the bstring handed out is the Interned
+    struct tagbstring str;
+    uint64_t hash;
+    struct Interned *next;
+    // changed only with its stripe's lock held
+    uint32_t refs;
+    // how far into its arena's data it is
+    uint32_t at;
+    char data[];
+} Interned;
+
+// a dead name's slot, on its stripe's free list for its size
+typedef struct InternFree {
+    struct InternFree *next;
+    struct InternFree *prev;
+    size_t size;
+    struct InternArena *arena;
+} InternFree;
+
+typedef struct InternArena {
+    // names still in it, it goes back once this is 0
+    size_t live;
+    size_t used;
+    char data[];
+} InternArena;
+
+typedef struct InternStripe {
+    pthread_mutex_t lock;
+    uint64_t mask;
+    Interned **bucket;
+    size_t count;
+    // the one that new names are carved from
+    InternArena *arena;
+    size_t arenas;
+    InternFree *free[INTERN_CLASSES];
+} InternStripe;
+
+// the name with a reference taken, the one already there if it's in
+bstring Intern_add(bstring name);
+
+// another reference to a name from Intern_add
+bstring Intern_retain(bstring name);
+
+// drops one, NULL is fine
+void Intern_release(bstring name);
+
+// only good while something else holds a reference
+bstring Intern_find(bstring name);
+
+size_t Intern_count();
+
+// the arenas and tables, not counting malloc's own overhead
+size_t Intern_bytes();
+
+uint64_t Intern_hash(bstring name);
+
+// what Intern_hash was for a name from Intern_add
+static inline uint64_t Intern_stored_hash(bstring name)
+{
+    return ((Interned *)name)->hash;
+}
+
+#endif
@@ -0,0 +1,243 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/eventfd.h>
+#include <lcthw/dbg.h>
+#include "iopool.h"
+
+int IO_THREADS = 4;
+__thread IoLoop *IO = NULL;
+
+// one queue for every network thread, whichever I/O thread is free takes it
+static pthread_mutex_t POOL_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t POOL_READY = PTHREAD_COND_INITIALIZER;
+static Queue *POOL_JOBS = NULL;
+
+IoJob *IoJob_create(IoOp op, bstring location, bstring to, int binary)
+{
+    IoJob *job = calloc(1, sizeof(IoJob));
+    check_mem(job);
+
+    job->op = op;
+    job->binary = binary;
+    job->location = bstrcpy(location);
+    check_mem(job->location);
+
+    if(to) {
+        // the command's tokens are gone by the time the read is back
+        job->to = bstrcpy(to);
+        check_mem(job->to);
+    }
+
+    return job;
+error:
+    IoJob_destroy(job);
+    return NULL;
+}
+
+void IoJob_destroy(IoJob *job)
+{
+    if(job) {
+        if(job->location) bdestroy(job->location);
+        if(job->to) bdestroy(job->to);
+        Sketch_destroy(job->sketch);
+        free(job);
+    }
+}
+
+void IoJob_run(IoJob *job)
+{
+    int fd = -1;
+    int rc = 0;
+
+    if(job->op == IO_STORE) {
+        fd = store_open(job->location, O_WRONLY | O_CREAT);
+        check(fd >= 0, "Cannot open file for writing: %s", bdata(job->location));
+
+        // another thread or process may be storing or loading it too, so
+        // lock before the truncate, the last store may have had a sketch
+        // this one doesn't
+        rc = flock(fd, LOCK_EX);
+        check(rc == 0, "Failed to lock %s", bdata(job->location));
+        rc = ftruncate(fd, 0);
+        check(rc == 0, "Failed to truncate %s", bdata(job->location));
+
+        rc = write(fd, &job->stats, sizeof(Stats));
+        check(rc == sizeof(Stats), "Failed to write to %s", bdata(job->location));
+
+        if(job->sketch) {
+            rc = write(fd, job->sketch, sizeof(Sketch));
+            check(rc == sizeof(Sketch), "Failed to write the sketch to %s",
+                    bdata(job->location));
+        }
+    } else {
+        fd = store_open(job->location, O_RDONLY);
+        check(fd >= 0, "Error opening file: %s", bdata(job->location));
+
+        // loads can share it, a store waits for them
+        rc = flock(fd, LOCK_SH);
+        check(rc == 0, "Failed to lock %s", bdata(job->location));
+
+        rc = read(fd, &job->stats, sizeof(Stats));
+        check(rc == sizeof(Stats), "Failed to read record at %s", bdata(job->location));
+
+        job->sketch = Sketch_create();
+        check_mem(job->sketch);
+
+        // a file stored without a sketch just ends here
+        rc = read(fd, job->sketch, sizeof(Sketch));
+        check(rc == 0 || rc == sizeof(Sketch), "Short sketch in %s", bdata(job->location));
+
+        if(rc == 0) {
+            Sketch_destroy(job->sketch);
+            job->sketch = NULL;
+        }
+    }
+
+    // close, which should release the lock
+    close(fd);
+    job->error = 0;
+    return;
+error:
+    // a short read or write leaves errno alone
+    job->error = errno ? errno : EIO;
+    if(fd >= 0) close(fd);
+}
+
+void *io_main(void *arg)
+{
+    (void)arg;
+    uint64_t one = 1;
+    IoJob *job = NULL;
+
+    while(1) {
+        pthread_mutex_lock(&POOL_LOCK);
+        while((job = Queue_recv(POOL_JOBS)) == NULL) {
+            pthread_cond_wait(&POOL_READY, &POOL_LOCK);
+        }
+        pthread_mutex_unlock(&POOL_LOCK);
+
+        errno = 0;
+        IoJob_run(job);
+
+        pthread_mutex_lock(&job->loop->lock);
+        Queue_send(job->loop->finished, job);
+        pthread_mutex_unlock(&job->loop->lock);
+
+        // wake up the network thread's epoll_wait
+        if(write(job->loop->event_fd, &one, sizeof(one)) != sizeof(one)) {
+            log_err("Failed to wake the loop for %s.", bdata(job->location));
+        }
+    }
+
+    return NULL;
+}
+
+int IoPool_start(int nthreads)
+{
+    int rc = 0;
+    int i = 0;
+    pthread_t thread;
+
+    check(nthreads > 0, "Need at least one I/O thread: %d", nthreads);
+
+    // tests and every server mode share the one pool
+    if(POOL_JOBS != NULL) return 0;
+
+    POOL_JOBS = Queue_create();
+    check_mem(POOL_JOBS);
+
+    for(i = 0; i < nthreads; i++) {
+        rc = pthread_create(&thread, NULL, io_main, NULL);
+        check(rc == 0, "Failed to start I/O thread %d.", i);
+        pthread_detach(thread);
+    }
+
+    return 0;
+error:
+    return -1;
+}
+
+IoLoop *IoLoop_create()
+{
+    IoLoop *loop = calloc(1, sizeof(IoLoop));
+    check_mem(loop);
+
+    loop->event_fd = -1;
+
+    int rc = pthread_mutex_init(&loop->lock, NULL);
+    check(rc == 0, "Failed to make the I/O loop lock.");
+
+    loop->finished = Queue_create();
+    check_mem(loop->finished);
+
+    loop->event_fd = eventfd(0, EFD_NONBLOCK);
+    check(loop->event_fd >= 0, "Failed to create eventfd.");
+
+    return loop;
+error:
+    IoLoop_destroy(loop);
+    return NULL;
+}
+
+void IoLoop_destroy(IoLoop *loop)
+{
+    if(loop) {
+        if(loop->event_fd >= 0) close(loop->event_fd);
+        if(loop->finished) Queue_destroy(loop->finished);
+        IoJob_destroy(loop->deferred);
+        pthread_mutex_destroy(&loop->lock);
+        free(loop);
+    }
+}
+
+void Io_defer(IoLoop *loop, IoJob *job)
+{
+    // a command hands off at most one job, as its last step
+    IoJob_destroy(loop->deferred);
+    loop->deferred = job;
+}
+
+int Io_submit(IoLoop *loop, io_done_cb done, void *owner)
+{
+    IoJob *job = loop->deferred;
+
+    // 1 when the command is waiting on the pool, 0 if it's all done
+    if(job == NULL) return 0;
+
+    loop->deferred = NULL;
+    job->done = done;
+    job->owner = owner;
+    job->loop = loop;
+
+    pthread_mutex_lock(&POOL_LOCK);
+    Queue_send(POOL_JOBS, job);
+    pthread_cond_signal(&POOL_READY);
+    pthread_mutex_unlock(&POOL_LOCK);
+
+    return 1;
+}
+
+void IoLoop_drain(IoLoop *loop)
+{
+    uint64_t count = 0;
+    IoJob *job = NULL;
+
+    // resets the eventfd counter, we empty the whole queue anyway
+    if(read(loop->event_fd, &count, sizeof(count)) != sizeof(count)) {
+        return;
+    }
+
+    while(1) {
+        pthread_mutex_lock(&loop->lock);
+        job = Queue_recv(loop->finished);
+        pthread_mutex_unlock(&loop->lock);
+
+        if(job == NULL) break;
+
+        job->done(job);
+        IoJob_destroy(job);
+    }
+}
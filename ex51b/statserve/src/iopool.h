@@ -0,0 +1,79 @@
+#ifndef _iopool_h
+#define _iopool_h
+
+#include <pthread.h>
+#include <lcthw/bstrlib.h>
+#include <lcthw/queue.h>
+#include <lcthw/stats.h>
+#include "statserve.h"
+
+/*
+ * store and load do their file I/O on a small pool of threads so a slow
+ * disk only stalls the client that asked. The handler does the part that
+ * touches DATA, then leaves an IoJob in IO->deferred. Whoever ran the
+ * command submits it with the thing waiting on it, and that connection
+ * reads nothing more until the reply is in, so per-connection order
+ * holds. The pool pushes finished jobs back onto the IoLoop they came
+ * from and pokes its eventfd, and that thread calls the job's done
+ * callback to finish the command against DATA.
+ */
+typedef enum IoOp {
+    IO_STORE, IO_LOAD
+} IoOp;
+
+struct IoJob;
+
+typedef void (*io_done_cb)(struct IoJob *job);
+
+typedef struct IoJob {
+    IoOp op;
+    bstring location;
+    // load's TO, the record is made once the read is back
+    bstring to;
+    // what store writes, or what load read
+    Stats stats;
+    // written after stats when there is one, older files don't have it
+    Sketch *sketch;
+    // the reply goes out as a FrameReply
+    int binary;
+    // 0, or the errno from the file calls
+    int error;
+    // runs on the thread that made the job
+    io_done_cb done;
+    // the Connection or Message waiting on it
+    void *owner;
+    struct IoLoop *loop;
+} IoJob;
+
+typedef struct IoLoop {
+    pthread_mutex_t lock;
+    Queue *finished;
+    // in the owning thread's epoll set
+    int event_fd;
+    // the job the last command handed off, until its caller submits it
+    IoJob *deferred;
+} IoLoop;
+
+// 0 does the file I/O inline on the network thread
+extern int IO_THREADS;
+extern __thread IoLoop *IO;
+
+int IoPool_start(int nthreads);
+
+IoLoop *IoLoop_create();
+
+void IoLoop_destroy(IoLoop *loop);
+
+void IoLoop_drain(IoLoop *loop);
+
+IoJob *IoJob_create(IoOp op, bstring location, bstring to, int binary);
+
+void IoJob_destroy(IoJob *job);
+
+void IoJob_run(IoJob *job);
+
+void Io_defer(IoLoop *loop, IoJob *job);
+
+int Io_submit(IoLoop *loop, io_done_cb done, void *owner);
+
+#endif
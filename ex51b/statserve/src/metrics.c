@@ -0,0 +1,156 @@
+#include <stdlib.h>
+#include <string.h>
+#include <lcthw/dbg.h>
+#include "metrics.h"
+#include "atomicstats.h"
+
+int METRICS_EVERY = 16;
+__thread Metrics METRICS;
+
+extern __thread RecordMap *DATA;
+
+static _Atomic(Metrics *) REGISTRY[METRICS_THREADS];
+static _Atomic int REGISTERED = 0;
+static __thread int IS_REGISTERED = 0;
+
+void Metrics_sample(Latency *latency, double micros)
+{
+    unsigned long seq = atomic_load_explicit(&METRICS.seq, memory_order_relaxed);
+
+    // odd first, so a reader never keeps half of this
+    atomic_store_explicit(&METRICS.seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    if(latency->sketch == NULL) latency->sketch = Sketch_create();
+    Stats_sample(&latency->stats, micros);
+    if(latency->sketch) Sketch_add(latency->sketch, micros);
+
+    atomic_store_explicit(&METRICS.seq, seq + 2, memory_order_release);
+}
+
+void Metrics_time(CommandMetrics *command, double start, double parsed)
+{
+    double now = metrics_now();
+
+    Metrics_sample(&command->parse, parsed - start);
+    Metrics_sample(&command->handler, now - parsed);
+}
+
+int Metrics_register()
+{
+    if(IS_REGISTERED) return 0;
+
+    int at = atomic_fetch_add(&REGISTERED, 1);
+    check(at < METRICS_THREADS, "Too many threads for info, %d isn't counted.", at);
+
+    atomic_store_explicit(&REGISTRY[at], &METRICS, memory_order_release);
+    IS_REGISTERED = 1;
+
+    return 0;
+error:
+    return -1;
+}
+
+void Metrics_publish()
+{
+    long slabs = 0;
+    int i = 0;
+
+    for(i = 0; i <= STATS_STRIPES_MAX; i++) {
+        slabs += RECORDS[i].live * (long)RECORDS[i].size;
+    }
+
+    atomic_store_explicit(&METRICS.slab_bytes, slabs, memory_order_relaxed);
+    atomic_store_explicit(&METRICS.records,
+            DATA ? (long)RecordMap_count(DATA) : 0, memory_order_relaxed);
+    atomic_store_explicit(&METRICS.table_bytes,
+            DATA ? (long)RecordMap_bytes(DATA) : 0, memory_order_relaxed);
+}
+
+static void fold_latency(Metrics *from, Latency *latency, Latency *into)
+{
+    Stats stats;
+    Sketch copy;
+    Sketch *sketch = NULL;
+    unsigned long seq = 0;
+
+    // the owner may be in the middle of it, copy until it held still
+    do {
+        seq = atomic_load_explicit(&from->seq, memory_order_acquire);
+        stats = latency->stats;
+        sketch = latency->sketch;
+        if(sketch) memcpy(&copy, sketch, sizeof(Sketch));
+        atomic_thread_fence(memory_order_acquire);
+    } while((seq & 1) || seq != atomic_load_explicit(&from->seq, memory_order_relaxed));
+
+    if(stats.n == 0) return;
+
+    stats_merge(&into->stats, &stats);
+
+    if(sketch) {
+        if(into->sketch == NULL) into->sketch = Sketch_create();
+        if(into->sketch) Sketch_merge(into->sketch, &copy);
+    }
+}
+
+static inline void fold_counter(_Atomic long *into, _Atomic long *from)
+{
+    atomic_store_explicit(into, atomic_load_explicit(into, memory_order_relaxed)
+            + atomic_load_explicit(from, memory_order_relaxed), memory_order_relaxed);
+}
+
+static inline void fold_high(_Atomic long *into, _Atomic long *from)
+{
+    metric_high(into, atomic_load_explicit(from, memory_order_relaxed));
+}
+
+void Metrics_fold(Metrics *total)
+{
+    int count = atomic_load_explicit(&REGISTERED, memory_order_acquire);
+    int i = 0;
+    int slot = 0;
+
+    if(count > METRICS_THREADS) count = METRICS_THREADS;
+
+    for(i = 0; i < count; i++) {
+        Metrics *from = atomic_load_explicit(&REGISTRY[i], memory_order_acquire);
+        // its slot is taken but it isn't stored yet
+        if(from == NULL) continue;
+
+        fold_counter(&total->connections, &from->connections);
+        fold_counter(&total->accepted, &from->accepted);
+        fold_counter(&total->bytes_in, &from->bytes_in);
+        fold_counter(&total->bytes_out, &from->bytes_out);
+        fold_counter(&total->bad, &from->bad);
+        fold_counter(&total->records, &from->records);
+        fold_counter(&total->table_bytes, &from->table_bytes);
+        fold_counter(&total->slab_bytes, &from->slab_bytes);
+        fold_high(&total->recv_high, &from->recv_high);
+        fold_high(&total->send_high, &from->send_high);
+        fold_latency(from, &from->flush, &total->flush);
+
+        for(slot = 0; slot < COMMAND_SLOTS; slot++) {
+            CommandMetrics *command = &from->command[slot];
+
+            if(atomic_load_explicit(&command->calls, memory_order_relaxed) == 0) continue;
+
+            fold_counter(&total->command[slot].calls, &command->calls);
+            fold_counter(&total->command[slot].errors, &command->errors);
+            fold_latency(from, &command->parse, &total->command[slot].parse);
+            fold_latency(from, &command->handler, &total->command[slot].handler);
+        }
+    }
+}
+
+void Metrics_clear(Metrics *total)
+{
+    int slot = 0;
+
+    Sketch_destroy(total->flush.sketch);
+    for(slot = 0; slot < COMMAND_SLOTS; slot++) {
+        Sketch_destroy(total->command[slot].parse.sketch);
+        Sketch_destroy(total->command[slot].handler.sketch);
+    }
+
+    memset(total, 0, sizeof(Metrics));
+}
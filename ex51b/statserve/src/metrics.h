@@ -0,0 +1,135 @@
+#ifndef _metrics_h
+#define _metrics_h
+
+#include <time.h>
+#include <stdatomic.h>
+#include <lcthw/stats.h>
+#include "statserve.h"
+#include "sketch.h"
+
+// threads whose numbers info can see, far more than workers ever are
+#define METRICS_THREADS 256
+
+/*
+ * The server's own numbers, for info. Every thread that runs commands
+ * counts into its own Metrics and nobody else writes it, so a command
+ * costs a couple of adds to memory no other core is touching, with no
+ * lock and no atomic instruction. info folds every registered thread's
+ * into one.
+ *
+ * The counters are atomics only so another thread can load them, the
+ * owner just stores the new value. A latency is a Stats plus a Sketch,
+ * far too big to load atomically, so the owner makes seq odd while it
+ * changes one and a reader copies it and tries again if seq was odd or
+ * moved. Only one request or flush in METRICS_EVERY is timed, reading
+ * the clock costs more than everything else put together. Times are in
+ * microseconds.
+ *
+ * A thread that registers never exits, its Metrics is thread local and
+ * the registry keeps pointing at it.
+ */
+typedef struct Latency {
+    Stats stats;
+    // NULL until the first sample, most commands never get timed
+    Sketch *sketch;
+} Latency;
+
+typedef struct CommandMetrics {
+    _Atomic long calls;
+    // refused, or failed and closed the connection
+    _Atomic long errors;
+    Latency parse;
+    Latency handler;
+} CommandMetrics;
+
+typedef struct Metrics {
+    // odd while a latency is being written
+    _Atomic unsigned long seq;
+    // requests and flushes, picks which ones get timed
+    unsigned long ticks;
+    // made less destroyed, one can go negative when a replica moves shards
+    _Atomic long connections;
+    _Atomic long accepted;
+    _Atomic long bytes_in;
+    _Atomic long bytes_out;
+    // requests that didn't parse, so they have no command to count under
+    _Atomic long bad;
+    // the most a recv_rb or send_rb has held
+    _Atomic long recv_high;
+    _Atomic long send_high;
+    // DATA and RECORDS as of the last Metrics_publish, only the owner can look
+    _Atomic long records;
+    _Atomic long table_bytes;
+    _Atomic long slab_bytes;
+    Latency flush;
+    CommandMetrics command[COMMAND_SLOTS];
+} Metrics;
+
+// a power of 2, 0 times nothing and only counts
+extern int METRICS_EVERY;
+extern __thread Metrics METRICS;
+
+static inline void metric_add(_Atomic long *counter, long n)
+{
+    // only the owner writes it, so no atomic add
+    atomic_store_explicit(counter,
+            atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline void metric_high(_Atomic long *mark, long value)
+{
+    if(value > atomic_load_explicit(mark, memory_order_relaxed)) {
+        atomic_store_explicit(mark, value, memory_order_relaxed);
+    }
+}
+
+static inline double metrics_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+// when a timed request or flush started, 0 when this one isn't timed
+static inline double Metrics_start()
+{
+    if(METRICS_EVERY == 0 || (++METRICS.ticks & (METRICS_EVERY - 1)) != 0) return 0;
+    return metrics_now();
+}
+
+// the end of parsing, for the ones Metrics_start timed
+static inline double Metrics_lap(double start)
+{
+    return start > 0 ? metrics_now() : 0;
+}
+
+void Metrics_sample(Latency *latency, double micros);
+
+void Metrics_time(CommandMetrics *command, double start, double parsed);
+
+static inline void Metrics_command(CommandSpec *spec, int failed, double start, double parsed)
+{
+    CommandMetrics *command = &METRICS.command[spec - COMMANDS];
+
+    metric_add(&command->calls, 1);
+    if(failed) metric_add(&command->errors, 1);
+    if(start > 0) Metrics_time(command, start, parsed);
+}
+
+static inline void Metrics_flush(double start)
+{
+    if(start > 0) Metrics_sample(&METRICS.flush, metrics_now() - start);
+}
+
+int Metrics_register();
+
+// copies this thread's DATA and RECORDS sizes where info can see them
+void Metrics_publish();
+
+// every registered thread added up into total, which starts zeroed
+void Metrics_fold(Metrics *total);
+
+// frees the sketches Metrics_fold made
+void Metrics_clear(Metrics *total);
+
+#endif
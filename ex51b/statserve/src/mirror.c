@@ -0,0 +1,60 @@
+// memfd_create is a GNU extension
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <lcthw/dbg.h>
+#include "mirror.h"
+
+// 0 gives connections plain RingBuffers, like when memfd isn't there
+int MIRROR_BUFFERS = 1;
+
+RingBuffer *MirrorBuffer_create(int size)
+{
+    int rc = 0;
+    int fd = -1;
+    char *base = MAP_FAILED;
+    long page = sysconf(_SC_PAGESIZE);
+    // lcthw keeps one byte free, so size + 1 like RingBuffer_create
+    int length = (size + 1 + page - 1) / page * page;
+    RingBuffer *buffer = calloc(1, sizeof(RingBuffer));
+    check_mem(buffer);
+
+    fd = memfd_create("statserve-ring", MFD_CLOEXEC);
+    check(fd >= 0, "Failed to make the memfd for a mirrored buffer.");
+
+    rc = ftruncate(fd, length);
+    check(rc == 0, "Failed to size the mirrored buffer.");
+
+    // reserve both halves first so nothing else lands in the second
+    base = mmap(NULL, length * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    check(base != MAP_FAILED, "Failed to reserve the mirrored buffer.");
+
+    check(mmap(base, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == base,
+            "Failed to map the mirrored buffer.");
+    check(mmap(base + length, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0)
+            == base + length, "Failed to map the mirror.");
+
+    // the mappings keep the memory alive
+    close(fd);
+
+    buffer->buffer = base;
+    buffer->length = length;
+
+    return buffer;
+error:
+    if(base != MAP_FAILED) munmap(base, length * 2);
+    if(fd >= 0) close(fd);
+    free(buffer);
+    return NULL;
+}
+
+void MirrorBuffer_destroy(RingBuffer *buffer)
+{
+    if(buffer) {
+        munmap(buffer->buffer, buffer->length * 2);
+        free(buffer);
+    }
+}
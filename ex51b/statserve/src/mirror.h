@@ -0,0 +1,21 @@
+#ifndef _mirror_h
+#define _mirror_h
+
+#include <lcthw/ringbuffer.h>
+
+/*
+ * A RingBuffer whose pages are mapped twice, back to back, so the
+ * unread bytes at start and the free space at end are each one run of
+ * memory even once end wraps around below start. recv, send and the
+ * parsers work straight out of it and nothing ever gets slid down.
+ * Use ring_unread and ring_room from net.h on it, the lcthw
+ * available_data macros go wrong once it wraps. length gets rounded
+ * up to whole pages.
+ */
+extern int MIRROR_BUFFERS;
+
+RingBuffer *MirrorBuffer_create(int size);
+
+void MirrorBuffer_destroy(RingBuffer *buffer);
+
+#endif
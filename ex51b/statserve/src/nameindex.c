@@ -0,0 +1,251 @@
+#include <stdlib.h>
+#include <string.h>
+#include <lcthw/dbg.h>
+#include "nameindex.h"
+#include "statserve.h"
+
+#define is_node(P) (((uintptr_t)(P)) & 1)
+#define as_node(P) ((NameNode *)((uintptr_t)(P) - 1))
+#define as_child(N) ((void *)((uintptr_t)(N) + 1))
+
+static inline uint32_t symbol(bstring name, size_t at)
+{
+    return at < (size_t)name->slen ? 0x100 | name->data[at] : 0;
+}
+
+static inline int direction(NameNode *node, bstring name)
+{
+    return (symbol(name, node->byte) & node->bit) != 0;
+}
+
+// the node's bit comes after byte and bit, so it's further down
+static inline int is_below(NameNode *node, size_t byte, uint32_t bit)
+{
+    return node->byte > byte || (node->byte == byte && node->bit < bit);
+}
+
+static Record *best_leaf(NameIndex *index, bstring name)
+{
+    void *at = index->root;
+
+    while(is_node(at)) {
+        NameNode *node = as_node(at);
+        at = node->child[direction(node, name)];
+    }
+
+    return at;
+}
+
+// where name and other first differ, 0 when they're the same name
+static uint32_t first_difference(bstring name, bstring other, size_t *byte)
+{
+    size_t longest = name->slen > other->slen ? name->slen : other->slen;
+    uint32_t diff = 0;
+
+    for(*byte = 0; *byte <= longest; (*byte)++) {
+        diff = symbol(name, *byte) ^ symbol(other, *byte);
+        // just the highest bit that's different
+        if(diff) return 1u << (31 - __builtin_clz(diff));
+    }
+
+    return 0;
+}
+
+static NameNode *node_alloc(NameIndex *index)
+{
+    NameNode *node = index->free;
+
+    if(node != NULL) {
+        index->free = node->child[0];
+        return node;
+    }
+
+    if(index->blocks == NULL || index->carve == NAMEINDEX_BLOCK) {
+        NameBlock *block = malloc(sizeof(NameBlock));
+        check_mem(block);
+        block->next = index->blocks;
+        index->blocks = block;
+        index->carve = 0;
+    }
+
+    return &index->blocks->node[index->carve++];
+error:
+    return NULL;
+}
+
+static void node_free(NameIndex *index, NameNode *node)
+{
+    node->child[0] = index->free;
+    index->free = node;
+}
+
+int NameIndex_add(NameIndex *index, Record *info)
+{
+    bstring name = info->name;
+    size_t byte = 0;
+    size_t need = 9 * ((size_t)name->slen + 1) + 2;
+
+    if(need > index->stack_size) {
+        void **stack = realloc(index->stack, need * sizeof(void *));
+        check_mem(stack);
+        index->stack = stack;
+        index->stack_size = need;
+    }
+
+    if(index->root == NULL) {
+        index->root = info;
+        index->count = 1;
+        return 0;
+    }
+
+    uint32_t bit = first_difference(name, best_leaf(index, name)->name, &byte);
+    check(bit != 0, "%s is already in the index.", name->data);
+
+    NameNode *node = node_alloc(index);
+    check_mem(node);
+
+    int side = (symbol(name, byte) & bit) != 0;
+    node->byte = byte;
+    node->bit = bit;
+    node->child[side] = info;
+
+    // it goes in above the first node that splits on a later bit
+    void **where = &index->root;
+    while(is_node(*where) && !is_below(as_node(*where), byte, bit)) {
+        NameNode *at = as_node(*where);
+        where = &at->child[direction(at, name)];
+    }
+
+    node->child[!side] = *where;
+    *where = as_child(node);
+    index->count++;
+
+    return 0;
+error:
+    return -1;
+}
+
+Record *NameIndex_remove(NameIndex *index, bstring name)
+{
+    void **where = &index->root;
+    void **above = NULL;
+    NameNode *parent = NULL;
+    size_t byte = 0;
+    int side = 0;
+
+    if(index->root == NULL) return NULL;
+
+    while(is_node(*where)) {
+        above = where;
+        parent = as_node(*where);
+        side = direction(parent, name);
+        where = &parent->child[side];
+    }
+
+    Record *info = *where;
+    if(first_difference(name, info->name, &byte) != 0) return NULL;
+
+    // the other side takes the parent's place
+    if(parent == NULL) {
+        index->root = NULL;
+    } else {
+        *above = parent->child[!side];
+        node_free(index, parent);
+    }
+
+    index->count--;
+    return info;
+}
+
+static inline int has_prefix(bstring name, bstring prefix)
+{
+    return name->slen >= prefix->slen
+        && memcmp(name->data, prefix->data, prefix->slen) == 0;
+}
+
+// to is the side that comes later in the walk, 1 for byte order and 0
+// for the reverse of it
+static int walk(NameIndex *index, bstring from, int inclusive, bstring prefix,
+        int to, NameIndex_cb cb, void *context)
+{
+    size_t top = 0;
+    size_t byte = 0;
+    int rc = 0;
+
+    if(index->root == NULL) return 0;
+
+    if(from == NULL) {
+        // from one end to the other
+        index->stack[top++] = index->root;
+    } else {
+        // from doesn't have to be in here, find where it would go
+        uint32_t bit = first_difference(from, best_leaf(index, from)->name, &byte);
+        void *at = index->root;
+
+        // everything on the later side of the path comes after from,
+        // stack it up so the nearest comes off first
+        while(is_node(at) && (bit == 0 || !is_below(as_node(at), byte, bit))) {
+            NameNode *node = as_node(at);
+            int side = direction(node, from);
+
+            if(side != to) index->stack[top++] = node->child[to];
+            at = node->child[side];
+        }
+
+        if(bit == 0) {
+            // it's the leaf we ended on
+            if(inclusive) index->stack[top++] = at;
+        } else if(((symbol(from, byte) & bit) != 0) != to) {
+            // from splits off the other way, so all of this subtree is after it
+            index->stack[top++] = at;
+        }
+    }
+
+    while(top > 0) {
+        void *at = index->stack[--top];
+
+        // down the near edge, the far sides wait their turn
+        while(is_node(at)) {
+            NameNode *node = as_node(at);
+            index->stack[top++] = node->child[to];
+            at = node->child[!to];
+        }
+
+        Record *info = at;
+        // in order, so the first one without it is the end of them
+        if(!has_prefix(info->name, prefix)) return 0;
+
+        rc = cb(info, context);
+        if(rc != 0) return rc;
+    }
+
+    return 0;
+}
+
+int NameIndex_walk(NameIndex *index, bstring from, int inclusive,
+        bstring prefix, NameIndex_cb cb, void *context)
+{
+    return walk(index, from, inclusive, prefix, 1, cb, context);
+}
+
+int NameIndex_walk_back(NameIndex *index, bstring from, int inclusive,
+        NameIndex_cb cb, void *context)
+{
+    struct tagbstring all = bsStatic("");
+
+    return walk(index, from, inclusive, &all, 0, cb, context);
+}
+
+void NameIndex_clear(NameIndex *index)
+{
+    NameBlock *block = index->blocks;
+
+    while(block != NULL) {
+        NameBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+
+    free(index->stack);
+    memset(index, 0, sizeof(NameIndex));
+}
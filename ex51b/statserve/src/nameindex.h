@@ -0,0 +1,71 @@
+#ifndef _nameindex_h
+#define _nameindex_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <lcthw/bstrlib.h>
+
+// nodes per block in the index's own pool
+#define NAMEINDEX_BLOCK 4096
+
+struct Record;
+
+/*
+ * Every name in a RecordMap again, in byte order, so list and dumptree
+ * can find a subtree without looking at the rest. It's a crit-bit
+ * tree: the leaves are the Records themselves and each inner node only
+ * says which bit of which byte tells its two sides apart, so a lookup
+ * touches one node per bit that matters and compares the name once at
+ * the leaf. A name that ends is a 0 and every byte that's there has
+ * 0x100 on top, so a name sorts before anything it's a prefix of.
+ *
+ * A walk can start anywhere, including after a name that was deleted
+ * since, which is how a reply picks up again after the last name it
+ * sent. It costs the length of the start plus the names it hands out.
+ */
+typedef struct NameNode {
+    // tagged with 1, a plain Record * is a leaf
+    void *child[2];
+    uint32_t byte;
+    // the one bit of the 9 bit symbol at byte, 0x100 down to 0x1
+    uint32_t bit;
+} NameNode;
+
+typedef struct NameBlock {
+    struct NameBlock *next;
+    NameNode node[NAMEINDEX_BLOCK];
+} NameBlock;
+
+typedef struct NameIndex {
+    void *root;
+    size_t count;
+    // freed nodes chained through child[0], then the rest of the newest block
+    NameNode *free;
+    NameBlock *blocks;
+    size_t carve;
+    // for a walk, no deeper than one entry per bit of the longest name
+    void **stack;
+    size_t stack_size;
+} NameIndex;
+
+// a nonzero return stops the walk and is what NameIndex_walk returns
+typedef int (*NameIndex_cb)(struct Record *info, void *context);
+
+// the name mustn't be in it already
+int NameIndex_add(NameIndex *index, struct Record *info);
+
+struct Record *NameIndex_remove(NameIndex *index, bstring name);
+
+// in order from the first name >= from (> from if !inclusive), for as
+// long as they start with prefix
+int NameIndex_walk(NameIndex *index, bstring from, int inclusive,
+        bstring prefix, NameIndex_cb cb, void *context);
+
+// the other way, from the last name <= from (< from if !inclusive) down
+// to the first, or from the very last when from is NULL
+int NameIndex_walk_back(NameIndex *index, bstring from, int inclusive,
+        NameIndex_cb cb, void *context);
+
+void NameIndex_clear(NameIndex *index);
+
+#endif
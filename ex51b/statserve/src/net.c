@@ -1,11 +1,13 @@
 #include <stdlib.h>
 #include <sys/select.h>
 #include <stdio.h>
+#include <string.h>
 #include <lcthw/ringbuffer.h>
 #include <lcthw/dbg.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
@@ -15,6 +17,12 @@
 struct tagbstring NL = bsStatic("\n");
 struct tagbstring CRLF = bsStatic("\r\n");
 
+// text replies end in \r\n unless the server runs with the lf option
+int REPLY_CRLF = 1;
+
+// clients and replicas on the same box can skip TCP, NULL for none
+const char *UNIX_PATH = NULL;
+
 int nonblock(int fd)
 {
     int flags = fcntl(fd, F_GETFL, 0);
@@ -53,20 +61,120 @@ error:
     return -1;
 }
 
+static int unix_address(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+
+    check(strlen(path) < sizeof(addr->sun_path), "Socket path too long: %s", path);
+    strcpy(addr->sun_path, path);
+
+    return 0;
+error:
+    return -1;
+}
+
+int unix_connect(const char *path)
+{
+    int rc = 0;
+    int sock = -1;
+    struct sockaddr_un addr;
+
+    rc = unix_address(path, &addr);
+    check(rc == 0, "Invalid socket path.");
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    check(sock >= 0, "Cannot create a socket.");
+
+    rc = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+    check(rc == 0, "Connect to %s failed.", path);
+
+    rc = nonblock(sock);
+    check(rc == 0, "Can't set nonblocking.");
+
+    return sock;
+error:
+    if(sock >= 0) close(sock);
+    return -1;
+}
+
+int unix_listen(const char *path)
+{
+    int rc = 0;
+    int sock = -1;
+    struct sockaddr_un addr;
+
+    rc = unix_address(path, &addr);
+    check(rc == 0, "Invalid socket path.");
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    check(sock >= 0, "Cannot create a socket.");
+
+    // left over from the last run, bind fails while it's there
+    unlink(path);
+
+    rc = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+    check(rc == 0, "Failed to bind to %s.", path);
+
+    rc = listen(sock, BACKLOG);
+    check(rc == 0, "Failed to listen on %s.", path);
+
+    return sock;
+error:
+    if(sock >= 0) close(sock);
+    return -1;
+}
+
 int read_some(RingBuffer * buffer, int fd, int is_socket)
 {
     int rc = 0;
 
-    if (RingBuffer_available_data(buffer) == 0) {
+    int avail = RingBuffer_available_data(buffer);
+
+    if (avail == 0) {
         buffer->start = buffer->end = 0;
+    } else if (buffer->start > 0) {
+        // slide a pipelined partial line down so there's room after it
+        memmove(buffer->buffer, RingBuffer_starts_at(buffer), avail);
+        buffer->start = 0;
+        buffer->end = avail;
     }
 
+    // append after anything still unread, like a partial line, but
+    // leave the last byte free: once end hits length - 1 the
+    // available_data macro wraps around and goes negative
+    int space = RingBuffer_available_space(buffer) - 1;
+    check(space > 0, "Line too long for the buffer on fd: %d", fd);
+
+    if (is_socket) {
+        rc = recv(fd, RingBuffer_ends_at(buffer), space, 0);
+    } else {
+        rc = read(fd, RingBuffer_ends_at(buffer), space);
+    }
+
+    check(rc >= 0, "Failed to read from fd: %d", fd);
+
+    RingBuffer_commit_write(buffer, rc);
+
+    return rc;
+
+error:
+    return -1;
+}
+
+int read_mirrored(RingBuffer * buffer, int fd, int is_socket)
+{
+    int rc = 0;
+
+    // the free space runs on into the mirror, so unlike read_some a
+    // partial line never has to be moved out of the way
+    int space = ring_room(buffer);
+    check(space > 0, "Line too long for the buffer on fd: %d", fd);
+
     if (is_socket) {
-        rc = recv(fd, RingBuffer_starts_at(buffer),
-                RingBuffer_available_space(buffer), 0);
+        rc = recv(fd, RingBuffer_ends_at(buffer), space, 0);
     } else {
-        rc = read(fd, RingBuffer_starts_at(buffer),
-                RingBuffer_available_space(buffer));
+        rc = read(fd, RingBuffer_ends_at(buffer), space);
     }
 
     check(rc >= 0, "Failed to read from fd: %d", fd);
@@ -82,21 +190,40 @@ error:
 int write_some(RingBuffer * buffer, int fd, int is_socket)
 {
     int rc = 0;
-    bstring data = RingBuffer_get_all(buffer);
+    int count = 1;
+    struct iovec iov[2];
+    struct msghdr msg = {.msg_iov = iov};
+
+    // send straight out of the buffer, replies already end in \r\n
+    // and binary frames must go out as they are anyway
+    iov[0].iov_base = RingBuffer_starts_at(buffer);
+
+    if (buffer->end >= buffer->start) {
+        iov[0].iov_len = buffer->end - buffer->start;
+    } else {
+        // wrapped, so it's the tail of the buffer then the head
+        iov[0].iov_len = buffer->length - buffer->start;
+        iov[1].iov_base = buffer->buffer;
+        iov[1].iov_len = buffer->end;
+        count = 2;
+    }
 
-    check(data != NULL, "Failed to get from the buffer.");
-    check(bfindreplace(data, &NL, &CRLF, 0) == BSTR_OK,
-            "Failed to replace NL.");
+    int avail = iov[0].iov_len + (count == 2 ? iov[1].iov_len : 0);
 
     if (is_socket) {
-        rc = send(fd, bdata(data), blength(data), 0);
+        msg.msg_iovlen = count;
+        rc = sendmsg(fd, &msg, 0);
     } else {
-        rc = write(fd, bdata(data), blength(data));
+        rc = writev(fd, iov, count);
     }
 
-    check(rc == blength(data), "Failed to write everything to fd: %d.",
-            fd);
-    bdestroy(data);
+    // a full socket takes what it can, the rest stays for the next try
+    if(rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        rc = 0;
+        errno = 0;
+    }
+    check(rc >= 0 && rc <= avail, "Failed to write to fd: %d.", fd);
+    RingBuffer_commit_read(buffer, rc);
 
     return rc;
 
@@ -104,7 +231,7 @@ error:
     return -1;
 }
 
-int attempt_listen(struct addrinfo *info)
+int attempt_listen(struct addrinfo *info, int reuseport)
 {
     int sockfd = -1; // default fail
     int rc = -1;
@@ -121,6 +248,12 @@ int attempt_listen(struct addrinfo *info)
     rc = setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
     check_debug(rc == 0, "Failed to set SO_REUSADDR.");
 
+    // let several sockets share the port, the kernel balances accepts
+    if(reuseport) {
+        rc = setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int));
+        check_debug(rc == 0, "Failed to set SO_REUSEPORT.");
+    }
+
     // attempt to bind to it
     rc = bind(sockfd, info->ai_addr, info->ai_addrlen);
     check_debug(rc == 0, "Failed to find socket.");
@@ -136,7 +269,7 @@ error:
 }
 
 
-int server_listen(const char *host, const char *port)
+int listen_on(const char *host, const char *port, int reuseport)
 {
     int rc = 0;
     int sockfd = -1; // default fail value
@@ -159,7 +292,7 @@ int server_listen(const char *host, const char *port)
     for(next_p = info; next_p != NULL; next_p = next_p->ai_next)
     {
         // attempt to listen to each one
-        sockfd = attempt_listen(next_p);
+        sockfd = attempt_listen(next_p, reuseport);
         if(sockfd != -1) break;
     }
 
@@ -172,32 +305,77 @@ error: //fallthrough
     return sockfd;
 }
 
-bstring read_line(RingBuffer *input, const char line_ending)
+int server_listen(const char *host, const char *port)
 {
-    int i = 0;
-    bstring result = NULL;
+    return listen_on(host, port, 0);
+}
+
+int server_listen_shared(const char *host, const char *port)
+{
+    return listen_on(host, port, 1);
+}
+
+int scan_line(RingBuffer *input, const char line_ending, int *scanned, int max_line)
+{
+    // the length of the next line, -1 if it isn't all here yet, or -2
+    // if it's longer than max_line. scanned remembers how much has no
+    // line ending in it, so a client sending a byte at a time costs one
+    // memchr over the new bytes, not one over everything so far
+    char *start = RingBuffer_starts_at(input);
+    int wrapped = input->end < input->start;
+    int first = wrapped ? input->length - input->start : input->end - input->start;
+    int avail = wrapped ? first + input->end : first;
+    int at = *scanned;
+    char *found = NULL;
+    int len = -1;
+
+    if(at < first) {
+        found = memchr(start + at, line_ending, first - at);
+        if(found) len = found - start;
+        at = first;
+    }
+
+    if(len == -1 && at < avail) {
+        // the rest of it starts back at the front of the buffer
+        found = memchr(input->buffer + at - first, line_ending, avail - at);
+        if(found) len = first + (found - input->buffer);
+    }
 
-    // not super efficient
-    // read a character at a time from the ring buffer
-    for(i = 0; i < RingBuffer_available_data(input); i++) {
-        // if the buffer has line ending
-        if(input->buffer[i] == line_ending) {
-            // get that much fromt he ring buffer
-            result = RingBuffer_gets(input, i);
-            check(result, "Failed to get line from RingBuffer");
-            // make sure that we got the right amount
-            check(RingBuffer_available_data(input) >= 1, 
-                    "Not enough data in the RingBuffer after reading line.");
-            // and commit it
-            RingBuffer_commit_read(input, 1);
-            break;
-        }
+    if(len == -1) {
+        *scanned = avail;
+        return avail > max_line ? -2 : -1;
     }
 
+    // the next scan starts on the next line
+    *scanned = 0;
+    return len > max_line ? -2 : len;
+}
+
+bstring read_line(RingBuffer *input, const char line_ending)
+{
+    int scanned = 0;
+    bstring result = NULL;
+    int len = scan_line(input, line_ending, &scanned, ring_unread(input));
+    int first = input->length - input->start;
+
     // notice this will fail in the cases where we get a set of data
     // on the wire that does not have a line ending yet
+    if(len < 0) return NULL;
+
+    // a mirror has it all in a row, a plain buffer may need the front too
+    result = blk2bstr(RingBuffer_starts_at(input), len < first ? len : first);
+    check(result, "Failed to get line from RingBuffer");
+    if(len > first) {
+        check(bcatblk(result, input->buffer, len - first) == BSTR_OK,
+                "Failed to get the wrapped part of the line.");
+    }
+
+    // and commit it with the line ending
+    RingBuffer_commit_read(input, len + 1);
+
     return result;
 error:
+    bdestroy(result);
     return NULL;
 }
 
@@ -207,3 +385,11 @@ void send_reply(RingBuffer *send_rb, bstring reply)
     RingBuffer_puts(send_rb, reply);
 }
 
+void send_line(RingBuffer *send_rb, const char *data, int len)
+{
+    bstring ending = REPLY_CRLF ? &CRLF : &NL;
+
+    RingBuffer_write(send_rb, (char *)data, len);
+    RingBuffer_puts(send_rb, ending);
+}
+
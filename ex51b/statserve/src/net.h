@@ -5,13 +5,27 @@
 
 #define BACKLOG 10
 
+// unread bytes and free space that stay right once end wraps below start,
+// which only a mirrored buffer lets happen
+#define ring_unread(B) (((B)->end - (B)->start + (B)->length) % (B)->length)
+#define ring_room(B) ((B)->length - 1 - ring_unread((B)))
+
 int nonblock(int fd);
 int client_connect(char *host, char *port);
+int unix_connect(const char *path);
+int unix_listen(const char *path);
 int read_some(RingBuffer * buffer, int fd, int is_socket);
+int read_mirrored(RingBuffer * buffer, int fd, int is_socket);
 int write_some(RingBuffer * buffer, int fd, int is_socket);
 int server_listen(const char *host, const char *port);
+int server_listen_shared(const char *host, const char *port);
+int scan_line(RingBuffer *input, const char line_ending, int *scanned, int max_line);
 bstring read_line(RingBuffer *input, const char line_ending);
 void send_reply(RingBuffer *send_rb, bstring reply);
+void send_line(RingBuffer *send_rb, const char *data, int len);
+
+extern int REPLY_CRLF;
+extern const char *UNIX_PATH;
 
 
 #endif
@@ -0,0 +1,315 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <lcthw/dbg.h>
+#include "recordmap.h"
+#include "statserve.h"
+
+static inline size_t probe_distance(RecordTable *table, uint64_t hash, size_t at)
+{
+    return (at - (hash & table->mask)) & table->mask;
+}
+
+static inline int same_name(bstring a, bstring b)
+{
+    return a == b || (a->slen == b->slen && memcmp(a->data, b->data, a->slen) == 0);
+}
+
+static inline size_t table_bytes(RecordTable *table)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return ((table->mask + 1) * sizeof(RecordSlot) + page - 1) & ~(page - 1);
+}
+
+static int table_init(RecordTable *table, size_t size)
+{
+    table->mask = size - 1;
+    table->count = 0;
+    table->head = 0;
+    table->unmapped = 0;
+
+    // fresh pages are already zero, every slot starts empty
+    table->slot = mmap(NULL, table_bytes(table), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    check(table->slot != MAP_FAILED, "Failed to map %zu record slots.", size);
+
+    return 0;
+error:
+    table->slot = NULL;
+    return -1;
+}
+
+static void table_free(RecordTable *table)
+{
+    size_t bytes = table_bytes(table);
+    size_t gone = table->head + table->unmapped;
+
+    // around the hole migrating already made, never over it
+    if(table->slot) {
+        if(table->head > 0) munmap(table->slot, table->head);
+        if(gone < bytes) munmap((char *)table->slot + gone, bytes - gone);
+    }
+    memset(table, 0, sizeof(RecordTable));
+}
+
+// how far past start a slot is, old's slots are only in order from there
+static inline size_t past_start(RecordTable *table, size_t start, size_t at)
+{
+    return (at - start) & table->mask;
+}
+
+// the old table's slots still start floor past start, both are 0 for now
+static long table_find(RecordTable *table, size_t start, size_t floor, size_t from,
+        uint64_t hash, bstring name)
+{
+    size_t at = from;
+    size_t distance = probe_distance(table, hash, from);
+
+    // an empty slot, or one closer to home than we are, and it isn't here
+    for(;; at = (at + 1) & table->mask, distance++) {
+        RecordSlot *slot = &table->slot[at];
+
+        // wrapped around into what's been moved out
+        if(past_start(table, start, at) < floor) return -1;
+
+        if(slot->record == NULL || probe_distance(table, slot->hash, at) < distance) {
+            return -1;
+        }
+
+        if(slot->hash == hash && same_name(slot->record->name, name)) {
+            return at;
+        }
+    }
+}
+
+static void table_insert(RecordTable *table, uint64_t hash, Record *info)
+{
+    RecordSlot in = {.hash = hash, .record = info};
+    RecordSlot swap;
+    size_t at = hash & table->mask;
+    size_t distance = 0;
+
+    for(;; at = (at + 1) & table->mask, distance++) {
+        RecordSlot *slot = &table->slot[at];
+
+        if(slot->record == NULL) {
+            *slot = in;
+            table->count++;
+            return;
+        }
+
+        // take from the rich, whoever is closer to home moves on
+        size_t theirs = probe_distance(table, slot->hash, at);
+        if(theirs < distance) {
+            swap = *slot;
+            *slot = in;
+            in = swap;
+            distance = theirs;
+        }
+    }
+}
+
+static void table_remove(RecordTable *table, size_t start, size_t floor, size_t at)
+{
+    size_t next = (at + 1) & table->mask;
+
+    // pull the rest of the run back a slot so no tombstones are needed
+    while(past_start(table, start, next) >= floor && table->slot[next].record != NULL
+            && probe_distance(table, table->slot[next].hash, next) > 0) {
+        table->slot[at] = table->slot[next];
+        at = next;
+        next = (next + 1) & table->mask;
+    }
+
+    table->slot[at].record = NULL;
+    table->count--;
+}
+
+static long old_find(RecordMap *map, uint64_t hash, bstring name)
+{
+    size_t home = hash & map->old.mask;
+
+    if(map->old.slot == NULL) return -1;
+
+    // the moved ones are all empty now, whatever was there is in now
+    if(past_start(&map->old, map->start, home) < map->moved) {
+        home = (map->start + map->moved) & map->old.mask;
+    }
+
+    return table_find(&map->old, map->start, map->moved, home, hash, name);
+}
+
+static void map_migrate(RecordMap *map)
+{
+    int i = 0;
+
+    if(map->old.slot == NULL) return;
+
+    for(i = 0; i < RECORDMAP_MIGRATE && map->moved <= map->old.mask; i++, map->moved++) {
+        RecordSlot *slot = &map->old.slot[(map->start + map->moved) & map->old.mask];
+
+        if(slot->record) {
+            table_insert(&map->now, slot->hash, slot->record);
+            slot->record = NULL;
+            map->old.count--;
+        }
+    }
+
+    if(map->moved > map->old.mask) {
+        table_free(&map->old);
+        map->moved = 0;
+    } else {
+        // give back the pages that are all moved, up to the end, the
+        // few that wrapped around go with the rest in table_free
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t bytes = table_bytes(&map->old);
+        size_t done = ((map->start + map->moved) * sizeof(RecordSlot)) & ~(page - 1);
+        size_t gone = map->old.head + map->old.unmapped;
+
+        if(done > bytes) done = bytes;
+
+        if(done > gone) {
+            munmap((char *)map->old.slot + gone, done - gone);
+            map->old.unmapped = done - map->old.head;
+        }
+    }
+}
+
+static int map_grow(RecordMap *map)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    // it can only fill up mid-move after a run of sets and no deletes
+    while(map->old.slot != NULL) map_migrate(map);
+
+    map->old = map->now;
+    map->moved = 0;
+
+    if(table_init(&map->now, (map->old.mask + 1) * 2) != 0) {
+        // still whole, keep using it
+        map->now = map->old;
+        memset(&map->old, 0, sizeof(RecordTable));
+        return -1;
+    }
+
+    // no run goes through an empty slot, so moving from one means every
+    // run left in old is whole and in order from start, never wrapped;
+    // it's at most 7/8 full so there is one, and it's nearly always
+    // in the first few
+    for(map->start = 0; map->old.slot[map->start].record != NULL; map->start++) {}
+    map->old.head = (map->start * sizeof(RecordSlot) + page - 1) & ~(page - 1);
+
+    return 0;
+}
+
+RecordMap *RecordMap_create()
+{
+    RecordMap *map = calloc(1, sizeof(RecordMap));
+    check_mem(map);
+
+    check(table_init(&map->now, RECORDMAP_MIN) == 0, "Failed to make the first table.");
+
+    return map;
+error:
+    RecordMap_destroy(map);
+    return NULL;
+}
+
+void RecordMap_destroy(RecordMap *map)
+{
+    if(map) {
+        table_free(&map->now);
+        table_free(&map->old);
+        NameIndex_clear(&map->names);
+        free(map);
+    }
+}
+
+Record *RecordMap_get(RecordMap *map, bstring name)
+{
+    uint64_t hash = Intern_hash(name);
+    long at = table_find(&map->now, 0, 0, hash & map->now.mask, hash, name);
+
+    if(at >= 0) return map->now.slot[at].record;
+
+    at = old_find(map, hash, name);
+    return at >= 0 ? map->old.slot[at].record : NULL;
+}
+
+int RecordMap_set(RecordMap *map, Record *info)
+{
+    map_migrate(map);
+
+    // counting what's still in old, so moving it over can't overfill now
+    if((RecordMap_count(map) + 1) * 8 > (map->now.mask + 1) * 7) {
+        check(map_grow(map) == 0, "Failed to grow the record map.");
+    }
+
+    // first, it's the one that can fail
+    check(NameIndex_add(&map->names, info) == 0, "Failed to index %s.", info->name->data);
+    table_insert(&map->now, Intern_stored_hash(info->name), info);
+
+    return 0;
+error:
+    return -1;
+}
+
+Record *RecordMap_delete(RecordMap *map, bstring name)
+{
+    Record *info = NULL;
+    uint64_t hash = Intern_hash(name);
+    long at = table_find(&map->now, 0, 0, hash & map->now.mask, hash, name);
+
+    if(at >= 0) {
+        info = map->now.slot[at].record;
+        table_remove(&map->now, 0, 0, at);
+    } else if((at = old_find(map, hash, name)) >= 0) {
+        info = map->old.slot[at].record;
+        table_remove(&map->old, map->start, map->moved, at);
+    }
+
+    if(info) NameIndex_remove(&map->names, info->name);
+
+    // after, so at is still where it was found
+    map_migrate(map);
+
+    return info;
+}
+
+size_t RecordMap_count(RecordMap *map)
+{
+    return map->now.count + map->old.count;
+}
+
+size_t RecordMap_bytes(RecordMap *map)
+{
+    // old's pages from head to unmapped past it were already handed back
+    size_t old = map->old.slot ? table_bytes(&map->old) - map->old.unmapped : 0;
+
+    return table_bytes(&map->now) + old;
+}
+
+int RecordMap_traverse(RecordMap *map, RecordMap_cb cb, void *context)
+{
+    size_t i = 0;
+    int rc = 0;
+
+    for(i = 0; i <= map->now.mask; i++) {
+        if(map->now.slot[i].record) {
+            rc = cb(map->now.slot[i].record, context);
+            if(rc != 0) return rc;
+        }
+    }
+
+    for(i = map->moved; map->old.slot && i <= map->old.mask; i++) {
+        RecordSlot *slot = &map->old.slot[(map->start + i) & map->old.mask];
+
+        if(slot->record) {
+            rc = cb(slot->record, context);
+            if(rc != 0) return rc;
+        }
+    }
+
+    return 0;
+}
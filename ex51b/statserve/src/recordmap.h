@@ -0,0 +1,83 @@
+#ifndef _recordmap_h
+#define _recordmap_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <lcthw/bstrlib.h>
+#include "nameindex.h"
+
+#define RECORDMAP_MIN 16
+// slots moved into the new table by each set or delete while it grows
+#define RECORDMAP_MIGRATE 64
+
+struct Record;
+
+/*
+ * Name to Record for DATA. It's one flat array of slots, open
+ * addressed with Robin Hood probing, so a lookup is usually a single
+ * cache line: each slot has the name's 64 bit hash next to the record,
+ * and a record's name is only looked at when the hash already matched.
+ * The key is always record->name, which is interned, so a set never
+ * hashes anything and a delete by the record's own name compares by
+ * pointer.
+ *
+ * It grows at 7/8 full without stopping to rehash. The old table is
+ * kept and every set and delete moves RECORDMAP_MIGRATE of its slots
+ * across, going up and around from start, while gets look in both.
+ * start is a slot that was empty when it began, so no run crosses it,
+ * and the moved slots are a hole in front of the rest: a get in the
+ * old table starts past it, and everything from there around to start
+ * still holds the Robin Hood order. The pages it leaves behind are
+ * unmapped as it goes, so there's no big free at the end either.
+ *
+ * Every set and delete also keeps names, the same records in name
+ * order, which is what list and dumptree walk.
+ */
+typedef struct RecordSlot {
+    uint64_t hash;
+    // NULL for an empty slot
+    struct Record *record;
+} RecordSlot;
+
+typedef struct RecordTable {
+    size_t mask;
+    size_t count;
+    // mapped on its own, and handed back a page at a time as it's moved,
+    // the bytes from head to head + unmapped are gone
+    RecordSlot *slot;
+    size_t head;
+    size_t unmapped;
+} RecordTable;
+
+typedef struct RecordMap {
+    RecordTable now;
+    // still being moved into now, slot is NULL when it isn't growing
+    RecordTable old;
+    // where the move began, and how many slots on from there are done
+    size_t start;
+    size_t moved;
+    NameIndex names;
+} RecordMap;
+
+typedef int (*RecordMap_cb)(struct Record *info, void *context);
+
+RecordMap *RecordMap_create();
+
+void RecordMap_destroy(RecordMap *map);
+
+struct Record *RecordMap_get(RecordMap *map, bstring name);
+
+// the name mustn't be in it already
+int RecordMap_set(RecordMap *map, struct Record *info);
+
+struct Record *RecordMap_delete(RecordMap *map, bstring name);
+
+size_t RecordMap_count(RecordMap *map);
+
+// what the slots have mapped, not counting the records or names
+size_t RecordMap_bytes(RecordMap *map);
+
+// cb mustn't change the map, a nonzero return stops it and is returned
+int RecordMap_traverse(RecordMap *map, RecordMap_cb cb, void *context);
+
+#endif
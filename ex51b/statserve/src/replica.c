@@ -0,0 +1,523 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <lcthw/dbg.h>
+#include "replica.h"
+#include "net.h"
+#include "metrics.h"
+
+long REPLICA_BACKLOG = 64 * 1024 * 1024;
+int REPLICATE_TCP = 0;
+int REPLICA_RETRY_MS = 1000;
+const char *REPLICA_HOST = NULL;
+const char *REPLICA_PORT = NULL;
+// seconds behind the primary as of each heartbeat, a name only the replica has
+struct tagbstring REPLICA_LAG = bsStatic("/replica/lag");
+
+struct tagbstring REPLICATE_PREFIX = bsStatic("replicate ");
+
+// every Feed's charged added up, the workers each ship their own
+static _Atomic long FEED_BACKLOG = 0;
+
+extern __thread RecordMap *DATA;
+
+int is_replicate_request(char *data, int len, int *shard)
+{
+    int at = blength(&REPLICATE_PREFIX);
+
+    if(len <= at || memcmp(data, REPLICATE_PREFIX.data, at) != 0) return 0;
+
+    // just the shard number, anything else is a bad command
+    for(*shard = 0; at < len && isdigit((unsigned char)data[at]) && *shard < 100000; at++) {
+        *shard = *shard * 10 + data[at] - '0';
+    }
+
+    return at == len;
+}
+
+static void feed_charge(Feed *feed, long bytes)
+{
+    atomic_fetch_add_explicit(&FEED_BACKLOG, bytes - feed->charged, memory_order_relaxed);
+    feed->charged = bytes;
+}
+
+static int feed_write(Feed *feed)
+{
+    int fd = feed->conn->fd;
+
+    while(feed->sent < blength(feed->out)) {
+        ssize_t rc = send(fd, bdata(feed->out) + feed->sent,
+                blength(feed->out) - feed->sent, MSG_NOSIGNAL);
+
+        if(rc == -1 && errno == EINTR) continue;
+        if(rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // the rest goes on the next EPOLLOUT
+            errno = 0;
+            feed_charge(feed, blength(feed->out) - feed->sent);
+            return 0;
+        }
+        check(rc > 0, "Failed to write to the replica on fd %d.", fd);
+
+        metric_add(&METRICS.bytes_out, rc);
+        feed->sent += rc;
+    }
+
+    // all out, start the buffer over
+    btrunc(feed->out, 0);
+    feed->sent = 0;
+    feed_charge(feed, 0);
+
+    return 0;
+error:
+    feed_charge(feed, blength(feed->out) - feed->sent);
+    return -1;
+}
+
+static void feed_drop(Feed *feed)
+{
+    // the hangup wakes epoll whatever it's waiting for, and closes it there
+    feed->dropped = 1;
+    shutdown(feed->conn->fd, SHUT_RDWR);
+}
+
+int Feed_allowed(Connection *conn)
+{
+    return conn->local || REPLICATE_TCP;
+}
+
+int Feed_start(Connection *conn, Wal *wal)
+{
+    Feed *feed = NULL;
+
+    check(wal != NULL, "Nothing to replicate without a log.");
+    check(RingBuffer_available_data(conn->send_rb) == 0,
+            "Replies still going out ahead of replicate on fd %d.", conn->fd);
+
+    feed = calloc(1, sizeof(Feed));
+    check_mem(feed);
+    feed->conn = conn;
+    feed->wal = wal;
+    feed->snapshotting = 1;
+    feed->out = bfromcstr("");
+    check_mem(feed->out);
+
+    // first, it says how many shards there are to connect to
+    check(Wal_append_beat(wal, feed->out) == 0, "Failed to start the feed.");
+    check(Wal_subscribe(wal, feed) == 0, "Failed to add the feed.");
+    conn->feed = feed;
+
+    log_info("Replica on fd %d following shard %d.", conn->fd, wal->id);
+    return Feed_send(conn);
+error:
+    if(feed) {
+        bdestroy(feed->out);
+        free(feed);
+    }
+    return -1;
+}
+
+void Feed_destroy(Feed *feed)
+{
+    if(feed) {
+        Wal_unsubscribe(feed->wal, feed);
+        Intern_release(feed->after);
+        feed_charge(feed, 0);
+        bdestroy(feed->out);
+        free(feed);
+    }
+}
+
+void Feed_ship(Feed *feed, char *data, int len)
+{
+    // closed but not reaped yet, its fd may already be someone else's
+    if(feed->dropped || feed->conn->closed) return;
+
+    if(bcatblk(feed->out, data, len) != BSTR_OK || feed_write(feed) != 0) {
+        feed_drop(feed);
+    } else if(feed->charged > 0
+            && atomic_load_explicit(&FEED_BACKLOG, memory_order_relaxed) > REPLICA_BACKLOG) {
+        // the replicas are too far behind between them, and this one is one
+        // that can't keep up, so it starts over instead
+        log_warn("Replica on fd %d is %ld bytes behind with the rest over %ld, dropping it.",
+                feed->conn->fd, feed->charged, REPLICA_BACKLOG);
+        feed_drop(feed);
+    } else if(feed->sent < blength(feed->out) && !feed->conn->blocked) {
+        if(client_block(feed->conn, 1) != 0) feed_drop(feed);
+    }
+}
+
+int Feed_send(Connection *conn)
+{
+    Feed *feed = conn->feed;
+    int turn = 0;
+    int rc = 0;
+
+    while(!feed->dropped) {
+        rc = feed_write(feed);
+        check(rc == 0, "Failed to feed the replica. Closing.");
+
+        if(feed->sent < blength(feed->out)) break;
+        if(!feed->snapshotting || turn == FEED_TURN) break;
+
+        // the chunk has to go after whatever already happened to its records
+        rc = Wal_commit(feed->wal);
+        check(rc == 0, "Failed to commit ahead of a snapshot chunk.");
+        if(blength(feed->out) > 0) continue;
+
+        rc = Wal_snapshot_chunk(feed->wal, feed->out, &feed->after, FEED_CHUNK);
+        check(rc != -1, "Failed to add a snapshot chunk. Closing.");
+        feed->snapshotting = rc == 0;
+        turn++;
+    }
+
+    check(!feed->dropped, "Replica on fd %d fell behind. Closing.", conn->fd);
+
+    // with more to go, EPOLLOUT comes straight back once other clients
+    // had their turn, or once the socket has room
+    int more = feed->sent < blength(feed->out) || feed->snapshotting;
+    return more != conn->blocked ? client_block(conn, more) : 0;
+error:
+    return -1;
+}
+
+int Feed_event(Connection *conn)
+{
+    char discard[256];
+
+    // a replica has nothing to say, so readable means it hung up
+    if(!conn->blocked) {
+        ssize_t rc = recv(conn->fd, discard, sizeof(discard), 0);
+        check_debug(rc != 0, "Replica closed.");
+        check(rc > 0 || errno == EAGAIN || errno == EWOULDBLOCK,
+                "Failed to read from the replica on fd %d.", conn->fd);
+        errno = 0;
+    }
+
+    return Feed_send(conn);
+error:
+    return -1;
+}
+
+long Feed_backlog()
+{
+    return atomic_load_explicit(&FEED_BACKLOG, memory_order_relaxed);
+}
+
+static int unlink_record(Record *info, void *context)
+{
+    (void)context;
+    info->parent = info->children = info->next = info->prev = NULL;
+    return 0;
+}
+
+static int destroy_record(Record *info, void *context)
+{
+    (void)context;
+    Record_destroy(info);
+    return 0;
+}
+
+static void drop_map(RecordMap *map)
+{
+    // unlinked first, so no record touches one that's already gone
+    RecordMap_traverse(map, unlink_record, NULL);
+    RecordMap_traverse(map, destroy_record, NULL);
+    RecordMap_destroy(map);
+}
+
+static void replica_lost(Replica *replica)
+{
+    int i = 0;
+
+    for(i = 0; i < replica->slots; i++) {
+        Upstream *up = replica->up[i];
+
+        // closing it takes it out of epoll too
+        if(up->fd >= 0) close(up->fd);
+        up->fd = -1;
+        up->used = up->synced = 0;
+    }
+
+    // a half built map is no use, the next try starts a new one
+    if(replica->building) drop_map(replica->building);
+    replica->building = NULL;
+    replica->target = DATA;
+    replica->nshards = 0;
+    replica->connected = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &replica->retry);
+    replica->retry.tv_sec += REPLICA_RETRY_MS / 1000;
+    replica->retry.tv_nsec += (REPLICA_RETRY_MS % 1000) * 1000000L;
+    if(replica->retry.tv_nsec >= 1000000000L) {
+        replica->retry.tv_sec++;
+        replica->retry.tv_nsec -= 1000000000L;
+    }
+}
+
+static int upstream_connect(Replica *replica, int shard)
+{
+    int rc = 0;
+    char line[64];
+    struct epoll_event ev = {.events = EPOLLIN};
+    Upstream *up = NULL;
+
+    if(shard >= replica->slots) {
+        Upstream **more = realloc(replica->up, (shard + 1) * sizeof(Upstream *));
+        check_mem(more);
+        replica->up = more;
+
+        for(; replica->slots <= shard; replica->slots++) {
+            up = calloc(1, sizeof(Upstream));
+            check_mem(up);
+            up->fd = -1;
+            up->shard = replica->slots;
+            replica->up[replica->slots] = up;
+        }
+    }
+
+    up = replica->up[shard];
+    up->fd = replica->port ? client_connect((char *)replica->host, (char *)replica->port)
+        : unix_connect(replica->host);
+    check(up->fd >= 0, "Failed to reach the primary at %s%s%s.", replica->host,
+            replica->port ? ":" : "", replica->port ? replica->port : "");
+
+    // a fresh socket takes one short line without blocking
+    int len = snprintf(line, sizeof(line), "replicate %d\n", shard);
+    rc = send(up->fd, line, len, MSG_NOSIGNAL);
+    check(rc == len, "Failed to ask the primary for shard %d.", shard);
+
+    ev.data.ptr = up;
+    rc = epoll_ctl(replica->epoll_fd, EPOLL_CTL_ADD, up->fd, &ev);
+    check(rc == 0, "Failed to add the primary's shard %d to epoll.", shard);
+
+    return 0;
+error:
+    return -1;
+}
+
+static int replica_connect(Replica *replica)
+{
+    // everything comes again from a new snapshot, the old DATA answers
+    // reads until it's all in
+    replica->building = RecordMap_create();
+    check_mem(replica->building);
+    replica->target = replica->building;
+    replica->connected = 1;
+
+    // its heartbeat says how many shards the rest are
+    check(upstream_connect(replica, 0) == 0, "Failed to connect to the primary.");
+
+    return 0;
+error:
+    replica_lost(replica);
+    return -1;
+}
+
+static int sample_lag(Replica *replica, double lag)
+{
+    int rc = 0;
+    char line[MAX_NAME + 64];
+    Command cmd = {.command = NULL};
+    int exists = RecordMap_get(DATA, &REPLICA_LAG) != NULL;
+
+    // through the handlers like anything else, so it rolls up and windows
+    int len = snprintf(line, sizeof(line), "%s %s %f", exists ? "sample" : "create",
+            (char *)REPLICA_LAG.data, lag);
+    rc = parse_command(line, len, &cmd);
+    check(rc == 0, "Failed to parse the lag sample.");
+
+    rc = run_command(&cmd, replica->replies);
+    replica->replies->start = replica->replies->end = 0;
+    check(rc == 0, "Failed to sample the lag.");
+
+    return 0;
+error:
+    return -1;
+}
+
+static int replica_beat(Replica *replica, WalEntry *entry, char *payload)
+{
+    int i = 0;
+    WalBeat beat;
+    struct timespec now;
+
+    check(entry->len == sizeof(WalBeat), "Bad heartbeat from the primary.");
+    memcpy(&beat, payload, sizeof(WalBeat));
+
+    if(replica->nshards == 0) {
+        // the first one, now the rest of the shards can be asked for
+        check(beat.shards > 0 && beat.shards <= 1024, "Bad shard count: %u", beat.shards);
+        replica->nshards = beat.shards;
+
+        for(i = 1; i < replica->nshards; i++) {
+            check(upstream_connect(replica, i) == 0, "Failed to connect to shard %d.", i);
+        }
+    }
+
+    // the primary came back with a different worker count
+    check((int)beat.shards == replica->nshards, "The primary went from %d shards to %u.",
+            replica->nshards, beat.shards);
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    double lag = now.tv_sec + now.tv_nsec / 1e9 - beat.sent;
+
+    return sample_lag(replica, lag > 0 ? lag : 0);
+error:
+    return -1;
+}
+
+static void replica_synced(Replica *replica)
+{
+    int i = 0;
+
+    if(replica->building == NULL || replica->nshards == 0) return;
+
+    for(i = 0; i < replica->nshards; i++) {
+        if(replica->up[i]->fd < 0 || !replica->up[i]->synced) return;
+    }
+
+    // every shard is in, the new map takes over from the old one
+    drop_map(DATA);
+    DATA = replica->target = replica->building;
+    replica->building = NULL;
+
+    log_info("Replica caught up with %d shards, %zu records.",
+            replica->nshards, RecordMap_count(DATA));
+}
+
+static int upstream_apply(Replica *replica, Upstream *up)
+{
+    int rc = 0;
+    size_t at = 0;
+    WalEntry entry;
+    char *payload = NULL;
+
+    while(Wal_next_entry(up->buffer, up->used, &at, &entry, &payload)) {
+        if(entry.type == WAL_HEARTBEAT) {
+            rc = replica_beat(replica, &entry, payload);
+        } else if(entry.type == WAL_CHECKPOINT) {
+            up->synced = 1;
+            replica_synced(replica);
+        } else {
+            RecordMap *live = DATA;
+            rc = Replay_apply(replica->replay, &entry, payload);
+            DATA = live;
+        }
+        check(rc == 0, "Failed to apply an entry from shard %d.", up->shard);
+    }
+
+    // what's left has to be the start of an entry that isn't all here
+    if(up->used - at >= sizeof(WalEntry)) {
+        memcpy(&entry, up->buffer + at, sizeof(WalEntry));
+        check(entry.len <= UPSTREAM_BUFFER - sizeof(WalEntry)
+                && up->used - at < sizeof(WalEntry) + entry.len,
+                "Corrupt entry from shard %d.", up->shard);
+    }
+
+    memmove(up->buffer, up->buffer + at, up->used - at);
+    up->used -= at;
+
+    return 0;
+error:
+    return -1;
+}
+
+Replica *Replica_create(const char *host, const char *port, int epoll_fd)
+{
+    Replica *replica = calloc(1, sizeof(Replica));
+    check_mem(replica);
+
+    replica->host = host;
+    replica->port = port;
+    replica->epoll_fd = epoll_fd;
+    replica->target = DATA;
+    // target is read for every entry, so a swap needs nothing else
+    replica->replay = Replay_create(&replica->target, 1, NULL);
+    replica->replies = RingBuffer_create(RB_SIZE);
+    check(replica->replay && replica->replies, "Out of memory.");
+
+    // the primary may not be up yet, that's just a retry later
+    replica_connect(replica);
+
+    return replica;
+error:
+    Replica_destroy(replica);
+    return NULL;
+}
+
+void Replica_destroy(Replica *replica)
+{
+    int i = 0;
+
+    if(replica) {
+        replica_lost(replica);
+
+        for(i = 0; i < replica->slots; i++) {
+            free(replica->up[i]);
+        }
+        free(replica->up);
+        Replay_destroy(replica->replay);
+        if(replica->replies) RingBuffer_destroy(replica->replies);
+        free(replica);
+    }
+}
+
+int Replica_owns(Replica *replica, void *ptr)
+{
+    int i = 0;
+
+    for(i = 0; i < replica->slots; i++) {
+        if(replica->up[i] == ptr) return 1;
+    }
+
+    return 0;
+}
+
+void Replica_read(Replica *replica, Upstream *up)
+{
+    // lost along with another shard earlier in the same batch of events
+    if(up->fd < 0) return;
+
+    ssize_t rc = recv(up->fd, up->buffer + up->used, UPSTREAM_BUFFER - up->used, 0);
+    if(rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        errno = 0;
+        return;
+    }
+    check(rc > 0, "Lost the primary's shard %d.", up->shard);
+    up->used += rc;
+
+    check(upstream_apply(replica, up) == 0, "Bad stream from shard %d.", up->shard);
+
+    return;
+error:
+    // everything starts over from a new snapshot
+    log_warn("Resyncing from the primary in %d ms.", REPLICA_RETRY_MS);
+    replica_lost(replica);
+}
+
+int Replica_timeout(Replica *replica)
+{
+    struct timespec now;
+
+    if(replica == NULL || replica->connected) return -1;
+
+    // how long until it tries the primary again
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long left = (replica->retry.tv_sec - now.tv_sec) * 1000
+        + (replica->retry.tv_nsec - now.tv_nsec) / 1000000;
+
+    return left > 0 ? left : 0;
+}
+
+void Replica_tick(Replica *replica)
+{
+    if(replica && !replica->connected && Replica_timeout(replica) == 0) {
+        replica_connect(replica);
+    }
+}
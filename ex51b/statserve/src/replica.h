@@ -0,0 +1,126 @@
+#ifndef _replica_h
+#define _replica_h
+
+#include <time.h>
+#include <lcthw/bstrlib.h>
+#include <lcthw/ringbuffer.h>
+#include "statserve.h"
+#include "wal.h"
+
+// snapshot records in a chunk, and chunks before the other clients get a turn
+#define FEED_CHUNK 256
+#define FEED_TURN 16
+// what a replica reads at once, far more than any one entry
+#define UPSTREAM_BUFFER (64 * 1024)
+
+/*
+ * Log shipping. A replica connects to the primary once per shard and
+ * sends "replicate SHARD", and from then on that connection is a Feed.
+ * It gets a heartbeat, then every batch the shard commits, in order, as
+ * the same entries the log has. In between, whenever the socket has
+ * room, it gets the shard's records a chunk at a time, ending with a
+ * checkpoint. A record's chunk already counts whatever the stream sent
+ * ahead of it, and Record_set overwrites what that did on the replica,
+ * so once the checkpoint is in the replica matches the shard.
+ *
+ * A replica can only ask on the unix socket, or anywhere once
+ * REPLICATE_TCP says so, since a feed gets every record there is.
+ *
+ * All the Feeds together hold at most about REPLICA_BACKLOG bytes that
+ * haven't gone out, however many replicas connect. Once they're over,
+ * a Feed that can't send what it has is hung up on rather than
+ * buffered without end. The replica reconnects and starts over
+ * from a new snapshot, built into a new map while the old one keeps
+ * answering reads, and swapped in once every shard's checkpoint is in.
+ *
+ * The replica is an event server without a log. It refuses whatever
+ * would change DATA, applies the entries with Replay_apply like
+ * recovery does, and samples how far behind each heartbeat was into
+ * REPLICA_LAG.
+ */
+typedef struct Feed {
+    Connection *conn;
+    // the shard it's fed from
+    Wal *wal;
+    // entries still to go out, from sent on
+    bstring out;
+    int sent;
+    // the last snapshot record sent, NULL before the first
+    bstring after;
+    int snapshotting;
+    // put the Feeds over REPLICA_BACKLOG, it's closed instead of buffering more
+    int dropped;
+    // what it counts for in Feed_backlog
+    long charged;
+} Feed;
+
+typedef struct Upstream {
+    // -1 while the primary is gone
+    int fd;
+    int shard;
+    // its snapshot's checkpoint is in
+    int synced;
+    int used;
+    char buffer[UPSTREAM_BUFFER];
+} Upstream;
+
+typedef struct Replica {
+    const char *host;
+    // NULL when host is a unix socket path
+    const char *port;
+    int epoll_fd;
+    // one per primary shard, kept for good once made so a stale epoll
+    // event never points at freed memory
+    Upstream **up;
+    int slots;
+    // 0 until the first heartbeat says how many shards there are
+    int nshards;
+    int connected;
+    // a resync fills this, it's NULL once it replaces DATA
+    RecordMap *building;
+    // where the entries go, building or DATA
+    RecordMap *target;
+    struct Replay *replay;
+    RingBuffer *replies;
+    // when to try the primary again
+    struct timespec retry;
+} Replica;
+
+extern long REPLICA_BACKLOG;
+extern int REPLICATE_TCP;
+extern int REPLICA_RETRY_MS;
+extern const char *REPLICA_HOST;
+extern const char *REPLICA_PORT;
+extern struct tagbstring REPLICA_LAG;
+
+int is_replicate_request(char *data, int len, int *shard);
+
+// replicate from here is from the unix socket, or that's not needed
+int Feed_allowed(Connection *conn);
+
+int Feed_start(Connection *conn, Wal *wal);
+
+void Feed_destroy(Feed *feed);
+
+void Feed_ship(Feed *feed, char *data, int len);
+
+int Feed_send(Connection *conn);
+
+int Feed_event(Connection *conn);
+
+// bytes every Feed on every thread has yet to send
+long Feed_backlog();
+
+Replica *Replica_create(const char *host, const char *port, int epoll_fd);
+
+void Replica_destroy(Replica *replica);
+
+int Replica_owns(Replica *replica, void *ptr);
+
+void Replica_read(Replica *replica, Upstream *up);
+
+int Replica_timeout(Replica *replica);
+
+void Replica_tick(Replica *replica);
+
+#endif
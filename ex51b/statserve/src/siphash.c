@@ -0,0 +1,110 @@
+#include <string.h>
+#include <endian.h>
+#include "siphash.h"
+
+#define ROTL(X, B) (uint64_t)(((X) << (B)) | ((X) >> (64 - (B))))
+
+#define SIPROUND do { \
+    v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+    v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+} while(0)
+
+static inline uint64_t load64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    memcpy(&v, p, sizeof(v));
+    return le64toh(v);
+}
+
+static inline void store64(uint8_t *p, uint64_t v)
+{
+    v = htole64(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+typedef struct SipState {
+    uint64_t v0;
+    uint64_t v1;
+    uint64_t v2;
+    uint64_t v3;
+} SipState;
+
+// everything up to the finish, which is all the two widths differ in
+// besides the one constant wide xors into v1
+static inline SipState sip_absorb(const void *in, size_t len,
+        const uint8_t key[SIPHASH_KEY_LEN], uint64_t wide)
+{
+    const uint8_t *at = in;
+    const uint8_t *end = at + len - (len % 8);
+    uint64_t k0 = load64(key);
+    uint64_t k1 = load64(key + 8);
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1 ^ wide;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+    uint64_t b = ((uint64_t)len) << 56;
+    uint64_t m = 0;
+
+    for(; at != end; at += 8) {
+        m = load64(at);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    // the last 0-7 bytes go in under the length
+    switch(len & 7) {
+        case 7: b |= ((uint64_t)at[6]) << 48; // fallthrough
+        case 6: b |= ((uint64_t)at[5]) << 40; // fallthrough
+        case 5: b |= ((uint64_t)at[4]) << 32; // fallthrough
+        case 4: b |= ((uint64_t)at[3]) << 24; // fallthrough
+        case 3: b |= ((uint64_t)at[2]) << 16; // fallthrough
+        case 2: b |= ((uint64_t)at[1]) << 8; // fallthrough
+        case 1: b |= ((uint64_t)at[0]); break;
+        case 0: break;
+    }
+
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+
+    return (SipState){v0, v1, v2, v3};
+}
+
+void siphash128(const void *in, size_t len, const uint8_t key[SIPHASH_KEY_LEN],
+        uint8_t out[SIPHASH_OUT_LEN])
+{
+    SipState s = sip_absorb(in, len, key, 0xee);
+    uint64_t v0 = s.v0, v1 = s.v1, v2 = s.v2, v3 = s.v3;
+
+    v2 ^= 0xee;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    store64(out, v0 ^ v1 ^ v2 ^ v3);
+
+    v1 ^= 0xdd;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    store64(out + 8, v0 ^ v1 ^ v2 ^ v3);
+}
+
+uint64_t siphash64(const void *in, size_t len, const uint8_t key[SIPHASH_KEY_LEN])
+{
+    SipState s = sip_absorb(in, len, key, 0);
+    uint64_t v0 = s.v0, v1 = s.v1, v2 = s.v2, v3 = s.v3;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
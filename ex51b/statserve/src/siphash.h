@@ -0,0 +1,18 @@
+#ifndef _siphash_h
+#define _siphash_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SIPHASH_KEY_LEN 16
+#define SIPHASH_OUT_LEN 16
+
+// SipHash-2-4 with the 128 bit output, out is little-endian like the
+// reference implementation so its test vectors apply
+void siphash128(const void *in, size_t len, const uint8_t key[SIPHASH_KEY_LEN],
+        uint8_t out[SIPHASH_OUT_LEN]);
+
+// the same with the plain 64 bit output, as a number
+uint64_t siphash64(const void *in, size_t len, const uint8_t key[SIPHASH_KEY_LEN]);
+
+#endif
@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <lcthw/dbg.h>
+#include "sketch.h"
+
+int SKETCHES = 1;
+
+#define GAMMA ((1 + SKETCH_ALPHA) / (1 - SKETCH_ALPHA))
+
+static inline int sketch_key(double magnitude)
+{
+    return (int)ceil(log(magnitude) / log(GAMMA));
+}
+
+static inline double key_value(int key)
+{
+    // the bin covers (gamma^(key-1), gamma^key], this is alpha from both ends
+    return 2.0 * pow(GAMMA, key) / (GAMMA + 1);
+}
+
+static void store_init(SketchStore *store)
+{
+    memset(store, 0, sizeof(SketchStore));
+    store->lo = 1;
+    store->hi = 0;
+}
+
+static void store_halve(SketchStore *store)
+{
+    int i = 0;
+
+    // rounding up so no bin in use goes empty
+    for(i = store->lo; i <= store->hi; i++) {
+        uint32_t *count = &store->counts[i - store->low];
+        *count -= *count / 2;
+    }
+}
+
+static uint64_t store_total(SketchStore *store)
+{
+    uint64_t total = 0;
+    int i = 0;
+
+    for(i = store->lo; i <= store->hi; i++) {
+        total += store->counts[i - store->low];
+    }
+
+    return total;
+}
+
+static void sketch_halve(Sketch *sk)
+{
+    store_halve(&sk->pos);
+    store_halve(&sk->neg);
+    sk->zeros -= sk->zeros / 2;
+    sk->n = sk->zeros + store_total(&sk->pos) + store_total(&sk->neg);
+}
+
+static void bump(Sketch *sk, uint32_t *bin, uint32_t count)
+{
+    // a bin about to overflow halves them all, the quantiles don't move
+    while(*bin > UINT32_MAX - count) {
+        sketch_halve(sk);
+        count -= count / 2;
+    }
+
+    *bin += count;
+    sk->n += count;
+}
+
+static void store_slide(SketchStore *store, int key)
+{
+    uint64_t moved[SKETCH_BINS] = {0};
+    int lo = key < store->lo ? key : store->lo;
+    int hi = key > store->hi ? key : store->hi;
+    int low = 0;
+    int i = 0;
+
+    if(hi - lo < SKETCH_BINS) {
+        // it all still fits, just move the window
+        low = key < store->low ? lo : hi - SKETCH_BINS + 1;
+    } else {
+        // keep the top, whatever falls off the bottom goes in the lowest bin
+        low = hi - SKETCH_BINS + 1;
+        lo = low;
+    }
+
+    for(i = store->lo; i <= store->hi; i++) {
+        moved[(i < low ? low : i) - low] += store->counts[i - store->low];
+    }
+
+    for(i = 0; i < SKETCH_BINS; i++) {
+        // only a fold can go over, and that far out it's close enough
+        store->counts[i] = moved[i] > UINT32_MAX ? UINT32_MAX : moved[i];
+    }
+
+    store->low = low;
+    store->lo = lo;
+    store->hi = hi;
+}
+
+static void store_add(Sketch *sk, SketchStore *store, int key, uint32_t count)
+{
+    if(store->hi < store->lo) {
+        // the first one, leave room on either side of it
+        store->low = key - SKETCH_BINS / 2;
+        store->lo = store->hi = key;
+    } else if(key < store->low || key >= store->low + SKETCH_BINS) {
+        store_slide(store, key);
+    }
+
+    // past the bottom after a fold, it goes in the lowest bin
+    if(key < store->low) key = store->low;
+    if(key < store->lo) store->lo = key;
+    if(key > store->hi) store->hi = key;
+
+    bump(sk, &store->counts[key - store->low], count);
+}
+
+Sketch *Sketch_create()
+{
+    Sketch *sk = malloc(sizeof(Sketch));
+    check_mem(sk);
+
+    Sketch_init(sk);
+
+    return sk;
+error:
+    return NULL;
+}
+
+void Sketch_destroy(Sketch *sk)
+{
+    if(sk) free(sk);
+}
+
+void Sketch_init(Sketch *sk)
+{
+    sk->n = 0;
+    sk->zeros = 0;
+    store_init(&sk->pos);
+    store_init(&sk->neg);
+}
+
+void Sketch_add(Sketch *sk, double value)
+{
+    double magnitude = fabs(value);
+
+    if(isnan(value)) return;
+
+    if(magnitude < SKETCH_MIN) {
+        bump(sk, &sk->zeros, 1);
+    } else {
+        if(magnitude > DBL_MAX) magnitude = DBL_MAX;
+        store_add(sk, value > 0 ? &sk->pos : &sk->neg, sketch_key(magnitude), 1);
+    }
+}
+
+void Sketch_merge(Sketch *to, Sketch *from)
+{
+    int i = 0;
+
+    bump(to, &to->zeros, from->zeros);
+
+    // the same alpha everywhere, so a bin is a bin
+    for(i = from->pos.lo; i <= from->pos.hi; i++) {
+        uint32_t count = from->pos.counts[i - from->pos.low];
+        if(count) store_add(to, &to->pos, i, count);
+    }
+
+    for(i = from->neg.lo; i <= from->neg.hi; i++) {
+        uint32_t count = from->neg.counts[i - from->neg.low];
+        if(count) store_add(to, &to->neg, i, count);
+    }
+}
+
+double Sketch_quantile(Sketch *sk, double q)
+{
+    uint64_t seen = 0;
+    int i = 0;
+
+    if(sk->n == 0) return NAN;
+
+    // the sample at this rank, counting from 0
+    double rank = q * (sk->n - 1);
+
+    // most negative first, then the zeros, then up through the positives
+    for(i = sk->neg.hi; i >= sk->neg.lo; i--) {
+        seen += sk->neg.counts[i - sk->neg.low];
+        if(seen > rank) return -key_value(i);
+    }
+
+    seen += sk->zeros;
+    if(seen > rank) return 0.0;
+
+    for(i = sk->pos.lo; i <= sk->pos.hi; i++) {
+        seen += sk->pos.counts[i - sk->pos.low];
+        if(seen > rank) return key_value(i);
+    }
+
+    // seen ends at n, which is always past rank
+    return key_value(sk->pos.hi);
+}
@@ -0,0 +1,57 @@
+#ifndef _sketch_h
+#define _sketch_h
+
+#include <stdint.h>
+
+// bins per sign, both stores together are about 2k
+#define SKETCH_BINS 256
+// any quantile comes back within 2% of a real sample
+#define SKETCH_ALPHA 0.02
+// closer to 0 than this just counts as 0
+#define SKETCH_MIN 1e-9
+
+/*
+ * A DDSketch: every sample lands in bin ceil(log(|x|) / log(gamma)),
+ * with gamma = (1 + alpha) / (1 - alpha), so a bin's middle is within
+ * alpha of everything in it. Two sketches with the same alpha merge by
+ * adding bins. Each sign gets a window of SKETCH_BINS bins that slides
+ * to fit, and once the samples span more than that the bins nearest 0
+ * get folded into the lowest one, so the tails stay exact and the
+ * memory never grows. A bin about to overflow halves every bin, which
+ * keeps the shape and so every quantile.
+ *
+ * Unlike AtomicStats it's plain memory, only the thread that owns the
+ * record's shard touches it. It's written to disk and the log as is.
+ */
+typedef struct SketchStore {
+    // the bin counts[0] holds, anything below it is folded in there
+    int32_t low;
+    // lowest and highest bins in use, hi < lo when it's empty
+    int32_t lo;
+    int32_t hi;
+    uint32_t counts[SKETCH_BINS];
+} SketchStore;
+
+typedef struct Sketch {
+    uint64_t n;
+    uint32_t zeros;
+    SketchStore pos;
+    SketchStore neg;
+} Sketch;
+
+// 0 and records don't keep a sketch, percentile replies ERR for them
+extern int SKETCHES;
+
+Sketch *Sketch_create();
+
+void Sketch_destroy(Sketch *sk);
+
+void Sketch_init(Sketch *sk);
+
+void Sketch_add(Sketch *sk, double value);
+
+void Sketch_merge(Sketch *to, Sketch *from);
+
+double Sketch_quantile(Sketch *sk, double q);
+
+#endif
@@ -0,0 +1,64 @@
+#include <stdlib.h>
+#include <lcthw/dbg.h>
+#include "slab.h"
+
+void Slab_init(Slab *slab, size_t size)
+{
+    slab->size = (size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+    slab->free = NULL;
+    slab->carve = slab->end = NULL;
+    slab->chunks = NULL;
+    slab->live = 0;
+}
+
+static int slab_grow(Slab *slab)
+{
+    SlabChunk *chunk = NULL;
+    size_t size = SLAB_CHUNK;
+
+    // a few objects bigger than a chunk still get a chunk to themselves
+    if(size < SLAB_ALIGN + slab->size) size = SLAB_ALIGN + slab->size;
+
+    int rc = posix_memalign((void **)&chunk, SLAB_ALIGN, size);
+    check(rc == 0, "Failed to allocate a slab chunk.");
+
+    // the header takes the first line so every object stays aligned
+    chunk->next = slab->chunks;
+    slab->chunks = chunk;
+    slab->carve = (char *)chunk + SLAB_ALIGN;
+    slab->end = (char *)chunk + size;
+
+    return 0;
+error:
+    return -1;
+}
+
+void *Slab_alloc(Slab *slab)
+{
+    void *object = slab->free;
+
+    if(object != NULL) {
+        slab->free = *(void **)object;
+    } else {
+        if(slab->carve == NULL || slab->end - slab->carve < (long)slab->size) {
+            check(slab_grow(slab) == 0, "Failed to grow the slab.");
+        }
+
+        object = slab->carve;
+        slab->carve += slab->size;
+    }
+
+    slab->live++;
+    return object;
+error:
+    return NULL;
+}
+
+void Slab_free(Slab *slab, void *object)
+{
+    if(object) {
+        *(void **)object = slab->free;
+        slab->free = object;
+        slab->live--;
+    }
+}
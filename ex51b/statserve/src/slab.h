@@ -0,0 +1,43 @@
+#ifndef _slab_h
+#define _slab_h
+
+#include <stddef.h>
+
+#define SLAB_CHUNK (64 * 1024)
+#define SLAB_ALIGN 64
+
+/*
+ * Fixed size objects carved out of 64k chunks, each one starting on
+ * its own cache line. A freed object goes on the front of the free
+ * list, kept in the object's first word, and the next alloc takes it
+ * right back, so create/delete churn never reaches malloc and never
+ * leaves holes between other allocations.
+ *
+ * Every thread has its own Slab so nothing is locked. An object can be
+ * freed into a different thread's Slab than the one it came from, it's
+ * just one of that thread's now, since chunks are kept until the
+ * process exits.
+ */
+typedef struct SlabChunk {
+    struct SlabChunk *next;
+} SlabChunk;
+
+typedef struct Slab {
+    // object size, rounded up to SLAB_ALIGN
+    size_t size;
+    void *free;
+    // the untouched end of the newest chunk
+    char *carve;
+    char *end;
+    SlabChunk *chunks;
+    // allocs less frees on this thread, for tests and the bench
+    long live;
+} Slab;
+
+void Slab_init(Slab *slab, size_t size);
+
+void *Slab_alloc(Slab *slab);
+
+void Slab_free(Slab *slab, void *object);
+
+#endif
@@ -1,36 +1,61 @@
 #include <stdio.h>
 #include <ctype.h>
+#include <string.h>
 #include <lcthw/dbg.h>
-#include <lcthw/hashmap.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <errno.h>
 #include "net.h"
 #include <netdb.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+#include <endian.h>
+#include <malloc.h>
+#include <math.h>
 #include "statserve.h"
-
-struct tagbstring LINE_SPLIT = bsStatic(" ");
-struct tagbstring CREATE = bsStatic("create");
-struct tagbstring STDDEV = bsStatic("stddev");
-struct tagbstring MEAN = bsStatic("mean");
-struct tagbstring SAMPLE = bsStatic("sample");
-struct tagbstring DUMP = bsStatic("dump");
-struct tagbstring DELETE = bsStatic("delete");
-struct tagbstring STORE = bsStatic("store");
-struct tagbstring LOAD = bsStatic("load");
-struct tagbstring OK = bsStatic("OK\n");
-struct tagbstring ERR = bsStatic("ERR\n");
-struct tagbstring DNE = bsStatic("DNE\n");
-struct tagbstring EXISTS = bsStatic("EXISTS\n");
-struct tagbstring SLASH = bsStatic("/");
+#include "wal.h"
+#include "siphash.h"
+#include "iopool.h"
+#include "mirror.h"
+#include "format.h"
+#include "replica.h"
+#include "metrics.h"
+
+struct tagbstring OK = bsStatic("OK\r\n");
+struct tagbstring ERR = bsStatic("ERR\r\n");
+struct tagbstring DNE = bsStatic("DNE\r\n");
+struct tagbstring EXISTS = bsStatic("EXISTS\r\n");
+struct tagbstring BUSY = bsStatic("BUSY\r\n");
+struct tagbstring BINARY = bsStatic("binary");
+struct tagbstring LIST_PREFIX = bsStatic("list ");
+struct tagbstring DUMPTREE_PREFIX = bsStatic("dumptree ");
 const char LINE_ENDING = '\n';
 
 const int RB_SIZE = 1024 * 10;
+// big enough for the longest reply, a dump or a whole mget
+const int REPLY_RESERVE = 1024 * 4;
+
+#define MAX_EVENTS 1024
+
+// each worker thread points this at its own shard
+__thread RecordMap *DATA = NULL;
+// Record_create's slabs, one for each stripe count
+__thread Slab RECORDS[STATS_STRIPES_MAX + 1];
+
+// closed during this batch of events, a later event in the same batch
+// can still point at one, so they're freed once it's done
+static __thread DArray *CLOSED = NULL;
 
-Hashmap *DATA = NULL;
 bstring STORE_PATH = NULL;
+// parents add up their children when they're read, not on every sample
+int ROLLUP_LAZY = 0;
+
+// a replica only changes with what the primary sends it
+int READ_ONLY = 0;
 
 void handle_sigchild(int sig) {
     sig = 0; // ignore it
@@ -38,118 +63,418 @@ void handle_sigchild(int sig) {
     }
 }
 
-// BUG: this is stupid, use md5
-void encipher(unsigned int num_rounds, uint32_t v[2], uint32_t const key[4]) {
-    unsigned int i;
-    uint32_t v0=v[0], v1=v[1], sum=0, delta=0x9E3779B9;
-    for (i=0; i < num_rounds; i++) {
-        v0 += (((v1 << 4) ^ (v1 >> 5)) + v1) ^ (sum + key[sum & 3]);
-        sum += delta;
-        v1 += (((v0 << 4) ^ (v0 >> 5)) + v0) ^ (sum + key[(sum>>11) & 3]);
+// names are hashed with this so nobody can pick names that pile up in
+// one directory, it lives in the store so the names survive restarts
+uint8_t STORE_KEY[SIPHASH_KEY_LEN];
+
+int load_store_key(bstring base)
+{
+    int rc = 0;
+    bstring path = bformat("%s/store.key", bdata(base));
+    int fd = open(bdata(path), O_RDONLY);
+
+    if(fd < 0 && errno == ENOENT) {
+        // a new store gets a new key
+        rc = getrandom(STORE_KEY, sizeof(STORE_KEY), 0);
+        check(rc == sizeof(STORE_KEY), "Failed to make a store key.");
+
+        fd = open(bdata(path), O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+        check(fd >= 0, "Failed to create %s", bdata(path));
+
+        rc = write(fd, STORE_KEY, sizeof(STORE_KEY));
+        check(rc == sizeof(STORE_KEY), "Failed to write %s", bdata(path));
+        check(fsync(fd) == 0, "Failed to sync %s", bdata(path));
+    } else {
+        check(fd >= 0, "Failed to open %s", bdata(path));
+
+        rc = read(fd, STORE_KEY, sizeof(STORE_KEY));
+        check(rc == sizeof(STORE_KEY), "Short store key in %s", bdata(path));
+    }
+
+    close(fd);
+    bdestroy(path);
+    return 0;
+error:
+    if(fd >= 0) close(fd);
+    bdestroy(path);
+    return -1;
+}
+
+bstring store_location(bstring base, bstring name)
+{
+    static const char HEX[] = "0123456789abcdef";
+    uint8_t hash[SIPHASH_OUT_LEN];
+    char hex[SIPHASH_OUT_LEN * 2 + 1];
+    int i = 0;
+
+    // only hex comes out, so no name can walk out of base
+    siphash128(bdata(name), blength(name), STORE_KEY, hash);
+    for(i = 0; i < SIPHASH_OUT_LEN; i++) {
+        hex[i * 2] = HEX[hash[i] >> 4];
+        hex[i * 2 + 1] = HEX[hash[i] & 0xf];
+    }
+    hex[SIPHASH_OUT_LEN * 2] = '\0';
+
+    // 256 * 256 directories keeps each one small at millions of stats
+    return bformat("%s/%.2s/%.2s/%s", bdata(base), hex, hex + 2, hex);
+}
+
+int store_open(bstring location, int flags)
+{
+    int fd = open(bdata(location), flags, S_IRUSR | S_IWUSR);
+
+    if(fd < 0 && errno == ENOENT && (flags & O_CREAT)) {
+        // first file in its fan-out directory, make ab/ then ab/cd/
+        int slash = bstrrchr(location, '/');
+        int upper = bstrrchrp(location, '/', slash - 1);
+        bstring dir = bmidstr(location, 0, upper);
+
+        if(mkdir(bdata(dir), S_IRWXU) == 0 || errno == EEXIST) {
+            bassignmidstr(dir, location, 0, slash);
+            mkdir(bdata(dir), S_IRWXU);
+        }
+        bdestroy(dir);
+
+        fd = open(bdata(location), flags, S_IRUSR | S_IWUSR);
     }
-    v[0]=v0; v[1]=v1;
+
+    return fd;
+}
+
+double le_double(double value)
+{
+    // doubles go over the wire as little-endian IEEE-754
+    uint64_t bits = 0;
+    memcpy(&bits, &value, sizeof(bits));
+    bits = htole64(bits);
+    memcpy(&value, &bits, sizeof(bits));
+    return value;
 }
 
-/// TOTALLY RANDOM! LOL  BUG: not secure
-const uint32_t STORE_KEY[4] = {18748274, 228374, 193034845, 85726348};
-struct tagbstring FAUX64 = bsStatic("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz1234567890");
+void send_frame(RingBuffer *send_rb, FrameReply *reply)
+{
+    RingBuffer_write(send_rb, (char *)reply, sizeof(FrameReply));
+}
 
-// BUG: this all dies
-bstring encrypt_armor_name(bstring name)
+void send_status(Command *cmd, RingBuffer *send_rb, ReplyStatus status)
 {
-    // copy the name to encrypt
-    bstring encname = bstrcpy(name);
-    size_t i = 0;
-    // point the encrypt pointer at it
-    // BUG: this cast is weird, why?
-    uint32_t *v = (uint32_t *)bdata(encname);
+    bstring text[] = {
+        [REPLY_OK] = &OK, [REPLY_ERR] = &ERR, [REPLY_DNE] = &DNE,
+        [REPLY_EXISTS] = &EXISTS, [REPLY_BUSY] = &BUSY
+    };
+
+    if(cmd->binary) {
+        FrameReply reply = {.status = htole32(status)};
+        send_frame(send_rb, &reply);
+    } else {
+        // send_line puts back whichever ending this server uses
+        send_line(send_rb, bdata(text[status]), blength(text[status]) - 2);
+    }
+}
 
-    // extend the encname so that it can hold everything
-    // BUG: use a correct padding algorithm
-    while(blength(encname) % (sizeof(uint32_t) * 2) > 0) {
-        bconchar(encname, ' ');
+void send_number(Command *cmd, RingBuffer *send_rb, double value)
+{
+    if(cmd->binary) {
+        FrameReply reply = {
+            .status = htole32(REPLY_NUMBER),
+            .value = le_double(value)
+        };
+        send_frame(send_rb, &reply);
+    } else {
+        char reply[FORMAT_MAX];
+        send_line(send_rb, reply, format_double(reply, value));
     }
+}
 
-    // run encipher on this
-    // BUG: get rid of encipher
-    for(i = 0; i < (size_t)blength(encname) / (sizeof(uint32_t) * 2); i+=2) {
-        encipher(1, v+i, STORE_KEY);
+int format_stats(char *reply, Stats *st)
+{
+    // mean stddev sum sumsq n min max
+    double fields[] = {Stats_mean(st), Stats_stddev(st), st->sum, st->sumsq};
+    char *at = reply;
+    int i = 0;
+
+    for(i = 0; i < 4; i++) {
+        at += format_double(at, fields[i]);
+        *at++ = ' ';
     }
 
-    // do a lame "base 64" kind of thing on it
-    // BUG: this is NOT the best way, it's a quick hack to get it working
-    // replace with real BASE64 later
-    for(i = 0; i < (size_t)blength(encname); i++) {
-        int at = encname->data[i] % blength(&FAUX64);
-        encname->data[i] = FAUX64.data[at];
+    at += format_long(at, st->n);
+    *at++ = ' ';
+    at += format_double(at, st->min);
+    *at++ = ' ';
+    at += format_double(at, st->max);
+
+    return at - reply;
+}
+
+void send_stats(Command *cmd, RingBuffer *send_rb, Stats *st)
+{
+    if(cmd->binary) {
+        FrameReply reply = {
+            .status = htole32(REPLY_STATS),
+            .value = le_double(Stats_mean(st)),
+            .stddev = le_double(Stats_stddev(st)),
+            .sum = le_double(st->sum),
+            .sumsq = le_double(st->sumsq),
+            .n = htole64(st->n),
+            .min = le_double(st->min),
+            .max = le_double(st->max)
+        };
+        send_frame(send_rb, &reply);
+    } else {
+        char reply[FORMAT_MAX * 7];
+        send_line(send_rb, reply, format_stats(reply, st));
     }
+}
 
-    // that's our final hack encrypted name
-    return encname;
+static inline size_t record_stats_at()
+{
+    // the stats start on the line after the Record
+    return (sizeof(Record) + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
 }
 
+static inline Slab *record_slab(int stripes)
+{
+    Slab *slab = &RECORDS[stripes];
+
+    if(slab->size == 0) {
+        Slab_init(slab, record_stats_at() + AtomicStats_size(stripes));
+    }
+
+    return slab;
+}
 
-bstring sanitize_location(bstring base, bstring path)
+Record *Record_create(bstring name)
 {
-    bstring attempt = NULL;
-    bstring encpath = NULL;
-    
-    // encrypt armore the name
-    // BUG: ditch encryption, it was dumb
-    encpath = encrypt_armor_name(path);
-    check(encpath != NULL, "Failed to encrypt path name: %s", bdata(path));
+    // the Record and its stats are one slab object
+    Record *info = Slab_alloc(record_slab(STATS_STRIPES));
+    check_mem(info);
+    memset(info, 0, sizeof(Record));
+
+    info->stat = (AtomicStats *)((char *)info + record_stats_at());
+    AtomicStats_init(info->stat, STATS_STRIPES);
+
+    if(SKETCHES) {
+        info->sketch = Sketch_create();
+        check_mem(info->sketch);
+    }
+
+    if(WINDOW_SECONDS) {
+        info->window = Window_create(WINDOW_SECONDS, Window_now());
+        check_mem(info->window);
+    }
+
+    // ahead of rolled_at, so the first read folds
+    info->version = 1;
 
-    // combine it with the base, this means that we've armored the 
-    // path so we can just append it
-    attempt = bformat("%s/%s", bdata(base), bdata(encpath));
-    bdestroy(encpath);
-    return attempt;
+    // the one copy of its name, which is also its key in DATA
+    info->name = Intern_add(name);
+    check_mem(info->name);
 
+    return info;
 error:
-    if(encpath) bdestroy(encpath);
-    if(attempt) bdestroy(attempt);
+    if(info) Record_destroy(info);
     return NULL;
 }
 
+void Record_adopt(Record *parent, Record *child)
+{
+    // push child on the front of parent's children
+    child->parent = parent;
+    child->prev = NULL;
+    child->next = parent->children;
+    if(parent->children) parent->children->prev = child;
+    parent->children = child;
+
+    Record_touch(parent);
+}
+
+static int adopt_orphan(Record *child, void *context)
+{
+    Record *info = context;
+
+    // only the level right under it, the rest hang off those
+    if(child->parent == NULL
+            && memchr(child->name->data + info->name->slen + 1, '/',
+                child->name->slen - info->name->slen - 1) == NULL) {
+        Record_adopt(info, child);
+    }
+
+    return 0;
+}
+
+void Record_adopt_orphans(Record *info)
+{
+    char under[MAX_NAME + 1];
+    struct tagbstring prefix;
+    int len = blength(info->name);
+
+    // nothing under a name this long could have been made
+    if(len >= MAX_NAME) return;
+
+    memcpy(under, info->name->data, len);
+    under[len] = '/';
+    blk2tbstr(prefix, under, len + 1);
+
+    NameIndex_walk(&DATA->names, &prefix, 1, &prefix, adopt_orphan, info);
+}
+
+void Record_link(Record *info)
+{
+    int len = blength(info->name) - 1;
+    struct tagbstring path;
+    Record *parent = NULL;
+
+    // the same cut scan_paths makes, back to the last /
+    while(len > 0 && info->name->data[len] != '/') len--;
+
+    if(len > 0) {
+        blk2tbstr(path, info->name->data, len);
+        parent = RecordMap_get(DATA, &path);
+        if(parent) Record_adopt(parent, info);
+    }
+
+    Record_adopt_orphans(info);
+}
+
+void Record_unlink(Record *info)
+{
+    Record *child = NULL;
+
+    if(info->parent) {
+        Record_touch(info->parent);
+
+        if(info->prev) {
+            info->prev->next = info->next;
+        } else {
+            info->parent->children = info->next;
+        }
+        if(info->next) info->next->prev = info->prev;
+    }
+
+    // orphans find a new parent if it's ever created again
+    for(child = info->children; child != NULL; child = child->next) {
+        child->parent = NULL;
+    }
+
+    info->parent = info->children = info->next = info->prev = NULL;
+}
+
+void Record_destroy(Record *info)
+{
+    if(info) {
+        Record_unlink(info);
+        Intern_release(info->name);
+        Sketch_destroy(info->sketch);
+        Window_destroy(info->window);
+        Slab_free(record_slab(info->stat->stripes), info);
+    }
+}
+
+void Record_touch(Record *info)
+{
+    // every rollup above this one counted what it had
+    for(; info != NULL; info = info->parent) {
+        info->version++;
+    }
+}
+
+void Record_fold(Record *info, Stats *out)
+{
+    Record *child = NULL;
+    Stats sub;
+
+    if(!ROLLUP_LAZY || info->children == NULL) {
+        AtomicStats_fold(info->stat, out);
+        return;
+    }
+
+    // only what changed since the last read gets folded again
+    if(info->rolled_at != info->version) {
+        AtomicStats_fold(info->stat, &info->rollup);
+
+        for(child = info->children; child != NULL; child = child->next) {
+            Record_fold(child, &sub);
+            stats_merge(&info->rollup, &sub);
+        }
+
+        info->rolled_at = info->version;
+    }
+
+    *out = info->rollup;
+}
+
+void Record_sample(Record *info, double value)
+{
+    if(ROLLUP_LAZY) Record_touch(info);
+
+    AtomicStats_sample(info->stat, value);
+    if(info->sketch) Sketch_add(info->sketch, value);
+    if(info->window) Window_sample(info->window, Window_now(), value);
+}
+
+void Record_merge(Record *info, Stats *stats, Sketch *sketch)
+{
+    if(ROLLUP_LAZY) Record_touch(info);
+
+    AtomicStats_merge(info->stat, stats);
+    if(info->sketch && sketch) Sketch_merge(info->sketch, sketch);
+    if(info->window) Window_merge(info->window, Window_now(), stats);
+}
+
+void Record_set(Record *info, Stats *stats, Sketch *sketch)
+{
+    if(ROLLUP_LAZY) Record_touch(info);
+
+    AtomicStats_set(info->stat, stats);
+
+    if(info->sketch && sketch) {
+        *info->sketch = *sketch;
+    } else if(info->sketch) {
+        // an empty sketch would give percentiles for none of the samples
+        Sketch_destroy(info->sketch);
+        info->sketch = NULL;
+    }
+}
+
 int handle_create(Command *cmd, RingBuffer *send_rb, bstring path)
 {
     int rc = 0;
     int is_root = biseq(path, cmd->name);
-    log_info("create: %s %s %s", bdata(cmd->name), bdata(path), bdata(cmd->number));
+    // number is only there for text, value is there for text and binary
+    log_info("create: %s %s %f", bdata(cmd->name), bdata(path), cmd->value);
 
-    Record *info = Hashmap_get(DATA, path);
+    Record *info = cmd->info;
 
     if(info != NULL && is_root) {
         // report if root exists, just skip children
-        send_reply(send_rb, &EXISTS);
+        send_status(cmd, send_rb, REPLY_EXISTS);
     } else if(info != NULL) {
         debug("Child %s exists, skipping it.", bdata(path));
         return 0;
     } else {
         // new child so make it
-        debug("create: %s %s", bdata(path), bdata(cmd->number));
+        debug("create: %s %f", bdata(path), cmd->value);
 
-        Record *info = calloc(1, sizeof(Record));
+        info = Record_create(path);
         check_mem(info);
 
-        // set its stat element
-        info->stat = Stats_create();
-        check_mem(info->stat);
-
-        // set its name element
-        info->name = bstrcpy(path);
-        check_mem(info->name);
-
-        // do a first sample
-        Stats_sample(info->stat, atof(bdata(cmd->number)));
+        // do a first sample, lazy parents only hold what's below them
+        if(is_root || !ROLLUP_LAZY) Record_sample(info, cmd->value);
 
         // add it to the hashmap
-        rc = Hashmap_set(DATA, info->name, info);
+        rc = RecordMap_set(DATA, info);
         check(rc == 0, "Failed to add data to map.");
+        Wal_dirty(WAL, info);
+
+        // the level below was made first, hang it and anything left
+        // over from a delete of this one off it
+        Record_adopt_orphans(info);
+        cmd->info = info;
 
         // only send the for the root part
         if(is_root) {
-            send_reply(send_rb, &OK);
+            send_status(cmd, send_rb, REPLY_OK);
         }
     }
 
@@ -161,70 +486,144 @@ error:
 
 int handle_sample(Command *cmd, RingBuffer *send_rb, bstring path)
 {
-    // get the info from the hashmap
-    Record *info = Hashmap_get(DATA, path);
+    // scan_paths already walked here from the level below
+    Record *info = cmd->info;
     int is_root = biseq(path, cmd->name);
-    log_info("sample %s %s %s", bdata(cmd->name), bdata(path), bdata(cmd->number));
-    bstring child_path = NULL;
+    Stats folded;
+    // an msample batch has no one value, it logged its own line
+    if(cmd->batch == NULL) {
+        log_info("sample %s %s %f", bdata(cmd->name), bdata(path), cmd->value);
+    }
 
-    if(info == NULL) {
+    if(!is_root && ROLLUP_LAZY) {
+        // the root's touch dirtied these, they add it up when read
+        return 0;
+    } else if(info == NULL) {
         // if it doesn't exist then DNE
-        send_reply(send_rb, &DNE);
+        send_status(cmd, send_rb, REPLY_DNE);
         return 0;
     } else {
-        if(is_root) {
+        if(is_root && cmd->batch) {
+            // msample folded its values already, add them all at once
+            Record_merge(info, cmd->batch, cmd->sketch);
+        } else if(is_root) {
             // just sample the root like normal
-            Stats_sample(info->stat, atof(bdata(cmd->number)));
-        } else {
-            // need to do some hackery to get the child path
-            // for rolling up mean-of-means on it
-
-            // increase the qty on path up one
-            cmd->path->qty++;
-            // get the "child path" (previous path?)
-            child_path = bjoin(cmd->path, &SLASH);
-            // get that info from the DATA
-            Record *child_info = Hashmap_get(DATA, child_path);
-            bdestroy(child_path);
-
-            // if it exists then sample on it
-            if(child_info) {
-                // info is /logins, child_info is /logins/zed 
-                // we want /logins/zed's mean to be a new sample on /logins
-                Stats_sample(info->stat, Stats_mean(child_info->stat));
-            }
-            // drop the path back to where it was
-            cmd->path->qty--;
+            Record_sample(info, cmd->value);
+        } else if(cmd->child) {
+            // info is /logins, cmd->child is /logins/zed 
+            // we want /logins/zed's mean to be a new sample on /logins
+            Record_sample(info, AtomicStats_mean(cmd->child->stat));
         }
 
+        Wal_dirty(WAL, info);
     }
 
     // do the reply for the mean last
-    bstring reply = bformat("%f\n", Stats_mean(info->stat));
-    send_reply(send_rb, reply);
-    bdestroy(reply);
+    Record_fold(info, &folded);
+    send_number(cmd, send_rb, Stats_mean(&folded));
+
+    return 0;
+}
+
+int handle_msample(Command *cmd, RingBuffer *send_rb, bstring path)
+{
+    Stats batch = {.n = 0};
+    Sketch sketch;
+    char *at = bdata(cmd->arg);
+    char *end = at + blength(cmd->arg);
+    char *stop = NULL;
+
+    check(path == NULL, "msample scans its own paths.");
+    log_info("msample %s %s", bdatae(cmd->name, ""), bdatae(cmd->arg, ""));
+
+    Sketch_init(&sketch);
+
+    // parse everything first so a bad value doesn't half apply
+    while(at < end) {
+        double value = strtod(at, &stop);
+        check(stop != at && (stop == end || *stop == ' '), "Bad msample value: %s", at);
+
+        Stats_sample(&batch, value);
+        if(SKETCHES) Sketch_add(&sketch, value);
+        at = stop + 1;
+    }
+
+    check(batch.n > 0, "msample needs at least one value.");
+
+    // then it's a sample with a fat root, the rollup runs just once
+    cmd->batch = &batch;
+    cmd->sketch = SKETCHES ? &sketch : NULL;
+    cmd->handler = handle_sample;
+
+    return scan_paths(cmd, send_rb);
+error:
+    return -1;
+}
+
+int mget_names(char *at, char *end)
+{
+    int count = 1;
+
+    for(; (at = memchr(at, ' ', end - at)) != NULL; at++) count++;
+
+    return count;
+}
+
+int handle_mget(Command *cmd, RingBuffer *send_rb, bstring path)
+{
+    char *at = bdata(cmd->arg);
+    char *end = at + blength(cmd->arg);
+    struct tagbstring name;
+    Stats folded;
+
+    check(path == NULL, "mget is non-recursive.");
+    log_info("mget %s %s", bdata(cmd->name), bdatae(cmd->arg, ""));
+
+    // the first name got its own token, the rest are still in arg
+    if(1 + (blength(cmd->arg) > 0 ? mget_names(at, end) : 0) > MGET_MAX) {
+        // one ERR for the line, not a reply per name and then a close
+        send_status(cmd, send_rb, REPLY_ERR);
+        return 0;
+    }
+
+    for(name = *cmd->name;;) {
+        Record *info = RecordMap_get(DATA, &name);
+
+        if(info == NULL) {
+            send_status(cmd, send_rb, REPLY_DNE);
+        } else {
+            Record_fold(info, &folded);
+            char reply[FORMAT_MAX * 2];
+            int len = format_double(reply, Stats_mean(&folded));
+            reply[len++] = ' ';
+            len += format_double(reply + len, Stats_stddev(&folded));
+            send_line(send_rb, reply, len);
+        }
+
+        if(at >= end || !next_token(&at, end, &name)) break;
+    }
 
     return 0;
+error:
+    return -1;
 }
 
 int handle_delete(Command *cmd, RingBuffer *send_rb, bstring path)
 {
     log_info("delete: %s", bdata(cmd->name));
-    Record *info = Hashmap_get(DATA, cmd->name);
-    check(path == NULL && cmd->path == NULL, "Should be a recursive command.");
+    Record *info = RecordMap_get(DATA, cmd->name);
+    check(path == NULL, "Should not be a recursive command.");
 
     // BUG: should just decide that this isn't scanned 
     // but run once, for now just only run on root
     if(info == NULL) {
-        send_reply(send_rb, &DNE);
+        send_status(cmd, send_rb, REPLY_DNE);
     } else {
-        Hashmap_delete(DATA, cmd->name);
-
-        free(info->stat);
-        bdestroy(info->name);
-        free(info);
+        RecordMap_delete(DATA, info->name);
+        Wal_deleted(WAL, info->name);
+        Record_destroy(info);
 
-        send_reply(send_rb, &OK);
+        send_status(cmd, send_rb, REPLY_OK);
     }
 
     return 0;
@@ -235,14 +634,14 @@ error:
 int handle_mean(Command *cmd, RingBuffer *send_rb, bstring path)
 {
     log_info("mean: %s %s %s", bdata(cmd->name), bdata(path), bdata(path));
-    Record *info = Hashmap_get(DATA, path);
+    Record *info = cmd->info;
+    Stats folded;
 
     if(info == NULL) {
-        send_reply(send_rb, &DNE);
+        send_status(cmd, send_rb, REPLY_DNE);
     } else {
-        bstring reply = bformat("%f\n", Stats_mean(info->stat));
-        send_reply(send_rb, reply);
-        bdestroy(reply);
+        Record_fold(info, &folded);
+        send_number(cmd, send_rb, Stats_mean(&folded));
     }
 
     return 0;
@@ -251,14 +650,14 @@ int handle_mean(Command *cmd, RingBuffer *send_rb, bstring path)
 int handle_stddev(Command *cmd, RingBuffer *send_rb, bstring path)
 {
     log_info("stddev: %s %s %s", bdata(cmd->name), bdata(path), bdata(path));
-    Record *info = Hashmap_get(DATA, path);
+    Record *info = cmd->info;
+    Stats folded;
 
     if(info == NULL) {
-        send_reply(send_rb, &DNE);
+        send_status(cmd, send_rb, REPLY_DNE);
     } else {
-        bstring reply = bformat("%f\n", Stats_stddev(info->stat));
-        send_reply(send_rb, reply);
-        bdestroy(reply);
+        Record_fold(info, &folded);
+        send_number(cmd, send_rb, Stats_stddev(&folded));
     }
 
     return 0;
@@ -267,176 +666,173 @@ int handle_stddev(Command *cmd, RingBuffer *send_rb, bstring path)
 int handle_dump(Command *cmd, RingBuffer *send_rb, bstring path)
 {
     log_info("dump: %s, %s, %s", bdata(cmd->name), bdata(path), bdata(path));
-    Record *info = Hashmap_get(DATA, path);
+    Record *info = cmd->info;
+    Stats folded;
 
     if(info == NULL) {
-        send_reply(send_rb, &DNE);
+        send_status(cmd, send_rb, REPLY_DNE);
     } else {
-        bstring reply = bformat("%f %f %f %f %ld %f %f\n",
-                Stats_mean(info->stat),
-                Stats_stddev(info->stat),
-                info->stat->sum,
-                info->stat->sumsq,
-                info->stat->n,
-                info->stat->min,
-                info->stat->max);
-
-        send_reply(send_rb, reply);
-        bdestroy(reply);
+        Record_fold(info, &folded);
+        send_stats(cmd, send_rb, &folded);
     }
 
     return 0;
 }
 
-
-int handle_store(Command *cmd, RingBuffer *send_rb, bstring path)
+int handle_percentile(Command *cmd, RingBuffer *send_rb, bstring path)
 {
-    Record *info = Hashmap_get(DATA, cmd->name);
-    bstring location = NULL;
-    bstring from = cmd->name;
-    int rc = 0;
-    int fd = -1;
+    log_info("percentile: %s %s %f", bdata(cmd->name), bdata(path), cmd->value);
+    Record *info = cmd->info;
+    Stats folded;
 
-    check(cmd != NULL, "Invalid command.");
-    debug("store %s", bdata(cmd->name));
-    check(path == NULL && cmd->path == NULL, "Store is non-recursive.");
+    check(cmd->value >= 0.0 && cmd->value <= 1.0, "Bad quantile: %f", cmd->value);
 
     if(info == NULL) {
-        send_reply(send_rb, &DNE);
+        send_status(cmd, send_rb, REPLY_DNE);
+    } else if(info->sketch == NULL) {
+        // made with sketches off, or loaded from a file without one
+        send_status(cmd, send_rb, REPLY_ERR);
     } else {
-        // it exists so we sanitize the name
-        location = sanitize_location(STORE_PATH, from);
-        check(location, "Failed to sanitize the location.");
-
-        // open the file we need with EXLOCK
-        fd = open(bdata(location), O_WRONLY | O_CREAT | O_EXLOCK, S_IRWXU);
-        check(fd >= 0, "Cannot open file for writing: %s", bdata(location));
-
-        // write the Stats part of info to it
-        rc = write(fd, info->stat, sizeof(Stats));
-        check(rc == sizeof(Stats), "Failed to write to %s", bdata(location));
+        double value = Sketch_quantile(info->sketch, cmd->value);
 
-        // close, which should release the lock
-        close(fd);
+        // the real min and max beat their bins, and bound everything else
+        AtomicStats_fold(info->stat, &folded);
+        if(cmd->value == 0.0 || value < folded.min) value = folded.min;
+        if(cmd->value == 1.0 || value > folded.max) value = folded.max;
 
-        // then send OK
-        send_reply(send_rb, &OK);
+        send_number(cmd, send_rb, value);
     }
 
     return 0;
-error: 
-    if(fd < 0) close(fd);
+error:
     return -1;
 }
 
-int handle_load(Command *cmd, RingBuffer *send_rb, bstring path)
+int handle_window(Command *cmd, RingBuffer *send_rb, bstring path)
 {
-    bstring to = cmd->arg;
-    bstring from = cmd->name;
-    bstring location = NULL;
-    Record *info = Hashmap_get(DATA, to);
-    int fd = -1;
-
-    check(path == NULL && cmd->path == NULL, "Load is non-recursive.");
+    log_info("window: %s %s %f", bdata(cmd->name), bdata(path), cmd->value);
+    Record *info = cmd->info;
+    int seconds = (int)cmd->value;
+    Stats folded;
 
-    if(info != NULL) {
-        // don't do it if the target to exists
-        send_reply(send_rb, &EXISTS);
+    if(info == NULL) {
+        send_status(cmd, send_rb, REPLY_DNE);
+    } else if(info->window == NULL) {
+        // made while windows were off
+        send_status(cmd, send_rb, REPLY_ERR);
     } else {
-        location = sanitize_location(STORE_PATH, from);
-        check(location, "Failed to sanitize location.");
+        check(seconds == cmd->value && seconds > 0 && seconds <= info->window->seconds,
+                "Bad window: %f", cmd->value);
 
-        // make a new record for the to target
-        // TODO: make regular CRUD methods for Record
-        info = calloc(1, sizeof(Record));
-        check_mem(info);
+        Window_fold(info->window, Window_now(), seconds, &folded);
+        send_stats(cmd, send_rb, &folded);
+    }
+
+    return 0;
+error:
+    return -1;
+}
+
+int handle_rate(Command *cmd, RingBuffer *send_rb, bstring path)
+{
+    log_info("rate: %s %s", bdata(cmd->name), bdata(path));
+    Record *info = cmd->info;
 
-        info->stat = calloc(1, sizeof(Stats));
-        check_mem(info->stat);
+    if(info == NULL) {
+        send_status(cmd, send_rb, REPLY_DNE);
+    } else if(info->window == NULL) {
+        send_status(cmd, send_rb, REPLY_ERR);
+    } else {
+        send_number(cmd, send_rb, Window_rate(info->window, Window_now()));
+    }
 
-        // open the file to read from readonly and locked
-        fd = open(bdata(location), O_RDONLY | O_EXLOCK);
-        check(fd >= 0, "Error opening file: %s", bdata(location));
+    return 0;
+}
 
-        // read into the stats record 
-        int rc = read(fd, info->stat, sizeof(Stats));
-        check(rc == sizeof(Stats), "Failed to read record at %s", bdata(location));
+// the longest list or dumptree line, and room for the OK after it
+#define SUBTREE_LINE (MAX_NAME + 1 + FORMAT_MAX * 7)
+#define SUBTREE_RESERVE (SUBTREE_LINE + 8)
 
-        // close so we release the lock quick
-        close(fd);
+typedef struct Subtree {
+    Command *cmd;
+    RingBuffer *send_rb;
+    // dumptree, so every name gets its stats
+    int dump;
+    int count;
+    bstring last;
+} Subtree;
 
-        // make a copy of to as the name for the info
-        info->name = bstrcpy(to);
-        check_mem(info->name);
+static inline int name_order(bstring a, bstring b)
+{
+    int rc = memcmp(a->data, b->data, a->slen < b->slen ? a->slen : b->slen);
+    return rc != 0 ? rc : a->slen - b->slen;
+}
 
-        // put it in the hashmap
-        rc = Hashmap_set(DATA, info->name, info);
-        check(rc == 0, "Failed to ass to data map: %s", bdata(info->name));
+int send_subtree_entry(Record *info, void *context)
+{
+    Subtree *walk = context;
+    char reply[SUBTREE_LINE];
+    int len = blength(info->name);
+    Stats folded;
+
+    // send_rb is about full, the rest goes in the next chunk
+    if(walk->count > 0 && RingBuffer_available_space(walk->send_rb) < SUBTREE_RESERVE) {
+        walk->cmd->after = walk->last;
+        return 1;
+    }
 
-        // and send the reply
-        send_reply(send_rb, &OK);
+    memcpy(reply, info->name->data, len);
+    if(walk->dump) {
+        Record_fold(info, &folded);
+        reply[len++] = ' ';
+        len += format_stats(reply + len, &folded);
     }
+    send_line(walk->send_rb, reply, len);
 
+    // parse_stream takes a reference, so it's still good as a place
+    // to start after a delete
+    walk->last = info->name;
+    walk->count++;
     return 0;
-error:
-    if(fd < 0) close(fd);
-    return -1;
 }
 
-int parse_command(struct bstrList *splits, Command *cmd)
+int send_subtree(Command *cmd, RingBuffer *send_rb, int dump)
 {
-    check(splits != NULL, "Invalid split line.");
+    int rc = 0;
+    char under[MAX_NAME + 2];
+    struct tagbstring name = *cmd->name;
+    struct tagbstring prefix;
+    bstring after = blength(cmd->arg) > 0 ? cmd->arg : NULL;
+    Subtree walk = {.cmd = cmd, .send_rb = send_rb, .dump = dump};
+    Record *info = NULL;
+
+    check(bchar(&name, 0) == '/', "Didn't give a valid URL.");
+    check(after == NULL || memchr(after->data, ' ', after->slen) == NULL,
+            "Only one name to start after for %s.", bdata(cmd->command));
+
+    // /logins/ is the same as /logins, and / is everything, which
+    // workers refuse since it's in every shard
+    if(name.data[name.slen - 1] == '/') name.slen--;
+    memcpy(under, name.data, name.slen);
+    under[name.slen] = '/';
+    blk2tbstr(prefix, under, name.slen + 1);
+    cmd->after = NULL;
+
+    // the record itself sorts ahead of everything under it
+    if(name.slen > 0 && (after == NULL || name_order(after, &name) < 0)) {
+        info = RecordMap_get(DATA, &name);
+        if(info) send_subtree_entry(info, &walk);
+    }
 
-    // get the command
-    cmd->command = splits->entry[0];
-
-    if(biseq(cmd->command, &CREATE)) {
-        check(splits->qty == 3, "Failed to parse create: %d", splits->qty);
-        cmd->name = splits->entry[1];
-        cmd->number = splits->entry[2];
-        cmd->handler = handle_create;
-        cmd->path = parse_name(cmd->name);
-    } else if(biseq(cmd->command, &MEAN)) {
-        check(splits->qty == 2, "Failed to parse mean: %d", splits->qty);
-        cmd->name = splits->entry[1];
-        cmd->handler = handle_mean;
-        cmd->path = parse_name(cmd->name);
-    } else if(biseq(cmd->command, &SAMPLE)) {
-        check(splits->qty == 3, "Failed to parse sample: %d", splits->qty);
-        cmd->name = splits->entry[1];
-        cmd->number = splits->entry[2];
-        cmd->handler = handle_sample;
-        cmd->path = parse_name(cmd->name);
-    } else if(biseq(cmd->command, &DUMP)) {
-        check(splits->qty == 2, "Failed to parse dump: %d", splits->qty);
-        cmd->name = splits->entry[1];
-        cmd->handler = handle_dump;
-        cmd->path = parse_name(cmd->name);
-    } else if(biseq(cmd->command, &DELETE)) {
-        check(splits->qty == 2, "Failed to parse delete: %d", splits->qty);
-        cmd->name = splits->entry[1];
-        cmd->handler = handle_delete;
-        cmd->path = NULL;
-    } else if(biseq(cmd->command, &STDDEV)) {
-        check(splits->qty == 2, "Failed to parse stddev: %d", splits->qty);
-        cmd->name = splits->entry[1];
-        cmd->handler = handle_stddev;
-        cmd->path = parse_name(cmd->name);
-    } else if(biseq(cmd->command, &STORE)) {
-        // store URL
-        check(splits->qty == 2, "Failed to parse store: %d", splits->qty);
-        cmd->name = splits->entry[1];
-        cmd->handler = handle_store;
-        cmd->path = NULL;
-    } else if(biseq(cmd->command, &LOAD)) {
-        // load FROM TO
-        check(splits->qty == 3, "Failed to parse load: %d", splits->qty);
-        cmd->name = splits->entry[1];
-        cmd->arg = splits->entry[2];
-        cmd->handler = handle_load;
-        cmd->path = NULL;
+    if(after == NULL || name_order(after, &prefix) < 0) {
+        rc = NameIndex_walk(&DATA->names, &prefix, 1, &prefix, send_subtree_entry, &walk);
     } else {
-        sentinel("Failed to parse the command.");
+        rc = NameIndex_walk(&DATA->names, after, 0, &prefix, send_subtree_entry, &walk);
+    }
+
+    // a walk that stopped short is picked up again after cmd->after
+    if(rc == 0) {
+        send_status(cmd, send_rb, walk.count > 0 || after ? REPLY_OK : REPLY_DNE);
     }
 
     return 0;
@@ -444,113 +840,1057 @@ error:
     return -1;
 }
 
-int scan_paths(Command *cmd, RingBuffer *send_rb)
+int handle_list(Command *cmd, RingBuffer *send_rb, bstring path)
 {
-    check(cmd->path != NULL, "Path was not set in command.");
+    log_info("list: %s %s", bdata(cmd->name), bdatae(cmd->arg, ""));
+    check(path == NULL, "list is non-recursive.");
 
-    int rc = 0;
-    // save the original path length
-    size_t qty = cmd->path->qty;
-
-    // starting at the longest path, shorten it and call
-    // for each one:
-    for(; cmd->path->qty > 1; cmd->path->qty--) {
-        // remake the path with / again
-        bstring path = bjoin(cmd->path, &SLASH);
-        // call the handler with the path
-        rc = cmd->handler(cmd, send_rb, path);
-        // if the handler returns != 0 then abort and return that
-        bdestroy(path);
+    return send_subtree(cmd, send_rb, 0);
+error:
+    return -1;
+}
 
-        if(rc != 0) break;
-    }
+int handle_dumptree(Command *cmd, RingBuffer *send_rb, bstring path)
+{
+    log_info("dumptree: %s %s", bdata(cmd->name), bdatae(cmd->arg, ""));
+    check(path == NULL, "dumptree is non-recursive.");
 
-    // restore path length
-    cmd->path->qty = qty;
-    return rc;
+    return send_subtree(cmd, send_rb, 1);
 error:
     return -1;
 }
 
-struct bstrList *parse_name(bstring name)
+// the longest info line, a key and a command name then five numbers
+#define INFO_LINE (32 + FORMAT_MAX * 6)
+
+static int info_key(char *line, const char *key, bstring name)
 {
-    return bsplits(name, &SLASH);
+    int len = strlen(key);
+
+    memcpy(line, key, len);
+    if(name) {
+        line[len++] = ' ';
+        memcpy(line + len, name->data, name->slen);
+        len += name->slen;
+    }
+
+    return len;
 }
 
-int parse_line(bstring data, RingBuffer *send_rb)
+static int info_long(char *at, long value)
 {
-    int rc = -1;
-    Command cmd = {.command = NULL};
+    *at = ' ';
+    return 1 + format_long(at + 1, value);
+}
 
-    // split data on line boundaries
-    struct bstrList *splits = bsplits(data, &LINE_SPLIT);
-    check(splits != NULL, "Bad data.");
+static int info_micros(char *at, double value)
+{
+    // to the nanosecond, the rest of the digits are just the clock
+    *at = ' ';
+    return 1 + format_double(at + 1, round(value * 1000) / 1000);
+}
 
-    // parse it into a command
-    rc = parse_command(splits, &cmd);
-    check(rc == 0, "Failed to parse command.");
+static int info_latency(char *at, Latency *latency)
+{
+    // n mean p50 p99 max
+    Stats *st = &latency->stats;
+    Sketch *sk = latency->sketch;
+    int len = info_long(at, st->n);
 
-    // scan the path and call the handlers
-    if(cmd.path) { 
-        check(cmd.path->qty > 1, "Didn't give a valid URL.");
-        rc = scan_paths(&cmd, send_rb);
-        check(rc == 0, "Failure running recursive command against path: %s", bdata(cmd.name));
-        bstrListDestroy(cmd.path);
-    } else {
-        rc = cmd.handler(&cmd, send_rb, NULL);
-        check(rc == 0, "Failed running command against path: %s", bdata(cmd.name));
-    }
+    len += info_micros(at + len, st->n ? Stats_mean(st) : 0);
+    len += info_micros(at + len, sk ? Sketch_quantile(sk, 0.5) : 0);
+    len += info_micros(at + len, sk ? Sketch_quantile(sk, 0.99) : 0);
+    len += info_micros(at + len, st->max);
 
-    bstrListDestroy(splits);
+    return len;
+}
 
-    return 0;
+int handle_info(Command *cmd, RingBuffer *send_rb, bstring path)
+{
+    char line[INFO_LINE];
+    int len = 0;
+    int slot = 0;
+    Metrics total;
+    struct mallinfo2 heap = mallinfo2();
+    (void)path;
+
+    // this thread's sizes as of now, every other's as of its last batch
+    Metrics_register();
+    Metrics_publish();
+    memset(&total, 0, sizeof(Metrics));
+    Metrics_fold(&total);
+
+    len = info_key(line, "connections", NULL);
+    len += info_long(line + len, total.connections);
+    len += info_long(line + len, total.accepted);
+    send_line(send_rb, line, len);
+
+    len = info_key(line, "bytes", NULL);
+    len += info_long(line + len, total.bytes_in);
+    len += info_long(line + len, total.bytes_out);
+    send_line(send_rb, line, len);
+
+    len = info_key(line, "records", NULL);
+    len += info_long(line + len, total.records);
+    len += info_long(line + len, total.table_bytes);
+    send_line(send_rb, line, len);
+
+    len = info_key(line, "memory", NULL);
+    len += info_long(line + len, heap.uordblks);
+    len += info_long(line + len, heap.hblkhd);
+    len += info_long(line + len, total.slab_bytes);
+    send_line(send_rb, line, len);
+
+    len = info_key(line, "buffers", NULL);
+    len += info_long(line + len, total.recv_high);
+    len += info_long(line + len, total.send_high);
+    send_line(send_rb, line, len);
+
+    len = info_key(line, "bad", NULL);
+    len += info_long(line + len, total.bad);
+    send_line(send_rb, line, len);
+
+    len = info_key(line, "flush", NULL);
+    len += info_latency(line + len, &total.flush);
+    send_line(send_rb, line, len);
+
+    for(slot = 0; slot < COMMAND_SLOTS; slot++) {
+        CommandMetrics *command = &total.command[slot];
+        if(command->calls == 0) continue;
+
+        // every command ever run is only a couple of k, this never trips
+        check(RingBuffer_available_space(send_rb) > INFO_LINE * 3 + 8,
+                "info doesn't fit in the send buffer.");
+
+        len = info_key(line, "command", &COMMANDS[slot].name);
+        len += info_long(line + len, command->calls);
+        len += info_long(line + len, command->errors);
+        send_line(send_rb, line, len);
+
+        // none of its calls were timed yet
+        if(command->parse.stats.n == 0) continue;
+
+        len = info_key(line, "parse", &COMMANDS[slot].name);
+        len += info_latency(line + len, &command->parse);
+        send_line(send_rb, line, len);
+
+        len = info_key(line, "handler", &COMMANDS[slot].name);
+        len += info_latency(line + len, &command->handler);
+        send_line(send_rb, line, len);
+    }
 
-error: // fallthrough
-    if(cmd.path) bstrListDestroy(cmd.path);
-    if(splits) bstrListDestroy(splits);
+    send_status(cmd, send_rb, REPLY_OK);
+    Metrics_clear(&total);
+    return 0;
+error:
+    Metrics_clear(&total);
     return -1;
 }
 
-void client_handler(int client_fd)
+int io_finish(IoJob *job, RingBuffer *send_rb)
 {
     int rc = 0;
-    RingBuffer *recv_rb = RingBuffer_create(RB_SIZE);
-    RingBuffer *send_rb = RingBuffer_create(RB_SIZE);
+    Record *info = NULL;
+    Command cmd = {.binary = job->binary};
 
-    check_mem(recv_rb);
-    check_mem(send_rb);
+    // same as when the file calls failed inline, the client gets closed
+    errno = job->error;
+    check(job->error == 0, "%s failed for %s",
+            job->op == IO_STORE ? "store" : "load", bdata(job->location));
 
-    // keep reading into the recv buffer and sending on send
-    while(read_some(recv_rb, client_fd, 1) != -1) {
-        // read a line from the recv_rb
-        bstring data = read_line(recv_rb, LINE_ENDING);
-        check(data != NULL, "Client closed.");
-
-        // parse it, close on any protocol errors
-        rc = parse_line(data, send_rb);
-        bdestroy(data); // cleanup here
-        check(rc == 0, "Failed to parse user. Closing.");
-
-        // and as long as there's something to send, send it
-        if(RingBuffer_available_data(send_rb)) {
-            write_some(send_rb, client_fd, 1);
-        }
+    if(job->op == IO_STORE) {
+        send_status(&cmd, send_rb, REPLY_OK);
+        return 0;
     }
 
-    // close the socket
-    rc = close(client_fd);
+    // another client may have made TO while the read was out
+    if(RecordMap_get(DATA, job->to) != NULL) {
+        send_status(&cmd, send_rb, REPLY_EXISTS);
+        return 0;
+    }
+
+    // make a new record for the to target
+    info = Record_create(job->to);
+    check_mem(info);
+    Record_set(info, &job->stats, job->sketch);
+
+    // put it in the hashmap
+    rc = RecordMap_set(DATA, info);
+    check(rc == 0, "Failed to add to data map: %s", bdata(info->name));
+    Record_link(info);
+
+    rc = Wal_log_record(WAL, info);
+    check(rc == 0, "Failed to log the load of %s", bdata(info->name));
+    Wal_dirty(WAL, info);
+
+    // and send the reply
+    send_status(&cmd, send_rb, REPLY_OK);
+
+    return 0;
+error:
+    if(info && RecordMap_get(DATA, info->name) != info) Record_destroy(info);
+    return -1;
+}
+
+int io_dispatch(IoJob *job, RingBuffer *send_rb)
+{
+    int rc = 0;
+
+    if(IO) {
+        // whoever ran the command submits it once it knows who's waiting
+        Io_defer(IO, job);
+        return 0;
+    }
+
+    // no pool on this thread, the fork server and tests do it inline
+    IoJob_run(job);
+    rc = io_finish(job, send_rb);
+    IoJob_destroy(job);
+
+    return rc;
+}
+
+int handle_store(Command *cmd, RingBuffer *send_rb, bstring path)
+{
+    Record *info = RecordMap_get(DATA, cmd->name);
+    bstring location = NULL;
+    IoJob *job = NULL;
+
+    check(cmd != NULL, "Invalid command.");
+    debug("store %s", bdata(cmd->name));
+    check(path == NULL, "Store is non-recursive.");
+
+    if(info == NULL) {
+        send_status(cmd, send_rb, REPLY_DNE);
+        return 0;
+    }
+
+    // it exists so we hash the name into the fan-out
+    location = store_location(STORE_PATH, cmd->name);
+    check(location, "Failed to make the store location.");
+
+    job = IoJob_create(IO_STORE, location, NULL, cmd->binary);
+    check_mem(job);
+    bdestroy(location);
+    location = NULL;
+
+    // what it is as of this command, later samples don't leak in
+    Record_fold(info, &job->stats);
+
+    if(info->sketch) {
+        job->sketch = Sketch_create();
+        check_mem(job->sketch);
+        *job->sketch = *info->sketch;
+    }
+
+    return io_dispatch(job, send_rb);
+error:
+    bdestroy(location);
+    IoJob_destroy(job);
+    return -1;
+}
+
+int handle_load(Command *cmd, RingBuffer *send_rb, bstring path)
+{
+    bstring to = cmd->arg;
+    bstring from = cmd->name;
+    bstring location = NULL;
+    IoJob *job = NULL;
+
+    check(path == NULL, "Load is non-recursive.");
+    check(blength(to) <= MAX_NAME, "Name too long to load into.");
+
+    if(RecordMap_get(DATA, to) != NULL) {
+        // don't do it if the target to exists
+        send_status(cmd, send_rb, REPLY_EXISTS);
+        return 0;
+    }
+
+    location = store_location(STORE_PATH, from);
+    check(location, "Failed to make the store location.");
+
+    job = IoJob_create(IO_LOAD, location, to, cmd->binary);
+    check_mem(job);
+    bdestroy(location);
+
+    return io_dispatch(job, send_rb);
+error:
+    bdestroy(location);
+    return -1;
+}
+
+// slots come from COMMAND_HASH, the compiler warns if two collide
+#define COMMAND_SLOT(F, L, N) (((F) + 2 * (L) + (N)) & (COMMAND_SLOTS - 1))
+#define COMMAND_HASH(B) COMMAND_SLOT(bchar((B), 0), bchar((B), blength((B)) - 1), blength((B)))
+
+CommandSpec COMMANDS[COMMAND_SLOTS] = {
+    [COMMAND_SLOT('c', 'e', 6)] = {bsStatic("create"), handle_create, 3, 1, 1},
+    [COMMAND_SLOT('m', 'n', 4)] = {bsStatic("mean"), handle_mean, 2, 1},
+    [COMMAND_SLOT('s', 'e', 6)] = {bsStatic("sample"), handle_sample, 3, 1, 1},
+    [COMMAND_SLOT('d', 'p', 4)] = {bsStatic("dump"), handle_dump, 2, 1},
+    [COMMAND_SLOT('d', 'e', 6)] = {bsStatic("delete"), handle_delete, 2, 0, 1},
+    [COMMAND_SLOT('s', 'v', 6)] = {bsStatic("stddev"), handle_stddev, 2, 1},
+    // store URL
+    [COMMAND_SLOT('s', 'e', 5)] = {bsStatic("store"), handle_store, 2, 0},
+    // load FROM TO, logs the record it loads itself
+    [COMMAND_SLOT('l', 'd', 4)] = {bsStatic("load"), handle_load, 3, 0},
+    // msample URL V1 V2 ... VN
+    [COMMAND_SLOT('m', 'e', 7)] = {bsStatic("msample"), handle_msample, VARIADIC, 0, 1},
+    // mget URL1 URL2 ... URLN
+    [COMMAND_SLOT('m', 't', 4)] = {bsStatic("mget"), handle_mget, VARIADIC, 0},
+    // percentile URL Q, with Q from 0 to 1
+    [COMMAND_SLOT('p', 'e', 10)] = {bsStatic("percentile"), handle_percentile, 3, 1},
+    // window URL SECONDS, a dump of just the last SECONDS
+    [COMMAND_SLOT('w', 'w', 6)] = {bsStatic("window"), handle_window, 3, 1},
+    // rate URL, samples a second over the whole window
+    [COMMAND_SLOT('r', 'e', 4)] = {bsStatic("rate"), handle_rate, 2, 1},
+    // list URL [AFTER], URL and every name under it in order, then OK
+    [COMMAND_SLOT('l', 't', 4)] = {bsStatic("list"), handle_list, VARIADIC, 0},
+    // dumptree URL [AFTER], the same with a dump after each name
+    [COMMAND_SLOT('d', 'e', 8)] = {bsStatic("dumptree"), handle_dumptree, VARIADIC, 0},
+    // info, lines of the server's own counters and latencies, then OK
+    [COMMAND_SLOT('i', 'o', 4)] = {bsStatic("info"), handle_info, 1, 0},
+};
+
+CommandSpec *OPCODES[OP_MAX] = {
+    [OP_CREATE] = &COMMANDS[COMMAND_SLOT('c', 'e', 6)],
+    [OP_MEAN] = &COMMANDS[COMMAND_SLOT('m', 'n', 4)],
+    [OP_SAMPLE] = &COMMANDS[COMMAND_SLOT('s', 'e', 6)],
+    [OP_DUMP] = &COMMANDS[COMMAND_SLOT('d', 'p', 4)],
+    [OP_DELETE] = &COMMANDS[COMMAND_SLOT('d', 'e', 6)],
+    [OP_STDDEV] = &COMMANDS[COMMAND_SLOT('s', 'v', 6)],
+    [OP_STORE] = &COMMANDS[COMMAND_SLOT('s', 'e', 5)],
+    [OP_LOAD] = &COMMANDS[COMMAND_SLOT('l', 'd', 4)],
+    [OP_PERCENTILE] = &COMMANDS[COMMAND_SLOT('p', 'e', 10)],
+    [OP_WINDOW] = &COMMANDS[COMMAND_SLOT('w', 'w', 6)],
+    [OP_RATE] = &COMMANDS[COMMAND_SLOT('r', 'e', 4)],
+};
+
+CommandSpec *find_command(bstring name)
+{
+    if(blength(name) == 0) return NULL;
+
+    CommandSpec *spec = &COMMANDS[COMMAND_HASH(name)];
+
+    // one compare, empty slots have no handler
+    return spec->handler && biseq(&spec->name, name) ? spec : NULL;
+}
+
+int next_token(char **at, char *end, struct tagbstring *token)
+{
+    // split on every space like bsplits did, 0 once we're past the end
+    if(*at > end) return 0;
+
+    char *space = memchr(*at, ' ', end - *at);
+    char *stop = space ? space : end;
+
+    // the NUL keeps bdata and atof inside the token
+    *stop = '\0';
+    blk2tbstr(*token, *at, stop - *at);
+    *at = stop + 1;
+
+    return 1;
+}
+
+int parse_command(char *data, int len, Command *cmd)
+{
+    int count = 0;
+    char *at = data;
+    char *end = data + len;
+    CommandSpec *spec = NULL;
+
+    check(data != NULL && len >= 0, "Invalid line.");
+
+    // get the command
+    next_token(&at, end, &cmd->tokens[0]);
+    cmd->command = &cmd->tokens[0];
+    spec = find_command(cmd->command);
+    check(spec != NULL, "Failed to parse the command.");
+
+    if(spec->args == VARIADIC) {
+        check(next_token(&at, end, &cmd->tokens[1]), "%s needs a name.", bdata(&spec->name));
+
+        // the rest of the line stays whole for the handler to walk
+        at = at > end ? end : at;
+        blk2tbstr(cmd->tokens[2], at, end - at);
+        count = 3;
+    } else {
+        for(count = 1; count < MAX_TOKENS && next_token(&at, end, &cmd->tokens[count]); count++) {
+        }
+
+        check(at > end, "Too many tokens in command.");
+        check(count == spec->args, "Failed to parse %s: %d",
+                bdata(&spec->name), count);
+    }
+
+    check(blength(&cmd->tokens[1]) <= MAX_NAME, "Name too long for %s.", bdata(&spec->name));
+
+    cmd->spec = spec;
+    cmd->handler = spec->handler;
+    cmd->recursive = spec->recursive;
+    cmd->name = &cmd->tokens[1];
+    // the third token is a number for create/sample and TO for load
+    cmd->number = count > 2 ? &cmd->tokens[2] : NULL;
+    cmd->arg = cmd->number;
+    cmd->value = cmd->number ? atof(bdata(cmd->number)) : 0.0;
+
+    return 0;
+error:
+    return -1;
+}
+
+Record *parent_record(Record *child, bstring path)
+{
+    if(child && child->parent) return child->parent;
+
+    Record *info = RecordMap_get(DATA, path);
+
+    // the level below was just made, it hangs off this one
+    if(child && info) Record_adopt(info, child);
+
+    return info;
+}
+
+int scan_paths(Command *cmd, RingBuffer *send_rb)
+{
+    int rc = 0;
+    char *name = bdata(cmd->name);
+    char *first = memchr(name, '/', blength(cmd->name));
+    char *slash = name + blength(cmd->name);
+    struct tagbstring path;
+
+    check(first != NULL, "Didn't give a valid URL.");
+
+    // only the full name needs a lookup, the rest follow parent links
+    cmd->child = NULL;
+    cmd->info = RecordMap_get(DATA, cmd->name);
+
+    // starting at the full name, cut off one component at a time,
+    // every ancestor is just a shorter view of the same bytes
+    while(1) {
+        blk2tbstr(path, name, slash - name);
+        // call the handler with the path
+        rc = cmd->handler(cmd, send_rb, &path);
+        // if the handler returns != 0 then abort and return that
+        if(rc != 0) break;
+
+        for(slash--; slash > first && *slash != '/'; slash--) {
+        }
+        if(slash <= first) break;
+
+        blk2tbstr(path, name, slash - name);
+        cmd->child = cmd->info;
+        cmd->info = parent_record(cmd->child, &path);
+    }
+
+    return rc;
+error:
+    return -1;
+}
+
+int run_command(Command *cmd, RingBuffer *send_rb)
+{
+    int rc = 0;
+
+    // scan the path and call the handlers
+    if(cmd->recursive) {
+        rc = scan_paths(cmd, send_rb);
+        check(rc == 0, "Failure running recursive command against path: %s", bdata(cmd->name));
+    } else {
+        rc = cmd->handler(cmd, send_rb, NULL);
+        check(rc == 0, "Failed running command against path: %s", bdata(cmd->name));
+    }
+
+    if(cmd->spec && cmd->spec->logged) {
+        rc = Wal_log_command(WAL, cmd);
+        check(rc == 0, "Failed to log command: %s", bdata(cmd->command));
+    }
+
+    return 0;
+error:
+    return -1;
+}
+
+static inline int is_refused(Command *cmd)
+{
+    // load logs the record it makes rather than itself
+    return READ_ONLY && (cmd->spec->logged || cmd->handler == handle_load);
+}
+
+int parse_buffer(char *data, int len, RingBuffer *send_rb)
+{
+    int rc = -1;
+    Command cmd = {.command = NULL};
+    double start = Metrics_start();
+
+    // parse it into a command, this writes NULs into data
+    rc = parse_command(data, len, &cmd);
+    check(rc == 0, "Failed to parse command.");
+    double parsed = Metrics_lap(start);
+
+    if(is_refused(&cmd)) {
+        send_status(&cmd, send_rb, REPLY_ERR);
+        Metrics_command(cmd.spec, 1, 0, 0);
+        return 0;
+    }
+
+    rc = run_command(&cmd, send_rb);
+    Metrics_command(cmd.spec, rc != 0, start, parsed);
+    return rc;
+error:
+    metric_add(&METRICS.bad, 1);
+    return -1;
+}
+
+int scan_frame(RingBuffer *input)
+{
+    // the length of the next frame, -1 if it isn't all here, 0 if too big
+    FrameHeader header;
+    int avail = ring_unread(input);
+    if(avail < (int)sizeof(FrameHeader)) return -1;
+
+    memcpy(&header, RingBuffer_starts_at(input), sizeof(FrameHeader));
+    int len = sizeof(FrameHeader) + le16toh(header.name_len) + le16toh(header.arg_len);
+
+    if(len > MAX_FRAME) return 0;
+    return avail >= len ? len : -1;
+}
+
+int is_frame_name(char *name, int len)
+{
+    int i = 0;
+
+    // anything a text token can't hold, the log and the replicas get
+    // every command back as a text line
+    for(i = 0; i < len; i++) {
+        if(name[i] == ' ' || name[i] == '\r' || name[i] == '\n' || name[i] == '\0') return 0;
+    }
+
+    return 1;
+}
+
+int parse_frame(char *data, int len, Command *cmd, char *names)
+{
+    FrameHeader header;
+    CommandSpec *spec = NULL;
+
+    check(len >= (int)sizeof(FrameHeader), "Short frame: %d", len);
+    memcpy(&header, data, sizeof(FrameHeader));
+
+    int name_len = le16toh(header.name_len);
+    int arg_len = le16toh(header.arg_len);
+    check((int)sizeof(FrameHeader) + name_len + arg_len == len, "Bad frame length.");
+
+    spec = header.opcode < OP_MAX ? OPCODES[header.opcode] : NULL;
+    check(spec != NULL, "Invalid opcode: %d", header.opcode);
+    check(name_len > 0 && name_len <= MAX_NAME, "Frame has a bad name length: %d", name_len);
+    check((arg_len > 0) == (header.opcode == OP_LOAD), "Only load takes an arg.");
+
+    // copy out so each name gets a NUL, like the text tokens
+    data += sizeof(FrameHeader);
+    check(is_frame_name(data, name_len) && is_frame_name(data + name_len, arg_len),
+            "Frame name has a space, CR, LF or NUL in it.");
+    memcpy(names, data, name_len);
+    names[name_len] = '\0';
+    blk2tbstr(cmd->tokens[1], names, name_len);
+
+    memcpy(names + name_len + 1, data + name_len, arg_len);
+    names[name_len + 1 + arg_len] = '\0';
+    blk2tbstr(cmd->tokens[2], names + name_len + 1, arg_len);
+
+    cmd->command = &spec->name;
+    cmd->spec = spec;
+    cmd->handler = spec->handler;
+    cmd->recursive = spec->recursive;
+    cmd->name = &cmd->tokens[1];
+    cmd->number = NULL;
+    cmd->arg = arg_len > 0 ? &cmd->tokens[2] : NULL;
+    cmd->value = le_double(header.number);
+    cmd->binary = 1;
+
+    return 0;
+error:
+    return -1;
+}
+
+int parse_frame_buffer(char *data, int len, RingBuffer *send_rb)
+{
+    int rc = 0;
+    Command cmd = {.command = NULL};
+    char names[MAX_FRAME];
+
+    double start = Metrics_start();
+
+    rc = parse_frame(data, len, &cmd, names);
+    check(rc == 0, "Failed to parse frame.");
+    double parsed = Metrics_lap(start);
+
+    if(is_refused(&cmd)) {
+        send_status(&cmd, send_rb, REPLY_ERR);
+        Metrics_command(cmd.spec, 1, 0, 0);
+        return 0;
+    }
+
+    rc = run_command(&cmd, send_rb);
+    Metrics_command(cmd.spec, rc != 0, start, parsed);
+    return rc;
+error:
+    metric_add(&METRICS.bad, 1);
+    return -1;
+}
+
+int parse_line(bstring data, RingBuffer *send_rb)
+{
+    check(data != NULL, "Bad data.");
+
+    return parse_buffer(bdata(data), blength(data), send_rb);
+error:
+    return -1;
+}
+
+int parse_stream(bstring data, RingBuffer *send_rb, bstring *after)
+{
+    int rc = 0;
+    Command cmd = {.command = NULL};
+
+    // parse_line, but says where a list or dumptree stopped short
+    check(data != NULL, "Bad data.");
+    double start = Metrics_start();
+    rc = parse_command(bdata(data), blength(data), &cmd);
+    check(rc == 0, "Failed to parse command.");
+    double parsed = Metrics_lap(start);
+
+    // every chunk of a list or dumptree counts as a call
+    rc = run_command(&cmd, send_rb);
+    Metrics_command(cmd.spec, rc != 0, start, parsed);
+    // the caller lets go of it once the next chunk's line is made
+    *after = cmd.after ? Intern_retain(cmd.after) : NULL;
+
+    return rc;
+error:
+    metric_add(&METRICS.bad, 1);
+    *after = NULL;
+    return -1;
+}
+
+int is_stream(char *data, int len)
+{
+    return (len > blength(&LIST_PREFIX)
+            && memcmp(data, bdata(&LIST_PREFIX), blength(&LIST_PREFIX)) == 0)
+        || (len > blength(&DUMPTREE_PREFIX)
+            && memcmp(data, bdata(&DUMPTREE_PREFIX), blength(&DUMPTREE_PREFIX)) == 0);
+}
+
+void client_handler(int client_fd)
+{
+    int rc = 0;
+    Connection *conn = Connection_create(client_fd);
+    check_mem(conn);
+
+    // keep reading into the recv buffer and sending on send
+    while(client_read(conn) == 0) {
+    }
+
+    // close the socket
+    rc = close(client_fd);
     check(rc != -1, "Failed to close the socket.");
 
 error: // fallthrough
-    if(recv_rb) RingBuffer_destroy(recv_rb);
-    if(send_rb) RingBuffer_destroy(send_rb);
+    Connection_destroy(conn);
     exit(0); // just exit the child process
 }
 
+Connection *Connection_create(int fd)
+{
+    Connection *conn = calloc(1, sizeof(Connection));
+    check_mem(conn);
+
+    conn->fd = fd;
+    // requests get parsed in place, a mirror keeps every one in a row
+    if(MIRROR_BUFFERS) {
+        conn->recv_rb = MirrorBuffer_create(RB_SIZE);
+        conn->mirrored = conn->recv_rb != NULL;
+    }
+    if(conn->recv_rb == NULL) conn->recv_rb = RingBuffer_create(RB_SIZE);
+    check_mem(conn->recv_rb);
+    conn->send_rb = RingBuffer_create(RB_SIZE);
+    check_mem(conn->send_rb);
+    TokenBucket_init(&conn->bucket, CLIENT_BURST, admit_now());
+    metric_add(&METRICS.connections, 1);
+    metric_add(&METRICS.accepted, 1);
+
+    return conn;
+error:
+    Connection_destroy(conn);
+    return NULL;
+}
+
+void Connection_destroy(Connection *conn)
+{
+    if(conn) {
+        if(conn->mirrored) {
+            MirrorBuffer_destroy(conn->recv_rb);
+        } else if(conn->recv_rb) {
+            RingBuffer_destroy(conn->recv_rb);
+        }
+        if(conn->send_rb) RingBuffer_destroy(conn->send_rb);
+        if(conn->source) Source_release(conn->source, admit_now());
+        if(conn->stream) bdestroy(conn->stream);
+        if(conn->feed) Feed_destroy(conn->feed);
+        // a half made one never counted
+        if(conn->send_rb) metric_add(&METRICS.connections, -1);
+        free(conn);
+    }
+}
+
+int client_flush(Connection *conn)
+{
+    int rc = 0;
+    double start = Metrics_start();
+
+    // nothing gets acked before its log entries are written
+    rc = Wal_commit(WAL);
+    check(rc == 0, "Failed to commit the log. Closing.");
+
+    if(RingBuffer_available_data(conn->send_rb)) {
+        metric_high(&METRICS.send_high, RingBuffer_available_data(conn->send_rb));
+        rc = write_some(conn->send_rb, conn->fd, 1);
+        check(rc != -1, "Failed to write reply. Closing.");
+        metric_add(&METRICS.bytes_out, rc);
+        Metrics_flush(start);
+
+        // the socket is full, nothing more gets run until it drains
+        if(RingBuffer_available_data(conn->send_rb) && !conn->blocked) {
+            return client_block(conn, 1);
+        }
+    }
+
+    return 0;
+error:
+    return -1;
+}
+
+int client_block(Connection *conn, int blocked)
+{
+    conn->blocked = blocked;
+
+    // client_pause picks EPOLLOUT instead of EPOLLIN while it's blocked
+    return client_pause(conn, conn->paused);
+}
+
+int client_unblock(Connection *conn)
+{
+    int rc = write_some(conn->send_rb, conn->fd, 1);
+    check(rc != -1, "Failed to write reply. Closing.");
+    metric_add(&METRICS.bytes_out, rc);
+
+    // still more than the socket will take, wait for the next EPOLLOUT
+    if(RingBuffer_available_data(conn->send_rb)) return 0;
+
+    return client_block(conn, 0);
+error:
+    return -1;
+}
+
+int client_stream_next(Connection *conn, bstring after)
+{
+    bstring next = NULL;
+    char *line = (char *)conn->stream->data;
+    int spaces = 0;
+    int len = 0;
+
+    if(after != NULL) {
+        // the same list NAME, just starting after where this one stopped
+        for(len = 0; len < conn->stream->slen; len++) {
+            if(line[len] == ' ' && ++spaces == 2) break;
+        }
+
+        next = bformat("%.*s %s", len, line, after->data);
+        check_mem(next);
+    }
+
+    bdestroy(conn->stream);
+    conn->stream = next;
+
+    return 0;
+error:
+    return -1;
+}
+
+int client_stream(Connection *conn)
+{
+    int rc = 0;
+    bstring after = NULL;
+    // parsing writes NULs into it, and conn->stream is needed for the next
+    bstring line = bstrcpy(conn->stream);
+    check_mem(line);
+
+    rc = parse_stream(line, conn->send_rb, &after);
+    bdestroy(line);
+    check(rc == 0, "Failed to run %s. Closing.", bdata(conn->stream));
+
+    rc = client_stream_next(conn, after);
+    Intern_release(after);
+
+    return rc;
+error:
+    return -1;
+}
+
+int client_attach(Connection *conn, struct sockaddr *addr)
+{
+    conn->local = addr->sa_family == AF_UNIX;
+    conn->source = Source_acquire(addr, admit_now());
+
+    // -1 once the address already has all the connections it gets
+    if(conn->source && SOURCE_CONNECTIONS > 0
+            && conn->source->connections > SOURCE_CONNECTIONS) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int client_admit(Connection *conn)
+{
+    Command cmd = {.binary = conn->binary};
+    double now = admit_now();
+
+    if(TokenBucket_take(&conn->bucket, CLIENT_RATE, CLIENT_BURST, now)
+            && (conn->source == NULL || TokenBucket_take(&conn->source->bucket,
+                    SOURCE_RATE, SOURCE_BURST, now))) {
+        return 1;
+    }
+
+    // shed it before any parsing, the client can back off and retry
+    send_status(&cmd, conn->send_rb, REPLY_BUSY);
+    return 0;
+}
+
+int is_binary_request(char *data, int len)
+{
+    return len == blength(&BINARY) && memcmp(data, bdata(&BINARY), len) == 0;
+}
+
+int client_scan(Connection *conn, int *len)
+{
+    // bytes to consume for the next request, -1 if it isn't all here
+    if(conn->binary) {
+        *len = scan_frame(conn->recv_rb);
+        return *len;
+    } else {
+        *len = scan_line(conn->recv_rb, LINE_ENDING, &conn->scanned, MAX_LINE);
+        if(*len == -1) return -1;
+
+        // a line that's too long gets the same 0 as a huge frame
+        return *len == -2 ? 0 : *len + 1;
+    }
+}
+
+int client_run(Connection *conn, char *data, int len)
+{
+    int rc = 0;
+    int shard = 0;
+    Command text = {.binary = 0};
+
+    if(conn->binary) {
+        return parse_frame_buffer(data, len, conn->send_rb);
+    } else if(is_binary_request(data, len)) {
+        // the OK has to go out as text before we switch
+        send_status(&text, conn->send_rb, REPLY_OK);
+        rc = client_flush(conn);
+        conn->binary = 1;
+        return rc;
+    } else if(is_replicate_request(data, len, &shard)) {
+        // one shard here, and nothing to send without a log
+        if(shard != 0 || WAL == NULL || !Feed_allowed(conn)) {
+            send_status(&text, conn->send_rb, REPLY_ERR);
+            return 0;
+        }
+
+        rc = client_flush(conn);
+        return rc == 0 ? Feed_start(conn, WAL) : rc;
+    } else {
+        // parse it in place
+        return parse_buffer(data, len, conn->send_rb);
+    }
+}
+
+int client_pipeline(Connection *conn)
+{
+    int rc = 0;
+    int len = 0;
+    int used = 0;
+
+    // run everything complete we have, a partial one waits for more,
+    // nothing runs past a store or load until its reply is in, and
+    // nothing runs at all while the socket won't take what we have
+    while(!conn->waiting && !conn->blocked && !conn->feed) {
+        if(conn->stream) {
+            // a chunk at a time, the rest waits behind it
+            rc = client_stream(conn);
+            check(rc == 0, "Failed to stream a reply. Closing.");
+        } else if((used = client_scan(conn, &len)) == -1) {
+            break;
+        } else {
+            check(used > 0, "Request too large. Closing.");
+            char *data = RingBuffer_starts_at(conn->recv_rb);
+
+            if(!client_admit(conn)) {
+                rc = 0;
+            } else if(!conn->binary && is_stream(data, len)) {
+                // the first chunk runs on the next time around
+                conn->stream = blk2bstr(data, len);
+                rc = conn->stream ? 0 : -1;
+            } else {
+                // close on any protocol errors
+                rc = client_run(conn, data, len);
+            }
+            RingBuffer_commit_read(conn->recv_rb, used);
+            if(IO) conn->waiting = Io_submit(IO, client_io_done, conn);
+            check(rc == 0, "Failed to parse user. Closing.");
+        }
+
+        // replies pile up in send_rb unless the next might not fit
+        if(RingBuffer_available_space(conn->send_rb) < REPLY_RESERVE) {
+            rc = client_flush(conn);
+            check(rc == 0, "Failed to flush a full send buffer.");
+        }
+    }
+
+    // one write for the whole batch
+    return client_flush(conn);
+error:
+    return -1;
+}
+
+int client_pause(Connection *conn, int paused)
+{
+    struct epoll_event ev = {
+        .events = conn->blocked ? EPOLLOUT : paused ? 0 : EPOLLIN,
+        .data.ptr = conn
+    };
+
+    int rc = epoll_ctl(conn->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+    check(rc == 0, "Failed to %s fd %d.", paused ? "pause" : "resume", conn->fd);
+    conn->paused = paused;
+
+    return 0;
+error:
+    return -1;
+}
+
+int client_resume(Connection *conn)
+{
+    conn->waiting = 0;
+
+    // anything it sent while waiting is still in the socket
+    return conn->paused ? client_pause(conn, 0) : 0;
+}
+
+int client_recv(Connection *conn)
+{
+    int rc = 0;
+
+    // only a plain recv_rb has to slide a partial line down first
+    if(conn->mirrored) {
+        rc = read_mirrored(conn->recv_rb, conn->fd, 1);
+    } else {
+        rc = read_some(conn->recv_rb, conn->fd, 1);
+    }
+
+    if(rc > 0) {
+        metric_add(&METRICS.bytes_in, rc);
+        metric_high(&METRICS.recv_high, ring_unread(conn->recv_rb));
+    }
+
+    return rc;
+}
+
+void client_io_done(IoJob *job)
+{
+    Connection *conn = job->owner;
+
+    if(conn->closed) {
+        Connection_destroy(conn);
+    } else if(client_resume(conn) != 0
+            || io_finish(job, conn->send_rb) != 0
+            || client_pipeline(conn) != 0) {
+        // client_pipeline carried on with whatever piled up meanwhile
+        client_close(conn);
+    }
+}
+
+int client_hung_up(Connection *conn, uint32_t events)
+{
+    // one that's reading finds out from recv or send, after whatever's
+    // still in the socket, but a paused one would get these every wait
+    return conn->paused && (events & (EPOLLHUP | EPOLLERR));
+}
+
+void client_close(Connection *conn)
+{
+    // closing the fd also takes it out of epoll
+    close(conn->fd);
+    conn->closed = 1;
+
+    // another shard or the disk still holds a pointer to it, the reply frees it
+    if(conn->waiting) return;
+
+    if(CLOSED == NULL) CLOSED = DArray_create(sizeof(Connection *), 32);
+
+    if(CLOSED == NULL || DArray_push(CLOSED, conn) != 0) {
+        // better a stale event than a leak on every close
+        log_err("Failed to defer freeing a connection.");
+        Connection_destroy(conn);
+    }
+}
+
+void client_reap()
+{
+    int i = 0;
+
+    if(CLOSED == NULL) return;
+
+    for(i = 0; i < DArray_count(CLOSED); i++) {
+        Connection_destroy(DArray_get(CLOSED, i));
+    }
+    CLOSED->end = 0;
+}
+
+int client_read(Connection *conn)
+{
+    int rc = 0;
+
+    // a replica's feed, it only ever writes
+    if(conn->feed) return Feed_event(conn);
+
+    // EPOLLOUT, once send_rb is out whatever's left runs again
+    if(conn->blocked) {
+        rc = client_unblock(conn);
+        check(rc == 0, "Failed to write reply. Closing.");
+        return client_pipeline(conn);
+    }
+
+    // nothing runs until the reply is in, so leave the rest in the
+    // socket rather than letting recv_rb fill up and close us
+    if(conn->waiting) return client_pause(conn, 1);
+
+    // the event loop only calls this when the fd is readable
+    rc = client_recv(conn);
+    check_debug(rc > 0, "Client closed.");
+
+    return client_pipeline(conn);
+error:
+    return -1;
+}
+
 int setup_data_store(const char *store_path)
 {
+    int rc = 0;
+
     // a more advanced design simply wouldn't use this
-    DATA = Hashmap_create(NULL, NULL);
+    DATA = RecordMap_create();
     check_mem(DATA);
 
     char *path = realpath(store_path, NULL);
@@ -559,6 +1899,9 @@ int setup_data_store(const char *store_path)
     STORE_PATH = bfromcstr(path);
     free(path);
 
+    rc = load_store_key(STORE_PATH);
+    check(rc == 0, "Failed to load the store key in %s", bdata(STORE_PATH));
+
     return 0;
 error:
     return -1;
@@ -614,3 +1957,169 @@ int run_server(const char *host, const char *port, const char *store_path)
 error:  // fallthrough
     return -1;
 }
+
+int accept_clients(int epoll_fd, int server_socket)
+{
+    int rc = 0;
+    int client_fd = -1;
+    Connection *conn = NULL;
+    struct epoll_event ev = {.events = EPOLLIN};
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+
+    // the listen socket is nonblocking so take everyone that's waiting
+    while((client_fd = accept(server_socket, (struct sockaddr *)&addr, &addr_len)) >= 0) {
+        debug("Client connected.");
+        addr_len = sizeof(addr);
+
+        rc = nonblock(client_fd);
+        check(rc == 0, "Failed to make client nonblocking.");
+
+        conn = Connection_create(client_fd);
+        check_mem(conn);
+        conn->epoll_fd = epoll_fd;
+
+        if(client_attach(conn, (struct sockaddr *)&addr) != 0) {
+            // its address has enough open already, say why and hang up
+            send_status(&(Command){.binary = 0}, conn->send_rb, REPLY_BUSY);
+            write_some(conn->send_rb, client_fd, 1);
+            close(client_fd);
+            Connection_destroy(conn);
+            conn = NULL;
+            continue;
+        }
+
+        ev.data.ptr = conn;
+        rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev);
+        check(rc == 0, "Failed to add client to epoll.");
+
+        conn = NULL;
+    }
+
+    check(errno == EAGAIN || errno == EWOULDBLOCK, "Failed to accept connection.");
+    errno = 0;
+
+    return 0;
+error:
+    if(client_fd >= 0) close(client_fd);
+    Connection_destroy(conn);
+    return -1;
+}
+
+int run_event_server(const char *host, const char *port, const char *store_path)
+{
+    int rc = 0;
+    int i = 0;
+    int nfds = 0;
+    int server_socket = -1;
+    int unix_socket = -1;
+    int epoll_fd = -1;
+    int timeout = 0;
+    Replica *replica = NULL;
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+
+    rc = setup_data_store(store_path);
+    check(rc == 0, "Failed to setup the data store.");
+    Metrics_register();
+
+    if(REPLICA_HOST) {
+        // everything comes from the primary, there's no log to keep
+        READ_ONLY = 1;
+    } else {
+        rc = Wal_recover(bdata(STORE_PATH), &DATA, &WAL, 1, NULL);
+        check(rc == 0, "Failed to recover from the log in %s.", bdata(STORE_PATH));
+    }
+
+    check(host != NULL, "Invalid host.");
+    check(port != NULL, "Invalid port.");
+
+    // a client going away mid-write shouldn't kill everyone else
+    struct sigaction sa = {.sa_handler = SIG_IGN};
+    sigemptyset(&sa.sa_mask);
+    rc = sigaction(SIGPIPE, &sa, 0);
+    check(rc != -1, "Failed to ignore SIGPIPE.");
+
+    server_socket = server_listen(host, port);
+    check(server_socket >= 0, "bind to %s:%s failed.", host, port);
+
+    rc = nonblock(server_socket);
+    check(rc == 0, "Failed to make the server socket nonblocking.");
+
+    epoll_fd = epoll_create1(0);
+    check(epoll_fd >= 0, "Failed to create epoll fd.");
+
+    // the server socket is the only one with a NULL ptr
+    rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &ev);
+    check(rc == 0, "Failed to add server socket to epoll.");
+
+    if(UNIX_PATH) {
+        unix_socket = unix_listen(UNIX_PATH);
+        check(unix_socket >= 0, "Failed to listen on %s.", UNIX_PATH);
+        check(nonblock(unix_socket) == 0, "Failed to make %s nonblocking.", UNIX_PATH);
+
+        // and this one is known by its own address
+        ev.data.ptr = &unix_socket;
+        rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, unix_socket, &ev);
+        check(rc == 0, "Failed to add %s to epoll.", UNIX_PATH);
+    }
+
+    if(REPLICA_HOST) {
+        replica = Replica_create(REPLICA_HOST, REPLICA_PORT, epoll_fd);
+        check_mem(replica);
+    }
+
+    if(IO_THREADS > 0) {
+        // store and load finish back here through IO's eventfd
+        rc = IoPool_start(IO_THREADS);
+        check(rc == 0, "Failed to start the I/O threads.");
+
+        IO = IoLoop_create();
+        check_mem(IO);
+
+        ev.data.ptr = IO;
+        rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, IO->event_fd, &ev);
+        check(rc == 0, "Failed to add the I/O eventfd to epoll.");
+    }
+
+    while(1) {
+        // wake up in time for a deferred fsync, or to retry the primary
+        timeout = replica ? Replica_timeout(replica) : Wal_timeout(WAL);
+        nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        if(nfds == -1 && errno == EINTR) continue;
+        check(nfds >= 0, "epoll_wait failed.");
+
+        for(i = 0; i < nfds; i++) {
+            Connection *conn = events[i].data.ptr;
+
+            if(conn == NULL) {
+                // one bad accept shouldn't take down the server
+                accept_clients(epoll_fd, server_socket);
+            } else if(events[i].data.ptr == &unix_socket) {
+                accept_clients(epoll_fd, unix_socket);
+            } else if(IO && events[i].data.ptr == IO) {
+                IoLoop_drain(IO);
+            } else if(replica && Replica_owns(replica, events[i].data.ptr)) {
+                Replica_read(replica, events[i].data.ptr);
+            } else if(!conn->closed && (client_hung_up(conn, events[i].events)
+                        || client_read(conn) != 0)) {
+                client_close(conn);
+            }
+        }
+
+        client_reap();
+        Metrics_publish();
+
+        if(Wal_commit(WAL) != 0) {
+            log_err("Failed to sync the log.");
+        }
+        Replica_tick(replica);
+    }
+
+error:  // fallthrough
+    Replica_destroy(replica);
+    if(epoll_fd >= 0) close(epoll_fd);
+    if(server_socket >= 0) close(server_socket);
+    if(unix_socket >= 0) close(unix_socket);
+    return -1;
+}
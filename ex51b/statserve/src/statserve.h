@@ -4,40 +4,300 @@
 #include <lcthw/bstrlib.h>
 #include <lcthw/ringbuffer.h>
 #include <lcthw/stats.h>
+#include <stdint.h>
+#include "atomicstats.h"
+#include "sketch.h"
+#include "window.h"
+#include "admit.h"
+#include "intern.h"
+#include "slab.h"
+#include "recordmap.h"
 
 struct Command;
 
 typedef int (*handler_cb)(struct Command *cmd, RingBuffer *send_rb, bstring path);
 
+#define MAX_TOKENS 4
+#define COMMAND_SLOTS 64
+#define MAX_FRAME 4096
+// longest text request, past this the client is closed
+#define MAX_LINE 4096
+// args for a command that takes a name and then the rest of the line
+#define VARIADIC -1
+#define MGET_MAX 32
+// longest name a record can have, a longer one is a protocol error
+#define MAX_NAME 256
+
+typedef enum ReplyStatus {
+    // BUSY means over its rate, the request was dropped unread
+    REPLY_OK, REPLY_ERR, REPLY_DNE, REPLY_EXISTS, REPLY_NUMBER, REPLY_STATS, REPLY_BUSY
+} ReplyStatus;
+
+/*
+ * Binary mode starts after a client sends the line "binary" and gets
+ * OK back. From then on every request is a FrameHeader followed by
+ * name_len bytes of name and arg_len bytes of arg (only load has one),
+ * and every reply is one FrameReply. Everything is little-endian.
+ * Names can't have a space, CR, LF or NUL in them, same as text ones,
+ * and a frame with one is a protocol error.
+ */
+typedef enum Opcode {
+    OP_CREATE = 1, OP_MEAN, OP_SAMPLE, OP_DUMP, OP_DELETE,
+    OP_STDDEV, OP_STORE, OP_LOAD, OP_PERCENTILE, OP_WINDOW, OP_RATE, OP_MAX
+} Opcode;
+
+typedef struct FrameHeader {
+    uint8_t opcode;
+    uint8_t reserved;
+    uint16_t name_len;
+    uint16_t arg_len;
+    uint16_t reserved2;
+    // create and sample's value, percentile's quantile, window's seconds
+    double number;
+} FrameHeader;
+
+typedef struct FrameReply {
+    uint32_t status;
+    uint32_t reserved;
+    // the mean, or stddev, percentile or rate for those commands
+    double value;
+    // the rest only for dump and window
+    double stddev;
+    double sum;
+    double sumsq;
+    uint64_t n;
+    double min;
+    double max;
+} FrameReply;
+
+struct Record;
+struct CommandSpec;
+struct IoJob;
+struct Feed;
+
 typedef struct Command {
     bstring command;
     bstring name;
-    struct bstrList *path;
     bstring number;
     bstring arg;
     handler_cb handler;
+    int recursive;
+    // the table entry this came from
+    struct CommandSpec *spec;
+    // number already parsed, text or binary
+    double value;
+    // every value msample was given, folded into one Stats
+    Stats *batch;
+    // and into one Sketch, NULL when records don't keep them
+    Sketch *sketch;
+    // replies go out as FrameReply instead of text
+    int binary;
+    // scan_paths fills these in for each path it visits
+    struct Record *info;
+    struct Record *child;
+    // list and dumptree stopped short after this name, NULL when they're done
+    bstring after;
+    // views into the line, everything above points in here
+    struct tagbstring tokens[MAX_TOKENS];
 } Command;
 
+typedef struct CommandSpec {
+    struct tagbstring name;
+    handler_cb handler;
+    // token count including the command itself, or VARIADIC
+    int args;
+    // run against every parent path too
+    int recursive;
+    // changes data, so it goes in the write-ahead log
+    int logged;
+} CommandSpec;
+
+extern CommandSpec COMMANDS[COMMAND_SLOTS];
+extern CommandSpec *OPCODES[OP_MAX];
 
 typedef struct Record {
     bstring name;
-    Stats *stat;
+    // writers from any thread, fold it to read
+    AtomicStats *stat;
+    // for percentile, NULL when it has none
+    Sketch *sketch;
+    // the last few seconds for window and rate, or NULL
+    Window *window;
+    // with lazy rollups, bumped by every change at or below this one
+    uint64_t version;
+    // its own stats plus every child's rollup, good while rolled_at == version
+    uint64_t rolled_at;
+    Stats rollup;
+    // changed since the last checkpoint
+    int dirty;
+    // the namespace tree, so rollups never rebuild path strings
+    struct Record *parent;
+    struct Record *children;
+    struct Record *next;
+    struct Record *prev;
 } Record;
 
-struct tagbstring OK;
+typedef struct Connection {
+    int fd;
+    RingBuffer *recv_rb;
+    RingBuffer *send_rb;
+    // set while another shard or the disk has one of our commands
+    int waiting;
+    // the client went away, freed when the reply comes if it was
+    // waiting, otherwise by client_reap once the batch is done
+    int closed;
+    // the epoll set it's in, and whether it's out of it for now
+    int epoll_fd;
+    int paused;
+    // switched to FrameHeader/FrameReply framing
+    int binary;
+    // how far into an mget line the worker has gotten across shards
+    int cursor;
+    // the next chunk of a list or dumptree, which goes before anything else
+    bstring stream;
+    // send_rb is more than the socket would take, wait for EPOLLOUT
+    int blocked;
+    // bytes of recv_rb already searched for the end of the line
+    int scanned;
+    // recv_rb came from MirrorBuffer_create
+    int mirrored;
+    // its own request budget, and the one it shares with its address
+    TokenBucket bucket;
+    Source *source;
+    // a replica sent replicate, it only gets the log from then on
+    struct Feed *feed;
+    // came in on UNIX_PATH, where replicate is taken without REPLICATE_TCP
+    int local;
+} Connection;
+
+extern struct tagbstring OK;
+
+extern const int RB_SIZE;
+extern const int REPLY_RESERVE;
+extern const char LINE_ENDING;
+extern int ROLLUP_LAZY;
+extern int READ_ONLY;
+extern __thread Slab RECORDS[STATS_STRIPES_MAX + 1];
 
 int setup_data_store(const char *store_path);
 
-struct bstrList *parse_name(bstring name);
+Record *Record_create(bstring name);
+
+void Record_adopt(Record *parent, Record *child);
+
+// takes in the records one level under it that have no parent
+void Record_adopt_orphans(Record *info);
+
+// for one that didn't come through scan_paths, finds its parent too
+void Record_link(Record *info);
+
+void Record_unlink(Record *info);
+
+void Record_destroy(Record *info);
+
+void Record_touch(Record *info);
+
+void Record_fold(Record *info, Stats *out);
+
+void Record_sample(Record *info, double value);
+
+void Record_merge(Record *info, Stats *stats, Sketch *sketch);
+
+void Record_set(Record *info, Stats *stats, Sketch *sketch);
+
+Record *parent_record(Record *child, bstring path);
+
+CommandSpec *find_command(bstring name);
+
+int next_token(char **at, char *end, struct tagbstring *token);
+
+// how many names from at to end, split on every space like next_token
+int mget_names(char *at, char *end);
+
+int parse_command(char *data, int len, Command *cmd);
 
 int scan_paths(Command *cmd, RingBuffer *send_rb);
 
+void send_status(Command *cmd, RingBuffer *send_rb, ReplyStatus status);
+
+void send_number(Command *cmd, RingBuffer *send_rb, double value);
+
+void send_stats(Command *cmd, RingBuffer *send_rb, Stats *st);
+
+int run_command(Command *cmd, RingBuffer *send_rb);
+
+int parse_buffer(char *data, int len, RingBuffer *send_rb);
+
+int scan_frame(RingBuffer *input);
+
+// a name a text line could carry too, so a frame can't make one the log can't
+int is_frame_name(char *name, int len);
+
+int parse_frame(char *data, int len, Command *cmd, char *names);
+
+int parse_frame_buffer(char *data, int len, RingBuffer *send_rb);
+
 int parse_line(bstring data, RingBuffer *send_rb);
 
+int parse_stream(bstring data, RingBuffer *send_rb, bstring *after);
+
+int is_stream(char *data, int len);
+
+Connection *Connection_create(int fd);
+
+void Connection_destroy(Connection *conn);
+
+int client_flush(Connection *conn);
+
+int client_block(Connection *conn, int blocked);
+
+int client_unblock(Connection *conn);
+
+int client_stream_next(Connection *conn, bstring after);
+
+int client_stream(Connection *conn);
+
+int client_attach(Connection *conn, struct sockaddr *addr);
+
+int client_admit(Connection *conn);
+
+int is_binary_request(char *data, int len);
+
+int client_scan(Connection *conn, int *len);
+
+int client_run(Connection *conn, char *data, int len);
+
+int client_pipeline(Connection *conn);
+
+int client_pause(Connection *conn, int paused);
+
+int client_resume(Connection *conn);
+
+int client_recv(Connection *conn);
+
+void client_io_done(struct IoJob *job);
+
+// the peer's gone while it was paused, so it has to be closed now
+int client_hung_up(Connection *conn, uint32_t events);
+
+void client_close(Connection *conn);
+
+void client_reap();
+
+int client_read(Connection *conn);
+
+int accept_clients(int epoll_fd, int server_socket);
+
 int run_server(const char *host, const char *port, const char *store_path);
 
-bstring sanitize_location(bstring base, bstring path);
+int run_event_server(const char *host, const char *port, const char *store_path);
+
+int load_store_key(bstring base);
+
+bstring store_location(bstring base, bstring name);
+
+int store_open(bstring location, int flags);
 
-bstring encrypt_armor_name(bstring name);
+int io_finish(struct IoJob *job, RingBuffer *send_rb);
 
 #endif
@@ -0,0 +1,937 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <lcthw/dbg.h>
+#include "wal.h"
+#include "replica.h"
+
+// rewrite the whole snapshot once it's this much bigger than the live set
+#define SNAPSHOT_GROWTH 2
+#define SNAPSHOT_SLACK (1024 * 1024)
+#define WRITE_CHUNK (1024 * 1024)
+
+int WAL_FSYNC_MS = 1000;
+int WAL_BEAT_MS = 1000;
+long WAL_CHECKPOINT_BYTES = 64 * 1024 * 1024;
+__thread Wal *WAL = NULL;
+
+extern __thread RecordMap *DATA;
+
+static uint32_t CRC_TABLE[256];
+static pthread_once_t CRC_ONCE = PTHREAD_ONCE_INIT;
+
+typedef struct Replay {
+    RecordMap **shards;
+    int nshards;
+    wal_route_cb route;
+    // commands are parsed in place, so they get copied here first
+    bstring line;
+    RingBuffer *replies;
+} Replay;
+
+typedef struct Rewrite {
+    Wal *wal;
+    int fd;
+    bstring out;
+    long bytes;
+    int rc;
+} Rewrite;
+
+static void crc_init(void)
+{
+    uint32_t i = 0;
+    int k = 0;
+
+    for(i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for(k = 0; k < 8; k++) {
+            c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        CRC_TABLE[i] = c;
+    }
+}
+
+uint32_t wal_crc(const void *data, size_t len)
+{
+    const unsigned char *at = data;
+    uint32_t crc = 0xFFFFFFFFu;
+
+    pthread_once(&CRC_ONCE, crc_init);
+
+    while(len--) {
+        crc = CRC_TABLE[(crc ^ *at++) & 0xFF] ^ (crc >> 8);
+    }
+
+    return crc ^ 0xFFFFFFFFu;
+}
+
+static long ms_since(struct timespec *then)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - then->tv_sec) * 1000 + (now.tv_nsec - then->tv_nsec) / 1000000;
+}
+
+static bstring wal_path(bstring dir, const char *kind, int gen, int id)
+{
+    return bformat("%s/%s-%d-%d", bdata(dir), kind, gen, id);
+}
+
+static int write_all(int fd, char *data, long len)
+{
+    while(len > 0) {
+        ssize_t rc = write(fd, data, len);
+        if(rc == -1 && errno == EINTR) continue;
+        check(rc > 0, "Failed to write to fd %d.", fd);
+
+        data += rc;
+        len -= rc;
+    }
+
+    return 0;
+error:
+    return -1;
+}
+
+static int sync_dir(bstring dir)
+{
+    // a rename isn't durable until the directory is synced
+    int fd = open(bdata(dir), O_RDONLY);
+    check(fd >= 0, "Failed to open %s.", bdata(dir));
+
+    int rc = fsync(fd);
+    close(fd);
+    check(rc == 0, "Failed to sync %s.", bdata(dir));
+
+    return 0;
+error:
+    return -1;
+}
+
+static int entry_begin(bstring out, WalType type, uint64_t lsn)
+{
+    WalEntry entry = {.type = type, .lsn = lsn};
+    int start = blength(out);
+
+    int rc = bcatblk(out, &entry, sizeof(WalEntry));
+    return rc == BSTR_OK ? start : -1;
+}
+
+static void entry_end(bstring out, int start)
+{
+    // out isn't aligned for a WalEntry, so poke the fields in
+    char *entry = bdata(out) + start;
+    uint32_t len = blength(out) - start - sizeof(WalEntry);
+    uint32_t crc = 0;
+
+    memcpy(entry + offsetof(WalEntry, len), &len, sizeof(len));
+    crc = wal_crc(entry + sizeof(crc), sizeof(WalEntry) - sizeof(crc) + len);
+    memcpy(entry + offsetof(WalEntry, crc), &crc, sizeof(crc));
+}
+
+static int append_record(bstring out, uint64_t lsn, Record *info)
+{
+    Stats folded;
+    int start = entry_begin(out, info->sketch ? WAL_SKETCHED : WAL_RECORD, lsn);
+    check(start >= 0, "Failed to start a record entry.");
+
+    AtomicStats_fold(info->stat, &folded);
+    check(bcatblk(out, &folded, sizeof(Stats)) == BSTR_OK, "Failed to add the stats.");
+
+    if(info->sketch) {
+        check(bcatblk(out, info->sketch, sizeof(Sketch)) == BSTR_OK,
+                "Failed to add the sketch.");
+    }
+    check(bconcat(out, info->name) == BSTR_OK, "Failed to add the name.");
+    entry_end(out, start);
+
+    return 0;
+error:
+    return -1;
+}
+
+static int append_name(bstring out, WalType type, uint64_t lsn, bstring name)
+{
+    int start = entry_begin(out, type, lsn);
+    check(start >= 0, "Failed to start an entry.");
+
+    if(name) {
+        check(bconcat(out, name) == BSTR_OK, "Failed to add the name.");
+    }
+    entry_end(out, start);
+
+    return 0;
+error:
+    return -1;
+}
+
+int Wal_log_command(Wal *wal, Command *cmd)
+{
+    int rc = 0;
+    int start = 0;
+    char number[32];
+
+    if(wal == NULL) return 0;
+
+    start = entry_begin(wal->pending, WAL_COMMAND, ++wal->lsn);
+    check(start >= 0, "Failed to start a command entry.");
+
+    // the same line a text client would send, binary frames included,
+    // parse_frame already refused any name that wouldn't read back
+    rc |= bconcat(wal->pending, cmd->command);
+    rc |= bconchar(wal->pending, ' ');
+    rc |= bconcat(wal->pending, cmd->name);
+
+    if(cmd->spec->args == VARIADIC) {
+        rc |= bconchar(wal->pending, ' ');
+        rc |= bconcat(wal->pending, cmd->arg);
+    } else if(cmd->spec->args == 3) {
+        // %.17g reads back as the exact same double
+        snprintf(number, sizeof(number), " %.17g", cmd->value);
+        rc |= bcatcstr(wal->pending, number);
+    }
+
+    check(rc == BSTR_OK, "Failed to log %s.", bdata(cmd->command));
+    entry_end(wal->pending, start);
+
+    return 0;
+error:
+    return -1;
+}
+
+int Wal_log_record(Wal *wal, Record *info)
+{
+    if(wal == NULL) return 0;
+
+    // load reads a file that may be gone by replay, so log what it read
+    return append_record(wal->pending, ++wal->lsn, info);
+}
+
+void Wal_dirty(Wal *wal, Record *info)
+{
+    if(wal && !info->dirty) {
+        info->dirty = 1;
+        DArray_push(wal->dirty, Intern_retain(info->name));
+    }
+}
+
+void Wal_deleted(Wal *wal, bstring name)
+{
+    // it outlives the record until the next checkpoint
+    if(wal) {
+        DArray_push(wal->dirty, Intern_retain(name));
+    }
+}
+
+static int flush_pending(Wal *wal)
+{
+    int rc = 0;
+    int i = 0;
+
+    if(blength(wal->pending) == 0) return 0;
+
+    rc = write_all(wal->log_fd, bdata(wal->pending), blength(wal->pending));
+    check(rc == 0, "Failed to write the log for shard %d.", wal->id);
+
+    wal->log_bytes += blength(wal->pending);
+    wal->unsynced = 1;
+
+    // replicas get the batch once it's in the log, never before
+    for(i = 0; i < DArray_count(wal->feeds); i++) {
+        Feed_ship(DArray_get(wal->feeds, i), bdata(wal->pending), blength(wal->pending));
+    }
+
+    btrunc(wal->pending, 0);
+
+    return 0;
+error:
+    return -1;
+}
+
+static int ship_beat(Wal *wal);
+
+int Wal_commit(Wal *wal)
+{
+    int rc = 0;
+
+    if(wal == NULL) return 0;
+
+    // the whole batch goes out in one write
+    rc = flush_pending(wal);
+    check(rc == 0, "Failed to commit shard %d.", wal->id);
+
+    if(wal->unsynced && WAL_FSYNC_MS >= 0 && ms_since(&wal->synced) >= WAL_FSYNC_MS) {
+        rc = fdatasync(wal->log_fd);
+        check(rc == 0, "Failed to sync the log for shard %d.", wal->id);
+
+        wal->unsynced = 0;
+        clock_gettime(CLOCK_MONOTONIC, &wal->synced);
+    }
+
+    if(wal->log_bytes >= WAL_CHECKPOINT_BYTES) {
+        rc = Wal_checkpoint(wal, 0);
+        check(rc == 0, "Failed to checkpoint shard %d.", wal->id);
+    }
+
+    if(DArray_count(wal->feeds) > 0 && ms_since(&wal->beat) >= WAL_BEAT_MS) {
+        rc = ship_beat(wal);
+        check(rc == 0, "Failed to send a heartbeat for shard %d.", wal->id);
+    }
+
+    return 0;
+error:
+    return -1;
+}
+
+int Wal_timeout(Wal *wal)
+{
+    long left = -1;
+    long beat = 0;
+
+    if(wal == NULL) return -1;
+
+    // how long epoll_wait can sleep before an fsync is due
+    if(wal->unsynced && WAL_FSYNC_MS >= 0) {
+        left = WAL_FSYNC_MS - ms_since(&wal->synced);
+        if(left < 0) left = 0;
+    }
+
+    // or the replicas' next heartbeat
+    if(DArray_count(wal->feeds) > 0) {
+        beat = WAL_BEAT_MS - ms_since(&wal->beat);
+        if(beat < 0) beat = 0;
+        if(left < 0 || beat < left) left = beat;
+    }
+
+    return left;
+}
+
+int Wal_append_beat(Wal *wal, bstring out)
+{
+    struct timespec now;
+    WalBeat beat = {.shard = wal->id, .shards = wal->nshards};
+    int start = entry_begin(out, WAL_HEARTBEAT, wal->lsn);
+    check(start >= 0, "Failed to start a heartbeat.");
+
+    // wall clock, the replica compares it to its own
+    clock_gettime(CLOCK_REALTIME, &now);
+    beat.sent = now.tv_sec + now.tv_nsec / 1e9;
+
+    check(bcatblk(out, &beat, sizeof(WalBeat)) == BSTR_OK, "Failed to add the heartbeat.");
+    entry_end(out, start);
+
+    return 0;
+error:
+    return -1;
+}
+
+static int ship_beat(Wal *wal)
+{
+    int i = 0;
+    bstring out = bfromcstr("");
+    check_mem(out);
+
+    check(Wal_append_beat(wal, out) == 0, "Failed to make a heartbeat.");
+
+    for(i = 0; i < DArray_count(wal->feeds); i++) {
+        Feed_ship(DArray_get(wal->feeds, i), bdata(out), blength(out));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &wal->beat);
+
+    bdestroy(out);
+    return 0;
+error:
+    bdestroy(out);
+    return -1;
+}
+
+int Wal_subscribe(Wal *wal, Feed *feed)
+{
+    return DArray_push(wal->feeds, feed);
+}
+
+void Wal_unsubscribe(Wal *wal, Feed *feed)
+{
+    int i = 0;
+
+    for(i = 0; i < DArray_count(wal->feeds); i++) {
+        if(DArray_get(wal->feeds, i) == feed) {
+            // order doesn't matter, the last one fills the hole
+            DArray_set(wal->feeds, i, DArray_last(wal->feeds));
+            DArray_pop(wal->feeds);
+            return;
+        }
+    }
+}
+
+typedef struct Chunk {
+    bstring out;
+    uint64_t lsn;
+    bstring last;
+    int left;
+} Chunk;
+
+static int chunk_record(Record *info, void *context)
+{
+    Chunk *chunk = context;
+
+    check(append_record(chunk->out, chunk->lsn, info) == 0, "Failed to add %s.",
+            info->name->data);
+    chunk->last = info->name;
+
+    return --chunk->left == 0;
+error:
+    return -1;
+}
+
+int Wal_snapshot_chunk(Wal *wal, bstring out, bstring *after, int count)
+{
+    Chunk chunk = {.out = out, .lsn = wal->lsn, .last = *after, .left = count};
+
+    // backwards so a record is always sent after everything below it,
+    // a command that rolls a child into its parents then never lands
+    // on a parent that was sent without the child it read
+    int rc = NameIndex_walk_back(&wal->data->names, *after, 0, chunk_record, &chunk);
+    check(rc >= 0, "Failed to add a snapshot chunk for shard %d.", wal->id);
+
+    // held, so it outlives its record until the next chunk
+    if(chunk.last != *after) {
+        Intern_release(*after);
+        *after = Intern_retain(chunk.last);
+    }
+    if(rc == 1) return 0;
+
+    rc = append_name(out, WAL_CHECKPOINT, wal->lsn, NULL);
+    check(rc == 0, "Failed to end the snapshot for shard %d.", wal->id);
+
+    return 1;
+error:
+    return -1;
+}
+
+static int rewrite_flush(Rewrite *rw)
+{
+    int rc = write_all(rw->fd, bdata(rw->out), blength(rw->out));
+
+    rw->bytes += blength(rw->out);
+    btrunc(rw->out, 0);
+
+    return rc;
+}
+
+static int rewrite_record(Record *info, void *context)
+{
+    Rewrite *rw = context;
+
+    info->dirty = 0;
+    rw->rc = append_record(rw->out, rw->wal->lsn, info);
+
+    if(rw->rc == 0 && blength(rw->out) >= WRITE_CHUNK) {
+        rw->rc = rewrite_flush(rw);
+    }
+
+    return rw->rc;
+}
+
+static int rewrite_snapshot(Wal *wal, bstring out)
+{
+    int rc = 0;
+    bstring path = wal_path(wal->dir, "snapshot", wal->gen, wal->id);
+    bstring tmp = bformat("%s.tmp", bdata(path));
+    Rewrite rw = {.wal = wal, .out = out, .fd = -1};
+
+    rw.fd = open(bdata(tmp), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, S_IRUSR | S_IWUSR);
+    check(rw.fd >= 0, "Failed to open %s.", bdata(tmp));
+
+    // every record, so nothing older needs reading back
+    rc = RecordMap_traverse(wal->data, rewrite_record, &rw);
+    check(rc == 0, "Failed to write the records to %s.", bdata(tmp));
+
+    rc = append_name(out, WAL_CHECKPOINT, wal->lsn, NULL);
+    check(rc == 0, "Failed to add the checkpoint.");
+    rc = rewrite_flush(&rw);
+    check(rc == 0, "Failed to write %s.", bdata(tmp));
+
+    rc = fdatasync(rw.fd);
+    check(rc == 0, "Failed to sync %s.", bdata(tmp));
+
+    // the old snapshot stays whole until the new one replaces it
+    rc = rename(bdata(tmp), bdata(path));
+    check(rc == 0, "Failed to rename %s.", bdata(tmp));
+    rc = sync_dir(wal->dir);
+    check(rc == 0, "Failed to sync the store directory.");
+
+    if(wal->snapshot_fd >= 0) close(wal->snapshot_fd);
+    wal->snapshot_fd = rw.fd;
+    wal->snapshot_bytes = wal->full_bytes = rw.bytes;
+
+    bdestroy(path);
+    bdestroy(tmp);
+    return 0;
+error:
+    if(rw.fd >= 0) close(rw.fd);
+    bdestroy(path);
+    bdestroy(tmp);
+    return -1;
+}
+
+static void release_dirty(Wal *wal)
+{
+    int i = 0;
+
+    for(i = 0; i < DArray_count(wal->dirty); i++) {
+        Intern_release(DArray_get(wal->dirty, i));
+    }
+    wal->dirty->end = 0;
+}
+
+static int append_dirty(Wal *wal, bstring out)
+{
+    int rc = 0;
+    int i = 0;
+    long bytes = 0;
+
+    for(i = 0; i < DArray_count(wal->dirty); i++) {
+        bstring name = DArray_get(wal->dirty, i);
+        Record *info = RecordMap_get(wal->data, name);
+
+        if(info == NULL) {
+            rc = append_name(out, WAL_TOMBSTONE, wal->lsn, name);
+        } else if(info->dirty) {
+            // a name that was deleted and made again shows up twice
+            info->dirty = 0;
+            rc = append_record(out, wal->lsn, info);
+        }
+        check(rc == 0, "Failed to add %s to the snapshot.", bdata(name));
+
+        if(blength(out) >= WRITE_CHUNK) {
+            rc = write_all(wal->snapshot_fd, bdata(out), blength(out));
+            check(rc == 0, "Failed to append to the snapshot.");
+            bytes += blength(out);
+            btrunc(out, 0);
+        }
+    }
+
+    // without this last entry recovery ignores everything above
+    rc = append_name(out, WAL_CHECKPOINT, wal->lsn, NULL);
+    check(rc == 0, "Failed to add the checkpoint.");
+
+    rc = write_all(wal->snapshot_fd, bdata(out), blength(out));
+    check(rc == 0, "Failed to append to the snapshot.");
+    bytes += blength(out);
+
+    rc = fdatasync(wal->snapshot_fd);
+    check(rc == 0, "Failed to sync the snapshot.");
+
+    wal->snapshot_bytes += bytes;
+    return 0;
+error:
+    return -1;
+}
+
+int Wal_checkpoint(Wal *wal, int full)
+{
+    int rc = 0;
+    bstring out = bfromcstr("");
+    check_mem(out);
+
+    // the log has to hold everything up to lsn before we truncate it
+    rc = flush_pending(wal);
+    check(rc == 0, "Failed to flush shard %d.", wal->id);
+
+    if(full || wal->snapshot_bytes > SNAPSHOT_GROWTH * wal->full_bytes + SNAPSHOT_SLACK) {
+        rc = rewrite_snapshot(wal, out);
+    } else {
+        rc = append_dirty(wal, out);
+    }
+    check(rc == 0, "Failed to write the snapshot for shard %d.", wal->id);
+
+    // a crash before this just replays entries the snapshot skips
+    rc = ftruncate(wal->log_fd, 0);
+    check(rc == 0, "Failed to truncate the log for shard %d.", wal->id);
+
+    release_dirty(wal);
+
+    // the snapshot was synced, so the log has nothing left to sync
+    wal->log_bytes = 0;
+    wal->unsynced = 0;
+    clock_gettime(CLOCK_MONOTONIC, &wal->synced);
+
+    bdestroy(out);
+    return 0;
+error:
+    bdestroy(out);
+    return -1;
+}
+
+static Wal *Wal_create(bstring dir, int gen, int id, RecordMap *data)
+{
+    int rc = 0;
+    bstring path = NULL;
+    Wal *wal = calloc(1, sizeof(Wal));
+    check_mem(wal);
+
+    wal->id = id;
+    wal->gen = gen;
+    wal->data = data;
+    wal->log_fd = wal->snapshot_fd = -1;
+    wal->dir = bstrcpy(dir);
+    wal->pending = bfromcstr("");
+    wal->dirty = DArray_create(sizeof(bstring), 128);
+    wal->feeds = DArray_create(sizeof(Feed *), 4);
+    check(wal->dir && wal->pending && wal->dirty && wal->feeds, "Out of memory.");
+    clock_gettime(CLOCK_MONOTONIC, &wal->synced);
+    wal->beat = wal->synced;
+
+    path = wal_path(dir, "wal", gen, id);
+    wal->log_fd = open(bdata(path), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, S_IRUSR | S_IWUSR);
+    check(wal->log_fd >= 0, "Failed to open %s.", bdata(path));
+
+    // the new generation starts from whatever recovery loaded
+    rc = Wal_checkpoint(wal, 1);
+    check(rc == 0, "Failed to write the first snapshot for shard %d.", id);
+
+    bdestroy(path);
+    return wal;
+error:
+    bdestroy(path);
+    Wal_destroy(wal);
+    return NULL;
+}
+
+void Wal_destroy(Wal *wal)
+{
+    // pending entries are dropped, commit first to keep them
+    if(wal) {
+        if(wal->log_fd >= 0) close(wal->log_fd);
+        if(wal->snapshot_fd >= 0) close(wal->snapshot_fd);
+        if(wal->dirty) {
+            release_dirty(wal);
+            DArray_destroy(wal->dirty);
+        }
+        // the feeds belong to their connections
+        if(wal->feeds) {
+            DArray_destroy(wal->feeds);
+        }
+        bdestroy(wal->pending);
+        bdestroy(wal->dir);
+        free(wal);
+    }
+}
+
+static char *map_file(bstring path, size_t *size)
+{
+    struct stat st;
+    char *data = NULL;
+    int fd = open(bdata(path), O_RDONLY);
+
+    *size = 0;
+    // a shard that never got a snapshot or log is just empty
+    if(fd < 0 && errno == ENOENT) return NULL;
+    check(fd >= 0, "Failed to open %s.", bdata(path));
+
+    check(fstat(fd, &st) == 0, "Failed to stat %s.", bdata(path));
+    if(st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        check(data != MAP_FAILED, "Failed to map %s.", bdata(path));
+        *size = st.st_size;
+    }
+
+    close(fd);
+    return data;
+error:
+    if(fd >= 0) close(fd);
+    return NULL;
+}
+
+int Wal_next_entry(char *data, size_t size, size_t *at, WalEntry *entry, char **payload)
+{
+    // 0 at the end, or at the first entry that was only partly written
+    if(size - *at < sizeof(WalEntry)) return 0;
+    memcpy(entry, data + *at, sizeof(WalEntry));
+
+    if(entry->len > size - *at - sizeof(WalEntry)) return 0;
+    if(wal_crc(data + *at + sizeof(entry->crc),
+                sizeof(WalEntry) - sizeof(entry->crc) + entry->len) != entry->crc) {
+        return 0;
+    }
+
+    *payload = data + *at + sizeof(WalEntry);
+    *at += sizeof(WalEntry) + entry->len;
+    return 1;
+}
+
+static void route_to(Replay *replay, char *name, int len)
+{
+    int shard = replay->route ? replay->route(name, name + len, replay->nshards) : 0;
+    DATA = replay->shards[shard];
+}
+
+Replay *Replay_create(RecordMap **shards, int nshards, wal_route_cb route)
+{
+    Replay *replay = calloc(1, sizeof(Replay));
+    check_mem(replay);
+
+    replay->shards = shards;
+    replay->nshards = nshards;
+    replay->route = route;
+    replay->line = bfromcstr("");
+    replay->replies = RingBuffer_create(RB_SIZE);
+    check(replay->line && replay->replies, "Out of memory.");
+
+    return replay;
+error:
+    Replay_destroy(replay);
+    return NULL;
+}
+
+void Replay_destroy(Replay *replay)
+{
+    if(replay) {
+        bdestroy(replay->line);
+        if(replay->replies) RingBuffer_destroy(replay->replies);
+        free(replay);
+    }
+}
+
+int Replay_apply(Replay *replay, WalEntry *entry, char *payload)
+{
+    int rc = 0;
+    Command cmd = {.command = NULL};
+    Record *info = NULL;
+    struct tagbstring name;
+    Stats stats;
+    Sketch sketch;
+    size_t fixed = sizeof(Stats);
+
+    switch(entry->type) {
+        case WAL_COMMAND:
+            bassignblk(replay->line, payload, entry->len);
+            rc = parse_command(bdata(replay->line), blength(replay->line), &cmd);
+            check(rc == 0, "Bad command in the log: %s", bdata(replay->line));
+
+            route_to(replay, bdata(cmd.name), blength(cmd.name));
+            rc = run_command(&cmd, replay->replies);
+            replay->replies->start = replay->replies->end = 0;
+            check(rc == 0, "Failed to replay a command.");
+            break;
+
+        case WAL_SKETCHED:
+            fixed += sizeof(Sketch);
+            // fallthrough
+        case WAL_RECORD:
+            check(entry->len > fixed, "Short record in the log.");
+            memcpy(&stats, payload, sizeof(Stats));
+            memcpy(&sketch, payload + sizeof(Stats), fixed - sizeof(Stats));
+            blk2tbstr(name, payload + fixed, entry->len - fixed);
+            route_to(replay, bdata(&name), blength(&name));
+
+            info = RecordMap_get(DATA, &name);
+            if(info == NULL) {
+                info = Record_create(&name);
+                check_mem(info);
+                rc = RecordMap_set(DATA, info);
+                check(rc == 0, "Failed to add %s.", bdata(info->name));
+                // in whatever order they come, each finds the ones already here
+                Record_link(info);
+            }
+            Record_set(info, &stats, entry->type == WAL_SKETCHED ? &sketch : NULL);
+            break;
+
+        case WAL_TOMBSTONE:
+            blk2tbstr(name, payload, entry->len);
+            route_to(replay, bdata(&name), blength(&name));
+
+            info = RecordMap_delete(DATA, &name);
+            Record_destroy(info);
+            break;
+
+        case WAL_CHECKPOINT:
+        case WAL_HEARTBEAT:
+            break;
+
+        default:
+            sentinel("Unknown log entry type: %d", entry->type);
+    }
+
+    return 0;
+error:
+    return -1;
+}
+
+static int replay_shard(Replay *replay, bstring dir, int gen, int id)
+{
+    size_t size = 0;
+    size_t at = 0;
+    size_t valid = 0;
+    uint64_t covered = 0;
+    WalEntry entry;
+    char *payload = NULL;
+    bstring path = wal_path(dir, "snapshot", gen, id);
+    char *data = map_file(path, &size);
+
+    // a checkpoint that was cut off partway through never happened
+    while(Wal_next_entry(data, size, &at, &entry, &payload)) {
+        if(entry.type == WAL_CHECKPOINT) {
+            valid = at;
+            covered = entry.lsn;
+        }
+    }
+
+    for(at = 0; at < valid && Wal_next_entry(data, size, &at, &entry, &payload);) {
+        if(Replay_apply(replay, &entry, payload) != 0) {
+            log_warn("Skipped a bad entry in %s.", bdata(path));
+        }
+    }
+
+    if(data) munmap(data, size);
+    bdestroy(path);
+
+    path = wal_path(dir, "wal", gen, id);
+    data = map_file(path, &size);
+
+    for(at = 0; Wal_next_entry(data, size, &at, &entry, &payload);) {
+        if(entry.lsn > covered && Replay_apply(replay, &entry, payload) != 0) {
+            log_warn("Skipped a bad entry in %s.", bdata(path));
+        }
+    }
+
+    if(at < size) {
+        log_warn("Dropped %zu bytes torn off the end of %s.", size - at, bdata(path));
+    }
+
+    if(data) munmap(data, size);
+    bdestroy(path);
+    return 0;
+}
+
+static int read_current(bstring dir, int *gen, int *nshards)
+{
+    bstring path = bformat("%s/CURRENT", bdata(dir));
+    FILE *current = fopen(bdata(path), "r");
+
+    *gen = *nshards = 0;
+
+    if(current == NULL) {
+        // a brand new store
+        check(errno == ENOENT, "Failed to open %s.", bdata(path));
+    } else {
+        int rc = fscanf(current, "%d %d", gen, nshards);
+        fclose(current);
+        check(rc == 2, "Corrupt %s.", bdata(path));
+    }
+
+    bdestroy(path);
+    return 0;
+error:
+    bdestroy(path);
+    return -1;
+}
+
+static int write_current(bstring dir, int gen, int nshards)
+{
+    int rc = 0;
+    bstring path = bformat("%s/CURRENT", bdata(dir));
+    bstring tmp = bformat("%s/CURRENT.tmp", bdata(dir));
+    bstring line = bformat("%d %d\n", gen, nshards);
+    int fd = open(bdata(tmp), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    check(fd >= 0, "Failed to open %s.", bdata(tmp));
+
+    rc = write_all(fd, bdata(line), blength(line));
+    check(rc == 0, "Failed to write %s.", bdata(tmp));
+    rc = fdatasync(fd);
+    check(rc == 0, "Failed to sync %s.", bdata(tmp));
+
+    // the switch to the new generation is this one rename
+    rc = rename(bdata(tmp), bdata(path));
+    check(rc == 0, "Failed to rename %s.", bdata(tmp));
+    rc = sync_dir(dir);
+    check(rc == 0, "Failed to sync the store directory.");
+
+    close(fd);
+    bdestroy(path);
+    bdestroy(tmp);
+    bdestroy(line);
+    return 0;
+error:
+    if(fd >= 0) close(fd);
+    bdestroy(path);
+    bdestroy(tmp);
+    bdestroy(line);
+    return -1;
+}
+
+int Wal_recover(const char *dir, RecordMap **shards, Wal **wals,
+        int nshards, wal_route_cb route)
+{
+    int rc = 0;
+    int id = 0;
+    int gen = 0;
+    int old = 0;
+    bstring base = bfromcstr(dir);
+    RecordMap *data = DATA;
+    Wal *wal = WAL;
+    Replay replay = {.shards = shards, .nshards = nshards, .route = route};
+
+    replay.line = bfromcstr("");
+    replay.replies = RingBuffer_create(RB_SIZE);
+    check(base && replay.line && replay.replies, "Out of memory.");
+
+    // replaying has to change the data without logging it again,
+    // or counting it as happening right now
+    WAL = NULL;
+    WINDOW_REPLAY = 1;
+
+    rc = read_current(base, &gen, &old);
+    check(rc == 0, "Failed to find the current generation in %s.", dir);
+
+    // the old shard count doesn't matter, every name gets routed again
+    for(id = 0; id < old; id++) {
+        rc = replay_shard(&replay, base, gen, id);
+        check(rc == 0, "Failed to recover shard %d.", id);
+    }
+
+    // put these back first, wals can be &WAL
+    DATA = data;
+    WAL = wal;
+    WINDOW_REPLAY = 0;
+
+    for(id = 0; id < nshards; id++) {
+        wals[id] = Wal_create(base, gen + 1, id, shards[id]);
+        check(wals[id] != NULL, "Failed to start the log for shard %d.", id);
+        wals[id]->nshards = nshards;
+    }
+
+    rc = write_current(base, gen + 1, nshards);
+    check(rc == 0, "Failed to switch to generation %d.", gen + 1);
+
+    for(id = 0; id < old; id++) {
+        bstring path = wal_path(base, "snapshot", gen, id);
+        unlink(bdata(path));
+        bdestroy(path);
+
+        path = wal_path(base, "wal", gen, id);
+        unlink(bdata(path));
+        bdestroy(path);
+    }
+
+    bdestroy(base);
+    bdestroy(replay.line);
+    RingBuffer_destroy(replay.replies);
+    return 0;
+error:
+    DATA = data;
+    WAL = wal;
+    WINDOW_REPLAY = 0;
+    bdestroy(base);
+    bdestroy(replay.line);
+    if(replay.replies) RingBuffer_destroy(replay.replies);
+    return -1;
+}
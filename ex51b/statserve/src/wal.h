@@ -0,0 +1,126 @@
+#ifndef _wal_h
+#define _wal_h
+
+#include <stdint.h>
+#include <time.h>
+#include <lcthw/bstrlib.h>
+#include <lcthw/darray.h>
+#include "statserve.h"
+
+/*
+ * Durability for one shard. Every mutating command is appended to
+ * wal-GEN-ID as the text line it would be sent as, buffered until the
+ * replies for a batch go out so the whole batch is one write(). The
+ * fsync happens every WAL_FSYNC_MS (0 for every batch, -1 never).
+ *
+ * Once the log passes WAL_CHECKPOINT_BYTES, just the records changed
+ * since the last checkpoint get appended to snapshot-GEN-ID, followed
+ * by a checkpoint entry holding the last lsn they cover, and the log is
+ * truncated. Recovery loads the snapshot up to its last checkpoint
+ * entry and replays the log entries after it, then starts a new
+ * generation and points the CURRENT file at it.
+ */
+typedef enum WalType {
+    // WAL_SKETCHED is a WAL_RECORD with the record's Sketch after its Stats
+    // WAL_HEARTBEAT only goes to replicas, it holds a WalBeat
+    WAL_COMMAND = 1, WAL_RECORD, WAL_TOMBSTONE, WAL_CHECKPOINT, WAL_SKETCHED,
+    WAL_HEARTBEAT
+} WalType;
+
+typedef struct WalEntry {
+    // over everything after it, a torn tail won't match
+    uint32_t crc;
+    // bytes after the header
+    uint32_t len;
+    uint64_t lsn;
+    uint8_t type;
+    uint8_t reserved[7];
+} WalEntry;
+
+typedef struct WalBeat {
+    // CLOCK_REALTIME seconds on the primary when it went out
+    double sent;
+    uint32_t shard;
+    uint32_t shards;
+} WalBeat;
+
+struct Feed;
+struct Replay;
+
+typedef struct Wal {
+    int id;
+    int gen;
+    int log_fd;
+    int snapshot_fd;
+    bstring dir;
+    // the shard this logs for
+    RecordMap *data;
+    // entries waiting for the next commit
+    bstring pending;
+    uint64_t lsn;
+    long log_bytes;
+    long snapshot_bytes;
+    // how big the snapshot was right after it was last rewritten
+    long full_bytes;
+    int unsynced;
+    struct timespec synced;
+    // names changed since the last checkpoint
+    DArray *dirty;
+    // replicas getting every commit, and when they last got a heartbeat
+    DArray *feeds;
+    struct timespec beat;
+    // the worker count, for the heartbeats
+    int nshards;
+} Wal;
+
+// picks the shard for a name, shard_for_name in worker mode
+typedef int (*wal_route_cb)(char *start, char *end, int nshards);
+
+extern int WAL_FSYNC_MS;
+extern int WAL_BEAT_MS;
+extern long WAL_CHECKPOINT_BYTES;
+extern __thread Wal *WAL;
+
+uint32_t wal_crc(const void *data, size_t len);
+
+int Wal_recover(const char *dir, RecordMap **shards, Wal **wals,
+        int nshards, wal_route_cb route);
+
+void Wal_destroy(Wal *wal);
+
+int Wal_log_command(Wal *wal, Command *cmd);
+
+int Wal_log_record(Wal *wal, Record *info);
+
+void Wal_dirty(Wal *wal, Record *info);
+
+// name has to be the interned one, the record's own name
+void Wal_deleted(Wal *wal, bstring name);
+
+int Wal_commit(Wal *wal);
+
+int Wal_timeout(Wal *wal);
+
+int Wal_checkpoint(Wal *wal, int full);
+
+int Wal_subscribe(Wal *wal, struct Feed *feed);
+
+void Wal_unsubscribe(Wal *wal, struct Feed *feed);
+
+int Wal_append_beat(Wal *wal, bstring out);
+
+// the records before *after in reverse name order, count at a time,
+// then a checkpoint and 1 once there are none left
+int Wal_snapshot_chunk(Wal *wal, bstring out, bstring *after, int count);
+
+// 1 and the next whole entry, 0 if it isn't all there or is corrupt
+int Wal_next_entry(char *data, size_t size, size_t *at, WalEntry *entry, char **payload);
+
+struct Replay *Replay_create(RecordMap **shards, int nshards, wal_route_cb route);
+
+void Replay_destroy(struct Replay *replay);
+
+// leaves DATA on the shard the entry went to
+int Replay_apply(struct Replay *replay, WalEntry *entry, char *payload);
+
+#endif
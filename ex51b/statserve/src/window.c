@@ -0,0 +1,104 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <lcthw/dbg.h>
+#include "window.h"
+#include "atomicstats.h"
+
+int WINDOW_SECONDS = 60;
+__thread int WINDOW_REPLAY = 0;
+
+static WindowBucket *bucket_for(Window *w, long now)
+{
+    WindowBucket *bucket = &w->bucket[now % w->seconds];
+
+    // last time around, or longer, start it over
+    if(bucket->second != now) {
+        memset(&bucket->stats, 0, sizeof(Stats));
+        bucket->second = now;
+    }
+
+    return bucket;
+}
+
+long Window_now()
+{
+    struct timespec now;
+
+    // the coarse clock is a few ns, it's called on every sample
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return now.tv_sec;
+}
+
+Window *Window_create(int seconds, long now)
+{
+    Window *w = NULL;
+    int i = 0;
+
+    check(seconds > 0, "Bad window size: %d", seconds);
+
+    w = calloc(1, sizeof(Window) + seconds * sizeof(WindowBucket));
+    check_mem(w);
+
+    w->seconds = seconds;
+    w->born = now;
+
+    // no second has these yet, so nothing reads as current
+    for(i = 0; i < seconds; i++) {
+        w->bucket[i].second = -1;
+    }
+
+    return w;
+error:
+    return NULL;
+}
+
+void Window_destroy(Window *w)
+{
+    if(w) free(w);
+}
+
+void Window_sample(Window *w, long now, double value)
+{
+    if(WINDOW_REPLAY) return;
+
+    Stats_sample(&bucket_for(w, now)->stats, value);
+}
+
+void Window_merge(Window *w, long now, Stats *from)
+{
+    if(WINDOW_REPLAY) return;
+
+    stats_merge(&bucket_for(w, now)->stats, from);
+}
+
+void Window_fold(Window *w, long now, int seconds, Stats *out)
+{
+    long second = 0;
+
+    memset(out, 0, sizeof(Stats));
+    if(seconds > w->seconds) seconds = w->seconds;
+    if(seconds > now + 1) seconds = now + 1;
+
+    // a bucket holding some other second is left from before, skip it
+    for(second = now - seconds + 1; second <= now; second++) {
+        WindowBucket *bucket = &w->bucket[second % w->seconds];
+
+        if(bucket->second == second) {
+            stats_merge(out, &bucket->stats);
+        }
+    }
+}
+
+double Window_rate(Window *w, long now)
+{
+    Stats folded;
+    long span = now - w->born + 1;
+
+    // samples a second over the whole window, or as long as it's been up
+    if(span > w->seconds) span = w->seconds;
+    if(span < 1) span = 1;
+
+    Window_fold(w, now, w->seconds, &folded);
+    return (double)folded.n / span;
+}
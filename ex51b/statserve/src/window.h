@@ -0,0 +1,48 @@
+#ifndef _window_h
+#define _window_h
+
+#include <lcthw/stats.h>
+
+/*
+ * The last few seconds of a record, as a ring with one Stats per
+ * second. A sample goes in bucket now % seconds, and a bucket still
+ * holding an older second gets emptied right then, so expiry is one
+ * reset per second that had samples and nothing ever rescans them.
+ * Reads fold at most seconds buckets, skipping any too old to count.
+ *
+ * Only live samples go in. Loaded, recovered and replayed stats are
+ * from some other time, so a window starts empty on every restart.
+ */
+typedef struct WindowBucket {
+    // the second this holds, stale once the ring comes around again
+    long second;
+    Stats stats;
+} WindowBucket;
+
+typedef struct Window {
+    int seconds;
+    // when it was made, rate doesn't count seconds from before that
+    long born;
+    WindowBucket bucket[];
+} Window;
+
+// how many seconds new records keep, 0 and they keep no window
+extern int WINDOW_SECONDS;
+// set while the log replays, those samples aren't from now
+extern __thread int WINDOW_REPLAY;
+
+long Window_now();
+
+Window *Window_create(int seconds, long now);
+
+void Window_destroy(Window *w);
+
+void Window_sample(Window *w, long now, double value);
+
+void Window_merge(Window *w, long now, Stats *from);
+
+void Window_fold(Window *w, long now, int seconds, Stats *out);
+
+double Window_rate(Window *w, long now);
+
+#endif
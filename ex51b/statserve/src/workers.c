@@ -0,0 +1,681 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <endian.h>
+#include <lcthw/dbg.h>
+#include "net.h"
+#include "workers.h"
+#include "replica.h"
+#include "metrics.h"
+
+#define MAX_EVENTS 1024
+
+extern __thread RecordMap *DATA;
+extern bstring STORE_PATH;
+
+Worker *WORKERS = NULL;
+int NUM_WORKERS = 0;
+// the worker running on this thread, for I/O completions
+static __thread Worker *SELF = NULL;
+
+struct tagbstring LOAD_PREFIX = bsStatic("load ");
+struct tagbstring MGET_PREFIX = bsStatic("mget ");
+
+uint32_t shard_hash(const char *key, size_t len)
+{
+    // FNV-1a, just needs to spread names over the shards
+    uint32_t hash = 2166136261u;
+    size_t i = 0;
+
+    for(i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+int shard_for_name(char *start, char *end, int nshards)
+{
+    // only the top component is hashed so scan_paths never leaves
+    // the shard, /logins/zed rolls up into /logins on the same worker
+    char *stop = start < end && *start == '/' ? start + 1 : start;
+    while(stop < end && *stop != '/' && *stop != ' ') stop++;
+
+    return shard_hash(start, stop - start) % nshards;
+}
+
+int shard_for_line(bstring line, int nshards)
+{
+    char *start = bdata(line);
+    char *end = start + blength(line);
+    // load FROM TO creates TO, everything else works on the first name
+    int skip = bisstemeqblk(line, bdata(&LOAD_PREFIX), blength(&LOAD_PREFIX)) ? 2 : 1;
+
+    for(; skip > 0; skip--) {
+        start = memchr(start, ' ', end - start);
+        if(start == NULL) return 0;
+        start++;
+    }
+
+    return shard_for_name(start, end, nshards);
+}
+
+int shard_for_frame(char *data, int len, int nshards)
+{
+    FrameHeader header;
+    if(len < (int)sizeof(FrameHeader)) return 0;
+
+    memcpy(&header, data, sizeof(FrameHeader));
+    char *start = data + sizeof(FrameHeader);
+    char *end = start + le16toh(header.name_len);
+
+    // same as text, load routes on its TO name
+    if(header.opcode == OP_LOAD) {
+        start = end;
+        end = start + le16toh(header.arg_len);
+    }
+
+    if(end > data + len) return 0;
+    return shard_for_name(start, end, nshards);
+}
+
+Worker *worker_for(Worker *worker, Connection *conn, char *data, int len)
+{
+    struct tagbstring line;
+
+    if(conn->binary) {
+        return &WORKERS[shard_for_frame(data, len, NUM_WORKERS)];
+    } else if(is_binary_request(data, len)) {
+        // switching framing is about this connection, not a shard
+        return worker;
+    } else {
+        blk2tbstr(line, data, len);
+        return &WORKERS[shard_for_line(&line, NUM_WORKERS)];
+    }
+}
+
+int worker_send(Worker *to, Message *msg)
+{
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&to->lock);
+    Queue_send(to->inbox, msg);
+    pthread_mutex_unlock(&to->lock);
+
+    // wake up the other worker's epoll_wait
+    int rc = write(to->event_fd, &one, sizeof(one));
+    check(rc == sizeof(one), "Failed to wake worker %d.", to->id);
+
+    return 0;
+error:
+    return -1;
+}
+
+int worker_request(Worker *worker, Worker *owner, Connection *conn, bstring data)
+{
+    Message *msg = calloc(1, sizeof(Message));
+    check_mem(msg);
+
+    msg->type = MSG_REQUEST;
+    msg->from = worker;
+    msg->conn = conn;
+    msg->binary = conn->binary;
+    msg->data = data;
+
+    conn->waiting = 1;
+    return worker_send(owner, msg);
+error:
+    bdestroy(data);
+    return -1;
+}
+
+int is_mget(char *data, int len)
+{
+    return len > blength(&MGET_PREFIX)
+        && memcmp(data, bdata(&MGET_PREFIX), blength(&MGET_PREFIX)) == 0;
+}
+
+int is_stream_of_all(char *data, int len)
+{
+    // the name is just /, with or without a name to start after
+    char *end = data + len;
+    char *name = memchr(data, ' ', len);
+
+    return name != NULL && end - name >= 2 && name[1] == '/'
+        && (end - name == 2 || name[2] == ' ');
+}
+
+int worker_mget(Worker *worker, Connection *conn, char *data, int len)
+{
+    // 1 once every name is answered, 0 while a shard has one of them
+    int rc = 0;
+    char *end = data + len;
+    char *at = data + (conn->cursor ? conn->cursor : blength(&MGET_PREFIX));
+    Command text = {.binary = 0};
+
+    // checked before any name goes out, so it's all or nothing
+    if(conn->cursor == 0 && mget_names(at, end) > MGET_MAX) {
+        send_status(&text, conn->send_rb, REPLY_ERR);
+        return 1;
+    }
+
+    // names can live on any shard, so each one goes out on its own
+    // as "mget NAME" and the line stays in recv_rb until they're done
+    while(at < end) {
+        char *space = memchr(at, ' ', end - at);
+        char *stop = space ? space : end;
+        Worker *owner = &WORKERS[shard_for_name(at, stop, NUM_WORKERS)];
+        bstring one = bformat("mget %.*s", (int)(stop - at), at);
+        check_mem(one);
+
+        conn->cursor = stop + 1 - data;
+
+        if(owner == worker) {
+            rc = parse_line(one, conn->send_rb);
+            bdestroy(one);
+            check(rc == 0, "Failed to run mget locally.");
+        } else {
+            rc = worker_request(worker, owner, conn, one);
+            check(rc == 0, "Failed to send mget to worker %d.", owner->id);
+            return 0;
+        }
+
+        at = stop + 1;
+    }
+
+    conn->cursor = 0;
+    return 1;
+error:
+    conn->cursor = 0;
+    return -1;
+}
+
+int worker_stream(Worker *worker, Connection *conn)
+{
+    int rc = 0;
+    Worker *owner = &WORKERS[shard_for_line(conn->stream, NUM_WORKERS)];
+    bstring copy = NULL;
+
+    if(owner == worker) return client_stream(conn);
+
+    // a chunk can fill all of scratch, so it needs an empty send_rb
+    // to land in
+    if(RingBuffer_available_data(conn->send_rb)) {
+        rc = client_flush(conn);
+        check(rc == 0, "Failed to flush ahead of a stream chunk.");
+        if(conn->blocked) return 0;
+    }
+
+    copy = bstrcpy(conn->stream);
+    check_mem(copy);
+
+    return worker_request(worker, owner, conn, copy);
+error:
+    return -1;
+}
+
+int worker_replicate(Worker *worker, Connection *conn, int shard)
+{
+    int rc = 0;
+    Command text = {.binary = 0};
+    Message *msg = NULL;
+
+    if(shard >= NUM_WORKERS || !Feed_allowed(conn)) {
+        send_status(&text, conn->send_rb, REPLY_ERR);
+        return 0;
+    }
+
+    rc = client_flush(conn);
+    check(rc == 0, "Failed to flush ahead of replicate.");
+
+    if(&WORKERS[shard] == worker) return Feed_start(conn, worker->wal);
+
+    // the feed has to be on the thread that commits the shard, so the
+    // connection moves there and this worker lets go of it for good
+    check(RingBuffer_available_data(conn->send_rb) == 0,
+            "Replies still going out ahead of replicate on fd %d.", conn->fd);
+    rc = epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    check(rc == 0, "Failed to take fd %d out of epoll.", conn->fd);
+
+    // sources are per worker, this one's count goes back now
+    if(conn->source) Source_release(conn->source, admit_now());
+    conn->source = NULL;
+
+    msg = calloc(1, sizeof(Message));
+    check_mem(msg);
+    msg->type = MSG_ADOPT;
+    msg->from = worker;
+    msg->conn = conn;
+
+    // it's in the inbox even if the wakeup failed, so it's theirs now
+    if(worker_send(&WORKERS[shard], msg) != 0) {
+        log_err("Failed to wake worker %d for a replica.", shard);
+    }
+
+    return 1;
+error:
+    return -1;
+}
+
+void worker_adopt(Worker *worker, Message *msg)
+{
+    Connection *conn = msg->conn;
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = conn};
+
+    free(msg);
+    conn->epoll_fd = worker->epoll_fd;
+    conn->paused = 0;
+
+    if(epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) != 0
+            || Feed_start(conn, worker->wal) != 0) {
+        log_err("Failed to start a replica on worker %d.", worker->id);
+        client_close(conn);
+    }
+}
+
+int worker_process(Worker *worker, Connection *conn);
+
+void worker_io_done(IoJob *job)
+{
+    Connection *conn = job->owner;
+
+    if(conn->closed) {
+        Connection_destroy(conn);
+    } else if(client_resume(conn) != 0
+            || io_finish(job, conn->send_rb) != 0
+            || worker_process(SELF, conn) != 0) {
+        client_close(conn);
+    }
+}
+
+int worker_process(Worker *worker, Connection *conn)
+{
+    int rc = 0;
+    int len = 0;
+    int used = 0;
+    Command text = {.binary = 0};
+    int shard = 0;
+
+    // stop at the first remote command so replies stay in order, and
+    // at a full socket so a stream goes no faster than the client reads
+    while(!conn->waiting && !conn->blocked && !conn->feed) {
+        if(conn->stream) {
+            // a chunk at a time, the rest waits behind it
+            rc = worker_stream(worker, conn);
+            check(rc == 0, "Failed to stream a reply. Closing.");
+        } else if((used = client_scan(conn, &len)) == -1) {
+            break;
+        } else {
+            check(used > 0, "Request too large. Closing.");
+
+            char *data = RingBuffer_starts_at(conn->recv_rb);
+
+            Worker *owner = worker_for(worker, conn, data, len);
+
+            if(conn->cursor == 0 && !client_admit(conn)) {
+                // shed before it's parsed or sent to another shard, an mget
+                // picking up where it left off already paid
+                RingBuffer_commit_read(conn->recv_rb, used);
+            } else if(!conn->binary && is_replicate_request(data, len, &shard)) {
+                RingBuffer_commit_read(conn->recv_rb, used);
+                rc = worker_replicate(worker, conn, shard);
+                check(rc != -1, "Failed to start a replica. Closing.");
+                // another worker has it now, hands off
+                if(rc == 1) return 0;
+            } else if(!conn->binary && is_stream(data, len)
+                    && NUM_WORKERS > 1 && is_stream_of_all(data, len)) {
+                // every shard has some of /, and a chunk comes from one owner
+                send_status(&text, conn->send_rb, REPLY_ERR);
+                RingBuffer_commit_read(conn->recv_rb, used);
+            } else if(!conn->binary && is_stream(data, len)) {
+                // every chunk goes to the owner on its own, starting next time
+                conn->stream = blk2bstr(data, len);
+                check_mem(conn->stream);
+                RingBuffer_commit_read(conn->recv_rb, used);
+            } else if(!conn->binary && is_mget(data, len)) {
+                rc = worker_mget(worker, conn, data, len);
+                check(rc != -1, "Failed to run mget. Closing.");
+                if(rc == 1) RingBuffer_commit_read(conn->recv_rb, used);
+            } else if(owner == worker) {
+                rc = client_run(conn, data, len);
+                RingBuffer_commit_read(conn->recv_rb, used);
+                if(IO) conn->waiting = Io_submit(IO, worker_io_done, conn);
+                check(rc == 0, "Failed to parse user. Closing.");
+            } else {
+                // the owner parses it later, long after recv_rb moves on
+                bstring copy = blk2bstr(data, len);
+                check_mem(copy);
+                RingBuffer_commit_read(conn->recv_rb, used);
+
+                rc = worker_request(worker, owner, conn, copy);
+                check(rc == 0, "Failed to send command to worker %d.", owner->id);
+            }
+        }
+
+        // replies pile up in send_rb unless the next might not fit
+        if(RingBuffer_available_space(conn->send_rb) < REPLY_RESERVE) {
+            rc = client_flush(conn);
+            check(rc == 0, "Failed to flush a full send buffer.");
+        }
+    }
+
+    // one write for the whole batch, or for a remote reply
+    rc = client_flush(conn);
+    check(rc == 0, "Failed to write reply. Closing.");
+
+    return 0;
+error:
+    return -1;
+}
+
+int worker_client_read(Worker *worker, Connection *conn)
+{
+    int rc = 0;
+
+    // a replica's feed, it only ever writes
+    if(conn->feed) return Feed_event(conn);
+
+    // same as client_read, EPOLLOUT picks up where it stopped
+    if(conn->blocked) {
+        rc = client_unblock(conn);
+        check(rc == 0, "Failed to write reply. Closing.");
+        return worker_process(worker, conn);
+    }
+
+    // and the rest waits in the socket
+    if(conn->waiting) return client_pause(conn, 1);
+
+    rc = client_recv(conn);
+    check_debug(rc > 0, "Client closed.");
+
+    return worker_process(worker, conn);
+error:
+    return -1;
+}
+
+void worker_reply(Worker *worker, Message *msg)
+{
+    // the reply is an ack too, so the log goes out first
+    if(msg->rc == 0 && Wal_commit(WAL) != 0) {
+        msg->rc = -1;
+    }
+
+    if(RingBuffer_available_data(worker->scratch)) {
+        msg->data = RingBuffer_get_all(worker->scratch);
+    }
+
+    msg->type = MSG_REPLY;
+    if(worker_send(msg->from, msg) != 0) {
+        // the client will hang, but there's nobody left to tell
+        log_err("Lost reply for worker %d.", msg->from->id);
+    }
+}
+
+void worker_request_done(IoJob *job)
+{
+    Message *msg = job->owner;
+
+    // DATA is still this shard, it finishes like any local command
+    msg->rc = io_finish(job, SELF->scratch);
+    worker_reply(SELF, msg);
+}
+
+void worker_handle_request(Worker *worker, Message *msg)
+{
+    // DATA is this worker's shard so this is just a local command
+    if(msg->binary) {
+        msg->rc = parse_frame_buffer(bdata(msg->data), blength(msg->data), worker->scratch);
+    } else {
+        msg->rc = parse_stream(msg->data, worker->scratch, &msg->after);
+    }
+    bdestroy(msg->data);
+    msg->data = NULL;
+
+    // a store or load replies once the disk is done with it
+    if(msg->rc == 0 && IO && Io_submit(IO, worker_request_done, msg)) {
+        return;
+    }
+
+    worker_reply(worker, msg);
+}
+
+void worker_handle_reply(Worker *worker, Message *msg)
+{
+    Connection *conn = msg->conn;
+
+    if(conn->closed) {
+        Connection_destroy(conn);
+    } else if(client_resume(conn) != 0 || msg->rc != 0) {
+        client_close(conn);
+    } else {
+        if(msg->data) send_reply(conn->send_rb, msg->data);
+
+        // a stream chunk's next one starts after where the owner stopped,
+        // then carry on with anything that piled up while we waited
+        if((conn->stream && client_stream_next(conn, msg->after) != 0)
+                || worker_process(worker, conn) != 0) {
+            client_close(conn);
+        }
+    }
+
+    Intern_release(msg->after);
+    if(msg->data) bdestroy(msg->data);
+    free(msg);
+}
+
+void worker_drain(Worker *worker)
+{
+    uint64_t count = 0;
+    Message *msg = NULL;
+
+    // resets the eventfd counter, we empty the whole inbox anyway
+    if(read(worker->event_fd, &count, sizeof(count)) != sizeof(count)) {
+        return;
+    }
+
+    while(1) {
+        pthread_mutex_lock(&worker->lock);
+        msg = Queue_recv(worker->inbox);
+        pthread_mutex_unlock(&worker->lock);
+
+        if(msg == NULL) break;
+
+        if(msg->type == MSG_REQUEST) {
+            worker_handle_request(worker, msg);
+        } else if(msg->type == MSG_ADOPT) {
+            worker_adopt(worker, msg);
+        } else {
+            worker_handle_reply(worker, msg);
+        }
+    }
+}
+
+void *worker_main(void *arg)
+{
+    Worker *worker = arg;
+    struct epoll_event events[MAX_EVENTS];
+    int nfds = 0;
+    int i = 0;
+
+    // the handlers only ever see this worker's shard
+    DATA = worker->data;
+    WAL = worker->wal;
+    IO = worker->io;
+    SELF = worker;
+    // so info on any worker adds this one in
+    Metrics_register();
+
+    while(1) {
+        // wake up in time for a deferred fsync
+        nfds = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, Wal_timeout(WAL));
+        if(nfds == -1 && errno == EINTR) continue;
+        check(nfds >= 0, "epoll_wait failed in worker %d.", worker->id);
+
+        for(i = 0; i < nfds; i++) {
+            void *ptr = events[i].data.ptr;
+
+            if(ptr == NULL) {
+                // one bad accept shouldn't take down the worker
+                accept_clients(worker->epoll_fd, worker->listen_fd);
+            } else if(ptr == &worker->unix_fd) {
+                accept_clients(worker->epoll_fd, worker->unix_fd);
+            } else if(ptr == worker) {
+                worker_drain(worker);
+            } else if(worker->io && ptr == worker->io) {
+                IoLoop_drain(worker->io);
+            } else if(!((Connection *)ptr)->closed && (client_hung_up(ptr, events[i].events)
+                        || worker_client_read(worker, ptr) != 0)) {
+                client_close(ptr);
+            }
+        }
+
+        client_reap();
+        Metrics_publish();
+
+        if(Wal_commit(WAL) != 0) {
+            log_err("Failed to sync the log for worker %d.", worker->id);
+        }
+    }
+
+error:
+    return NULL;
+}
+
+int Worker_init(Worker *worker, int id, const char *host, const char *port)
+{
+    int rc = 0;
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+
+    worker->id = id;
+    worker->listen_fd = worker->unix_fd = worker->epoll_fd = worker->event_fd = -1;
+
+    rc = pthread_mutex_init(&worker->lock, NULL);
+    check(rc == 0, "Failed to make worker lock.");
+
+    worker->inbox = Queue_create();
+    check_mem(worker->inbox);
+
+    worker->data = RecordMap_create();
+    check_mem(worker->data);
+
+    worker->scratch = RingBuffer_create(RB_SIZE);
+    check_mem(worker->scratch);
+
+    // every worker gets its own socket on the same port
+    worker->listen_fd = server_listen_shared(host, port);
+    check(worker->listen_fd >= 0, "bind to %s:%s failed.", host, port);
+
+    rc = nonblock(worker->listen_fd);
+    check(rc == 0, "Failed to make the server socket nonblocking.");
+
+    worker->event_fd = eventfd(0, EFD_NONBLOCK);
+    check(worker->event_fd >= 0, "Failed to create eventfd.");
+
+    worker->epoll_fd = epoll_create1(0);
+    check(worker->epoll_fd >= 0, "Failed to create epoll fd.");
+
+    rc = epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->listen_fd, &ev);
+    check(rc == 0, "Failed to add server socket to epoll.");
+
+    ev.data.ptr = worker;
+    rc = epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->event_fd, &ev);
+    check(rc == 0, "Failed to add eventfd to epoll.");
+
+    if(UNIX_PATH && id == 0) {
+        // one socket, so one worker; its commands get routed like any other
+        worker->unix_fd = unix_listen(UNIX_PATH);
+        check(worker->unix_fd >= 0, "Failed to listen on %s.", UNIX_PATH);
+        check(nonblock(worker->unix_fd) == 0, "Failed to make %s nonblocking.", UNIX_PATH);
+
+        ev.data.ptr = &worker->unix_fd;
+        rc = epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->unix_fd, &ev);
+        check(rc == 0, "Failed to add %s to epoll.", UNIX_PATH);
+    }
+
+    if(IO_THREADS > 0) {
+        // this worker's store and load jobs come back through here
+        worker->io = IoLoop_create();
+        check_mem(worker->io);
+
+        ev.data.ptr = worker->io;
+        rc = epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->io->event_fd, &ev);
+        check(rc == 0, "Failed to add the I/O eventfd to epoll.");
+    }
+
+    return 0;
+error:
+    return -1;
+}
+
+int run_worker_server(const char *host, const char *port,
+        const char *store_path, int nworkers)
+{
+    int rc = 0;
+    int i = 0;
+    RecordMap **shards = NULL;
+    Wal **wals = NULL;
+
+    check(host != NULL, "Invalid host.");
+    check(port != NULL, "Invalid port.");
+    check(nworkers > 0, "Need at least one worker: %d", nworkers);
+
+    rc = setup_data_store(store_path);
+    check(rc == 0, "Failed to setup the data store.");
+
+    // a client going away mid-write shouldn't kill everyone else
+    struct sigaction sa = {.sa_handler = SIG_IGN};
+    sigemptyset(&sa.sa_mask);
+    rc = sigaction(SIGPIPE, &sa, 0);
+    check(rc != -1, "Failed to ignore SIGPIPE.");
+
+    if(IO_THREADS > 0) {
+        rc = IoPool_start(IO_THREADS);
+        check(rc == 0, "Failed to start the I/O threads.");
+    }
+
+    WORKERS = calloc(nworkers, sizeof(Worker));
+    check_mem(WORKERS);
+    NUM_WORKERS = nworkers;
+
+    // every worker has to exist before any of them can route to another
+    for(i = 0; i < nworkers; i++) {
+        rc = Worker_init(&WORKERS[i], i, host, port);
+        check(rc == 0, "Failed to setup worker %d.", i);
+    }
+
+    shards = calloc(nworkers, sizeof(RecordMap *));
+    check_mem(shards);
+    wals = calloc(nworkers, sizeof(Wal *));
+    check_mem(wals);
+
+    for(i = 0; i < nworkers; i++) {
+        shards[i] = WORKERS[i].data;
+    }
+
+    // the log may be from a different worker count, names get routed again
+    rc = Wal_recover(bdata(STORE_PATH), shards, wals, nworkers, shard_for_name);
+    check(rc == 0, "Failed to recover from the log in %s.", bdata(STORE_PATH));
+
+    for(i = 0; i < nworkers; i++) {
+        WORKERS[i].wal = wals[i];
+    }
+
+    for(i = 0; i < nworkers; i++) {
+        rc = pthread_create(&WORKERS[i].thread, NULL, worker_main, &WORKERS[i]);
+        check(rc == 0, "Failed to start worker %d.", i);
+    }
+
+    for(i = 0; i < nworkers; i++) {
+        pthread_join(WORKERS[i].thread, NULL);
+    }
+
+error: // fallthrough
+    if(shards) free(shards);
+    if(wals) free(wals);
+    return -1;
+}
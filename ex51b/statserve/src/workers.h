@@ -0,0 +1,66 @@
+#ifndef _workers_h
+#define _workers_h
+
+#include <pthread.h>
+#include <lcthw/bstrlib.h>
+#include <lcthw/queue.h>
+#include <lcthw/ringbuffer.h>
+#include "statserve.h"
+#include "wal.h"
+#include "iopool.h"
+
+typedef struct Worker {
+    int id;
+    pthread_t thread;
+    int listen_fd;
+    // worker 0 also takes UNIX_PATH, -1 for the rest
+    int unix_fd;
+    int epoll_fd;
+    int event_fd;
+    // this worker's shard of the namespace
+    RecordMap *data;
+    // and its log
+    Wal *wal;
+    // where its store and load jobs finish, NULL does them inline
+    IoLoop *io;
+    // holds replies for commands run for other shards
+    RingBuffer *scratch;
+    // the only lock, held just long enough to touch inbox
+    pthread_mutex_t lock;
+    Queue *inbox;
+} Worker;
+
+typedef enum MessageType {
+    // MSG_ADOPT hands a replica's connection to the worker with its shard
+    MSG_REQUEST, MSG_REPLY, MSG_ADOPT
+} MessageType;
+
+typedef struct Message {
+    MessageType type;
+    // the worker that owns conn and gets the reply
+    Worker *from;
+    Connection *conn;
+    // the command going out, the reply coming back
+    bstring data;
+    // data is a binary frame rather than a text line
+    int binary;
+    int rc;
+    // where a list or dumptree chunk stopped, NULL once it's done
+    bstring after;
+} Message;
+
+uint32_t shard_hash(const char *key, size_t len);
+
+int shard_for_name(char *start, char *end, int nshards);
+
+int shard_for_line(bstring line, int nshards);
+
+int shard_for_frame(char *data, int len, int nshards);
+
+// list / or dumptree /, which would need every shard's names merged
+int is_stream_of_all(char *data, int len);
+
+int run_worker_server(const char *host, const char *port,
+        const char *store_path, int nworkers);
+
+#endif
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <lcthw/dbg.h>
+#include "statserve.h"
+
+#define LIVE 100000
+#define OPS 5000000
+
+// rampant create/delete: LIVE records stay around and every op deletes
+// a random one and creates another in its place, the way Record_create
+// and Record_destroy did it before against the slab they use now. no
+// sketches or windows, so only the Record and its stats churn. each
+// runs in its own process so RSS is just its own
+
+typedef Record *(*create_cb)(bstring name);
+typedef void (*destroy_cb)(Record *info);
+
+double elapsed(struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+long status_kb(const char *field)
+{
+    char line[256];
+    long kb = -1;
+    FILE *status = fopen("/proc/self/status", "r");
+
+    while(status && fgets(line, sizeof(line), status)) {
+        if(strncmp(line, field, strlen(field)) == 0) {
+            kb = atol(line + strlen(field) + 1);
+        }
+    }
+
+    if(status) fclose(status);
+    return kb;
+}
+
+Record *malloc_create(bstring name)
+{
+    Record *info = calloc(1, sizeof(Record));
+    check_mem(info);
+
+    info->stat = AtomicStats_create(STATS_STRIPES);
+    check_mem(info->stat);
+    info->version = 1;
+    info->name = Intern_add(name);
+
+    return info;
+error:
+    return NULL;
+}
+
+void malloc_destroy(Record *info)
+{
+    Intern_release(info->name);
+    AtomicStats_destroy(info->stat);
+    free(info);
+}
+
+void churn(const char *label, create_cb create, destroy_cb destroy)
+{
+    static Record *live[LIVE];
+    struct timespec start;
+    char text[64];
+    struct tagbstring name;
+    unsigned int seed = 1;
+    int i = 0;
+
+    for(i = 0; i < LIVE; i++) {
+        snprintf(text, sizeof(text), "/churn/%d", i);
+        btfromcstr(name, text);
+        live[i] = create(&name);
+        check(live[i], "Failed to create a record.");
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for(i = 0; i < OPS; i++) {
+        int slot = rand_r(&seed) % LIVE;
+
+        // a short-lived string between them, like a reply or log line
+        bstring noise = bformat("%d", i);
+
+        destroy(live[slot]);
+        snprintf(text, sizeof(text), "/churn/%d", slot);
+        btfromcstr(name, text);
+        live[slot] = create(&name);
+        check(live[slot], "Failed to create a record.");
+        AtomicStats_sample(live[slot]->stat, i);
+
+        bdestroy(noise);
+    }
+
+    double ns = elapsed(&start);
+
+    printf("  %-14s %8.2f M ops/s, %6ld kB RSS, %6ld kB peak\n", label,
+            OPS / ns * 1e3, status_kb("VmRSS"), status_kb("VmHWM"));
+    return;
+error:
+    exit(1);
+}
+
+int run(const char *label, create_cb create, destroy_cb destroy)
+{
+    int status = 0;
+    pid_t pid = fork();
+    check(pid >= 0, "Failed to fork.");
+
+    if(pid == 0) {
+        churn(label, create, destroy);
+        fflush(stdout);
+        _exit(0);
+    }
+
+    check(waitpid(pid, &status, 0) == pid, "Failed to wait for %s.", label);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+error:
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    SKETCHES = 0;
+    WINDOW_SECONDS = 0;
+
+    printf("%d live records, %d deletes and creates\n", LIVE, OPS);
+    fflush(stdout);
+    check(run("calloc/free:", malloc_create, malloc_destroy) == 0, "calloc run failed.");
+    check(run("slab:", Record_create, Record_destroy) == 0, "slab run failed.");
+
+    return 0;
+error:
+    return 1;
+}
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <lcthw/dbg.h>
+#include <lcthw/bstrlib.h>
+#include "format.h"
+
+#define REPLIES 1000000
+
+// the seven fields of a dump reply, formatted the old way with %f into
+// a fresh bstring and the new way with format_double into a stack line
+
+typedef struct Dump {
+    double mean;
+    double stddev;
+    double sum;
+    double sumsq;
+    long n;
+    double min;
+    double max;
+} Dump;
+
+uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+double elapsed(struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+Dump make_dump(uint64_t *state)
+{
+    // latency-ish samples, a few ms with a fraction
+    double min = (next_random(state) % 100000) / 1000.0;
+    double max = min + (next_random(state) % 1000000) / 1000.0;
+    long n = next_random(state) % 10000 + 1;
+    double mean = (min + max) / 3.0;
+    double sum = mean * n;
+
+    Dump dump = {.mean = mean, .stddev = (max - min) / 7.0, .sum = sum,
+        .sumsq = sum * mean * 1.1, .n = n, .min = min, .max = max};
+    return dump;
+}
+
+double run_bformat(Dump *dumps, int count, long *bytes)
+{
+    struct timespec start;
+    int i = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for(i = 0; i < REPLIES; i++) {
+        Dump *d = &dumps[i % count];
+        bstring reply = bformat("%f %f %f %f %ld %f %f", d->mean, d->stddev,
+                d->sum, d->sumsq, d->n, d->min, d->max);
+        *bytes += blength(reply);
+        bdestroy(reply);
+    }
+
+    return elapsed(&start) / REPLIES;
+}
+
+double run_format(Dump *dumps, int count, long *bytes)
+{
+    struct timespec start;
+    char reply[FORMAT_MAX * 7];
+    int i = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for(i = 0; i < REPLIES; i++) {
+        Dump *d = &dumps[i % count];
+        char *at = reply;
+
+        at += format_double(at, d->mean);
+        *at++ = ' ';
+        at += format_double(at, d->stddev);
+        *at++ = ' ';
+        at += format_double(at, d->sum);
+        *at++ = ' ';
+        at += format_double(at, d->sumsq);
+        *at++ = ' ';
+        at += format_long(at, d->n);
+        *at++ = ' ';
+        at += format_double(at, d->min);
+        *at++ = ' ';
+        at += format_double(at, d->max);
+
+        *bytes += at - reply;
+    }
+
+    return elapsed(&start) / REPLIES;
+}
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+    uint64_t state = 42;
+    long old_bytes = 0;
+    long new_bytes = 0;
+    Dump dumps[1024];
+    int i = 0;
+
+    for(i = 0; i < 1024; i++) {
+        dumps[i] = make_dump(&state);
+    }
+
+    double old_ns = run_bformat(dumps, 1024, &old_bytes);
+    double new_ns = run_format(dumps, 1024, &new_bytes);
+    check(old_ns > 0 && new_ns > 0, "A run failed.");
+
+    printf("%d dump replies\n", REPLIES);
+    printf("  bformat %%f:      %8.1f ns/reply, %5.1f bytes, 6 digits\n",
+            old_ns, (double)old_bytes / REPLIES);
+    printf("  format_double:   %8.1f ns/reply, %5.1f bytes, round trips (%.2fx)\n",
+            new_ns, (double)new_bytes / REPLIES, old_ns / new_ns);
+
+    return 0;
+error:
+    return 1;
+}
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <time.h>
+#include <lcthw/dbg.h>
+#include <lcthw/bstrlib.h>
+#include <lcthw/ringbuffer.h>
+#include "statserve.h"
+#include "net.h"
+
+#define LINES 200
+
+// a long msample line sent whole, or by a client dripping a byte at a time
+
+double elapsed(struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+bstring long_line()
+{
+    bstring line = bfromcstr("msample /drip");
+    int i = 0;
+
+    for(i = 0; blength(line) < MAX_LINE - 8; i++) {
+        bformata(line, " %d", i % 100);
+    }
+    bconchar(line, '\n');
+
+    return line;
+}
+
+double run(bstring line, int step, int remember)
+{
+    struct timespec start;
+    RingBuffer *input = RingBuffer_create(RB_SIZE);
+    int scanned = 0;
+    int found = 0;
+    int sent = 0;
+    int i = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for(i = 0; i < LINES; i++) {
+        for(sent = 0; sent < blength(line); sent += step) {
+            int chunk = blength(line) - sent < step ? blength(line) - sent : step;
+            RingBuffer_write(input, bdata(line) + sent, chunk);
+
+            // without remembering, every scan starts over like before
+            if(!remember) scanned = 0;
+            int len = scan_line(input, '\n', &scanned, MAX_LINE);
+            check(len != -2, "Line came out too long.");
+
+            if(len >= 0) {
+                RingBuffer_commit_read(input, len + 1);
+                found++;
+            }
+        }
+    }
+
+    check(found == LINES, "Only found %d of %d lines.", found, LINES);
+    RingBuffer_destroy(input);
+
+    return elapsed(&start) / LINES;
+error:
+    RingBuffer_destroy(input);
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+    bstring line = long_line();
+
+    double bulk_ns = run(line, blength(line), 1);
+    double drip_ns = run(line, 1, 1);
+    double rescan_ns = run(line, 1, 0);
+    check(bulk_ns > 0 && drip_ns > 0 && rescan_ns > 0, "A run failed.");
+
+    printf("%d lines of %d bytes\n", LINES, blength(line));
+    printf("  bulk delivery:              %10.1f ns/line\n", bulk_ns);
+    printf("  1 byte at a time:           %10.1f ns/line\n", drip_ns);
+    printf("  1 byte at a time, rescan:   %10.1f ns/line (%.1fx)\n",
+            rescan_ns, rescan_ns / drip_ns);
+
+    bdestroy(line);
+    return 0;
+error:
+    bdestroy(line);
+    return 1;
+}
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+#include <lcthw/dbg.h>
+#include <lcthw/hashmap.h>
+#include "statserve.h"
+
+#define NAMES 100000
+#define LOOKUPS 1000000
+
+// deep names that share most of their bytes, the way /api/v1/... does,
+// measured as bstrcpy copies in a plain Hashmap against interned ones
+// in a Hashmap that compares them by pointer
+
+double elapsed(struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+int name_compare(void *a, void *b)
+{
+    return a != b;
+}
+
+uint32_t name_hash(void *key)
+{
+    return Intern_stored_hash(key);
+}
+
+size_t heap_used()
+{
+    struct mallinfo2 info = mallinfo2();
+
+    // the arenas are big enough to be mmapped, which is hblkhd
+    return info.uordblks + info.hblkhd;
+}
+
+void make_name(char *text, size_t size, int i)
+{
+    snprintf(text, size, "/api/v1/region%d/service%d/endpoint%d", i % 7, i % 100, i);
+}
+
+double run(int interned, size_t *bytes)
+{
+    struct timespec start;
+    char text[128];
+    struct tagbstring name;
+    size_t before = heap_used();
+    Hashmap *map = interned ? Hashmap_create(name_compare, name_hash) : Hashmap_create(NULL, NULL);
+    long found = 0;
+    int i = 0;
+    check_mem(map);
+
+    for(i = 0; i < NAMES; i++) {
+        make_name(text, sizeof(text), i);
+        btfromcstr(name, text);
+
+        bstring key = interned ? Intern_add(&name) : bstrcpy(&name);
+        check(key && Hashmap_set(map, key, key) == 0, "Failed to add a name.");
+    }
+
+    *bytes = heap_used() - before;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // lookups come off the wire, so they start from the bytes either way
+    for(i = 0; i < LOOKUPS; i++) {
+        make_name(text, sizeof(text), (int)((i * 7919L) % NAMES));
+        btfromcstr(name, text);
+
+        if(interned) {
+            bstring key = Intern_find(&name);
+            found += key && Hashmap_get(map, key) != NULL;
+        } else {
+            found += Hashmap_get(map, &name) != NULL;
+        }
+    }
+
+    double ns = elapsed(&start) / LOOKUPS;
+    check(found == LOOKUPS, "Missed %ld lookups.", LOOKUPS - found);
+
+    return ns;
+error:
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+    size_t copied_bytes = 0;
+    size_t interned_bytes = 0;
+
+    double copied_ns = run(0, &copied_bytes);
+    double interned_ns = run(1, &interned_bytes);
+    check(copied_ns > 0 && interned_ns > 0, "A run failed.");
+
+    printf("%d names, %d lookups by name\n", NAMES, LOOKUPS);
+    printf("  bstrcpy keys:  %8.1f ns/lookup, %6.1f bytes/name (with map nodes)\n",
+            copied_ns, (double)copied_bytes / NAMES);
+    printf("  interned keys: %8.1f ns/lookup, %6.1f bytes/name (with map nodes)\n",
+            interned_ns, (double)interned_bytes / NAMES);
+
+    return 0;
+error:
+    return 1;
+}
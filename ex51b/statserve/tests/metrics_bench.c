@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <lcthw/dbg.h>
+#include "statserve.h"
+#include "metrics.h"
+
+#define ROUNDS 100000
+#define TRIES 10
+
+// what info costs the commands it counts: the same sample through
+// parse_buffer with nothing timed, with the default one in
+// METRICS_EVERY timed, and with every one of them timed
+
+const char *LINE = "sample /api/v1/users/zed/logins 12.5";
+
+double elapsed(struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+double run(int every, RingBuffer *send_rb)
+{
+    char buffer[128];
+    int len = strlen(LINE);
+    struct timespec start;
+    int rc = 0;
+    int i = 0;
+
+    METRICS_EVERY = every;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < ROUNDS; i++) {
+        // parsing writes NULs, so refill like recv would
+        memcpy(buffer, LINE, len);
+        rc |= parse_buffer(buffer, len, send_rb);
+        send_rb->start = send_rb->end = 0;
+    }
+
+    check(rc == 0, "A sample failed.");
+    return elapsed(&start) / ROUNDS;
+error:
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+    int rc = 0;
+    int every = METRICS_EVERY;
+    char line[64];
+    RingBuffer *send_rb = RingBuffer_create(RB_SIZE);
+    check_mem(send_rb);
+
+    // every handler logs, buffered it's a write per 64k instead of per line,
+    // which is all the noise between runs otherwise
+    setvbuf(stderr, NULL, _IOFBF, 64 * 1024);
+
+    rc = setup_data_store("/tmp");
+    check(rc == 0, "Failed to setup the data store.");
+    Metrics_register();
+
+    strcpy(line, "create /api/v1/users/zed/logins 1");
+    rc = parse_buffer(line, strlen(line), send_rb);
+    check(rc == 0, "Failed to create the record.");
+
+    // taking turns, so whatever else the box is doing hits all three,
+    // and the best of each
+    double best[3] = {0, 0, 0};
+    int config[3] = {0, every, 1};
+    int try = 0;
+    int i = 0;
+
+    run(0, send_rb);
+    for(try = 0; try < TRIES; try++) {
+        for(i = 0; i < 3; i++) {
+            double ns = run(config[i], send_rb);
+            check(ns > 0, "A run failed.");
+            if(try == 0 || ns < best[i]) best[i] = ns;
+        }
+    }
+
+    double off_ns = best[0];
+    double sampled_ns = best[1];
+    double all_ns = best[2];
+
+    printf("parse_buffer \"%s\"\n", LINE);
+    printf("  counting only:      %8.1f ns/op\n", off_ns);
+    printf("  1 in %-3d timed:     %8.1f ns/op (%+.1f%%)\n", every, sampled_ns,
+            (sampled_ns - off_ns) * 100 / off_ns);
+    printf("  every one timed:    %8.1f ns/op (%+.1f%%)\n", all_ns,
+            (all_ns - off_ns) * 100 / off_ns);
+
+    RingBuffer_destroy(send_rb);
+    return 0;
+error:
+    return 1;
+}
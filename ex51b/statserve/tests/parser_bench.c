@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <lcthw/dbg.h>
+#include <lcthw/bstrlib.h>
+#include "statserve.h"
+
+#define ROUNDS 1000000
+
+struct tagbstring LINE_SPLIT = bsStatic(" ");
+struct tagbstring SLASH = bsStatic("/");
+struct tagbstring CREATE = bsStatic("create");
+struct tagbstring MEAN = bsStatic("mean");
+struct tagbstring DUMP = bsStatic("dump");
+struct tagbstring DELETE = bsStatic("delete");
+struct tagbstring STDDEV = bsStatic("stddev");
+struct tagbstring STORE = bsStatic("store");
+struct tagbstring SAMPLE = bsStatic("sample");
+
+const char *LINE = "sample /api/v1/users/zed/logins/today 12.5";
+
+int paths_seen = 0;
+
+int count_path(Command *cmd, RingBuffer *send_rb, bstring path)
+{
+    (void)cmd;
+    (void)send_rb;
+    paths_seen += blength(path) > 0;
+    return 0;
+}
+
+double elapsed(struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+// the old parser: bsplits the line, walk the biseq chain, bsplits
+// the name and bjoin every parent path
+int split_parse(bstring data)
+{
+    struct bstrList *splits = bsplits(data, &LINE_SPLIT);
+    struct bstrList *path = NULL;
+    bstring command = splits->entry[0];
+    check(splits->qty == 3, "Bad line.");
+
+    if(biseq(command, &CREATE) || biseq(command, &MEAN) || biseq(command, &DUMP)
+            || biseq(command, &DELETE) || biseq(command, &STDDEV)
+            || biseq(command, &STORE)) {
+        sentinel("Wrong command.");
+    } else if(biseq(command, &SAMPLE)) {
+        path = bsplits(splits->entry[1], &SLASH);
+    }
+
+    size_t qty = path->qty;
+    for(; path->qty > 1; path->qty--) {
+        bstring joined = bjoin(path, &SLASH);
+        count_path(NULL, NULL, joined);
+        bdestroy(joined);
+    }
+    path->qty = qty;
+
+    bstrListDestroy(path);
+    bstrListDestroy(splits);
+    return 0;
+error:
+    bstrListDestroy(splits);
+    return -1;
+}
+
+int view_parse(char *data, int len)
+{
+    Command cmd = {.command = NULL};
+
+    int rc = parse_command(data, len, &cmd);
+    check(rc == 0, "Bad line.");
+
+    cmd.handler = count_path;
+    return scan_paths(&cmd, NULL);
+error:
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+    int i = 0;
+    int rc = 0;
+    struct timespec start;
+    char buffer[128];
+    int len = strlen(LINE);
+    bstring line = bfromcstr(LINE);
+    double split_ns = 0.0;
+    double view_ns = 0.0;
+
+    // scan_paths looks the name up, so it needs an (empty) DATA
+    rc = setup_data_store("/tmp");
+    check(rc == 0, "Failed to setup the data store.");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < ROUNDS; i++) {
+        rc |= split_parse(line);
+    }
+    split_ns = elapsed(&start) / ROUNDS;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < ROUNDS; i++) {
+        // the real thing parses in place, so refill like recv would
+        memcpy(buffer, LINE, len);
+        rc |= view_parse(buffer, len);
+    }
+    view_ns = elapsed(&start) / ROUNDS;
+
+    check(rc == 0, "A parser failed.");
+    check(paths_seen == ROUNDS * 12, "Wrong number of paths: %d", paths_seen);
+
+    printf("parse \"%s\"\n", LINE);
+    printf("  bsplits + biseq: %8.1f ns/op\n", split_ns);
+    printf("  views + table:   %8.1f ns/op (%.1fx)\n", view_ns, split_ns / view_ns);
+
+    bdestroy(line);
+    return 0;
+error:
+    return 1;
+}
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <lcthw/dbg.h>
+#include <lcthw/hashmap.h>
+#include "statserve.h"
+
+#define LOOKUPS 1000000
+// the Hashmap scans a whole bucket per get, so it gets fewer
+#define HASHMAP_WORK 10000000000.0
+
+// DATA as it was, a Hashmap keyed by interned names behind an
+// Intern_find, against the RecordMap, at 1M and 10M records. gets use
+// a separate bstring over the same bytes so neither can match on the
+// pointer, which is how names arrive from a client
+
+int name_compare(void *a, void *b)
+{
+    return a != b;
+}
+
+uint32_t name_hash(void *key)
+{
+    return Intern_stored_hash(key);
+}
+
+double elapsed(struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+double hashmap_run(Record *records, long count, double *get_ns)
+{
+    struct timespec start;
+    long lookups = HASHMAP_WORK / count;
+    long found = 0;
+    long i = 0;
+    Hashmap *map = Hashmap_create(name_compare, name_hash);
+    check_mem(map);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < count; i++) {
+        check(Hashmap_set(map, records[i].name, &records[i]) == 0, "Failed to set.");
+    }
+    double set_ns = elapsed(&start) / count;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < lookups; i++) {
+        struct tagbstring wire = *records[(i * 7919) % count].name;
+        bstring key = Intern_find(&wire);
+        found += key && Hashmap_get(map, key) != NULL;
+    }
+    *get_ns = elapsed(&start) / lookups;
+    check(found == lookups, "Missed %ld gets.", lookups - found);
+
+    Hashmap_destroy(map);
+    return set_ns;
+error:
+    return -1;
+}
+
+double recordmap_worst(Record *records, long count)
+{
+    struct timespec one;
+    double worst = 0;
+    long i = 0;
+    RecordMap *map = RecordMap_create();
+    check_mem(map);
+
+    // on its own, a clock read costs about as much as a set
+    for(i = 0; i < count; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &one);
+        check(RecordMap_set(map, &records[i]) == 0, "Failed to set.");
+
+        // a stop-the-world rehash would show up here
+        double ns = elapsed(&one);
+        if(ns > worst) worst = ns;
+    }
+
+    RecordMap_destroy(map);
+    return worst / 1000;
+error:
+    return -1;
+}
+
+double recordmap_run(Record *records, long count, double *get_ns)
+{
+    struct timespec start;
+    long found = 0;
+    long i = 0;
+    RecordMap *map = RecordMap_create();
+    check_mem(map);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < count; i++) {
+        check(RecordMap_set(map, &records[i]) == 0, "Failed to set.");
+    }
+    double set_ns = elapsed(&start) / count;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < LOOKUPS; i++) {
+        struct tagbstring wire = *records[(i * 7919) % count].name;
+        found += RecordMap_get(map, &wire) != NULL;
+    }
+    *get_ns = elapsed(&start) / LOOKUPS;
+    check(found == LOOKUPS, "Missed %ld gets.", LOOKUPS - found);
+
+    RecordMap_destroy(map);
+    return set_ns;
+error:
+    return -1;
+}
+
+int run(long count)
+{
+    char text[128];
+    struct tagbstring name;
+    double hashmap_get = 0;
+    double recordmap_get = 0;
+    long i = 0;
+
+    // bare records, the maps only ever look at the name
+    Record *records = calloc(count, sizeof(Record));
+    check_mem(records);
+
+    for(i = 0; i < count; i++) {
+        snprintf(text, sizeof(text), "/api/v1/region%ld/service%ld/endpoint%ld",
+                i % 7, i % 100, i);
+        btfromcstr(name, text);
+        records[i].name = Intern_add(&name);
+        check_mem(records[i].name);
+    }
+
+    double hashmap_set = hashmap_run(records, count, &hashmap_get);
+    double recordmap_set = recordmap_run(records, count, &recordmap_get);
+    double worst_us = recordmap_worst(records, count);
+    check(hashmap_set > 0 && recordmap_set > 0 && worst_us > 0, "A run failed.");
+
+    printf("%ld records\n", count);
+    printf("  Hashmap:   %8.1f ns/set, %10.1f ns/get\n", hashmap_set, hashmap_get);
+    printf("  RecordMap: %8.1f ns/set, %10.1f ns/get, worst set %.1f us (%.0fx faster gets)\n",
+            recordmap_set, recordmap_get, worst_us, hashmap_get / recordmap_get);
+
+    free(records);
+    return 0;
+error:
+    free(records);
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    check(run(1000000) == 0, "1M run failed.");
+    check(run(10000000) == 0, "10M run failed.");
+
+    return 0;
+error:
+    return 1;
+}
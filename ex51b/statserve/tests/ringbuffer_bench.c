@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <lcthw/dbg.h>
+#include <lcthw/ringbuffer.h>
+#include "statserve.h"
+#include "net.h"
+#include "mirror.h"
+
+#define OPS 5000000
+#define POOL (1024 * 64)
+
+// the same seeded run of random writes and reads goes through a plain
+// RingBuffer used the way read_some does, sliding the unread bytes down
+// before each write, and through a mirrored one that never moves them
+
+typedef struct Run {
+    double ns;
+    uint64_t sum;
+    long moved;
+} Run;
+
+char POOL_DATA[POOL];
+
+uint64_t next_random(uint64_t *state)
+{
+    // xorshift64, so a seed gives the same run every time
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+double elapsed(struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+uint64_t consume(RingBuffer *buffer, int amount)
+{
+    // stands in for the parser, memchr reads it in place about this fast
+    unsigned char *at = (unsigned char *)RingBuffer_starts_at(buffer);
+    uint64_t sum = amount;
+    uint64_t word = 0;
+    int i = 0;
+
+    for(i = 0; i + 8 <= amount; i += 8) {
+        memcpy(&word, at + i, 8);
+        sum += word;
+    }
+    for(; i < amount; i++) {
+        sum = sum * 31 + at[i];
+    }
+
+    RingBuffer_commit_read(buffer, amount);
+    return sum;
+}
+
+Run fuzz(RingBuffer *buffer, int mirrored, uint64_t seed)
+{
+    Run run = {.sum = 0};
+    struct timespec start;
+    uint64_t state = seed;
+    int from = 0;
+    int i = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for(i = 0; i < OPS; i++) {
+        uint64_t op = next_random(&state);
+        int unread = ring_unread(buffer);
+
+        if(op & 1) {
+            // a recv of up to 2k, never more than both buffers can take
+            int amount = (op >> 8) % 2048;
+            int room = RB_SIZE - 2 - unread;
+            amount = amount < room ? amount : room;
+
+            if(!mirrored && unread == 0) {
+                buffer->start = buffer->end = 0;
+            } else if(!mirrored && buffer->start > 0) {
+                memmove(buffer->buffer, RingBuffer_starts_at(buffer), unread);
+                buffer->start = 0;
+                buffer->end = unread;
+                run.moved += unread;
+            }
+
+            from = (from + amount) % (POOL - 2048);
+            memcpy(RingBuffer_ends_at(buffer), POOL_DATA + from, amount);
+            RingBuffer_commit_write(buffer, amount);
+        } else if(unread > 0) {
+            // then a request or so gets parsed out of it
+            run.sum ^= consume(buffer, (op >> 8) % unread + 1);
+        }
+    }
+
+    run.ns = elapsed(&start) / OPS;
+    return run;
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t seed = argc > 1 ? strtoull(argv[1], NULL, 10) : 42;
+    uint64_t fill = seed;
+    int i = 0;
+
+    for(i = 0; i < POOL; i++) {
+        POOL_DATA[i] = next_random(&fill);
+    }
+
+    RingBuffer *plain = RingBuffer_create(RB_SIZE);
+    RingBuffer *mirror = MirrorBuffer_create(RB_SIZE);
+    check(plain && mirror, "Failed to make the buffers.");
+
+    Run sliding = fuzz(plain, 0, seed);
+    Run mirrored = fuzz(mirror, 1, seed);
+    check(sliding.sum == mirrored.sum, "The buffers read back different bytes.");
+
+    printf("%d random ops, seed %llu, checksum %016llx\n", OPS,
+            (unsigned long long)seed, (unsigned long long)sliding.sum);
+    printf("  RingBuffer, sliding:  %8.1f ns/op, %ld bytes moved\n",
+            sliding.ns, sliding.moved);
+    printf("  mirrored:             %8.1f ns/op (%.2fx)\n",
+            mirrored.ns, sliding.ns / mirrored.ns);
+
+    RingBuffer_destroy(plain);
+    MirrorBuffer_destroy(mirror);
+    return 0;
+error:
+    return 1;
+}
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <lcthw/dbg.h>
+#include <lcthw/ringbuffer.h>
+#include "statserve.h"
+
+#define LEAVES 100
+#define SAMPLES 1000000
+// one dashboard read of the top per this many samples
+#define READ_EVERY 1000
+
+// heavy fan-in, every sample lands on some /api/svcN/endpointM and a
+// dashboard polls /api, eager pushes into /api/svcN and /api on every
+// sample, lazy bumps their versions and adds up once per read
+
+extern __thread RecordMap *DATA;
+
+double elapsed(struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+int run_line(const char *text, RingBuffer *replies)
+{
+    char line[128];
+    int len = strlen(text);
+
+    // parse_buffer writes into the line, so give it a copy
+    memcpy(line, text, len + 1);
+    int rc = parse_buffer(line, len, replies);
+    replies->start = replies->end = 0;
+
+    return rc;
+}
+
+double run(int lazy, double *top)
+{
+    struct timespec start;
+    RingBuffer *replies = RingBuffer_create(RB_SIZE);
+    Record *leaves[LEAVES];
+    char line[128];
+    Stats folded;
+    int i = 0;
+
+    ROLLUP_LAZY = lazy;
+    DATA = RecordMap_create();
+
+    for(i = 0; i < LEAVES; i++) {
+        snprintf(line, sizeof(line), "create /api/svc%d/endpoint%d 1", i % 10, i);
+        check(run_line(line, replies) == 0, "Failed to create a leaf.");
+
+        snprintf(line, sizeof(line), "/api/svc%d/endpoint%d", i % 10, i);
+        struct tagbstring name;
+        btfromcstr(name, line);
+        leaves[i] = RecordMap_get(DATA, &name);
+        check(leaves[i] && leaves[i]->parent && leaves[i]->parent->parent,
+                "Leaf isn't linked up.");
+    }
+
+    Record *api = leaves[0]->parent->parent;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // what handle_sample does to each level, without its log_info
+    for(i = 0; i < SAMPLES; i++) {
+        Record *info = leaves[(i * 7) % LEAVES];
+        Record_sample(info, i % 97);
+
+        for(; !lazy && info->parent; info = info->parent) {
+            Record_sample(info->parent, AtomicStats_mean(info->stat));
+        }
+
+        if(i % READ_EVERY == 0) {
+            Record_fold(api, &folded);
+        }
+    }
+
+    double ns = elapsed(&start) / SAMPLES;
+
+    Record_fold(api, &folded);
+    *top = Stats_mean(&folded);
+
+    RingBuffer_destroy(replies);
+    return ns;
+error:
+    RingBuffer_destroy(replies);
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+    double eager_top = 0;
+    double lazy_top = 0;
+
+    double eager_ns = run(0, &eager_top);
+    double lazy_ns = run(1, &lazy_top);
+    check(eager_ns > 0 && lazy_ns > 0, "A run failed.");
+
+    printf("%d samples over %d leaves, mean /api every %d\n", SAMPLES, LEAVES, READ_EVERY);
+    printf("  eager rollup:  %8.1f ns/sample, /api mean %f (of means)\n",
+            eager_ns, eager_top);
+    printf("  lazy rollup:   %8.1f ns/sample, /api mean %f (of samples) (%.2fx)\n",
+            lazy_ns, lazy_top, eager_ns / lazy_ns);
+
+    return 0;
+error:
+    return 1;
+}
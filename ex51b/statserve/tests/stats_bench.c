@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <lcthw/dbg.h>
+#include <lcthw/stats.h>
+#include "atomicstats.h"
+
+#define THREADS 4
+#define ROUNDS 1000000
+
+// one hot record like /logins, sampled by every thread at once
+Stats LOCKED = {.n = 0};
+pthread_mutex_t LOCK = PTHREAD_MUTEX_INITIALIZER;
+AtomicStats *STRIPED = NULL;
+
+double elapsed(struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+void *locked_writer(void *arg)
+{
+    (void)arg;
+    int i = 0;
+
+    for(i = 0; i < ROUNDS; i++) {
+        pthread_mutex_lock(&LOCK);
+        Stats_sample(&LOCKED, i);
+        pthread_mutex_unlock(&LOCK);
+    }
+
+    return NULL;
+}
+
+void *striped_writer(void *arg)
+{
+    (void)arg;
+    int i = 0;
+
+    for(i = 0; i < ROUNDS; i++) {
+        AtomicStats_sample(STRIPED, i);
+    }
+
+    return NULL;
+}
+
+double run_writers(void *(*writer)(void *))
+{
+    pthread_t threads[THREADS];
+    struct timespec start;
+    int i = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for(i = 0; i < THREADS; i++) {
+        pthread_create(&threads[i], NULL, writer, NULL);
+    }
+
+    for(i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    return elapsed(&start) / (THREADS * ROUNDS);
+}
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    (void)argv;
+    Stats folded;
+    double locked_ns = run_writers(locked_writer);
+
+    STRIPED = AtomicStats_create(1);
+    double shared_ns = run_writers(striped_writer);
+    AtomicStats_fold(STRIPED, &folded);
+    check(folded.n == THREADS * ROUNDS, "Shared stripe lost samples.");
+    AtomicStats_destroy(STRIPED);
+
+    STRIPED = AtomicStats_create(THREADS);
+    double striped_ns = run_writers(striped_writer);
+    AtomicStats_fold(STRIPED, &folded);
+    check(folded.n == THREADS * ROUNDS, "Striped stats lost samples.");
+    AtomicStats_destroy(STRIPED);
+
+    check(LOCKED.n == THREADS * ROUNDS, "Locked stats lost samples.");
+
+    printf("%d threads sampling one record\n", THREADS);
+    printf("  mutex + Stats:      %8.1f ns/sample\n", locked_ns);
+    printf("  atomics, 1 stripe:  %8.1f ns/sample\n", shared_ns);
+    printf("  atomics, %d stripes: %8.1f ns/sample (%.1fx)\n", THREADS,
+            striped_ns, locked_ns / striped_ns);
+
+    return 0;
+error:
+    return 1;
+}
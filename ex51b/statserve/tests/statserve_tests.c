@@ -1,9 +1,29 @@
 #include "minunit.h"
 #include <dlfcn.h>
 #include "statserve.h"
+#include "net.h"
+#include "workers.h"
+#include "wal.h"
+#include "siphash.h"
+#include "iopool.h"
+#include "mirror.h"
+#include "format.h"
+#include "replica.h"
+#include "metrics.h"
 #include <lcthw/bstrlib.h>
 #include <lcthw/ringbuffer.h>
 #include <assert.h>
+#include <ctype.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/file.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <math.h>
+#include <stddef.h>
 
 typedef struct LineTest {
     char *line;
@@ -38,6 +58,8 @@ error:
 }
 
 
+extern __thread RecordMap *DATA;
+
 int run_test_lines(LineTest *tests, int count)
 {
     int i = 0;
@@ -51,13 +73,21 @@ error:
     return 0;
 }
 
+int fake_calls = 0;
+
 int fake_command(Command *cmd, RingBuffer *send_rb, bstring path)
 {
+    struct tagbstring expect[] = {
+        bsStatic("/logins/zed"), bsStatic("/logins")
+    };
+
     check(cmd != NULL, "Bad cmd.");
-    check(cmd->path != NULL, "Bad path.");
     check(send_rb != NULL, "Bad send_rb.");
     check(path != NULL, "Bad path given.");
+    check(fake_calls < 2, "Too many paths scanned.");
+    check(biseq(path, &expect[fake_calls]), "Wrong path %d.", fake_calls);
 
+    fake_calls++;
     return 0;
 error:
     return -1;
@@ -65,12 +95,10 @@ error:
 
 char *test_path_parsing()
 {
-    struct bstrList *result = NULL;
-    struct tagbstring slash = bsStatic("/");
     struct tagbstring logins_zed = bsStatic("/logins/zed");
+    struct tagbstring no_url = bsStatic("zed");
     struct tagbstring command_name = bsStatic("dump");
     RingBuffer *send_rb = RingBuffer_create(1024);
-    struct bstrList *path = bsplits(&logins_zed, &slash);
     int rc = 0;
 
     Command fake = {
@@ -78,14 +106,55 @@ char *test_path_parsing()
         .name = &logins_zed,
         .number = NULL,
         .handler = fake_command,
-        .path = path
+        .recursive = 1
     };
 
-    result = parse_name(&logins_zed);
-    mu_assert(result != NULL, "Failed to parse /logins/zed");
-
     rc = scan_paths(&fake, send_rb); 
     mu_assert(rc != -1, "scan_paths failed.");
+    mu_assert(fake_calls == 2, "scan_paths didn't visit every parent.");
+
+    fake.name = &no_url;
+    rc = scan_paths(&fake, send_rb);
+    mu_assert(rc == -1, "scan_paths should reject a name without a /.");
+
+    RingBuffer_destroy(send_rb);
+    return NULL;
+}
+
+char *test_parse_command()
+{
+    char line[] = "sample /logins/zed 10";
+    char extra[] = "mean /logins extra";
+    char unknown[] = "smaple /logins 10";
+    Command cmd = {.command = NULL};
+    int i = 0;
+    int rc = 0;
+
+    // every command has to sit in the slot its own name hashes to
+    for(i = 0; i < COMMAND_SLOTS; i++) {
+        if(COMMANDS[i].handler) {
+            mu_assert(find_command(&COMMANDS[i].name) == &COMMANDS[i],
+                    "Command table slot doesn't match its hash.");
+        }
+    }
+
+    rc = parse_command(line, strlen(line), &cmd);
+    mu_assert(rc == 0, "Failed to parse sample.");
+    mu_assert(cmd.recursive, "sample should be recursive.");
+    mu_assert(biseqcstr(cmd.name, "/logins/zed"), "Wrong name token.");
+    mu_assert(biseqcstr(cmd.number, "10"), "Wrong number token.");
+
+    rc = parse_command(extra, strlen(extra), &cmd);
+    mu_assert(rc == -1, "mean should take one argument.");
+
+    rc = parse_command(unknown, strlen(unknown), &cmd);
+    mu_assert(rc == -1, "Should not parse an unknown command.");
+
+    // names past MAX_NAME are refused before anything gets made for them
+    char long_name[MAX_NAME + 16] = "mean /";
+    memset(long_name + 6, 'x', MAX_NAME);
+    rc = parse_command(long_name, strlen(long_name), &cmd);
+    mu_assert(rc == -1, "Should not parse a name over MAX_NAME.");
 
     return NULL;
 }
@@ -105,7 +174,7 @@ char *test_create()
 
 char *test_sample()
 {
-    struct tagbstring sample1 = bsStatic("100.000000\n");
+    struct tagbstring sample1 = bsStatic("100\r\n");
 
     LineTest tests[] = {
         {.line = "sample /zed 100", .result = &sample1, .description = "sample zed failed."}
@@ -116,6 +185,419 @@ char *test_sample()
     return NULL;
 }
 
+char *test_rollup_tree()
+{
+    struct tagbstring rollup1 = bsStatic("15\r\n12.5\r\n11.25\r\n");
+    struct tagbstring orphan = bsStatic("20\r\nDNE\r\n11.25\r\n");
+    struct tagbstring relinked = bsStatic("25\r\n13\r\n11.833333333333334\r\n");
+
+    LineTest tests[] = {
+        {.line = "create /api/users/zed 10", .result = &OK, .description = "create tree failed"},
+        {.line = "sample /api/users/zed 20", .result = &rollup1, .description = "rollup failed"},
+        {.line = "delete /api/users", .result = &OK, .description = "delete middle failed"},
+        {.line = "sample /api/users/zed 30", .result = &orphan, .description = "orphan sample failed"},
+        {.line = "create /api/users 1", .result = &OK, .description = "recreate middle failed"},
+        {.line = "sample /api/users/zed 40", .result = &relinked, .description = "relink failed"},
+    };
+
+    mu_assert(run_test_lines(tests, 6), "Failed to run rollup tests.");
+
+    Record *zed = RecordMap_get(DATA, &(struct tagbstring)bsStatic("/api/users/zed"));
+    mu_assert(zed && zed->parent && zed->parent->parent, "Tree isn't linked.");
+    mu_assert(zed->parent->children == zed, "Parent doesn't know its child.");
+
+    return NULL;
+}
+
+char *test_msample_mget()
+{
+    struct tagbstring rollup = bsStatic("2.5\r\n1.75\r\n");
+    struct tagbstring means = bsStatic("2.5 1.2909944487358056\r\n1.75 1.0606601717798212\r\nDNE\r\n");
+    struct tagbstring one = bsStatic("1.75 1.0606601717798212\r\n");
+    struct tagbstring bad = bsStatic("msample /multi/a 5 oops");
+    struct tagbstring empty = bsStatic("msample /multi/a");
+
+    LineTest tests[] = {
+        {.line = "create /multi/a 1", .result = &OK, .description = "create multi failed"},
+        {.line = "msample /multi/a 2 3 4", .result = &rollup, .description = "msample failed"},
+        {.line = "mget /multi/a /multi /nope", .result = &means, .description = "mget failed"},
+        {.line = "mget /multi", .result = &one, .description = "mget one failed"},
+    };
+
+    mu_assert(run_test_lines(tests, 4), "Failed to run msample/mget tests.");
+
+    // a bad value rejects the whole line without sampling any of it
+    RingBuffer *send_rb = RingBuffer_create(1024);
+    mu_assert(parse_line(bstrcpy(&bad), send_rb) == -1, "msample took a bad value.");
+    mu_assert(parse_line(bstrcpy(&empty), send_rb) == -1, "msample took no values.");
+    mu_assert(RingBuffer_empty(send_rb), "Failed msample shouldn't reply.");
+    RingBuffer_destroy(send_rb);
+
+    Stats folded;
+    Record *info = RecordMap_get(DATA, &(struct tagbstring)bsStatic("/multi/a"));
+    mu_assert(info != NULL, "msample lost /multi/a.");
+    AtomicStats_fold(info->stat, &folded);
+    mu_assert(folded.n == 4, "msample sampled the bad line.");
+
+    // MGET_MAX names get a line apiece, one more gets one ERR for all of them
+    struct tagbstring err = bsStatic("ERR\r\n");
+    char lines[3][16 + (MGET_MAX + 2) * 8];
+    bstring many = bfromcstr("");
+    int i = 0;
+    int n = 0;
+
+    for(i = 0; i < MGET_MAX; i++) bcatcstr(many, "DNE\r\n");
+
+    for(n = 0; n < 3; n++) {
+        strcpy(lines[n], "mget");
+        for(i = 0; i < MGET_MAX + n; i++) strcat(lines[n], " /nope");
+    }
+
+    LineTest limits[] = {
+        {.line = lines[0], .result = many, .description = "mget of MGET_MAX failed"},
+        {.line = lines[1], .result = &err, .description = "mget of one too many failed"},
+        {.line = lines[2], .result = &err, .description = "mget of two too many failed"},
+    };
+    mu_assert(run_test_lines(limits, 3), "Failed to run the mget limit tests.");
+    bdestroy(many);
+
+    return NULL;
+}
+
+#define HOT_THREADS 4
+#define HOT_SAMPLES 100000
+
+void *hot_writer(void *arg)
+{
+    AtomicStats *st = arg;
+    int i = 0;
+
+    for(i = 1; i <= HOT_SAMPLES; i++) {
+        AtomicStats_sample(st, i);
+    }
+
+    return NULL;
+}
+
+char *test_atomic_stats()
+{
+    pthread_t threads[HOT_THREADS];
+    int stripes[] = {1, HOT_THREADS};
+    Stats folded;
+    int s = 0;
+    int i = 0;
+
+    for(s = 0; s < 2; s++) {
+        AtomicStats *st = AtomicStats_create(stripes[s]);
+        mu_assert(st != NULL, "Failed to make AtomicStats.");
+
+        for(i = 0; i < HOT_THREADS; i++) {
+            pthread_create(&threads[i], NULL, hot_writer, st);
+        }
+
+        for(i = 0; i < HOT_THREADS; i++) {
+            pthread_join(threads[i], NULL);
+        }
+
+        // whole numbers add exactly, so nothing lost shows up in the sum
+        AtomicStats_fold(st, &folded);
+        mu_assert(folded.n == HOT_THREADS * HOT_SAMPLES, "Lost a sample.");
+        mu_assert(folded.sum == HOT_THREADS * (HOT_SAMPLES * (HOT_SAMPLES + 1.0) / 2),
+                "Lost part of the sum.");
+        mu_assert(folded.min == 1 && folded.max == HOT_SAMPLES, "Wrong min/max.");
+
+        AtomicStats_destroy(st);
+    }
+
+    // loading a Stats puts it back the way it was stored
+    Stats stored = {.sum = 6, .sumsq = 14, .n = 3, .min = 1, .max = 3};
+    AtomicStats *st = AtomicStats_create(HOT_THREADS);
+    AtomicStats_sample(st, 100);
+    AtomicStats_set(st, &stored);
+    AtomicStats_fold(st, &folded);
+    mu_assert(memcmp(&folded, &stored, sizeof(Stats)) == 0, "Set didn't replace the stripes.");
+    AtomicStats_destroy(st);
+
+    return NULL;
+}
+
+int run_lines(const char *lines[], int count)
+{
+    int i = 0;
+    int rc = 0;
+    RingBuffer *send_rb = RingBuffer_create(1024);
+
+    for(i = 0; i < count && rc == 0; i++) {
+        bstring line = bfromcstr(lines[i]);
+        rc = parse_line(line, send_rb);
+        bdestroy(line);
+        send_rb->start = send_rb->end = 0;
+    }
+
+    RingBuffer_destroy(send_rb);
+    return rc;
+}
+
+int same_record(RecordMap *a, RecordMap *b, char *name)
+{
+    struct tagbstring key;
+    Stats sa;
+    Stats sb;
+
+    btfromcstr(key, name);
+    Record *ra = RecordMap_get(a, &key);
+    Record *rb = RecordMap_get(b, &key);
+    if(ra == NULL || rb == NULL) return ra == rb;
+
+    AtomicStats_fold(ra->stat, &sa);
+    AtomicStats_fold(rb->stat, &sb);
+    if(memcmp(&sa, &sb, sizeof(Stats)) != 0) return 0;
+
+    // up to the end of the last bin, the tail padding is whatever
+    if(ra->sketch == NULL || rb->sketch == NULL) return ra->sketch == rb->sketch;
+    return memcmp(ra->sketch, rb->sketch, offsetof(Sketch, neg) + sizeof(SketchStore)) == 0;
+}
+
+char *test_wal_recover()
+{
+    char dir[] = "/tmp/statserve-wal-XXXXXX";
+    char *names[] = {"/wal", "/wal/a", "/wal/b", "/wal/gone", "/other"};
+    const char *before[] = {"create /wal/a 1", "create /wal/b 2", "sample /wal/a 3",
+        "msample /wal/b 4 5 6", "create /other 7"};
+    const char *after[] = {"sample /wal/a 0.1", "create /wal/gone 1",
+        "delete /wal/gone", "delete /wal/b", "sample /other 8"};
+    const char *tail[] = {"sample /wal/a 9"};
+    RecordMap *saved = DATA;
+    RecordMap *live = RecordMap_create();
+    RecordMap *shards[2] = {RecordMap_create(), RecordMap_create()};
+    RecordMap *again = RecordMap_create();
+    Wal *wals[2] = {NULL, NULL};
+    Wal *wal = NULL;
+    int i = 0;
+
+    mu_assert(mkdtemp(dir) != NULL, "Failed to make a store directory.");
+    // just like run_event_server, straight into the thread's WAL
+    mu_assert(Wal_recover(dir, &live, &WAL, 1, NULL) == 0, "Failed to start an empty log.");
+    mu_assert(WAL != NULL, "Recovery didn't set WAL.");
+    wal = WAL;
+
+    // half goes into a checkpoint, the rest only into the log
+    DATA = live;
+    mu_assert(run_lines(before, 5) == 0, "Failed to run the first batch.");
+    mu_assert(Wal_checkpoint(wal, 0) == 0, "Failed to checkpoint.");
+    mu_assert(run_lines(after, 5) == 0, "Failed to run the second batch.");
+    mu_assert(Wal_commit(wal) == 0, "Failed to commit.");
+    Wal_destroy(wal);
+    WAL = NULL;
+
+    mu_assert(RecordMap_get(live, &(struct tagbstring)bsStatic("/wal/a")) != NULL, "Lost /wal/a.");
+    mu_assert(RecordMap_get(live, &(struct tagbstring)bsStatic("/wal/b")) == NULL, "Kept /wal/b.");
+
+    // come back up with two shards instead of one
+    mu_assert(Wal_recover(dir, shards, wals, 2, shard_for_name) == 0, "Failed to recover.");
+    for(i = 0; i < 5; i++) {
+        RecordMap *owner = shards[shard_for_name(names[i], names[i] + strlen(names[i]), 2)];
+        mu_assert(same_record(live, owner, names[i]), "Recovered the wrong stats.");
+    }
+
+    bstring path = bformat("%s/wal-1-0", dir);
+    mu_assert(access(bdata(path), F_OK) == -1, "Old generation wasn't removed.");
+    bdestroy(path);
+
+    // a torn write at the end of the log is ignored
+    int owner = shard_for_name(names[0], names[0] + strlen(names[0]), 2);
+    DATA = live;
+    mu_assert(run_lines(tail, 1) == 0, "Failed to run the tail live.");
+    DATA = shards[owner];
+    WAL = wals[owner];
+    mu_assert(run_lines(tail, 1) == 0, "Failed to run the tail.");
+    mu_assert(Wal_commit(WAL) == 0, "Failed to commit the tail.");
+    WAL = NULL;
+
+    path = bformat("%s/wal-2-%d", dir, owner);
+    int fd = open(bdata(path), O_WRONLY | O_APPEND);
+    mu_assert(fd >= 0 && write(fd, "\x01\x02\x03", 3) == 3, "Failed to tear the log.");
+    close(fd);
+    bdestroy(path);
+    Wal_destroy(wals[0]);
+    Wal_destroy(wals[1]);
+
+    mu_assert(Wal_recover(dir, &again, &wal, 1, NULL) == 0, "Failed to recover the torn log.");
+    for(i = 0; i < 5; i++) {
+        mu_assert(same_record(live, again, names[i]), "Torn log recovered wrong.");
+    }
+
+    Wal_destroy(wal);
+    DATA = saved;
+    return NULL;
+}
+
+char *test_replication()
+{
+    char dir[] = "/tmp/statserve-feed-XXXXXX";
+    char *names[] = {"/feed", "/feed/a", "/feed/b", "/feed/c", "/other"};
+    const char *before[] = {"create /feed/a 1", "create /feed/b 2", "sample /feed/a 3",
+        "create /other 4"};
+    const char *after[] = {"sample /feed/b 5", "create /feed/c 6", "delete /other"};
+    char buffer[64 * 1024];
+    RecordMap *saved = DATA;
+    RecordMap *primary = RecordMap_create();
+    RecordMap *replica = RecordMap_create();
+    Wal *wal = NULL;
+    int fds[2] = {-1, -1};
+    int beats = 0;
+    int checkpoints = 0;
+    size_t used = 0;
+    size_t at = 0;
+    WalEntry entry;
+    char *payload = NULL;
+    int shard = -1;
+    int i = 0;
+
+    mu_assert(is_replicate_request("replicate 3", 11, &shard) && shard == 3,
+            "Didn't take replicate 3.");
+    mu_assert(!is_replicate_request("replicate x", 11, &shard), "Took replicate x.");
+
+    mu_assert(mkdtemp(dir) != NULL, "Failed to make a store directory.");
+    mu_assert(Wal_recover(dir, &primary, &WAL, 1, NULL) == 0, "Failed to start the log.");
+    wal = WAL;
+    DATA = primary;
+    mu_assert(run_lines(before, 4) == 0, "Failed to run the first batch.");
+
+    // the snapshot goes out as soon as it starts, the rest as it commits
+    mu_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "Failed to make a socketpair.");
+    Connection *conn = Connection_create(fds[0]);
+    mu_assert(conn != NULL, "Failed to make the connection.");
+    mu_assert(Feed_start(conn, wal) == 0, "Failed to start the feed.");
+    mu_assert(run_lines(after, 3) == 0, "Failed to run the second batch.");
+    mu_assert(Wal_commit(wal) == 0, "Failed to commit.");
+
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    ssize_t rc = 0;
+    while((rc = read(fds[1], buffer + used, sizeof(buffer) - used)) > 0) used += rc;
+
+    struct Replay *replay = Replay_create(&replica, 1, NULL);
+    mu_assert(replay != NULL, "Failed to make the replay.");
+    while(Wal_next_entry(buffer, used, &at, &entry, &payload)) {
+        if(entry.type == WAL_HEARTBEAT) beats++;
+        if(entry.type == WAL_CHECKPOINT) checkpoints++;
+        mu_assert(Replay_apply(replay, &entry, payload) == 0, "Failed to apply an entry.");
+    }
+    mu_assert(at == used, "Left part of an entry.");
+    mu_assert(beats == 1 && checkpoints == 1, "Wrong heartbeats or checkpoints.");
+
+    DATA = primary;
+    for(i = 0; i < 5; i++) {
+        mu_assert(same_record(primary, replica, names[i]), "The replica doesn't match.");
+    }
+
+    // a replica won't take anything that would change it
+    READ_ONLY = 1;
+    RingBuffer *send_rb = RingBuffer_create(1024);
+    bstring line = bfromcstr("sample /feed/a 7");
+    mu_assert(parse_line(line, send_rb) == 0, "Failed to refuse the sample.");
+    mu_assert(RingBuffer_available_data(send_rb) > 0 && send_rb->buffer[0] == 'E',
+            "The sample wasn't refused.");
+    READ_ONLY = 0;
+    bdestroy(line);
+    RingBuffer_destroy(send_rb);
+
+    Replay_destroy(replay);
+    Connection_destroy(conn);
+    close(fds[0]);
+    close(fds[1]);
+    Wal_destroy(wal);
+    WAL = NULL;
+    DATA = saved;
+    return NULL;
+}
+
+Connection *feed_connection(int epoll_fd, int *peer)
+{
+    int fds[2] = {-1, -1};
+    int small = 4096;
+    struct epoll_event ev = {.events = EPOLLIN};
+
+    check(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "Failed to make a socketpair.");
+    // so a few KB nobody reads is enough to back it up
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &small, sizeof(small));
+    nonblock(fds[0]);
+
+    Connection *conn = Connection_create(fds[0]);
+    check_mem(conn);
+    conn->epoll_fd = epoll_fd;
+    ev.data.ptr = conn;
+    check(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[0], &ev) == 0, "Failed to add to epoll.");
+
+    *peer = fds[1];
+    return conn;
+error:
+    return NULL;
+}
+
+char *test_feed_limits()
+{
+    char dir[] = "/tmp/statserve-limits-XXXXXX";
+    const char *lines[] = {"create /limits/a 1", "create /limits/b 2"};
+    char junk[40 * 1024];
+    RecordMap *saved = DATA;
+    RecordMap *primary = RecordMap_create();
+    long backlog = REPLICA_BACKLOG;
+    int epoll_fd = epoll_create1(0);
+    int peers[3] = {-1, -1, -1};
+    Connection *conns[3] = {NULL, NULL, NULL};
+    int i = 0;
+
+    mu_assert(mkdtemp(dir) != NULL, "Failed to make a store directory.");
+    mu_assert(Wal_recover(dir, &primary, &WAL, 1, NULL) == 0, "Failed to start the log.");
+    DATA = primary;
+    mu_assert(run_lines(lines, 2) == 0, "Failed to make the records.");
+    for(i = 0; i < 3; i++) {
+        conns[i] = feed_connection(epoll_fd, &peers[i]);
+        mu_assert(conns[i] != NULL, "Failed to make a connection.");
+    }
+
+    // over TCP it's refused unless asked for, from the unix socket it's fine
+    REPLICATE_TCP = 0;
+    mu_assert(client_run(conns[0], "replicate 0", 11) == 0, "Failed to refuse replicate.");
+    mu_assert(conns[0]->feed == NULL, "Replicated over TCP.");
+    mu_assert(RingBuffer_available_data(conns[0]->send_rb) > 0
+            && conns[0]->send_rb->buffer[0] == 'E', "Replicate over TCP wasn't an ERR.");
+
+    conns[1]->local = 1;
+    mu_assert(client_run(conns[1], "replicate 0", 11) == 0, "Failed to replicate locally.");
+    mu_assert(conns[1]->feed != NULL, "Didn't replicate on the unix socket.");
+
+    REPLICATE_TCP = 1;
+    mu_assert(client_run(conns[2], "replicate 0", 11) == 0, "Failed to replicate.");
+    mu_assert(conns[2]->feed != NULL, "Didn't replicate once it's allowed.");
+    REPLICATE_TCP = 0;
+
+    // each is under the backlog on its own, but not the two of them
+    REPLICA_BACKLOG = 64 * 1024;
+    memset(junk, 'x', sizeof(junk));
+    Feed_ship(conns[1]->feed, junk, sizeof(junk));
+    mu_assert(!conns[1]->feed->dropped, "Dropped a feed under the backlog.");
+    mu_assert(Feed_backlog() > 0, "Nothing counted behind.");
+    Feed_ship(conns[2]->feed, junk, sizeof(junk));
+    mu_assert(conns[2]->feed->dropped, "The feeds together went over the backlog.");
+    mu_assert(!conns[1]->feed->dropped, "Dropped the wrong feed.");
+
+    for(i = 0; i < 3; i++) {
+        close(conns[i]->fd);
+        Connection_destroy(conns[i]);
+        close(peers[i]);
+    }
+    mu_assert(Feed_backlog() == 0, "The feeds still count for something once gone.");
+
+    REPLICA_BACKLOG = backlog;
+    close(epoll_fd);
+    Wal_destroy(WAL);
+    WAL = NULL;
+    DATA = saved;
+    return NULL;
+}
+
 char *test_store_load()
 {
     LineTest tests[] = {
@@ -131,47 +613,1496 @@ char *test_store_load()
     return NULL;
 }
 
-char *test_encrypt_armor_name()
+int sketch_close(double got, double want)
 {
-    struct tagbstring test1 = bsStatic("/logins");
-    struct tagbstring expect1 = bsStatic("vtmTmzNI");
-    struct tagbstring test2 = bsStatic("../../../../../../../../etc/passwd");
-    struct tagbstring expect2 = bsStatic("pVOBpFjHEIhB7cuT3BGUvyZGn3lvyj226mgggggg");
-   
-    bstring result = encrypt_armor_name(&test1);
-    debug("Got encrypted name %s", bdata(result));
-    mu_assert(biseq(result, &expect1), "Failed to encrypt test2.");
-    bdestroy(result);
+    // a value right on a bin's edge is exactly alpha off, give it rounding
+    return fabs(got - want) <= fabs(want) * SKETCH_ALPHA * (1 + 1e-9);
+}
 
-    result = encrypt_armor_name(&test2);
-    debug("Got encrypted name %s", bdata(result));
-    mu_assert(biseq(result, &expect2), "Failed to encrypt test2.");
-    bdestroy(result);
+char *test_sketch()
+{
+    Sketch *sk = Sketch_create();
+    Sketch odd;
+    Sketch even;
+    double qs[] = {0.0, 0.01, 0.5, 0.9, 0.99, 1.0};
+    int i = 0;
+
+    mu_assert(sk != NULL, "Failed to make a sketch.");
+    Sketch_init(&odd);
+    Sketch_init(&even);
+    mu_assert(isnan(Sketch_quantile(sk, 0.5)), "An empty sketch has no quantiles.");
+
+    for(i = 1; i <= 10000; i++) {
+        Sketch_add(sk, i);
+        Sketch_add(i % 2 ? &odd : &even, i);
+    }
+    Sketch_merge(&odd, &even);
+
+    for(i = 0; i < (int)(sizeof(qs) / sizeof(qs[0])); i++) {
+        double expect = floor(qs[i] * 9999) + 1;
+        double got = Sketch_quantile(sk, qs[i]);
+
+        debug("q %f expect %f got %f", qs[i], expect, got);
+        mu_assert(sketch_close(got, expect), "Quantile is too far off.");
+        mu_assert(Sketch_quantile(&odd, qs[i]) == got, "Merged halves don't match.");
+    }
 
+    // negatives come before zero, and zero before the positives
+    Sketch_init(&odd);
+    Sketch_add(&odd, -50);
+    Sketch_add(&odd, 0);
+    Sketch_add(&odd, 50);
+    mu_assert(sketch_close(Sketch_quantile(&odd, 0), -50), "Wrong negative.");
+    mu_assert(Sketch_quantile(&odd, 0.5) == 0.0, "Wrong zero.");
+    mu_assert(sketch_close(Sketch_quantile(&odd, 1), 50), "Wrong positive.");
+
+    // far wider than the window, the bottom folds but the tail holds
+    Sketch_init(&odd);
+    for(i = 0; i < 1000; i++) {
+        Sketch_add(&odd, pow(10, -6 + i * 12.0 / 999));
+    }
+    double p99 = pow(10, -6 + 989 * 12.0 / 999);
+    mu_assert(sketch_close(Sketch_quantile(&odd, 0.99), p99),
+            "Lost the tail after folding.");
+    mu_assert(odd.n == 1000, "Folding lost samples.");
+
+    Sketch_destroy(sk);
     return NULL;
 }
 
-char *test_path_sanitize_armor()
+char *test_percentile()
 {
-    struct tagbstring base = bsStatic("/tmp");
-    struct tagbstring test1 = bsStatic("/somepath/here/there");
-    bstring encname = encrypt_armor_name(&test1);
-    bstring expect = bformat("%s/%s", bdata(&base), bdata(encname));
-    struct tagbstring test2 = bsStatic("../../../../../../../../etc/passwd");
+    struct tagbstring rollup = bsStatic("2.5\r\n1.75\r\n");
+    struct tagbstring top = bsStatic("4\r\n2.5\r\n");
+    struct tagbstring bottom = bsStatic("1\r\n1\r\n");
+    struct tagbstring loaded = bsStatic("4\r\n");
+    struct tagbstring err = bsStatic("ERR\r\n");
+    bstring bad = bfromcstr("percentile /pct/a 2");
+    RingBuffer *send_rb = RingBuffer_create(1024);
+
+    LineTest tests[] = {
+        {.line = "create /pct/a 1", .result = &OK, .description = "create pct failed"},
+        {.line = "msample /pct/a 2 3 4", .result = &rollup, .description = "msample pct failed"},
+        // 0 and 1 are the real min and max all the way up
+        {.line = "percentile /pct/a 1", .result = &top, .description = "p100 failed"},
+        {.line = "percentile /pct/a 0", .result = &bottom, .description = "p0 failed"},
+        {.line = "store /pct/a", .result = &OK, .description = "store pct failed"},
+        {.line = "load /pct/a /pctload", .result = &OK, .description = "load pct failed"},
+        {.line = "percentile /pctload 1", .result = &loaded, .description = "loaded p100 failed"},
+        {.line = "delete /pctload", .result = &OK, .description = "delete pctload failed"},
+    };
+
+    mu_assert(run_test_lines(tests, 8), "Failed to run percentile tests.");
+
+    struct tagbstring name = bsStatic("/pct/a");
+    Record *info = RecordMap_get(DATA, &name);
+    mu_assert(info && info->sketch && info->sketch->n == 4, "The sketch missed samples.");
+    mu_assert(sketch_close(Sketch_quantile(info->sketch, 0.5), 2),
+            "Wrong median.");
+
+    mu_assert(parse_line(bad, send_rb) == -1, "A quantile over 1 should fail.");
+
+    // records made with sketches off have nothing to answer with
+    SKETCHES = 0;
+    LineTest off[] = {
+        {.line = "create /nosketch 1", .result = &OK, .description = "create nosketch failed"},
+        {.line = "percentile /nosketch 0.5", .result = &err, .description = "nosketch failed"},
+        {.line = "delete /nosketch", .result = &OK, .description = "delete nosketch failed"},
+    };
+    mu_assert(run_test_lines(off, 3), "Failed to run the nosketch tests.");
+    SKETCHES = 1;
+
+    bdestroy(bad);
+    RingBuffer_destroy(send_rb);
+    return NULL;
+}
+
+char *test_window()
+{
+    Window *w = Window_create(60, 100);
+    Stats batch = {.n = 0};
+    Stats st;
+
+    mu_assert(w != NULL, "Failed to make a window.");
+
+    Window_sample(w, 100, 1);
+    Window_sample(w, 100, 3);
+    Window_sample(w, 130, 5);
+
+    Window_fold(w, 130, 60, &st);
+    mu_assert(st.n == 3 && st.min == 1 && st.max == 5, "Wrong whole window.");
+    Window_fold(w, 130, 30, &st);
+    mu_assert(st.n == 1 && st.sum == 5, "Second 100 is past a 30 second window.");
+    mu_assert(Window_rate(w, 130) == 3.0 / 31, "Rate should only count since born.");
+
+    // 160 lands in 100's bucket and empties it first
+    Window_sample(w, 160, 7);
+    Window_fold(w, 160, 60, &st);
+    mu_assert(st.n == 2 && st.min == 5 && st.max == 7, "Old second wasn't expired.");
+    mu_assert(Window_rate(w, 200) == 1.0 / 60, "Wrong rate over the full window.");
+
+    // long quiet, every bucket is stale without anything clearing them
+    Window_fold(w, 500, 60, &st);
+    mu_assert(st.n == 0, "Stale buckets were counted.");
+
+    Stats_sample(&batch, 2);
+    Stats_sample(&batch, 4);
+    Window_merge(w, 500, &batch);
+    WINDOW_REPLAY = 1;
+    Window_sample(w, 500, 100);
+    WINDOW_REPLAY = 0;
+    Window_fold(w, 500, 1, &st);
+    mu_assert(st.n == 2 && st.sum == 6, "Merge or replay went wrong.");
+
+    Window_destroy(w);
+    return NULL;
+}
+
+char *test_window_commands()
+{
+    struct tagbstring both = bsStatic("2 1.4142135623730951 4 10 2 1 3\r\n"
+            "1.5 0.7071067811865476 3 5 2 1 2\r\n");
+    struct tagbstring err = bsStatic("ERR\r\n");
+    bstring bad = bfromcstr("window /win/a 61");
+    RingBuffer *send_rb = RingBuffer_create(1024);
+
+    LineTest tests[] = {
+        {.line = "create /win/a 1", .result = &OK, .description = "create win failed"},
+        {.line = "sample /win/a 3", .result = &(struct tagbstring)bsStatic("2\r\n1.5\r\n"),
+            .description = "sample win failed"},
+        {.line = "window /win/a 60", .result = &both, .description = "window failed"},
+        {.line = "delete /win/a", .result = &OK, .description = "delete win/a failed"},
+        {.line = "delete /win", .result = &OK, .description = "delete win failed"},
+    };
 
+    mu_assert(run_test_lines(tests, 3), "Failed to run window tests.");
+    mu_assert(parse_line(bad, send_rb) == -1, "A window past the ring should fail.");
+    mu_assert(run_test_lines(tests + 3, 2), "Failed to clean up the window tests.");
+
+    WINDOW_SECONDS = 0;
+    LineTest off[] = {
+        {.line = "create /nowin 1", .result = &OK, .description = "create nowin failed"},
+        {.line = "rate /nowin", .result = &err, .description = "nowin rate failed"},
+        {.line = "delete /nowin", .result = &OK, .description = "delete nowin failed"},
+    };
+    mu_assert(run_test_lines(off, 3), "Failed to run the no window tests.");
+    WINDOW_SECONDS = 60;
+
+    bdestroy(bad);
+    RingBuffer_destroy(send_rb);
+    return NULL;
+}
+
+void *intern_churner(void *arg)
+{
+    char text[64];
+    struct tagbstring name;
+    bstring held[64];
+    long i = 0;
+    int j = 0;
+
+    // every thread on the same names, adding and letting go at once
+    for(i = 0; i < 64 * 300; i++) {
+        snprintf(text, sizeof(text), "/intern/threads/%ld", i % 500);
+        btfromcstr(name, text);
+        held[i % 64] = Intern_add(&name);
+        if(held[i % 64] == NULL || !biseq(held[i % 64], &name)) return arg;
+        if(i % 64 == 63) {
+            for(j = 0; j < 64; j++) Intern_release(held[j]);
+        }
+    }
+
+    return NULL;
+}
+
+char *test_intern()
+{
+    struct tagbstring name = bsStatic("/intern/a");
+    char text[64];
+    size_t before = Intern_count();
+    int i = 0;
+
+    // same bytes from anywhere come back as the same pointer
+    bstring first = Intern_add(&name);
+    bstring again = Intern_add(&(struct tagbstring)bsStatic("/intern/a"));
+    mu_assert(first != NULL && first == again, "Same name interned twice.");
+    mu_assert(first != &name && biseq(first, &name), "Interned name isn't a copy.");
+    mu_assert(Intern_find(&name) == first, "Didn't find an interned name.");
+    mu_assert(Intern_find(&(struct tagbstring)bsStatic("/intern/b")) == NULL,
+            "Found a name that was never interned.");
+    mu_assert(bcatcstr(first, "x") != BSTR_OK, "An interned name was changed.");
+
+    // past the first table, so everything has moved at least once
+    for(i = 0; i < INTERN_BUCKETS_MIN * 3; i++) {
+        snprintf(text, sizeof(text), "/intern/grow/%d", i);
+        struct tagbstring grown;
+        btfromcstr(grown, text);
+        mu_assert(Intern_add(&grown) != NULL, "Failed to intern a name.");
+    }
+    for(i = 0; i < INTERN_BUCKETS_MIN * 3; i++) {
+        snprintf(text, sizeof(text), "/intern/grow/%d", i);
+        struct tagbstring grown;
+        btfromcstr(grown, text);
+        mu_assert(Intern_find(&grown) != NULL, "Lost a name when the table grew.");
+    }
+    mu_assert(Intern_find(&name) == first, "First name moved.");
+
+    mu_assert(Intern_count() - before == INTERN_BUCKETS_MIN * 3 + 1,
+            "Wrong number of interned names.");
+
+    // a record's name is the interned one, and it's the map key
+    RecordMap *map = RecordMap_create();
+    Record *info = Record_create(&name);
+    mu_assert(info && info->name == first, "Record didn't use the interned name.");
+    mu_assert(RecordMap_set(map, info) == 0, "Failed to add the record.");
+    mu_assert(RecordMap_get(map, &(struct tagbstring)bsStatic("/intern/a")) == info,
+            "Record_find missed.");
+    Record_destroy(info);
+    RecordMap_destroy(map);
+
+    // the last reference let go takes it out
+    before = Intern_count();
+    Intern_release(first);
+    mu_assert(Intern_find(&name) == first, "Freed a name that's still held.");
+    Intern_release(again);
+    mu_assert(Intern_find(&name) == NULL, "A name nobody holds is still in.");
+    mu_assert(Intern_count() == before - 1, "Releasing didn't count it out.");
+
+    // so is a deleted record's
+    LineTest churn[] = {
+        {.line = "create /intern/gone 1", .result = &OK, .description = "create gone failed"},
+        {.line = "delete /intern/gone", .result = &OK, .description = "delete gone failed"},
+    };
+    mu_assert(run_test_lines(churn, 2), "Failed to create and delete.");
+    mu_assert(Intern_find(&(struct tagbstring)bsStatic("/intern/gone")) == NULL,
+            "A deleted record's name is still in.");
+
+    // names coming and going in a window don't grow the arenas: the
+    // second pass has ten times the names of the first, none the same
+    static bstring held[1000];
+    size_t bytes = 0;
+    int pass = 0;
+
+    for(pass = 0; pass < 2; pass++) {
+        int total = pass == 0 ? 20000 : 200000;
+
+        for(i = 0; i < total + 1000; i++) {
+            if(i >= 1000) Intern_release(held[i % 1000]);
+            if(i >= total) continue;
+
+            snprintf(text, sizeof(text), "/intern/churn/%d/%d", pass, i);
+            struct tagbstring churned;
+            btfromcstr(churned, text);
+            held[i % 1000] = Intern_add(&churned);
+            mu_assert(held[i % 1000] != NULL, "Failed to intern a churned name.");
+        }
+
+        if(pass == 0) bytes = Intern_bytes();
+    }
+    mu_assert(Intern_bytes() <= bytes, "Churning names grew the intern arenas.");
+
+    pthread_t threads[HOT_THREADS];
+    void *failed = NULL;
+    before = Intern_count();
+
+    for(i = 0; i < HOT_THREADS; i++) {
+        mu_assert(pthread_create(&threads[i], NULL, intern_churner, &failed) == 0,
+                "Failed to start a thread.");
+    }
+    for(i = 0; i < HOT_THREADS; i++) {
+        pthread_join(threads[i], &failed);
+        mu_assert(failed == NULL, "A thread got the wrong name back.");
+    }
+    mu_assert(Intern_count() == before, "Threads left names behind.");
+
+    return NULL;
+}
+
+char *test_record_slab()
+{
+    struct tagbstring name = bsStatic("/slab/a");
+    Slab *slab = &RECORDS[STATS_STRIPES];
+    int stripes = STATS_STRIPES;
+
+    Record *info = Record_create(&name);
+    mu_assert(info != NULL, "Failed to create a record.");
+    long live = slab->live;
+
+    // one object, on its own line, with the stats a line further in
+    mu_assert(((uintptr_t)info % SLAB_ALIGN) == 0, "Record isn't cache line aligned.");
+    mu_assert((char *)info->stat > (char *)info
+            && (char *)info->stat + AtomicStats_size(stripes) <= (char *)info + slab->size,
+            "Stats aren't inside the record's object.");
+    mu_assert(((uintptr_t)info->stat % SLAB_ALIGN) == 0, "Stats aren't aligned.");
+
+    Record_sample(info, 5.0);
+    mu_assert(AtomicStats_mean(info->stat) == 5.0, "Inline stats don't work.");
+
+    // churn goes straight back to the free list, and comes back clean
+    Record_destroy(info);
+    mu_assert(slab->live == live - 1, "Destroy didn't free to the slab.");
+    Record *again = Record_create(&name);
+    mu_assert(again == info, "The freed object wasn't reused.");
+    mu_assert(again->children == NULL && again->version == 1, "Reused record isn't reset.");
+    mu_assert(again->stat->stripe[0].n == 0, "Reused stats aren't reset.");
+
+    // other stripe counts get their own slab
+    STATS_STRIPES = 4;
+    Record *wide = Record_create(&name);
+    mu_assert(wide && wide->stat->stripes == 4, "Wrong stripe count.");
+    mu_assert(RECORDS[4].size >= sizeof(Record) + AtomicStats_size(4), "Slab too small.");
+    Record_destroy(wide);
+    STATS_STRIPES = stripes;
+
+    Record_destroy(again);
+
+    return NULL;
+}
+
+int count_record(Record *info, void *context)
+{
+    (void)info;
+    (*(int *)context)++;
+    return 0;
+}
+
+char *test_recordmap()
+{
+    static Record records[5000];
+    struct tagbstring name;
+    char text[64];
+    int count = 0;
+    int i = 0;
+
+    RecordMap *map = RecordMap_create();
+    mu_assert(map != NULL, "Failed to create a record map.");
+
+    for(i = 0; i < 5000; i++) {
+        snprintf(text, sizeof(text), "/map/%d", i);
+        btfromcstr(name, text);
+        records[i].name = Intern_add(&name);
+        mu_assert(RecordMap_set(map, &records[i]) == 0, "Failed to set.");
+
+        // every third one goes again, so deletes land mid-move too
+        if(i % 3 == 0) {
+            mu_assert(RecordMap_delete(map, records[i].name) == &records[i],
+                    "Delete returned the wrong record.");
+        }
+
+        // it's always growing, so this checks both tables
+        if(i % 97 == 0) {
+            mu_assert(RecordMap_get(map, records[i / 2].name) ==
+                    ((i / 2) % 3 == 0 ? NULL : &records[i / 2]),
+                    "Lost a record while growing.");
+        }
+    }
+
+    mu_assert(RecordMap_count(map) == 5000 - 1667, "Wrong count.");
+
+    // a copy of the bytes finds it as well as the interned name does
+    for(i = 0; i < 5000; i++) {
+        snprintf(text, sizeof(text), "/map/%d", i);
+        btfromcstr(name, text);
+        mu_assert(RecordMap_get(map, &name) == (i % 3 == 0 ? NULL : &records[i]),
+                "Wrong record for a name.");
+    }
+    mu_assert(RecordMap_get(map, &(struct tagbstring)bsStatic("/map/nope")) == NULL,
+            "Found a name that was never set.");
+
+    mu_assert(RecordMap_traverse(map, count_record, &count) == 0, "Traverse failed.");
+    mu_assert(count == 5000 - 1667, "Traverse didn't see every record once.");
+
+    RecordMap_destroy(map);
+
+    return NULL;
+}
+
+char *test_recordmap_collide()
+{
+    static Record records[113];
+    struct tagbstring name;
+    char text[64];
+    int count = 0;
+    int round = 0;
+    int i = 0;
+
+    RecordMap *map = RecordMap_create();
+    mu_assert(map != NULL, "Failed to create a record map.");
+
+    // all in the last slot of 128, so at 7/8 full their one run wraps
+    // around past slot 0 and the 113th set grows it in the middle of that
+    for(i = 0; count < 113; i++) {
+        snprintf(text, sizeof(text), "/collide/%d", i);
+        btfromcstr(name, text);
+        if((Intern_hash(&name) & 127) != 127) continue;
+
+        records[count].name = Intern_add(&name);
+        mu_assert(RecordMap_set(map, &records[count]) == 0, "Failed to set.");
+        count++;
+    }
+
+    mu_assert(map->old.slot != NULL, "The last set didn't start a grow.");
+
+    // a delete per round, every get checked while the move goes on
+    for(round = 0; map->old.slot != NULL; round++) {
+        for(i = round; i < 113; i++) {
+            mu_assert(RecordMap_get(map, records[i].name) == &records[i],
+                    "Lost a colliding record mid-grow.");
+        }
+
+        mu_assert(RecordMap_delete(map, records[round].name) == &records[round],
+                "Delete mid-grow returned the wrong record.");
+        mu_assert(RecordMap_get(map, records[round].name) == NULL,
+                "A deleted record is still there.");
+    }
+
+    for(i = round; i < 113; i++) {
+        mu_assert(RecordMap_get(map, records[i].name) == &records[i],
+                "Lost a colliding record after the grow.");
+    }
+    mu_assert(RecordMap_count(map) == (size_t)(113 - round), "Wrong count after the grow.");
+
+    count = 0;
+    mu_assert(RecordMap_traverse(map, count_record, &count) == 0, "Traverse failed.");
+    mu_assert(count == 113 - round, "Traverse didn't see every record once.");
+
+    RecordMap_destroy(map);
+
+    return NULL;
+}
+
+int collect_name(Record *info, void *context)
+{
+    bstring out = context;
+    bconcat(out, info->name);
+    bconchar(out, ' ');
+    return 0;
+}
+
+int stop_at_two(Record *info, void *context)
+{
+    (void)info;
+    return ++(*(int *)context) == 2 ? 7 : 0;
+}
+
+int check_order(Record *info, void *context)
+{
+    static char last[64];
+    int *seen = context;
+
+    // strictly increasing, and every one of them under /bulk/
+    if(*seen > 0 && strcmp(last, (char *)info->name->data) >= 0) return -1;
+    snprintf(last, sizeof(last), "%s", info->name->data);
+    (*seen)++;
+    return 0;
+}
+
+char *test_nameindex()
+{
+    char *names[] = {
+        "/logins", "/logins/zed", "/logins-old", "/logins/amy",
+        "/logins/amy/2fa", "/log", "/logout", "/logins/b"
+    };
+    static Record records[3000];
+    Record some[8];
+    NameIndex index = {.root = NULL};
+    struct tagbstring name;
+    struct tagbstring all = bsStatic("");
+    struct tagbstring under = bsStatic("/logins/");
+    struct tagbstring amy = bsStatic("/logins/amy");
+    struct tagbstring bulk = bsStatic("/bulk/");
+    bstring out = bfromcstr("");
+    char text[64];
+    int seen = 0;
+    int i = 0;
+
+    for(i = 0; i < 8; i++) {
+        btfromcstr(name, names[i]);
+        some[i].name = Intern_add(&name);
+        mu_assert(NameIndex_add(&index, &some[i]) == 0, "Failed to add a name.");
+    }
+    mu_assert(NameIndex_add(&index, &some[0]) == -1, "Added a name twice.");
+    mu_assert(index.count == 8, "Wrong count.");
+
+    // byte order, and a name comes before everything it's a prefix of
+    NameIndex_walk(&index, &all, 1, &all, collect_name, out);
+    mu_assert(biseqcstr(out, "/log /logins /logins-old /logins/amy /logins/amy/2fa "
+                "/logins/b /logins/zed /logout "), "Walked out of order.");
+
+    btrunc(out, 0);
+    NameIndex_walk(&index, &under, 1, &under, collect_name, out);
+    mu_assert(biseqcstr(out, "/logins/amy /logins/amy/2fa /logins/b /logins/zed "),
+            "Prefix walk went outside the subtree.");
+
+    // picking up after a name that's gone since
+    mu_assert(NameIndex_remove(&index, &amy) == &some[3], "Removed the wrong record.");
+    mu_assert(NameIndex_remove(&index, &amy) == NULL, "Removed a name twice.");
+    btrunc(out, 0);
+    NameIndex_walk(&index, &amy, 0, &under, collect_name, out);
+    mu_assert(biseqcstr(out, "/logins/amy/2fa /logins/b /logins/zed "),
+            "Resuming after a deleted name went wrong.");
+
+    mu_assert(NameIndex_walk(&index, &all, 1, &all, stop_at_two, &seen) == 7,
+            "A callback couldn't stop the walk.");
+    mu_assert(seen == 2, "Walk kept going after it was stopped.");
+
+    for(i = 0; i < 3000; i++) {
+        snprintf(text, sizeof(text), "/bulk/%d", i * 7919 % 3000);
+        btfromcstr(name, text);
+        records[i].name = Intern_add(&name);
+        mu_assert(NameIndex_add(&index, &records[i]) == 0, "Failed to add in bulk.");
+        if(i % 3 == 0) {
+            mu_assert(NameIndex_remove(&index, records[i].name) == &records[i],
+                    "Bulk remove returned the wrong record.");
+        }
+    }
+
+    seen = 0;
+    mu_assert(NameIndex_walk(&index, &bulk, 1, &bulk, check_order, &seen) == 0,
+            "Bulk walk out of order.");
+    mu_assert(seen == 2000, "Bulk walk missed names.");
+
+    bdestroy(out);
+    NameIndex_clear(&index);
+
+    return NULL;
+}
+
+char *test_lazy_rollup()
+{
+    struct tagbstring three = bsStatic("3\r\n");
+    struct tagbstring four = bsStatic("4\r\n");
+    struct tagbstring five = bsStatic("5\r\n");
+    struct tagbstring both = bsStatic("3\r\n3\r\n");
+    struct tagbstring dump = bsStatic("3 2 9 35 3 1 5\r\n");
+    struct tagbstring name = bsStatic("/lazy");
+
+    ROLLUP_LAZY = 1;
+
+    LineTest tests[] = {
+        {.line = "create /lazy/a 1", .result = &OK, .description = "create lazy/a failed"},
+        {.line = "create /lazy/b 3", .result = &OK, .description = "create lazy/b failed"},
+        // only the name itself replies, the parent waits for a read
+        {.line = "sample /lazy/a 5", .result = &three, .description = "lazy sample failed"},
+        {.line = "mean /lazy/b", .result = &both, .description = "lazy mean failed"},
+        // every sample below, not a mean of means
+        {.line = "dump /lazy", .result = &dump, .description = "lazy dump failed"},
+    };
+    mu_assert(run_test_lines(tests, 5), "Failed to run the lazy rollup tests.");
+
+    Record *lazy = RecordMap_get(DATA, &name);
+    mu_assert(lazy != NULL, "Lost /lazy.");
+    mu_assert(lazy->rolled_at == lazy->version, "A read should leave the rollup clean.");
+
+    uint64_t rolled = lazy->rolled_at;
+    mu_assert(run_test_lines(&tests[4], 1), "Failed to read the rollup again.");
+    mu_assert(lazy->rolled_at == rolled, "A clean rollup was folded again.");
+
+    LineTest changes[] = {
+        {.line = "sample /lazy/b 7", .result = &five, .description = "lazy sample b failed"},
+        {.line = "mean /lazy", .result = &four, .description = "lazy mean after sample failed"},
+        // a delete takes its samples out of the parent too
+        {.line = "delete /lazy/a", .result = &OK, .description = "delete lazy/a failed"},
+        {.line = "mean /lazy", .result = &five, .description = "lazy mean after delete failed"},
+        {.line = "delete /lazy/b", .result = &OK, .description = "delete lazy/b failed"},
+        {.line = "delete /lazy", .result = &OK, .description = "delete lazy failed"},
+    };
+    mu_assert(lazy->rolled_at == rolled, "Nothing should have changed yet.");
+    mu_assert(run_test_lines(changes, 6), "Failed to run the lazy rollup changes.");
+
+    // records that come back from the log or a snapshot link up too
+    char dir[] = "/tmp/statserve-lazy-XXXXXX";
+    const char *lines[] = {"create /relazy/a 1", "create /relazy/b 3", "sample /relazy/a 5"};
+    struct tagbstring three_quarters = bsStatic("2.75\r\n");
+    RecordMap *saved = DATA;
+    RecordMap *live = RecordMap_create();
+    RecordMap *once = RecordMap_create();
+    RecordMap *twice = RecordMap_create();
+    Wal *wal = NULL;
+
+    mu_assert(mkdtemp(dir) != NULL, "Failed to make a store directory.");
+    mu_assert(Wal_recover(dir, &live, &WAL, 1, NULL) == 0, "Failed to start the log.");
+    DATA = live;
+    mu_assert(run_lines(lines, 3) == 0, "Failed to run the lazy lines.");
+    mu_assert(Wal_commit(WAL) == 0, "Failed to commit.");
+    Wal_destroy(WAL);
+
+    // the first restart replays commands, the second reads its snapshot
+    mu_assert(Wal_recover(dir, &once, &wal, 1, NULL) == 0, "Failed to restart.");
+    Wal_destroy(wal);
+    mu_assert(Wal_recover(dir, &twice, &WAL, 1, NULL) == 0, "Failed to restart again.");
+    DATA = twice;
+
+    LineTest restarted[] = {
+        {.line = "mean /relazy", .result = &three, .description = "lazy mean after restart failed"},
+        {.line = "dump /relazy", .result = &dump, .description = "lazy dump after restart failed"},
+        // made again, it takes back the children its delete left
+        {.line = "delete /relazy", .result = &OK, .description = "delete relazy failed"},
+        {.line = "create /relazy/c 2", .result = &OK, .description = "create relazy/c failed"},
+        {.line = "mean /relazy", .result = &three_quarters,
+            .description = "lazy mean after remaking the parent failed"},
+    };
+    mu_assert(run_test_lines(restarted, 5), "Failed to run the lazy restart tests.");
+
+    Wal_destroy(WAL);
+    WAL = NULL;
+    DATA = saved;
+    ROLLUP_LAZY = 0;
+    return NULL;
+}
+
+char *test_io_pool()
+{
+    int sv[2] = {-1, -1};
+    char reply[128] = {0};
+    char *lines = "store /iozed\nmean /iozed\nload /iozed /iosam\nmean /iosam\n";
+    char *expect = "OK\r\n10\r\nOK\r\n10\r\n";
+    struct pollfd done = {.events = POLLIN};
+    int got = 0;
+    int rc = 0;
+
+    LineTest setup[] = {
+        {.line = "create /iozed 10", .result = &OK, .description = "create iozed failed"},
+    };
+    LineTest cleanup[] = {
+        {.line = "delete /iozed", .result = &OK, .description = "delete iozed failed"},
+        {.line = "delete /iosam", .result = &OK, .description = "delete iosam failed"},
+    };
+    mu_assert(run_test_lines(setup, 1), "Failed to set up the io test.");
+
+    rc = IoPool_start(2);
+    mu_assert(rc == 0, "Failed to start the I/O pool.");
+    IO = IoLoop_create();
+    mu_assert(IO != NULL, "Failed to create the I/O loop.");
+    done.fd = IO->event_fd;
+
+    rc = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    mu_assert(rc == 0, "Failed to make a socketpair.");
+    Connection *conn = Connection_create(sv[0]);
+    mu_assert(conn != NULL, "Failed to create connection.");
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = conn};
+    conn->epoll_fd = epoll_create1(0);
+    rc = epoll_ctl(conn->epoll_fd, EPOLL_CTL_ADD, sv[0], &ev);
+    mu_assert(rc == 0, "Failed to add the client to epoll.");
+
+    rc = write(sv[1], lines, strlen(lines));
+    mu_assert(rc == (int)strlen(lines), "Failed to write the commands.");
+
+    // the store goes to the pool and everything behind it waits
+    rc = client_read(conn);
+    mu_assert(rc == 0, "client_read failed.");
+    mu_assert(conn->waiting, "store should leave the connection waiting.");
+    mu_assert(ring_unread(conn->recv_rb) > 0, "Commands ran past the store.");
+
+    // the load only goes out once the store is back, then the means
+    while(got < (int)strlen(expect)) {
+        rc = poll(&done, 1, 5000);
+        mu_assert(rc == 1, "Timed out waiting on the I/O pool.");
+        IoLoop_drain(IO);
+
+        ioctl(sv[1], FIONREAD, &rc);
+        if(rc > 0) {
+            rc = read(sv[1], reply + got, sizeof(reply) - 1 - got);
+            mu_assert(rc > 0, "Failed to read the replies.");
+            got += rc;
+        }
+    }
+
+    reply[got] = '\0';
+    mu_assert(strcmp(reply, expect) == 0, "Replies came back out of order.");
+    mu_assert(!conn->waiting, "Connection still waiting after the replies.");
+
+    close(conn->epoll_fd);
+    close(sv[0]);
+    close(sv[1]);
+    Connection_destroy(conn);
+    IoLoop_destroy(IO);
+    IO = NULL;
+
+    mu_assert(run_test_lines(cleanup, 2), "Failed to clean up the io test.");
+
+    return NULL;
+}
+
+void *run_job(void *arg)
+{
+    IoJob_run(arg);
+    return NULL;
+}
+
+char *test_store_lock()
+{
+    char dir[] = "/tmp/statserve-lock-XXXXXX";
+    char path[64];
+    struct timespec wait = {.tv_sec = 0, .tv_nsec = 50 * 1000000};
+    pthread_t thread;
+    int fd = -1;
+
+    mu_assert(mkdtemp(dir) != NULL, "Failed to make a store directory.");
+    snprintf(path, sizeof(path), "%s/rec", dir);
+    bstring location = bfromcstr(path);
+    IoJob *job = IoJob_create(IO_STORE, location, NULL, 0);
+    mu_assert(job != NULL, "Failed to make the job.");
+    Stats_sample(&job->stats, 5);
+    IoJob_run(job);
+    mu_assert(job->error == 0, "Failed to store.");
+
+    // someone else has it, the store waits them out and then writes
+    fd = open(path, O_RDONLY);
+    mu_assert(fd >= 0 && flock(fd, LOCK_SH) == 0, "Failed to lock the record.");
+    Stats_sample(&job->stats, 7);
+    job->error = -1;
+    mu_assert(pthread_create(&thread, NULL, run_job, job) == 0, "Failed to start the store.");
+    nanosleep(&wait, NULL);
+    mu_assert(job->error == -1, "Stored while a load had it locked.");
+
+    close(fd);
+    pthread_join(thread, NULL);
+    mu_assert(job->error == 0, "Failed to store once it was unlocked.");
+    IoJob_destroy(job);
+
+    job = IoJob_create(IO_LOAD, location, NULL, 0);
+    mu_assert(job != NULL, "Failed to make the job.");
+    IoJob_run(job);
+    mu_assert(job->error == 0 && job->stats.n == 2, "Didn't load what was stored.");
+    IoJob_destroy(job);
+
+    unlink(path);
+    rmdir(dir);
+    bdestroy(location);
+    return NULL;
+}
+
+char *test_paused_hangup()
+{
+    int sv[2] = {-1, -1};
+    struct epoll_event ev;
+    int rc = 0;
+
+    rc = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    mu_assert(rc == 0, "Failed to make a socketpair.");
+    Connection *conn = Connection_create(sv[0]);
+    mu_assert(conn != NULL, "Failed to create connection.");
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    conn->epoll_fd = epoll_create1(0);
+    rc = epoll_ctl(conn->epoll_fd, EPOLL_CTL_ADD, sv[0], &ev);
+    mu_assert(rc == 0, "Failed to add the client to epoll.");
+
+    // a request's out on another shard, and the client sends more
+    conn->waiting = 1;
+    rc = write(sv[1], "mean /x\n", 8);
+    mu_assert(rc == 8, "Failed to write the command.");
+    mu_assert(epoll_wait(conn->epoll_fd, &ev, 1, 0) == 1, "Not readable.");
+    mu_assert(!client_hung_up(conn, ev.events), "Hung up while it's still there.");
+    mu_assert(client_read(conn) == 0 && conn->paused, "Didn't pause while waiting.");
+    mu_assert(epoll_wait(conn->epoll_fd, &ev, 1, 0) == 0, "Paused but still woken.");
+
+    // the hangup comes even with no events asked for, every single wait
+    close(sv[1]);
+    mu_assert(epoll_wait(conn->epoll_fd, &ev, 1, 0) == 1, "Never heard about the hangup.");
+    mu_assert(client_hung_up(conn, ev.events), "Didn't see the paused one hung up.");
+
+    // the reply that's coming frees it
+    client_close(conn);
+    mu_assert(conn->closed, "Didn't close it.");
+
+    close(conn->epoll_fd);
+    Connection_destroy(conn);
+
+    return NULL;
+}
+
+char *test_store_hash()
+{
+    // the 128 bit vectors from the SipHash reference, key 00..0f and
+    // message 00..(len - 1)
+    uint8_t key[SIPHASH_KEY_LEN];
+    uint8_t message[15];
+    uint8_t out[SIPHASH_OUT_LEN];
+    uint8_t expect0[] = {0xa3, 0x81, 0x7f, 0x04, 0xba, 0x25, 0xa8, 0xe6,
+        0x6d, 0xf6, 0x72, 0x14, 0xc7, 0x55, 0x02, 0x93};
+    uint8_t expect15[] = {0x54, 0x93, 0xe9, 0x99, 0x33, 0xb0, 0xa8, 0x11,
+        0x7e, 0x08, 0xec, 0x0f, 0x97, 0xcf, 0xc3, 0xd9};
+    int i = 0;
+
+    for(i = 0; i < SIPHASH_KEY_LEN; i++) key[i] = i;
+    for(i = 0; i < 15; i++) message[i] = i;
+
+    siphash128(message, 0, key, out);
+    mu_assert(memcmp(out, expect0, sizeof(out)) == 0, "Wrong siphash for the empty message.");
+
+    siphash128(message, 15, key, out);
+    mu_assert(memcmp(out, expect15, sizeof(out)) == 0, "Wrong siphash for 15 bytes.");
+
+    // and the 64 bit ones, which names are hashed with
+    mu_assert(siphash64(message, 0, key) == 0x726fdb47dd0e0e31ULL,
+            "Wrong 64 bit siphash for the empty message.");
+    mu_assert(siphash64(message, 15, key) == 0xa129ca6149be45e5ULL,
+            "Wrong 64 bit siphash for 15 bytes.");
+
+    return NULL;
+}
+
+char *test_store_location()
+{
+    struct tagbstring base = bsStatic("/tmp");
+    struct tagbstring test1 = bsStatic("/somepath/here/there");
+    struct tagbstring test2 = bsStatic("../../../../../../../../etc/passwd");
+    bstring result = store_location(&base, &test1);
+    bstring again = store_location(&base, &test1);
+    int i = 0;
+
+    // base/ab/cd/abcd... with only hex after base
+    mu_assert(result != NULL, "Failed to make a store location.");
+    mu_assert(blength(result) == 5 + 3 + 3 + 32, "Wrong store location length.");
+    mu_assert(bchar(result, 7) == '/' && bchar(result, 10) == '/', "No fan-out directories.");
+    mu_assert(memcmp(bdata(result) + 5, bdata(result) + 11, 2) == 0, "Wrong first level.");
+    mu_assert(memcmp(bdata(result) + 8, bdata(result) + 13, 2) == 0, "Wrong second level.");
+    mu_assert(biseq(result, again), "Same name went to two places.");
+    bdestroy(again);
+
+    // no name can get out of base
+    again = store_location(&base, &test2);
+    mu_assert(!biseq(result, again), "Two names went to the same place.");
+    mu_assert(bstrncmp(again, &base, blength(&base)) == 0, "Escaped the store.");
+    for(i = blength(&base) + 1; i < blength(again); i++) {
+        mu_assert(isxdigit(bchar(again, i)) || bchar(again, i) == '/', "Not just hex.");
+    }
+
+    bdestroy(result);
+    bdestroy(again);
+    return NULL;
+}
+
+char *test_client_read()
+{
+    int sv[2] = {-1, -1};
+    char reply[64] = {0};
+    char *lines = "create /evented 10\nsample /evented 20\nmean /even";
+    char *rest = "ted\n";
+    int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    mu_assert(rc == 0, "Failed to make a socketpair.");
+
+    Connection *conn = Connection_create(sv[0]);
+    mu_assert(conn != NULL, "Failed to create connection.");
+
+    // a pipelined batch ending in a partial line
+    rc = write(sv[1], lines, strlen(lines));
+    mu_assert(rc == (int)strlen(lines), "Failed to write the commands.");
+
+    rc = client_read(conn);
+    mu_assert(rc == 0, "client_read failed.");
+
+    // both complete lines get answered in one write
+    rc = read(sv[1], reply, sizeof(reply) - 1);
+    mu_assert(rc > 0, "Failed to read the replies.");
+    reply[rc] = '\0';
+    mu_assert(strcmp(reply, "OK\r\n15\r\n") == 0, "Wrong replies from client_read.");
+
+    // the rest of the partial line finishes the last command
+    rc = write(sv[1], rest, strlen(rest));
+    mu_assert(rc == (int)strlen(rest), "Failed to write the rest.");
+
+    rc = client_read(conn);
+    mu_assert(rc == 0, "client_read failed on the partial line.");
+
+    rc = read(sv[1], reply, sizeof(reply) - 1);
+    mu_assert(rc > 0, "Failed to read the reply.");
+    reply[rc] = '\0';
+    mu_assert(strcmp(reply, "15\r\n") == 0, "Wrong reply for the partial line.");
+
+    // more lines than recv_rb holds, so reads fill it to the brim
+    int i = 0;
+    int pending = 0;
+    int got = 0;
+    int count = RB_SIZE / strlen("mean /evented\n") * 2;
+    char *answers = calloc(count, strlen("15\r\n"));
+    bstring batch = bfromcstr("");
+    for(i = 0; i < count; i++) {
+        bcatcstr(batch, "mean /evented\n");
+    }
+    rc = write(sv[1], bdata(batch), blength(batch));
+    mu_assert(rc == blength(batch), "Failed to write the batch.");
+    bdestroy(batch);
+
+    do {
+        rc = client_read(conn);
+        mu_assert(rc == 0, "client_read failed on a full buffer.");
+        ioctl(sv[0], FIONREAD, &pending);
+    } while(pending > 0);
+
+    for(got = 0; got < count * (int)strlen("15\r\n"); got += rc) {
+        rc = read(sv[1], answers + got, count * strlen("15\r\n") - got);
+        mu_assert(rc > 0, "Failed to read the batch replies.");
+    }
+    for(i = 0; i < count; i++) {
+        mu_assert(memcmp(answers + i * strlen("15\r\n"), "15\r\n",
+                    strlen("15\r\n")) == 0, "Wrong reply in a full buffer batch.");
+    }
+    free(answers);
+
+    // the other side hanging up should close the connection
+    close(sv[1]);
+    rc = client_read(conn);
+    mu_assert(rc == -1, "client_read should fail on a closed client.");
+
+    close(sv[0]);
+    Connection_destroy(conn);
+
+    return NULL;
+}
+
+int make_frame(char *frame, int opcode, const char *name, double number)
+{
+    FrameHeader header = {
+        .opcode = opcode,
+        .name_len = strlen(name),
+        .number = number
+    };
+
+    // the test machine is little-endian, so no conversions here
+    memcpy(frame, &header, sizeof(header));
+    memcpy(frame + sizeof(header), name, header.name_len);
+
+    return sizeof(header) + header.name_len;
+}
+
+int write_frame(int fd, int opcode, const char *name, double number)
+{
+    char frame[MAX_FRAME];
+    int len = make_frame(frame, opcode, name, number);
+
+    return write(fd, frame, len);
+}
+
+char *test_scan_line()
+{
+    int scanned = 0;
+    int i = 0;
+    char *line = "mean /drip\n";
+    RingBuffer *input = RingBuffer_create(32);
+
+    // a byte at a time, each scan only looks at the new byte
+    for(i = 0; line[i] != '\n'; i++) {
+        RingBuffer_write(input, &line[i], 1);
+        mu_assert(scan_line(input, '\n', &scanned, MAX_LINE) == -1, "Found a line too soon.");
+        mu_assert(scanned == i + 1, "scan_line didn't remember how far it got.");
+    }
+
+    RingBuffer_write(input, "\n", 1);
+    mu_assert(scan_line(input, '\n', &scanned, MAX_LINE) == 10, "Missed the line ending.");
+    mu_assert(scanned == 0, "The next line should scan from its start.");
+
+    // a line that wraps around the end of the buffer
+    memcpy(input->buffer + input->length - 4, "mean", 4);
+    memcpy(input->buffer, " /x\n", 4);
+    input->start = input->length - 4;
+    input->end = 4;
+    mu_assert(scan_line(input, '\n', &scanned, MAX_LINE) == 7, "Missed a wrapped line.");
+
+    // no ending and already past the limit
+    input->start = 0;
+    input->end = 20;
+    memset(input->buffer, 'x', 20);
+    mu_assert(scan_line(input, '\n', &scanned, 16) == -2, "Didn't stop a long line.");
+
+    RingBuffer_destroy(input);
+
+    return NULL;
+}
+
+char *test_mirror_buffer()
+{
+    int fds[2] = {-1, -1};
+    char *lines = "mean /a\nmean /b\n";
+    RingBuffer *input = MirrorBuffer_create(RB_SIZE);
+    mu_assert(input != NULL, "Failed to make a mirrored buffer.");
+    mu_assert(input->length >= RB_SIZE + 1, "Mirrored buffer is too small.");
+
+    int rc = pipe(fds);
+    mu_assert(rc == 0, "Failed to make a pipe.");
+
+    // park start and end just shy of the end so the next read wraps
+    input->start = input->end = input->length - 5;
+
+    rc = write(fds[1], lines, strlen(lines));
+    mu_assert(rc == (int)strlen(lines), "Failed to write the lines.");
+    rc = read_mirrored(input, fds[0], 0);
+    mu_assert(rc == (int)strlen(lines), "read_mirrored didn't take it all in one go.");
+    mu_assert(input->end < input->start, "The read should have wrapped.");
+    mu_assert(ring_unread(input) == (int)strlen(lines), "Wrong unread count after a wrap.");
+
+    // the wrapped bytes are still in a row from start
+    mu_assert(memcmp(RingBuffer_starts_at(input), lines, strlen(lines)) == 0,
+            "Mirror doesn't line up with the front of the buffer.");
+
+    bstring line = read_line(input, '\n');
+    mu_assert(line && biseqcstr(line, "mean /a"), "Wrong line across the wrap.");
+    bdestroy(line);
+
+    line = read_line(input, '\n');
+    mu_assert(line && biseqcstr(line, "mean /b"), "Wrong line after the wrap.");
+    bdestroy(line);
+    mu_assert(ring_unread(input) == 0, "read_line left bytes behind.");
+
+    close(fds[0]);
+    close(fds[1]);
+    MirrorBuffer_destroy(input);
+
+    return NULL;
+}
+
+char *test_write_some()
+{
+    int fds[2] = {-1, -1};
+    char out[32] = {0};
+    Command text = {.binary = 0};
+    RingBuffer *send_rb = RingBuffer_create(16);
+    int rc = pipe(fds);
+    mu_assert(rc == 0, "Failed to make a pipe.");
+
+    // replies come out of send_line with the ending already on
+    send_status(&text, send_rb, REPLY_DNE);
+    REPLY_CRLF = 0;
+    send_status(&text, send_rb, REPLY_OK);
+    REPLY_CRLF = 1;
+
+    rc = write_some(send_rb, fds[1], 0);
+    mu_assert(rc == 8, "Wrong count from write_some.");
+    rc = read(fds[0], out, sizeof(out) - 1);
+    out[rc] = '\0';
+    mu_assert(strcmp(out, "DNE\r\nOK\n") == 0, "Wrong line endings.");
+
+    // wrapped data goes out as the tail then the head in one writev
+    memcpy(send_rb->buffer + send_rb->length - 3, "abc", 3);
+    memcpy(send_rb->buffer, "de", 2);
+    send_rb->start = send_rb->length - 3;
+    send_rb->end = 2;
+
+    rc = write_some(send_rb, fds[1], 0);
+    mu_assert(rc == 5, "write_some didn't write both segments.");
+    rc = read(fds[0], out, sizeof(out) - 1);
+    out[rc] = '\0';
+    mu_assert(strcmp(out, "abcde") == 0, "Wrapped segments out of order.");
+    mu_assert(send_rb->start == send_rb->end, "write_some didn't commit the read.");
+
+    close(fds[0]);
+    close(fds[1]);
+    RingBuffer_destroy(send_rb);
+
+    return NULL;
+}
+
+char *test_format()
+{
+    char out[FORMAT_MAX + 1];
+    int len = 0;
+    int i = 0;
+    double back = 0;
+    uint64_t state = 88172645463325252ULL;
+
+    struct { double value; char *expect; } fixed[] = {
+        {15.0, "15"}, {12.5, "12.5"}, {0.1, "0.1"}, {-0.0, "0"},
+        {0.000001, "0.000001"}, {1e-7, "1e-7"}, {1e21, "1e+21"},
+        {123456789012345680000.0, "123456789012345680000"},
+        {5e-324, "5e-324"}, {1.7976931348623157e308, "1.7976931348623157e+308"},
+        {NAN, "nan"}, {-INFINITY, "-inf"},
+    };
+
+    for(i = 0; i < (int)(sizeof(fixed) / sizeof(fixed[0])); i++) {
+        len = format_double(out, fixed[i].value);
+        out[len] = '\0';
+        debug("format %s expect %s", out, fixed[i].expect);
+        mu_assert(strcmp(out, fixed[i].expect) == 0, "Wrong formatting for a double.");
+    }
+
+    len = format_long(out, -9223372036854775807L - 1);
+    out[len] = '\0';
+    mu_assert(strcmp(out, "-9223372036854775808") == 0, "Wrong formatting for a long.");
+
+    // random bit patterns all have to read back exactly
+    for(i = 0; i < 100000; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+
+        double value = 0;
+        memcpy(&value, &state, sizeof(value));
+        if(!isfinite(value)) continue;
+
+        len = format_double(out, value);
+        out[len] = '\0';
+        back = strtod(out, NULL);
+        mu_assert(memcmp(&back, &value, sizeof(value)) == 0 || value == 0,
+                "A formatted double didn't round trip.");
+    }
+
+    return NULL;
+}
+
+char *test_binary_frames()
+{
+    int sv[2] = {-1, -1};
+    char ok[8] = {0};
+    FrameReply replies[3];
+    int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    mu_assert(rc == 0, "Failed to make a socketpair.");
+
+    Connection *conn = Connection_create(sv[0]);
+    mu_assert(conn != NULL, "Failed to create connection.");
+
+    rc = write(sv[1], "binary\n", 7);
+    mu_assert(rc == 7, "Failed to ask for binary.");
+    mu_assert(client_read(conn) == 0, "client_read failed on binary.");
+    rc = read(sv[1], ok, sizeof(ok) - 1);
+    mu_assert(rc == 4 && strcmp(ok, "OK\r\n") == 0, "Binary wasn't accepted.");
+
+    // a mean of 3.25 has a \n byte in it, which must not become \r\n
+    write_frame(sv[1], OP_CREATE, "/framed", 1.5);
+    write_frame(sv[1], OP_SAMPLE, "/framed", 5.0);
+    write_frame(sv[1], OP_DUMP, "/framed", 0.0);
+    mu_assert(client_read(conn) == 0, "client_read failed on frames.");
+
+    rc = read(sv[1], replies, sizeof(replies));
+    mu_assert(rc == sizeof(replies), "Wrong reply size for frames.");
+    mu_assert(replies[0].status == REPLY_OK, "create should reply OK.");
+    mu_assert(replies[1].status == REPLY_NUMBER && replies[1].value == 3.25,
+            "sample should reply with the mean.");
+    mu_assert(replies[2].status == REPLY_STATS && replies[2].n == 2
+            && replies[2].max == 5.0, "dump has the wrong stats.");
+
+    // a name with a byte no text name can have is as bad as a huge one
+    char frame[64];
+    char names[MAX_FRAME];
+    const char *bad[] = {"/fr amed", "/framed\n", "/framed\r", "/fr\0med"};
+    Command cmd = {.command = NULL};
+    FrameHeader header = {.opcode = OP_CREATE, .name_len = 8, .number = 1.0};
+    int i = 0;
+
+    memcpy(frame, &header, sizeof(header));
+    memcpy(frame + sizeof(header), "/framed2", 8);
+    mu_assert(parse_frame(frame, sizeof(header) + 8, &cmd, names) == 0,
+            "Refused a good frame name.");
+    for(i = 0; i < 4; i++) {
+        memcpy(frame + sizeof(header), bad[i], 8);
+        mu_assert(parse_frame(frame, sizeof(header) + 8, &cmd, names) == -1,
+                "Took a frame name a text line can't carry.");
+    }
+
+    write_frame(sv[1], OP_CREATE, "/fr amed", 1.0);
+    mu_assert(client_read(conn) == -1, "A frame name with a space should fail.");
+
+    close(sv[1]);
+    close(sv[0]);
+    Connection_destroy(conn);
+    rc = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    mu_assert(rc == 0, "Failed to make a socketpair.");
+    conn = Connection_create(sv[0]);
+    mu_assert(conn != NULL, "Failed to create connection.");
+    conn->binary = 1;
+
+    // a frame bigger than we'll ever buffer closes the client
+    FrameHeader huge = {.opcode = OP_MEAN, .name_len = MAX_FRAME};
+    rc = write(sv[1], &huge, sizeof(huge));
+    mu_assert(client_read(conn) == -1, "Oversized frame should fail.");
+
+    close(sv[1]);
+    close(sv[0]);
+    Connection_destroy(conn);
+
+    return NULL;
+}
+
+char *test_binary_recover()
+{
+    char dir[] = "/tmp/statserve-binwal-XXXXXX";
+    char frame[MAX_FRAME];
+    char *names[] = {"/binwal", "/binwal/a", "/binwal b"};
+    RecordMap *saved = DATA;
+    RecordMap *live = RecordMap_create();
+    RecordMap *again = RecordMap_create();
+    RingBuffer *send_rb = RingBuffer_create(1024);
+    Wal *wal = NULL;
+    Stats folded;
+    int len = 0;
+    int i = 0;
+
+    mu_assert(mkdtemp(dir) != NULL, "Failed to make a store directory.");
+    mu_assert(Wal_recover(dir, &live, &WAL, 1, NULL) == 0, "Failed to start the log.");
+    wal = WAL;
+    DATA = live;
+
+    // the log has these as text lines, they have to read back the same
+    len = make_frame(frame, OP_CREATE, "/binwal/a", 2.0);
+    mu_assert(parse_frame_buffer(frame, len, send_rb) == 0, "Failed a binary create.");
+    len = make_frame(frame, OP_SAMPLE, "/binwal/a", 4.0);
+    mu_assert(parse_frame_buffer(frame, len, send_rb) == 0, "Failed a binary sample.");
+
+    // and one that would be two tokens there never gets in
+    len = make_frame(frame, OP_CREATE, "/binwal b", 1.0);
+    mu_assert(parse_frame_buffer(frame, len, send_rb) == -1, "Took a name with a space.");
+    len = make_frame(frame, OP_SAMPLE, "/binwal b", 1.0);
+    mu_assert(parse_frame_buffer(frame, len, send_rb) == -1, "Sampled a name with a space.");
+
+    mu_assert(Wal_commit(wal) == 0, "Failed to commit.");
+    Wal_destroy(wal);
+    WAL = NULL;
+
+    mu_assert(Wal_recover(dir, &again, &wal, 1, NULL) == 0, "Failed to restart.");
+    for(i = 0; i < 3; i++) {
+        mu_assert(same_record(live, again, names[i]), "Binary commands recovered wrong.");
+    }
+
+    Record *info = RecordMap_get(again, &(struct tagbstring)bsStatic("/binwal/a"));
+    mu_assert(info != NULL, "Lost /binwal/a over the restart.");
+    AtomicStats_fold(info->stat, &folded);
+    mu_assert(folded.n == 2 && Stats_mean(&folded) == 3.0, "/binwal/a lost a sample.");
+    mu_assert(RecordMap_get(again, &(struct tagbstring)bsStatic("/binwal b")) == NULL,
+            "The refused name came back.");
+
+    RingBuffer_destroy(send_rb);
+    Wal_destroy(wal);
+    DATA = saved;
+    return NULL;
+}
+
+char *test_admission()
+{
+    TokenBucket bucket;
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    int sv[2] = {-1, -1};
+    char lines[] = "mean /busy\r\nmean /busy\r\ncreate /busy 1\r\n";
+    char reply[64] = {0};
+    int rc = 0;
+
+    // the whole burst up front, then one a second
+    TokenBucket_init(&bucket, 2, 100.0);
+    mu_assert(TokenBucket_take(&bucket, 1, 2, 100.0), "First token denied.");
+    mu_assert(TokenBucket_take(&bucket, 1, 2, 100.0), "Second token denied.");
+    mu_assert(!TokenBucket_take(&bucket, 1, 2, 100.5), "Empty bucket gave a token.");
+    mu_assert(TokenBucket_take(&bucket, 1, 2, 101.0), "Bucket didn't refill.");
+    mu_assert(TokenBucket_take(&bucket, 0, 2, 101.0), "A rate of 0 is unlimited.");
+
+    // connections from one address share a source, and the cap counts them
+    inet_pton(AF_INET, "10.1.2.3", &addr.sin_addr);
+    SOURCE_CONNECTIONS = 1;
+    Connection *first = Connection_create(-1);
+    Connection *second = Connection_create(-1);
+    mu_assert(client_attach(first, (struct sockaddr *)&addr) == 0,
+            "First connection from an address refused.");
+    mu_assert(client_attach(second, (struct sockaddr *)&addr) == -1,
+            "Second connection should be over the cap.");
+    mu_assert(first->source == second->source, "Same address, different sources.");
+    mu_assert(first->source->connections == 2, "Wrong source connection count.");
+    Connection_destroy(second);
+    mu_assert(first->source->connections == 1, "Release didn't drop the count.");
+    Connection_destroy(first);
+    SOURCE_CONNECTIONS = 0;
+
+    // over the client's rate a request is answered BUSY and never run
+    CLIENT_RATE = 0.001;
+    CLIENT_BURST = 2;
+    rc = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    mu_assert(rc == 0, "Failed to make a socketpair.");
+    Connection *conn = Connection_create(sv[0]);
+    mu_assert(conn != NULL, "Failed to create connection.");
+
+    rc = write(sv[1], lines, strlen(lines));
+    mu_assert(rc == (int)strlen(lines), "Failed to write the commands.");
+    mu_assert(client_read(conn) == 0, "client_read failed.");
+    rc = read(sv[1], reply, sizeof(reply) - 1);
+    mu_assert(rc > 0 && strcmp(reply, "DNE\r\nDNE\r\nBUSY\r\n") == 0,
+            "Third request should be shed.");
+    mu_assert(RecordMap_get(DATA, &(struct tagbstring)bsStatic("/busy")) == NULL,
+            "A shed create still ran.");
+
+    close(sv[1]);
+    close(sv[0]);
+    Connection_destroy(conn);
+    CLIENT_RATE = 0;
+    CLIENT_BURST = 100;
+
+    return NULL;
+}
+
+char *test_list_commands()
+{
+    struct tagbstring tree = bsStatic("/tree\r\n/tree/a\r\n/tree/b\r\n/tree/b/c\r\nOK\r\n");
+    struct tagbstring after = bsStatic("/tree/b/c\r\nOK\r\n");
+    struct tagbstring none = bsStatic("DNE\r\n");
+    struct tagbstring dump = bsStatic("/tree/b 2 nan 2 4 1 2 2\r\n/tree/b/c 2 nan 2 4 1 2 2\r\nOK\r\n");
+    int sv[2] = {-1, -1};
+    int size = 4096;
+    char text[64];
+    int rc = 0;
+    int i = 0;
+
+    LineTest tests[] = {
+        {.line = "create /tree/a 1", .result = &OK, .description = "create tree failed"},
+        {.line = "create /tree/b/c 2", .result = &OK, .description = "create tree failed"},
+        {.line = "create /treetop 3", .result = &OK, .description = "create treetop failed"},
+        {.line = "list /tree", .result = &tree, .description = "list failed"},
+        {.line = "list /tree/", .result = &tree, .description = "list with a slash failed"},
+        {.line = "list /tree /tree/b", .result = &after, .description = "list after failed"},
+        {.line = "list /nope", .result = &none, .description = "list of nothing failed"},
+        {.line = "dumptree /tree/b", .result = &dump, .description = "dumptree failed"},
+    };
+    mu_assert(run_test_lines(tests, 8), "Failed to run the list tests.");
+
+    // far more than the socket holds, so it has to wait on EPOLLOUT
+    for(i = 0; i < 5000; i++) {
+        snprintf(text, sizeof(text), "create /stream/%04d 1", i);
+        bstring line = bfromcstr(text);
+        RingBuffer *send_rb = RingBuffer_create(1024);
+        mu_assert(parse_line(line, send_rb) == 0, "Failed to create a stream record.");
+        RingBuffer_destroy(send_rb);
+        bdestroy(line);
+    }
+
+    rc = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    mu_assert(rc == 0, "Failed to make a socketpair.");
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    nonblock(sv[0]);
+    Connection *conn = Connection_create(sv[0]);
+    mu_assert(conn != NULL, "Failed to create connection.");
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = conn};
+    conn->epoll_fd = epoll_create1(0);
+    rc = epoll_ctl(conn->epoll_fd, EPOLL_CTL_ADD, sv[0], &ev);
+    mu_assert(rc == 0, "Failed to add the client to epoll.");
+
+    rc = write(sv[1], "list /stream\nmean /stream/0001\n", 31);
+    mu_assert(rc == 31, "Failed to write the commands.");
+    mu_assert(client_read(conn) == 0, "client_read failed.");
+    mu_assert(conn->blocked && conn->stream, "A full socket didn't hold up the stream.");
+    mu_assert(ring_unread(conn->recv_rb) > 0, "The mean ran ahead of the stream.");
+
+    // read like a slow client, the server only goes on when told it can
+    bstring got = bfromcstr("");
+    char chunk[4096];
+    while(conn->blocked || conn->stream || ring_unread(conn->recv_rb) > 0) {
+        rc = read(sv[1], chunk, sizeof(chunk));
+        mu_assert(rc > 0, "Failed to read the stream.");
+        bcatblk(got, chunk, rc);
+
+        rc = epoll_wait(conn->epoll_fd, &ev, 1, 0);
+        if(rc == 1) {
+            mu_assert(ev.events & EPOLLOUT, "Blocked without waiting for EPOLLOUT.");
+            mu_assert(client_read(conn) == 0, "client_read failed on EPOLLOUT.");
+        }
+    }
+    while((rc = recv(sv[1], chunk, sizeof(chunk), MSG_DONTWAIT)) > 0) {
+        bcatblk(got, chunk, rc);
+    }
+
+    bstring expect = bfromcstr("/stream\r\n");
+    for(i = 0; i < 5000; i++) {
+        bformata(expect, "/stream/%04d\r\n", i);
+    }
+    // mean answers for /stream/0001 and then /stream
+    bcatcstr(expect, "OK\r\n1\r\n1\r\n");
+    mu_assert(biseq(got, expect), "Stream came out wrong or out of order.");
+
+    bdestroy(got);
+    bdestroy(expect);
+    close(conn->epoll_fd);
+    close(sv[0]);
+    close(sv[1]);
+    Connection_destroy(conn);
+
+    return NULL;
+}
+
+char *test_info()
+{
+    const char *request = "create /info/a 1\nsample /info/a 2\nsample /info/a 3\ninfo\n";
+    long sample = find_command(&(struct tagbstring)bsStatic("sample")) - COMMANDS;
+    long create = find_command(&(struct tagbstring)bsStatic("create")) - COMMANDS;
+    RecordMap *saved = DATA;
+    int every = METRICS_EVERY;
+    int sv[2] = {-1, -1};
+    char reply[RB_SIZE];
+    Metrics before;
+    Metrics after;
+    int rc = 0;
+
+    // counts pile up across tests, so it's what this one adds
+    DATA = RecordMap_create();
+    METRICS_EVERY = 1;
+    mu_assert(Metrics_register() == 0, "Failed to register.");
+    memset(&before, 0, sizeof(Metrics));
+    Metrics_fold(&before);
+
+    rc = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    mu_assert(rc == 0, "Failed to make a socketpair.");
+    Connection *conn = Connection_create(sv[0]);
+    mu_assert(conn != NULL, "Failed to create connection.");
+
+    int len = strlen(request);
+    mu_assert(write(sv[1], request, len) == len, "Failed to write the commands.");
+    mu_assert(client_read(conn) == 0, "client_read failed.");
+
+    rc = read(sv[1], reply, sizeof(reply) - 1);
+    mu_assert(rc > 0, "No reply.");
+    reply[rc] = '\0';
+    mu_assert(strncmp(reply, "OK\r\n", 4) == 0, "create failed.");
+    mu_assert(strstr(reply, "\r\nconnections ") != NULL, "No connection count.");
+    mu_assert(strstr(reply, "\r\ncommand sample ") != NULL, "No sample counts.");
+    mu_assert(strstr(reply, "\r\nhandler sample ") != NULL, "No sample latency.");
+    mu_assert(strstr(reply, "\r\nrecords ") != NULL, "No record count.");
+    mu_assert(strcmp(reply + rc - 4, "OK\r\n") == 0, "info didn't end with OK.");
+
+    // a line with no command has nowhere to count but bad
+    bstring line = bfromcstr("nope /info/a");
+    RingBuffer *send_rb = RingBuffer_create(1024);
+    mu_assert(parse_line(line, send_rb) == -1, "nope parsed.");
+    RingBuffer_destroy(send_rb);
+    bdestroy(line);
+
+    memset(&after, 0, sizeof(Metrics));
+    Metrics_fold(&after);
+    mu_assert(after.command[sample].calls - before.command[sample].calls == 2, "Wrong sample calls.");
+    mu_assert(after.command[create].calls - before.command[create].calls == 1, "Wrong create calls.");
+    mu_assert(after.command[sample].handler.stats.n - before.command[sample].handler.stats.n == 2,
+            "Every sample should be timed.");
+    mu_assert(after.command[sample].handler.sketch != NULL, "No sample histogram.");
+    mu_assert(after.flush.stats.n > before.flush.stats.n, "The flush wasn't timed.");
+    mu_assert(after.bytes_in - before.bytes_in == len, "Wrong bytes in.");
+    mu_assert(after.bytes_out - before.bytes_out == rc, "Wrong bytes out.");
+    mu_assert(after.connections - before.connections == 1, "Wrong connection count.");
+    mu_assert(after.bad - before.bad == 1, "Wrong bad count.");
+
+    Connection_destroy(conn);
+    close(sv[0]);
+    close(sv[1]);
+    Metrics_clear(&before);
+    Metrics_clear(&after);
+    METRICS_EVERY = every;
+    DATA = saved;
+    return NULL;
+}
+
+char *test_shard_for_line()
+{
+    struct tagbstring child = bsStatic("sample /logins/zed 10");
+    struct tagbstring parent = bsStatic("mean /logins");
+    struct tagbstring load = bsStatic("load /other /logins/sam");
+    int shard = 0;
 
-    bstring result = sanitize_location(&base, &test1);
-    mu_assert(result != NULL, "Failed to sanitize path.");
-    mu_assert(biseq(result, expect), "failed to sanitize test1");
+    // a whole tree has to live in one shard for the rollups to work
+    shard = shard_for_line(&parent, 16);
+    mu_assert(shard >= 0 && shard < 16, "Shard out of range.");
+    mu_assert(shard_for_line(&child, 16) == shard, "Child went to a different shard.");
+    mu_assert(shard_for_line(&load, 16) == shard, "load should use the target name.");
 
-    // this should be pulled up into a tester function
-    // BUG: just get rid of this and use md5
-    encname = encrypt_armor_name(&test2);
-    expect = bformat("%s/%s", bdata(&base), bdata(encname));
-    result = sanitize_location(&base, &test2);
-    mu_assert(result != NULL, "Failed to sanitize path.");
-    mu_assert(biseq(result, expect), "failed to sanitize test1");
-    
+    // everything else under one name stays in that name's shard
+    mu_assert(is_stream_of_all("list /", 6), "list / is in one shard.");
+    mu_assert(is_stream_of_all("dumptree / /logins", 18), "dumptree / is in one shard.");
+    mu_assert(!is_stream_of_all("list /logins", 12), "list /logins is in every shard.");
+    mu_assert(!is_stream_of_all("list //", 7), "list // is in every shard.");
 
     return NULL;
 }
@@ -184,11 +2115,42 @@ char *all_tests()
     mu_assert(rc == 0, "Failed to setup the data store.");
 
     mu_run_test(test_path_parsing);
-    mu_run_test(test_encrypt_armor_name);
-    mu_run_test(test_path_sanitize_armor);
+    mu_run_test(test_parse_command);
+    mu_run_test(test_store_hash);
+    mu_run_test(test_store_location);
     mu_run_test(test_create);
     mu_run_test(test_sample);
+    mu_run_test(test_rollup_tree);
+    mu_run_test(test_msample_mget);
+    mu_run_test(test_atomic_stats);
+    mu_run_test(test_wal_recover);
+    mu_run_test(test_replication);
+    mu_run_test(test_feed_limits);
     mu_run_test(test_store_load);
+    mu_run_test(test_sketch);
+    mu_run_test(test_percentile);
+    mu_run_test(test_window);
+    mu_run_test(test_window_commands);
+    mu_run_test(test_lazy_rollup);
+    mu_run_test(test_intern);
+    mu_run_test(test_record_slab);
+    mu_run_test(test_recordmap);
+    mu_run_test(test_recordmap_collide);
+    mu_run_test(test_nameindex);
+    mu_run_test(test_io_pool);
+    mu_run_test(test_store_lock);
+    mu_run_test(test_paused_hangup);
+    mu_run_test(test_client_read);
+    mu_run_test(test_scan_line);
+    mu_run_test(test_mirror_buffer);
+    mu_run_test(test_write_some);
+    mu_run_test(test_format);
+    mu_run_test(test_binary_frames);
+    mu_run_test(test_binary_recover);
+    mu_run_test(test_admission);
+    mu_run_test(test_list_commands);
+    mu_run_test(test_shard_for_line);
+    mu_run_test(test_info);
 
     return NULL;
 }
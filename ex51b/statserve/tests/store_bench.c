@@ -0,0 +1,155 @@
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <ftw.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <lcthw/dbg.h>
+#include <lcthw/stats.h>
+#include "statserve.h"
+
+#define LOOKUPS 10000
+
+extern bstring STORE_PATH;
+
+// stores count stats the way handle_store does, then times random loads
+// every decade so the ab/cd fan-out can be compared against one flat dir
+
+double elapsed(struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+bstring bench_name(int i)
+{
+    return bformat("/bench/%d/requests", i);
+}
+
+bstring bench_location(bstring base, bstring name, int flat)
+{
+    bstring location = store_location(base, name);
+    check(location, "Failed to make the store location.");
+
+    if(flat) {
+        // same hashed file name, just without the ab/cd directories
+        bstring file = bformat("%s/flat/%s", bdata(base),
+                bdata(location) + blength(location) - 32);
+        bdestroy(location);
+        location = file;
+    }
+
+    return location;
+error:
+    return NULL;
+}
+
+int store_one(bstring base, int i, int flat)
+{
+    bstring name = bench_name(i);
+    bstring location = bench_location(base, name, flat);
+    Stats st = {.sum = i, .sumsq = i, .n = 1, .min = i, .max = i};
+    int fd = -1;
+
+    check(location, "No location for %s", bdata(name));
+    fd = store_open(location, O_WRONLY | O_CREAT);
+    check(fd >= 0, "Cannot open file for writing: %s", bdata(location));
+    check(write(fd, &st, sizeof(st)) == sizeof(st), "Failed to write %s",
+            bdata(location));
+
+    close(fd);
+    bdestroy(location);
+    bdestroy(name);
+    return 0;
+error:
+    if(fd >= 0) close(fd);
+    bdestroy(location);
+    bdestroy(name);
+    return -1;
+}
+
+double load_random(bstring base, int stored, int flat)
+{
+    struct timespec start;
+    Stats st;
+    int i = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for(i = 0; i < LOOKUPS; i++) {
+        int which = random() % stored;
+        bstring name = bench_name(which);
+        bstring location = bench_location(base, name, flat);
+        int fd = store_open(location, O_RDONLY);
+        check(fd >= 0, "Error opening file: %s", bdata(location));
+
+        int rc = read(fd, &st, sizeof(st));
+        close(fd);
+        check(rc == sizeof(st) && st.n == 1 && st.sum == which,
+                "Bad stats loaded from %s", bdata(location));
+
+        bdestroy(location);
+        bdestroy(name);
+    }
+
+    return elapsed(&start) / LOOKUPS;
+error:
+    return -1;
+}
+
+int remove_entry(const char *path, const struct stat *sb, int flag,
+        struct FTW *ftw)
+{
+    (void)sb;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+int main(int argc, char *argv[])
+{
+    int count = argc > 1 ? atoi(argv[1]) : 1000000;
+    const char *dir = argc > 2 ? argv[2] : "/tmp/statserve-store-bench";
+    int stored = 0;
+    int next = 1000;
+    int rc = 0;
+
+    check(count > 0, "Usage: store_bench [count] [dir]");
+    nftw(dir, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+    check(mkdir(dir, 0700) == 0, "Failed to make %s", dir);
+
+    rc = setup_data_store(dir);
+    check(rc == 0, "Failed to set up the store in %s", dir);
+
+    bstring flat = bformat("%s/flat", dir);
+    rc = mkdir((char *)flat->data, 0700);
+    bdestroy(flat);
+    check(rc == 0, "Failed to make the flat dir.");
+
+    printf("%d random loads at each size\n", LOOKUPS);
+    printf("  %10s %14s %14s\n", "stored", "ab/cd ns/load", "flat ns/load");
+
+    for(stored = 0; stored < count; stored++) {
+        check(store_one(STORE_PATH, stored, 0) == 0, "Fan-out store failed.");
+        check(store_one(STORE_PATH, stored, 1) == 0, "Flat store failed.");
+
+        if(stored + 1 == next || stored + 1 == count) {
+            double fanout_ns = load_random(STORE_PATH, stored + 1, 0);
+            double flat_ns = load_random(STORE_PATH, stored + 1, 1);
+            check(fanout_ns > 0 && flat_ns > 0, "Loads failed.");
+
+            printf("  %10d %14.1f %14.1f\n", stored + 1, fanout_ns, flat_ns);
+            fflush(stdout);
+            next *= 10;
+        }
+    }
+
+    nftw(dir, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+    return 0;
+error:
+    nftw(dir, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+    return 1;
+}
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <lcthw/dbg.h>
+#include "statserve.h"
+
+#define RECORDS 1000000
+#define QUERIES 1000
+
+// what list costs for a small subtree in a big namespace: every
+// record in RecordMap_traverse with a prefix test, which is all an
+// unordered map can do, against a NameIndex_walk that only sees the
+// subtree. each of 10000 services has 100 endpoints under it
+
+typedef struct Query {
+    struct tagbstring prefix;
+    long found;
+} Query;
+
+double elapsed(struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+int match_prefix(Record *info, void *context)
+{
+    Query *query = context;
+
+    if(info->name->slen >= query->prefix.slen
+            && memcmp(info->name->data, query->prefix.data, query->prefix.slen) == 0) {
+        query->found++;
+    }
+
+    return 0;
+}
+
+int count_match(Record *info, void *context)
+{
+    (void)info;
+    ((Query *)context)->found++;
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    char text[128];
+    struct tagbstring name;
+    struct timespec start;
+    Query query = {.found = 0};
+    long found = 0;
+    long i = 0;
+    (void)argc;
+    (void)argv;
+
+    // bare records, the map and the index only ever look at the name
+    Record *records = calloc(RECORDS, sizeof(Record));
+    check_mem(records);
+    RecordMap *map = RecordMap_create();
+    check_mem(map);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < RECORDS; i++) {
+        long at = i * 7919L % RECORDS;
+        snprintf(text, sizeof(text), "/api/service%ld/endpoint%ld", at / 100, at % 100);
+        btfromcstr(name, text);
+        records[i].name = Intern_add(&name);
+        check_mem(records[i].name);
+        check(RecordMap_set(map, &records[i]) == 0, "Failed to set.");
+    }
+    double set_ns = elapsed(&start) / RECORDS;
+
+    // a handful of scans is plenty to see what one costs
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < QUERIES / 100; i++) {
+        snprintf(text, sizeof(text), "/api/service%ld/", i * 7);
+        btfromcstr(query.prefix, text);
+        RecordMap_traverse(map, match_prefix, &query);
+    }
+    double scan_us = elapsed(&start) / (QUERIES / 100) / 1000;
+    found = query.found;
+
+    query.found = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < QUERIES; i++) {
+        snprintf(text, sizeof(text), "/api/service%ld/", i * 7);
+        btfromcstr(query.prefix, text);
+        NameIndex_walk(&map->names, &query.prefix, 1, &query.prefix, count_match, &query);
+    }
+    double walk_us = elapsed(&start) / QUERIES / 1000;
+    check(found * 100 == query.found, "Scan found %ld, walk found %ld.", found, query.found);
+
+    printf("%d records, subtrees of %ld\n", RECORDS, found / (QUERIES / 100));
+    printf("  Intern_add and RecordMap_set: %8.1f ns\n", set_ns);
+    printf("  full scan:                    %8.1f us/query\n", scan_us);
+    printf("  NameIndex_walk:               %8.1f us/query (%.0fx faster)\n",
+            walk_us, scan_us / walk_us);
+
+    RecordMap_destroy(map);
+    free(records);
+    return 0;
+error:
+    return 1;
+}